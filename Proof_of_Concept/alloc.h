@@ -0,0 +1,160 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Allocation accounting: what each subsystem has asked for, how much of
+// it is still live, and the most that ever was. Allocations are tagged
+// with the subsystem when made and freed; sizes come from the allocator
+// itself (malloc_usable_size), so nothing is stored next to the memory
+// and the figures are what it really costs.
+//
+// Counters are atomics, since buffers are also allocated from pool jobs.
+// Per-frame deltas are taken by alloc_end_frame(), which render_window()
+// calls.
+//
+// Memory must be freed with the tag it was allocated with, or the figures
+// drift; they're never wrong about what's safe to free, as it all comes
+// from malloc.
+
+typedef enum {
+  ALLOC_TMT,       // Screen models, and the copies of what was sent.
+  ALLOC_BUFFER,    // Piece trees, add blocks, history, snapshots.
+  ALLOC_COMPONENT, // Components, their state, and indexes over buffers.
+  ALLOC_OTHER,
+  ALLOC_NUM_TAGS
+} AllocTag;
+
+static const char *const alloc_tag_names[ALLOC_NUM_TAGS] = {
+    "tmt", "buffer", "component", "other"};
+
+typedef struct {
+  atomic_size_t bytes, peak; // Live, and the most ever live.
+  atomic_size_t calls, frees;
+  // Taken on the UI thread at the end of each frame.
+  size_t calls_mark, bytes_mark;
+  size_t frame_calls;
+  long frame_bytes;
+} AllocCounters;
+
+typedef struct {
+  size_t bytes, peak, calls, frees;
+  size_t frame_calls; // Over the last frame.
+  long frame_bytes;   // Net, over the last frame.
+} AllocStats;
+
+static AllocCounters allocCounters[ALLOC_NUM_TAGS];
+
+static inline void allocAdd(AllocTag tag, void *p) {
+  AllocCounters *c = &allocCounters[tag];
+  size_t n = malloc_usable_size(p);
+  size_t bytes =
+      atomic_fetch_add_explicit(&c->bytes, n, memory_order_relaxed) + n;
+  atomic_fetch_add_explicit(&c->calls, 1, memory_order_relaxed);
+  size_t peak = atomic_load_explicit(&c->peak, memory_order_relaxed);
+  while (peak < bytes && !atomic_compare_exchange_weak_explicit(
+                             &c->peak, &peak, bytes, memory_order_relaxed,
+                             memory_order_relaxed))
+    ;
+}
+
+static inline void allocRemove(AllocTag tag, void *p) {
+  AllocCounters *c = &allocCounters[tag];
+  atomic_fetch_sub_explicit(&c->bytes, malloc_usable_size(p),
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->frees, 1, memory_order_relaxed);
+}
+
+static inline void *tui_malloc(AllocTag tag, size_t n) {
+  void *p = malloc(n);
+  if (p)
+    allocAdd(tag, p);
+  return p;
+}
+
+static inline void *tui_calloc(AllocTag tag, size_t count, size_t n) {
+  void *p = calloc(count, n);
+  if (p)
+    allocAdd(tag, p);
+  return p;
+}
+
+// Like realloc, counted as a free and an allocation. On failure the old
+// block is left, and left counted, as it was.
+static inline void *tui_realloc(AllocTag tag, void *old, size_t n) {
+  size_t before = old ? malloc_usable_size(old) : 0;
+  void *p = realloc(old, n);
+  if (!p)
+    return NULL;
+  if (old) {
+    atomic_fetch_sub_explicit(&allocCounters[tag].bytes, before,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocCounters[tag].frees, 1,
+                              memory_order_relaxed);
+  }
+  allocAdd(tag, p);
+  return p;
+}
+
+static inline void tui_free(AllocTag tag, void *p) {
+  if (!p)
+    return;
+  allocRemove(tag, p);
+  free(p);
+}
+
+// Takes each tag's deltas since the last call; once a frame, on the UI
+// thread. Returns the allocation calls made meanwhile, over all tags.
+static inline size_t alloc_end_frame(void) {
+  size_t total = 0;
+  for (size_t i = 0; i < ALLOC_NUM_TAGS; i++) {
+    AllocCounters *c = &allocCounters[i];
+    size_t calls = atomic_load_explicit(&c->calls, memory_order_relaxed);
+    size_t bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+    c->frame_calls = calls - c->calls_mark;
+    c->frame_bytes = (long)(bytes - c->bytes_mark);
+    c->calls_mark = calls;
+    c->bytes_mark = bytes;
+    total += c->frame_calls;
+  }
+  return total;
+}
+
+static inline AllocStats alloc_stats(AllocTag tag) {
+  AllocCounters *c = &allocCounters[tag];
+  return (AllocStats){
+      .bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed),
+      .peak = atomic_load_explicit(&c->peak, memory_order_relaxed),
+      .calls = atomic_load_explicit(&c->calls, memory_order_relaxed),
+      .frees = atomic_load_explicit(&c->frees, memory_order_relaxed),
+      .frame_calls = c->frame_calls,
+      .frame_bytes = c->frame_bytes,
+  };
+}
+
+// A table of every tag's figures, for a debug command or a log.
+static inline void alloc_print(FILE *f) {
+  fprintf(f, "%-10s %12s %12s %10s %10s %8s %10s\n", "tag", "live",
+          "peak", "calls", "frees", "frame", "frame B");
+  for (size_t i = 0; i < ALLOC_NUM_TAGS; i++) {
+    AllocStats s = alloc_stats((AllocTag)i);
+    fprintf(f, "%-10s %12zu %12zu %10zu %10zu %8zu %10ld\n",
+            alloc_tag_names[i], s.bytes, s.peak, s.calls, s.frees,
+            s.frame_calls, s.frame_bytes);
+  }
+}
+
+// libtmt has hooks of its own, so it needn't know about this file.
+#ifndef TMT_MALLOC
+#define TMT_MALLOC(n) tui_malloc(ALLOC_TMT, n)
+#define TMT_CALLOC(count, n) tui_calloc(ALLOC_TMT, count, n)
+#define TMT_REALLOC(p, n) tui_realloc(ALLOC_TMT, p, n)
+#define TMT_FREE(p) tui_free(ALLOC_TMT, p)
+#endif
+
+#endif
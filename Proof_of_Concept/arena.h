@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "alloc.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Append-only byte storage in fixed blocks. Nothing in it ever moves, so
+// other threads may keep reading what was handed out while more is
+// appended. Callers serialise appends themselves.
+
+#define ARENA_BLOCK_SIZE ((size_t)1 << 20)
+#define ARENA_MAX_BLOCKS 8192
+
+typedef struct {
+  char *blocks[ARENA_MAX_BLOCKS];
+  size_t num_blocks, used;
+} Arena;
+
+// Copies n bytes in and returns where they went, or NULL when out of
+// memory or n is bigger than a block.
+static inline const char *arena_copy(Arena *a, const char *s, size_t n) {
+  if (n > ARENA_BLOCK_SIZE)
+    return NULL;
+  if (!a->num_blocks || a->used + n > ARENA_BLOCK_SIZE) {
+    char *block;
+    if (a->num_blocks == ARENA_MAX_BLOCKS ||
+        !(block = tui_malloc(ALLOC_COMPONENT, ARENA_BLOCK_SIZE)))
+      return NULL;
+    a->blocks[a->num_blocks++] = block;
+    a->used = 0;
+  }
+  char *p = a->blocks[a->num_blocks - 1] + a->used;
+  memcpy(p, s, n);
+  a->used += n;
+  return p;
+}
+
+static inline void arena_free(Arena *a) {
+  for (size_t i = 0; i < a->num_blocks; i++)
+    tui_free(ALLOC_COMPONENT, a->blocks[i]);
+  a->num_blocks = a->used = 0;
+}
+
+#endif
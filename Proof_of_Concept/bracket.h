@@ -0,0 +1,688 @@
+#ifndef BRACKET_H
+#define BRACKET_H
+
+#include "buffer.h"
+#include "pool.h"
+
+// Finds matching brackets without scanning between them. The buffer is cut
+// into chunks of a few KiB kept in a treap in order, and each chunk knows
+// how its brackets change the nesting depth: the net change, the lowest
+// the depth gets going forwards and the highest coming backwards. Each
+// subtree knows the same for all its chunks together, so the chunk where
+// a bracket's match lies is found by walking down the tree.
+//
+// Brackets in strings and comments don't count. Whether a chunk starts in
+// one depends on everything before it, so each chunk has its summary
+// worked out for every state it could start in, and the right one is
+// picked on the way down. An edit then only ever lexes the chunks it
+// touches, even one that opens a comment running to the end of the file.
+// A chunk can end half way through a token, like the / of a //, so the
+// states include being just past a character that might start one.
+//
+// It doesn't even do that right away: the chunks are swapped for one
+// dirty chunk of the new length, which costs a split and a merge, and
+// the dirty ones are lexed the next time a match is asked for. A burst
+// of edits, like a macro being replayed, is then lexed once at the end.
+//
+// There's no highlighter to ask about strings and comments yet, so the
+// lexer knows C's: // and /* */ comments, "strings" and 'c'haracters.
+
+#define BRACKET_CHUNK 4096
+#define BRACKET_MAX_CHUNK (2 * BRACKET_CHUNK)
+#define BRACKET_SEGMENT ((size_t)1 << 20) // Per job when indexing a file.
+
+enum {
+  BRACKET_CODE,
+  BRACKET_BLOCK_COMMENT,
+  BRACKET_LINE_COMMENT,
+  BRACKET_STRING,
+  BRACKET_CHAR,
+  BRACKET_SLASH,         // Past a / in code.
+  BRACKET_BLOCK_STAR,    // Past a * in a block comment.
+  BRACKET_STRING_ESCAPE, // Past a \ in a string.
+  BRACKET_CHAR_ESCAPE,   // Past a \ in a character.
+  BRACKET_STATES
+};
+
+typedef struct {
+  ptrdiff_t sum;
+  ptrdiff_t min; // Lowest depth reached going forwards, relative.
+  ptrdiff_t max; // Highest reached going backwards from the end.
+  uint8_t end;   // State after.
+} BracketSum;
+
+typedef struct BracketNode {
+  struct BracketNode *left, *right;
+  uint32_t priority;
+  size_t len, total_len;
+  bool dirty, any_dirty; // Not lexed since an edit; any in the subtree.
+  BracketSum self[BRACKET_STATES];  // Indexed by the state it starts in.
+  BracketSum total[BRACKET_STATES]; // For the subtree.
+} BracketNode;
+
+typedef struct {
+  Buffer *buffer;
+  BracketNode *root;
+  uint32_t seed;
+  bool failed; // An edit couldn't be indexed; start over when asked.
+} BracketIndex;
+
+// Returns +1 for an opening bracket, -1 for a closing one, or 0 at the
+// end, with *i just past it. Looks at a character at a time, so where
+// the text is cut doesn't matter.
+static inline int bracketNext(const char *p, size_t n, size_t *i,
+                              uint8_t *state) {
+  size_t at = *i;
+  uint8_t s = *state;
+  int found = 0;
+  while (at < n && !found) {
+    char c = p[at++];
+    switch (s) {
+    case BRACKET_SLASH:
+      if (c == '/' || c == '*') {
+        s = c == '/' ? BRACKET_LINE_COMMENT : BRACKET_BLOCK_COMMENT;
+        break;
+      }
+      // Not a comment, so it's code like any other.
+      s = BRACKET_CODE;
+      // Fall through.
+    case BRACKET_CODE:
+      if (c == '/')
+        s = BRACKET_SLASH;
+      else if (c == '"')
+        s = BRACKET_STRING;
+      else if (c == '\'')
+        s = BRACKET_CHAR;
+      else if (c == '(' || c == '[' || c == '{')
+        found = 1;
+      else if (c == ')' || c == ']' || c == '}')
+        found = -1;
+      break;
+    case BRACKET_BLOCK_STAR:
+      if (c == '/') {
+        s = BRACKET_CODE;
+        break;
+      }
+      // Still in the comment, which another * could end.
+      s = BRACKET_BLOCK_COMMENT;
+      // Fall through.
+    case BRACKET_BLOCK_COMMENT:
+      if (c == '*')
+        s = BRACKET_BLOCK_STAR;
+      break;
+    case BRACKET_LINE_COMMENT:
+      if (c == '\n')
+        s = BRACKET_CODE;
+      break;
+    case BRACKET_STRING_ESCAPE:
+      s = BRACKET_STRING;
+      break;
+    case BRACKET_CHAR_ESCAPE:
+      s = BRACKET_CHAR;
+      break;
+    default:
+      if (c == '\\')
+        s = s == BRACKET_STRING ? BRACKET_STRING_ESCAPE : BRACKET_CHAR_ESCAPE;
+      else if (c == '\n' || c == (s == BRACKET_STRING ? '"' : '\''))
+        s = BRACKET_CODE;
+    }
+  }
+  *i = at;
+  *state = s;
+  return found;
+}
+
+static inline BracketSum bracketScan(const char *p, size_t n,
+                                     uint8_t state) {
+  BracketSum sum = {0, 0, 0, state};
+  size_t i = 0;
+  int d;
+  while ((d = bracketNext(p, n, &i, &sum.end))) {
+    sum.sum += d;
+    if (sum.sum < sum.min)
+      sum.min = sum.sum;
+  }
+  // Coming backwards, the depth at a point is the total less what's
+  // before it, so it's highest where that's lowest.
+  sum.max = sum.sum - sum.min;
+  return sum;
+}
+
+// Where to end a chunk starting at p, with n bytes left.
+static inline size_t bracketCut(const char *p, size_t n) {
+  if (n <= BRACKET_MAX_CHUNK)
+    return n;
+  size_t cut = BRACKET_CHUNK;
+  const char *nl = memchr(p + cut, '\n', BRACKET_MAX_CHUNK - cut);
+  return nl ? (size_t)(nl - p) + 1 : cut;
+}
+
+static inline BracketSum bracketCombine(BracketSum a, const BracketSum *b) {
+  const BracketSum *then = &b[a.end];
+  BracketSum out;
+  out.sum = a.sum + then->sum;
+  out.min = a.min < a.sum + then->min ? a.min : a.sum + then->min;
+  out.max = then->max > then->sum + a.max ? then->max : then->sum + a.max;
+  out.end = then->end;
+  return out;
+}
+
+static inline void bracketUpdate(BracketNode *n) {
+  n->total_len = n->len;
+  for (uint8_t s = 0; s < BRACKET_STATES; s++) {
+    BracketSum sum = n->left ? n->left->total[s] : (BracketSum){0, 0, 0, s};
+    sum = bracketCombine(sum, n->self);
+    n->total[s] = n->right ? bracketCombine(sum, n->right->total) : sum;
+  }
+  n->any_dirty = n->dirty;
+  if (n->left) {
+    n->total_len += n->left->total_len;
+    n->any_dirty |= n->left->any_dirty;
+  }
+  if (n->right) {
+    n->total_len += n->right->total_len;
+    n->any_dirty |= n->right->any_dirty;
+  }
+}
+
+static inline uint32_t bracketRandom(BracketIndex *x) {
+  // xorshift32
+  x->seed ^= x->seed << 13;
+  x->seed ^= x->seed >> 17;
+  x->seed ^= x->seed << 5;
+  return x->seed;
+}
+
+static inline BracketNode *bracketMerge(BracketNode *l, BracketNode *r) {
+  if (!l)
+    return r;
+  if (!r)
+    return l;
+  if (l->priority > r->priority) {
+    l->right = bracketMerge(l->right, r);
+    bracketUpdate(l);
+    return l;
+  }
+  r->left = bracketMerge(l, r->left);
+  bracketUpdate(r);
+  return r;
+}
+
+// Splits before the chunk starting at offset, which must be a boundary.
+static inline void bracketSplit(BracketNode *t, size_t offset,
+                                BracketNode **l, BracketNode **r) {
+  if (!t) {
+    *l = *r = NULL;
+    return;
+  }
+  size_t left_len = t->left ? t->left->total_len : 0;
+  if (offset <= left_len) {
+    bracketSplit(t->left, offset, l, &t->left);
+    *r = t;
+  } else {
+    bracketSplit(t->right, offset - left_len - t->len, &t->right, r);
+    *l = t;
+  }
+  bracketUpdate(t);
+}
+
+static inline void bracketFree(BracketNode *n) {
+  if (!n)
+    return;
+  bracketFree(n->left);
+  bracketFree(n->right);
+  tui_free(ALLOC_COMPONENT, n);
+}
+
+// A chunk of the n bytes at p, or a dirty one n bytes long if p is NULL.
+static inline BracketNode *bracketNewNode(const char *p, size_t n) {
+  BracketNode *node = tui_malloc(ALLOC_COMPONENT, sizeof(BracketNode));
+  if (!node)
+    return NULL;
+  node->left = node->right = NULL;
+  node->len = n;
+  node->dirty = !p;
+  for (uint8_t s = 0; s < BRACKET_STATES; s++)
+    node->self[s] = p ? bracketScan(p, n, s) : (BracketSum){0, 0, 0, s};
+  bracketUpdate(node);
+  return node;
+}
+
+// Cuts text into chunks and strings them together in order.
+static inline bool bracketChunks(BracketIndex *x, const char *p, size_t n,
+                                 BracketNode **out) {
+  BracketNode *t = NULL;
+  for (size_t at = 0, len; at < n; at += len) {
+    len = bracketCut(p + at, n - at);
+    BracketNode *node = bracketNewNode(p + at, len);
+    if (!node) {
+      bracketFree(t);
+      return false;
+    }
+    node->priority = bracketRandom(x);
+    t = bracketMerge(t, node);
+  }
+  *out = t;
+  return true;
+}
+
+// The chunk holding offset, where it starts and the state it starts in.
+static inline BracketNode *bracketFind(const BracketIndex *x, size_t offset,
+                                       size_t *start, uint8_t *state) {
+  BracketNode *n = x->root;
+  size_t base = 0;
+  uint8_t s = BRACKET_CODE;
+  while (n) {
+    size_t left_len = n->left ? n->left->total_len : 0;
+    if (offset < base + left_len) {
+      n = n->left;
+      continue;
+    }
+    if (n->left)
+      s = n->left->total[s].end;
+    if (offset < base + left_len + n->len) {
+      *start = base + left_len;
+      *state = s;
+      return n;
+    }
+    s = n->self[s].end;
+    base += left_len + n->len;
+    n = n->right;
+  }
+  return NULL;
+}
+
+////////////////////////
+// Keeping it current //
+////////////////////////
+
+static inline bool bracketReindex(BracketIndex *x, size_t start, size_t len,
+                                  BracketNode **out) {
+  char *text = tui_malloc(ALLOC_COMPONENT, len ? len : 1);
+  if (!text)
+    return false;
+  buffer_read(x->buffer, start, len, text);
+  bool ok = bracketChunks(x, text, len, out);
+  tui_free(ALLOC_COMPONENT, text);
+  return ok;
+}
+
+static void bracketAfterEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  BracketIndex *x = ctx;
+  if (x->failed)
+    return;
+  size_t old_size = buffer_size(b) - edit->inserted + edit->removed;
+  size_t start = 0, end = 0;
+  uint8_t s;
+  if (old_size) {
+    // The chunks either side as well, in case the edit joins two bytes
+    // into a token across where they meet.
+    size_t lo = edit->offset ? edit->offset - 1 : 0;
+    size_t hi = bufferMin(edit->offset + edit->removed + 1, old_size - 1);
+    bracketFind(x, lo, &start, &s);
+    BracketNode *last = bracketFind(x, hi, &end, &s);
+    end += last->len;
+  }
+  BracketNode *l, *m, *r;
+  bracketSplit(x->root, start, &l, &m);
+  bracketSplit(m, end - start, &m, &r);
+  bracketFree(m);
+  end = end - edit->removed + edit->inserted;
+  m = NULL;
+  if (end > start && !(m = bracketNewNode(NULL, end - start))) {
+    bracketFree(l);
+    bracketFree(r);
+    x->root = NULL;
+    x->failed = true;
+    return;
+  }
+  if (m)
+    m->priority = bracketRandom(x);
+  x->root = bracketMerge(bracketMerge(l, m), r);
+}
+
+// Segments are read from a snapshot: reading the buffer itself can
+// unpack text into it, which only its own thread may do.
+typedef struct {
+  const BufferSnapshot *snapshot;
+  const size_t *span_starts;
+  size_t start, len;
+  BracketNode *out;
+  bool failed;
+} BracketSegment;
+
+static inline void bracketCopy(const BracketSegment *seg, char *out) {
+  const BufferSnapshot *snap = seg->snapshot;
+  size_t lo = 0, hi = snap->num_spans;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (seg->span_starts[mid] <= seg->start)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  size_t offset = seg->start, n = seg->len;
+  for (size_t i = lo; n; i++) {
+    size_t skip = offset - seg->span_starts[i];
+    size_t take = bufferMin(n, snap->spans[i].len - skip);
+    memcpy(out, snap->spans[i].text + skip, take);
+    out += take;
+    offset += take;
+    n -= take;
+  }
+}
+
+static void bracketIndexSegment(void *arg) {
+  BracketSegment *seg = arg;
+  char *text = tui_malloc(ALLOC_COMPONENT, seg->len);
+  if (!text) {
+    seg->failed = true;
+    return;
+  }
+  bracketCopy(seg, text);
+  // Priorities come from the segment's own generator; chunks are merged
+  // in order afterwards, so any spread of them makes a valid treap.
+  BracketIndex local = {.seed = (uint32_t)(seg->start / BRACKET_SEGMENT) *
+                                    0x9E3779B9u | 1};
+  seg->failed = !bracketChunks(&local, text, seg->len, &seg->out);
+  tui_free(ALLOC_COMPONENT, text);
+}
+
+// Lexes len bytes from start into chunks like bracketReindex(), but a
+// segment per job.
+static inline bool bracketIndexRange(BracketIndex *x, size_t start,
+                                     size_t len, BracketNode **out) {
+  size_t size = start + len;
+  size_t count = len / BRACKET_SEGMENT + 1;
+  BufferSnapshot *snap = buffer_snapshot(x->buffer);
+  size_t *starts = snap ? tui_malloc(ALLOC_COMPONENT,
+                                     (snap->num_spans + 1) * sizeof(size_t))
+                        : NULL;
+  BracketSegment *segs =
+      starts ? tui_calloc(ALLOC_COMPONENT, count, sizeof(BracketSegment))
+             : NULL;
+  if (!segs) {
+    buffer_release(snap);
+    tui_free(ALLOC_COMPONENT, starts);
+    return false;
+  }
+  for (size_t i = 0, at = 0; i < snap->num_spans; i++) {
+    starts[i] = at;
+    at += snap->spans[i].len;
+  }
+  PoolGroup group = {0};
+  size_t n = 0;
+  for (size_t at = start; at < size; n++) {
+    size_t end = at + BRACKET_SEGMENT < size ? at + BRACKET_SEGMENT : size;
+    segs[n] = (BracketSegment){snap, starts, at, end - at, NULL, false};
+    pool_submit(pool_shared(), &group, bracketIndexSegment, &segs[n]);
+    at = end;
+  }
+  pool_wait(pool_shared(), &group);
+  buffer_release(snap);
+  tui_free(ALLOC_COMPONENT, starts);
+
+  bool ok = true;
+  *out = NULL;
+  for (size_t i = 0; i < n; i++) {
+    ok &= !segs[i].failed;
+    *out = bracketMerge(*out, segs[i].out);
+  }
+  tui_free(ALLOC_COMPONENT, segs);
+  if (!ok) {
+    bracketFree(*out);
+    *out = NULL;
+  }
+  return ok;
+}
+
+// Indexes the whole buffer.
+static inline bool bracketBuild(BracketIndex *x) {
+  bracketFree(x->root);
+  x->root = NULL;
+  bool ok = bracketIndexRange(x, 0, buffer_size(x->buffer), &x->root);
+  x->failed = !ok;
+  return ok;
+}
+
+static inline void bracketCollectDirty(const BracketNode *n, size_t base,
+                                       size_t *starts, size_t *count) {
+  if (!n || !n->any_dirty)
+    return;
+  size_t left_len = n->left ? n->left->total_len : 0;
+  bracketCollectDirty(n->left, base, starts, count);
+  if (n->dirty)
+    starts[(*count)++] = base + left_len;
+  bracketCollectDirty(n->right, base + left_len + n->len, starts, count);
+}
+
+static inline size_t bracketCountDirty(const BracketNode *n) {
+  if (!n || !n->any_dirty)
+    return 0;
+  return n->dirty + bracketCountDirty(n->left) + bracketCountDirty(n->right);
+}
+
+// Lexes the dirty chunks, last first so that a small one can take in the
+// chunk after it, which is clean by then. A big one, like a file's tail
+// loaded after the rest, is lexed on the pool.
+static inline bool bracketClean(BracketIndex *x) {
+  size_t count = bracketCountDirty(x->root);
+  if (!count)
+    return true;
+  size_t *starts = tui_malloc(ALLOC_COMPONENT, count * sizeof(size_t));
+  if (!starts)
+    return false;
+  count = 0;
+  bracketCollectDirty(x->root, 0, starts, &count);
+  bool ok = true;
+  while (ok && count--) {
+    BracketNode *l, *m, *r;
+    bracketSplit(x->root, starts[count], &l, &r);
+    BracketNode *first = r;
+    while (first->left)
+      first = first->left;
+    size_t len = first->len;
+    bracketSplit(r, len, &m, &r);
+    if (len < BRACKET_CHUNK / 4 && r) {
+      BracketNode *next = r, *more;
+      while (next->left)
+        next = next->left;
+      bracketSplit(r, next->len, &more, &r);
+      len += next->len;
+      m = bracketMerge(m, more);
+    }
+    bracketFree(m);
+    ok = len > BRACKET_SEGMENT ? bracketIndexRange(x, starts[count], len, &m)
+                               : bracketReindex(x, starts[count], len, &m);
+    x->root = bracketMerge(bracketMerge(l, ok ? m : NULL), r);
+  }
+  tui_free(ALLOC_COMPONENT, starts);
+  return ok;
+}
+
+//////////////
+// Matching //
+//////////////
+
+// Goes through the chunks from offset from on, state being the state
+// there, until the depth gets down to *need (which is negative). Returns
+// the chunk it does so in, with *start and *state set for it.
+static inline BracketNode *bracketForward(BracketNode *n, size_t base,
+                                          size_t from, uint8_t *state,
+                                          ptrdiff_t *need, size_t *start) {
+  if (!n || base + n->total_len <= from)
+    return NULL;
+  if (base >= from) {
+    if (n->total[*state].min > *need) {
+      *need -= n->total[*state].sum;
+      *state = n->total[*state].end;
+      return NULL;
+    }
+  }
+  size_t left_len = n->left ? n->left->total_len : 0;
+  BracketNode *found = bracketForward(n->left, base, from, state, need,
+                                      start);
+  if (found)
+    return found;
+  size_t at = base + left_len;
+  if (at >= from) {
+    if (n->self[*state].min <= *need) {
+      *start = at;
+      return n;
+    }
+    *need -= n->self[*state].sum;
+    *state = n->self[*state].end;
+  }
+  return bracketForward(n->right, at + n->len, from, state, need, start);
+}
+
+// Goes back through the chunks ending at or before offset to, until the
+// depth gets up to *need (which is positive). base and state are where
+// the subtree starts. Returns the chunk it does so in, with *start and
+// *found_state set for it.
+static inline BracketNode *bracketBackward(BracketNode *n, size_t base,
+                                           size_t to, uint8_t state,
+                                           ptrdiff_t *need, size_t *start,
+                                           uint8_t *found_state) {
+  if (!n || base >= to)
+    return NULL;
+  if (base + n->total_len <= to && n->total[state].max < *need) {
+    *need -= n->total[state].sum;
+    return NULL;
+  }
+  size_t left_len = n->left ? n->left->total_len : 0;
+  size_t at = base + left_len;
+  uint8_t self = n->left ? n->left->total[state].end : state;
+  BracketNode *found =
+      bracketBackward(n->right, at + n->len, to, n->self[self].end, need,
+                      start, found_state);
+  if (found)
+    return found;
+  if (at + n->len <= to) {
+    if (n->self[self].max >= *need) {
+      *start = at;
+      *found_state = self;
+      return n;
+    }
+    *need -= n->self[self].sum;
+  }
+  return bracketBackward(n->left, base, to, state, need, start,
+                         found_state);
+}
+
+// Finds the bracket that the one at offset pairs with. Returns false if
+// there isn't a bracket there outside strings and comments, or it has no
+// match. Any kinds of bracket pair with each other.
+static inline bool bracket_match(BracketIndex *x, size_t offset,
+                                 size_t *match) {
+  // Most offsets asked about aren't brackets, and needn't wait for a lex.
+  char c;
+  if (offset >= buffer_size(x->buffer))
+    return false;
+  buffer_read(x->buffer, offset, 1, &c);
+  if (!c || !strchr("()[]{}", c))
+    return false;
+  if (!bracketClean(x))
+    x->failed = true;
+  if (x->failed && !bracketBuild(x))
+    return false;
+  size_t start;
+  uint8_t state;
+  BracketNode *n = bracketFind(x, offset, &start, &state);
+  if (!n)
+    return false;
+  char text[BRACKET_MAX_CHUNK];
+  buffer_read(x->buffer, start, n->len, text);
+
+  // Find the bracket, keeping the unmatched opening ones before it.
+  uint16_t opens[BRACKET_MAX_CHUNK];
+  size_t num_opens = 0, i = 0, unmatched = 0;
+  int d;
+  while ((d = bracketNext(text, n->len, &i, &state)) &&
+         start + i - 1 < offset) {
+    if (d > 0)
+      opens[num_opens++] = (uint16_t)(i - 1);
+    else if (num_opens)
+      num_opens--;
+    else
+      unmatched++;
+  }
+  if (!d || start + i - 1 != offset)
+    return false;
+
+  ptrdiff_t need;
+  size_t found_start;
+  uint8_t found_state;
+  BracketNode *found;
+  if (d < 0) {
+    if (num_opens) {
+      *match = start + opens[num_opens - 1];
+      return true;
+    }
+    need = 1 + (ptrdiff_t)unmatched;
+    found = bracketBackward(x->root, 0, start, BRACKET_CODE, &need,
+                            &found_start, &found_state);
+    if (!found)
+      return false;
+    // The last opening bracket from which the depth to the chunk's end
+    // is need.
+    buffer_read(x->buffer, found_start, found->len, text);
+    ptrdiff_t total = found->self[found_state].sum, depth = 0;
+    size_t last = 0;
+    i = 0;
+    while ((d = bracketNext(text, found->len, &i, &found_state))) {
+      if (d > 0 && total - depth == need)
+        last = i;
+      depth += d;
+    }
+    *match = found_start + last - 1;
+    return true;
+  }
+
+  ptrdiff_t depth = 0;
+  while ((d = bracketNext(text, n->len, &i, &state)))
+    if ((depth += d) < 0) {
+      *match = start + i - 1;
+      return true;
+    }
+  need = -1 - depth;
+  found = bracketForward(x->root, 0, start + n->len, &state, &need,
+                         &found_start);
+  if (!found)
+    return false;
+  buffer_read(x->buffer, found_start, found->len, text);
+  depth = 0;
+  i = 0;
+  while ((d = bracketNext(text, found->len, &i, &state)))
+    if ((depth += d) == need)
+      break;
+  *match = found_start + i - 1;
+  return true;
+}
+
+static inline BracketIndex *bracket_attach(Buffer *b) {
+  BracketIndex *x = tui_calloc(ALLOC_COMPONENT, 1, sizeof(BracketIndex));
+  if (!x)
+    return NULL;
+  x->buffer = b;
+  x->seed = 0x2545F491u ^ (uint32_t)(uintptr_t)x;
+  if (!x->seed)
+    x->seed = 1;
+  BufferListener listener = {NULL, bracketAfterEdit, x, NULL};
+  if (!bracketBuild(x) || !buffer_listen(b, listener)) {
+    bracketFree(x->root);
+    tui_free(ALLOC_COMPONENT, x);
+    return NULL;
+  }
+  return x;
+}
+
+static inline void bracket_detach(BracketIndex *x) {
+  if (!x)
+    return;
+  buffer_unlisten(x->buffer, x);
+  bracketFree(x->root);
+  tui_free(ALLOC_COMPONENT, x);
+}
+
+#endif
@@ -0,0 +1,1525 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "encoding.h"
+#include "lz.h"
+
+// The text of an open file, as a piece tree: a treap of pieces ordered by
+// position, each node also summing the bytes and newlines of its subtree,
+// so that edits and line lookups are O(log n).
+//
+// Piece text lives in sources that are never written once filled: source
+// 0 is the file as loaded, the rest are fixed-size blocks of typed text.
+// Pieces never straddle two sources.
+//
+// Anything that keeps derived state (indexes, caches, markers) registers
+// a listener and hears about every edit just before and just after it is
+// applied.
+//
+// Undo history comes almost for free: removed pieces are kept rather than
+// freed, since the text they point at never changes, and putting them back
+// is one split and two merges. Undone changes are kept the same way for
+// redo.
+//
+// A large file can be opened from its head alone (buffer_open_head()),
+// which is enough to show, with the rest read in on the pool and added once
+// it's all there. Until then the buffer refuses edits.
+//
+// The text is always UTF-8. A file in another encoding (see encoding.h),
+// guessed from its head, is decoded into source 0 as it's read, and saved
+// in it again by buffer_save().
+//
+// A buffer left alone for a while can have its add blocks and history
+// packed with lz.h (see pack.h), which frees the originals. Either comes
+// back the first time it's needed: a packed add block when a piece of it
+// is read, the history when there's an edit, undo or redo.
+
+#define BUFFER_MAX_PIECE ((size_t)64 << 10)
+#define BUFFER_ADD_BLOCK ((size_t)64 << 10)
+#define BUFFER_MAX_LISTENERS 16
+#define BUFFER_HEAD_BYTES ((size_t)256 << 10) // Read before the first paint.
+#define BUFFER_LOAD_CHUNK ((size_t)4 << 20)    // And the rest, per job.
+#define BUFFER_SAVE_BLOCK ((size_t)64 << 10)
+
+typedef struct BufferNode {
+  struct BufferNode *left, *right;
+  uint32_t priority;
+
+  // The piece.
+  uint32_t source;
+  size_t offset, len, newlines;
+
+  // Sums over the subtree.
+  size_t total_len, total_newlines;
+} BufferNode;
+
+typedef struct {
+  size_t offset;            // Where the edit starts.
+  size_t removed, inserted; // Bytes.
+  size_t line;              // Line that contains offset.
+  size_t removed_lines;     // Newlines among the removed bytes.
+  size_t inserted_lines;    // Newlines among the inserted bytes.
+} BufferEdit;
+
+struct Buffer;
+
+// A frozen copy of the piece list. It shares the text, which is never
+// rewritten, so it is cheap to take and can be read from another thread
+// while the buffer keeps changing. It must not outlive the buffer, and is
+// given back with buffer_release(), since text it shares can't be packed.
+typedef struct {
+  const char *text;
+  size_t len, newlines;
+} BufferSpan;
+
+typedef struct {
+  struct Buffer *buffer;
+  size_t size, newlines;
+  size_t num_spans;
+  BufferSpan spans[];
+} BufferSnapshot;
+
+typedef void (*BufferListenerFn)(struct Buffer *b, const BufferEdit *edit,
+                                 void *ctx);
+
+typedef struct {
+  BufferListenerFn before, after;
+  void *ctx;
+  // Called when the buffer is known to match the file on disk again.
+  void (*saved)(struct Buffer *b, void *ctx);
+} BufferListener;
+
+// One change in the undo or redo history. Inserted text is remembered by
+// its length alone, removed text by its pieces; undoing or redoing turns
+// one kind into the other. Changes are grouped, and group_start marks the
+// oldest change of each group.
+typedef struct {
+  size_t offset, len;
+  BufferNode *removed; // NULL if the text at offset was inserted.
+  bool group_start;
+} BufferChange;
+
+typedef struct {
+  BufferChange *items;
+  size_t count, cap;
+} BufferChanges;
+
+typedef struct {
+  char *data; // NULL if not packed.
+  size_t len, size; // Packed and not.
+} BufferPacked;
+
+// What's been packed. A packed add block's source is NULL; the history,
+// when packed, leaves both undo and redo empty.
+typedef struct {
+  BufferPacked *sources;
+  size_t cap_sources;
+  BufferPacked history;
+  size_t unpacks; // Bumped whenever something is unpacked.
+} BufferPack;
+
+typedef struct Buffer {
+  char *path;
+  BufferNode *root;
+
+  char **sources;
+  size_t num_sources, cap_sources;
+  size_t add_used; // Bytes used in the last source, if it's an add block.
+  bool add_open;   // Whether the last source is an add block with room.
+
+  uint32_t seed;
+  size_t num_listeners;
+  BufferListener listeners[BUFFER_MAX_LISTENERS];
+
+  BufferChanges undo, redo;
+  size_t group_depth;
+  bool group_pending; // The next change starts the open group.
+
+  BufferPack *pack;   // NULL until something's packed.
+  size_t snapshots;   // Not yet released.
+
+  // Bumped by every edit, so a snapshot can tell if it's still current.
+  size_t version, saved_version;
+
+  bool loading; // The rest of the file is still being read; read-only.
+
+  Encoding encoding; // The file's, for saving.
+  bool bom;          // Whether it starts with a byte order mark.
+} Buffer;
+
+static inline size_t bufferMin(size_t a, size_t b) { return a < b ? a : b; }
+
+static inline uint32_t bufferXorshift(uint32_t *seed) {
+  uint32_t x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *seed = x;
+}
+
+static inline uint32_t bufferRandom(Buffer *b) {
+  return bufferXorshift(&b->seed);
+}
+
+static inline size_t bufferCountNewlines(const char *p, size_t n) {
+  size_t count = 0;
+  const char *end = p + n;
+  while ((p = memchr(p, '\n', (size_t)(end - p))))
+    count++, p++;
+  return count;
+}
+
+// Brings back a packed add block. Readers can't fail, and a block that
+// can't be unpacked is lost text, so failing to is fatal.
+static inline void bufferUnpackSource(const Buffer *b, uint32_t source) {
+  BufferPacked *packed = &b->pack->sources[source];
+  char *text = tui_malloc(ALLOC_BUFFER, BUFFER_ADD_BLOCK);
+  if (!text || !lz_decompress(packed->data, packed->len, text, packed->size))
+    abort();
+  tui_free(ALLOC_BUFFER, packed->data);
+  packed->data = NULL;
+  b->sources[source] = text;
+  b->pack->unpacks++;
+}
+
+static inline char *bufferSource(const Buffer *b, uint32_t source) {
+  if (!b->sources[source])
+    bufferUnpackSource(b, source);
+  return b->sources[source];
+}
+
+static inline const char *bufferPieceText(const Buffer *b,
+                                          const BufferNode *n) {
+  return bufferSource(b, n->source) + n->offset;
+}
+
+static inline void bufferUpdate(BufferNode *n) {
+  n->total_len = n->len;
+  n->total_newlines = n->newlines;
+  if (n->left) {
+    n->total_len += n->left->total_len;
+    n->total_newlines += n->left->total_newlines;
+  }
+  if (n->right) {
+    n->total_len += n->right->total_len;
+    n->total_newlines += n->right->total_newlines;
+  }
+}
+
+static inline BufferNode *bufferNewNode(Buffer *b, uint32_t source,
+                                        size_t offset, size_t len) {
+  BufferNode *n = tui_malloc(ALLOC_BUFFER, sizeof(BufferNode));
+  if (!n)
+    return NULL;
+  *n = (BufferNode){.priority = bufferRandom(b),
+                    .source = source,
+                    .offset = offset,
+                    .len = len};
+  n->newlines = bufferCountNewlines(bufferPieceText(b, n), len);
+  bufferUpdate(n);
+  return n;
+}
+
+static inline BufferNode *bufferMerge(BufferNode *l, BufferNode *r) {
+  if (!l || !r)
+    return l ? l : r;
+  if (l->priority > r->priority) {
+    l->right = bufferMerge(l->right, r);
+    bufferUpdate(l);
+    return l;
+  }
+  r->left = bufferMerge(l, r->left);
+  bufferUpdate(r);
+  return r;
+}
+
+// Splits t into the first pos bytes and the rest, cutting a piece in two
+// if pos falls inside it. Fails only if that cut can't allocate.
+static inline bool bufferSplit(Buffer *b, BufferNode *t, size_t pos,
+                               BufferNode **l, BufferNode **r) {
+  if (!t) {
+    *l = *r = NULL;
+    return true;
+  }
+  size_t left_len = t->left ? t->left->total_len : 0;
+  bool ok = true;
+  if (pos <= left_len) {
+    ok = bufferSplit(b, t->left, pos, l, &t->left);
+    bufferUpdate(t);
+    *r = t;
+  } else if (pos >= left_len + t->len) {
+    ok = bufferSplit(b, t->right, pos - left_len - t->len, &t->right, r);
+    bufferUpdate(t);
+    *l = t;
+  } else {
+    size_t k = pos - left_len;
+    BufferNode *tail = bufferNewNode(b, t->source, t->offset + k, t->len - k);
+    if (!tail) {
+      *l = t;
+      *r = NULL;
+      return false;
+    }
+    t->len = k;
+    t->newlines -= tail->newlines;
+    *r = bufferMerge(tail, t->right);
+    t->right = NULL;
+    bufferUpdate(t);
+    *l = t;
+  }
+  return ok;
+}
+
+static inline void bufferFreeTree(BufferNode *n) {
+  if (!n)
+    return;
+  bufferFreeTree(n->left);
+  bufferFreeTree(n->right);
+  tui_free(ALLOC_BUFFER, n);
+}
+
+static inline bool bufferAddSource(Buffer *b, char *text) {
+  if (b->num_sources == b->cap_sources) {
+    size_t cap = b->cap_sources ? b->cap_sources * 2 : 8;
+    char **sources =
+        tui_realloc(ALLOC_BUFFER, b->sources, cap * sizeof(char *));
+    if (!sources)
+      return false;
+    b->sources = sources;
+    b->cap_sources = cap;
+  }
+  b->sources[b->num_sources++] = text;
+  return true;
+}
+
+// Builds a tree of pieces of at most BUFFER_MAX_PIECE over a source, so no
+// single piece is ever expensive to cut.
+static inline BufferNode *bufferPieces(Buffer *b, uint32_t source,
+                                       size_t offset, size_t len) {
+  BufferNode *tree = NULL;
+  for (size_t at = 0; at < len; at += BUFFER_MAX_PIECE) {
+    BufferNode *n =
+        bufferNewNode(b, source, offset + at,
+                      bufferMin(BUFFER_MAX_PIECE, len - at));
+    if (!n) {
+      bufferFreeTree(tree);
+      return NULL;
+    }
+    tree = bufferMerge(tree, n);
+  }
+  return tree;
+}
+
+static inline size_t bufferCountNodes(const BufferNode *n) {
+  return n ? 1 + bufferCountNodes(n->left) + bufferCountNodes(n->right) : 0;
+}
+
+// Builds a tree over nodes already in order in one pass, keeping a stack
+// of the right spine: each node takes over the part of it with lower
+// priorities as its left subtree. A node is final once it leaves the stack.
+static inline BufferNode *bufferBuild(BufferNode **nodes, size_t n,
+                                      BufferNode **spine) {
+  size_t top = 0;
+  for (size_t i = 0; i < n; i++) {
+    BufferNode *node = nodes[i], *last = NULL;
+    node->left = node->right = NULL;
+    while (top && spine[top - 1]->priority < node->priority) {
+      last = spine[--top];
+      bufferUpdate(last);
+    }
+    node->left = last;
+    if (top)
+      spine[top - 1]->right = node;
+    spine[top++] = node;
+  }
+  while (top > 1)
+    bufferUpdate(spine[--top]);
+  if (!top)
+    return NULL;
+  bufferUpdate(spine[0]);
+  return spine[0];
+}
+
+static inline void bufferFlatten(BufferNode *n, BufferNode **out,
+                                 size_t *count) {
+  if (!n)
+    return;
+  bufferFlatten(n->left, out, count);
+  out[(*count)++] = n;
+  bufferFlatten(n->right, out, count);
+}
+
+static inline size_t buffer_size(const Buffer *b) {
+  return b->root ? b->root->total_len : 0;
+}
+
+static inline size_t buffer_num_lines(const Buffer *b) {
+  return (b->root ? b->root->total_newlines : 0) + 1;
+}
+
+// The line that contains offset, counting from 0.
+static inline size_t buffer_line_of(const Buffer *b, size_t offset) {
+  size_t line = 0;
+  for (const BufferNode *n = b->root; n;) {
+    size_t left_len = n->left ? n->left->total_len : 0;
+    if (offset < left_len) {
+      n = n->left;
+      continue;
+    }
+    if (n->left)
+      line += n->left->total_newlines;
+    offset -= left_len;
+    if (offset < n->len)
+      return line + bufferCountNewlines(bufferPieceText(b, n), offset);
+    line += n->newlines;
+    offset -= n->len;
+    n = n->right;
+  }
+  return line;
+}
+
+// Offset of the first byte of a line. Past the last line, the size.
+static inline size_t buffer_line_start(const Buffer *b, size_t line) {
+  if (!line)
+    return 0;
+  // Find the newline that ends line - 1.
+  size_t want = line, offset = 0;
+  for (const BufferNode *n = b->root; n;) {
+    size_t left_nl = n->left ? n->left->total_newlines : 0;
+    if (want <= left_nl) {
+      n = n->left;
+      continue;
+    }
+    want -= left_nl;
+    offset += n->left ? n->left->total_len : 0;
+    if (want <= n->newlines) {
+      const char *text = bufferPieceText(b, n), *p = text;
+      for (;; p++) {
+        p = memchr(p, '\n', n->len - (size_t)(p - text));
+        if (!--want)
+          return offset + (size_t)(p - text) + 1;
+      }
+    }
+    want -= n->newlines;
+    offset += n->len;
+    n = n->right;
+  }
+  return buffer_size(b);
+}
+
+static inline void bufferReadTree(const Buffer *b, const BufferNode *n,
+                                  size_t offset, size_t len, char *out) {
+  while (n && len) {
+    size_t left_len = n->left ? n->left->total_len : 0;
+    if (offset < left_len) {
+      size_t take = bufferMin(len, left_len - offset);
+      bufferReadTree(b, n->left, offset, take, out);
+      out += take;
+      len -= take;
+      offset = left_len;
+    }
+    if (!len)
+      return;
+    offset -= left_len;
+    if (offset < n->len) {
+      size_t take = bufferMin(len, n->len - offset);
+      memcpy(out, bufferPieceText(b, n) + offset, take);
+      out += take;
+      len -= take;
+      offset = 0;
+    } else {
+      offset -= n->len;
+    }
+    n = n->right;
+  }
+}
+
+// Copies len bytes starting at offset; the range must be in the buffer.
+// Call it from the buffer's thread, since it may unpack text; other
+// threads read a buffer_snapshot().
+static inline void buffer_read(const Buffer *b, size_t offset, size_t len,
+                               char *out) {
+  bufferReadTree(b, b->root, offset, len, out);
+}
+
+// Copies a line without its newline into a fresh allocation.
+static inline char *buffer_line(const Buffer *b, size_t line, size_t *len) {
+  size_t start = buffer_line_start(b, line);
+  size_t end = buffer_line_start(b, line + 1);
+  if (end > start && line + 1 < buffer_num_lines(b))
+    end--;
+  char *text = malloc(end - start + 1);
+  if (!text)
+    return NULL;
+  buffer_read(b, start, end - start, text);
+  text[end - start] = 0;
+  *len = end - start;
+  return text;
+}
+
+static inline void bufferNotify(Buffer *b, const BufferEdit *edit,
+                                bool after) {
+  for (size_t i = 0; i < b->num_listeners; i++) {
+    BufferListenerFn fn =
+        after ? b->listeners[i].after : b->listeners[i].before;
+    if (fn)
+      fn(b, edit, b->listeners[i].ctx);
+  }
+}
+
+static inline bool buffer_listen(Buffer *b, BufferListener listener) {
+  if (b->num_listeners == BUFFER_MAX_LISTENERS)
+    return false;
+  b->listeners[b->num_listeners++] = listener;
+  return true;
+}
+
+static inline void buffer_unlisten(Buffer *b, void *ctx) {
+  for (size_t i = 0; i < b->num_listeners;)
+    if (b->listeners[i].ctx == ctx)
+      b->listeners[i] = b->listeners[--b->num_listeners];
+    else
+      i++;
+}
+
+static inline void bufferFreeChanges(BufferChanges *c) {
+  for (size_t i = 0; i < c->count; i++)
+    bufferFreeTree(c->items[i].removed);
+  c->count = 0;
+}
+
+static inline bool bufferPushChange(BufferChanges *c, BufferChange change) {
+  if (c->count == c->cap) {
+    size_t cap = c->cap ? c->cap * 2 : 64;
+    BufferChange *items =
+        tui_realloc(ALLOC_BUFFER, c->items, cap * sizeof(BufferChange));
+    if (!items)
+      return false;
+    c->items = items;
+    c->cap = cap;
+  }
+  c->items[c->count++] = change;
+  return true;
+}
+
+// The history packs as varints: for undo then redo, the number of changes,
+// then each change's offset, length, group_start and number of removed
+// pieces, and each piece's source, offset, length and newlines in order.
+#define BUFFER_MAX_VARINT 10
+
+static inline unsigned char *bufferPutVarint(unsigned char *out, size_t v) {
+  for (; v >= 0x80; v >>= 7)
+    *out++ = (unsigned char)(v | 0x80);
+  *out++ = (unsigned char)v;
+  return out;
+}
+
+static inline bool bufferGetVarint(const unsigned char **p,
+                                   const unsigned char *end, size_t *v) {
+  *v = 0;
+  for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char c = *(*p)++;
+    *v |= (size_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static inline unsigned char *bufferPutTree(unsigned char *out,
+                                           const BufferNode *n) {
+  if (!n)
+    return out;
+  out = bufferPutTree(out, n->left);
+  out = bufferPutVarint(out, n->source);
+  out = bufferPutVarint(out, n->offset);
+  out = bufferPutVarint(out, n->len);
+  out = bufferPutVarint(out, n->newlines);
+  return bufferPutTree(out, n->right);
+}
+
+// The history as varints, in a fresh allocation.
+static inline char *bufferHistoryBytes(const Buffer *b, size_t *len) {
+  const BufferChanges *lists[] = {&b->undo, &b->redo};
+  size_t most = 2 * BUFFER_MAX_VARINT;
+  for (size_t l = 0; l < 2; l++)
+    for (size_t i = 0; i < lists[l]->count; i++)
+      most += 4 * BUFFER_MAX_VARINT *
+              (1 + bufferCountNodes(lists[l]->items[i].removed));
+  unsigned char *bytes = tui_malloc(ALLOC_BUFFER, most), *out = bytes;
+  if (!bytes)
+    return NULL;
+  for (size_t l = 0; l < 2; l++) {
+    out = bufferPutVarint(out, lists[l]->count);
+    for (size_t i = 0; i < lists[l]->count; i++) {
+      const BufferChange *c = &lists[l]->items[i];
+      out = bufferPutVarint(out, c->offset);
+      out = bufferPutVarint(out, c->len);
+      out = bufferPutVarint(out, c->group_start);
+      out = bufferPutVarint(out, bufferCountNodes(c->removed));
+      out = bufferPutTree(out, c->removed);
+    }
+  }
+  *len = (size_t)(out - bytes);
+  return (char *)bytes;
+}
+
+// Rebuilds one change's removed pieces, as a tree with fresh priorities.
+static inline bool bufferGetTree(Buffer *b, const unsigned char **p,
+                                 const unsigned char *end, size_t count,
+                                 BufferNode **tree) {
+  *tree = NULL;
+  if (!count)
+    return true;
+  BufferNode **nodes =
+      tui_malloc(ALLOC_BUFFER, 2 * count * sizeof(BufferNode *));
+  size_t made = 0;
+  bool ok = nodes != NULL;
+  while (ok && made < count) {
+    size_t source, offset, len, newlines;
+    BufferNode *n = NULL;
+    ok = bufferGetVarint(p, end, &source) &&
+         bufferGetVarint(p, end, &offset) && bufferGetVarint(p, end, &len) &&
+         bufferGetVarint(p, end, &newlines) && source < b->num_sources &&
+         (n = tui_malloc(ALLOC_BUFFER, sizeof(BufferNode)));
+    if (ok) {
+      *n = (BufferNode){.priority = bufferRandom(b),
+                        .source = (uint32_t)source,
+                        .offset = offset,
+                        .len = len,
+                        .newlines = newlines};
+      nodes[made++] = n;
+    }
+  }
+  if (ok)
+    *tree = bufferBuild(nodes, count, nodes + count);
+  else
+    for (size_t i = 0; i < made; i++)
+      tui_free(ALLOC_BUFFER, nodes[i]);
+  tui_free(ALLOC_BUFFER, nodes);
+  return ok;
+}
+
+static inline bool bufferHistoryFromBytes(Buffer *b, const char *bytes,
+                                          size_t len) {
+  const unsigned char *p = (const unsigned char *)bytes, *end = p + len;
+  BufferChanges *lists[] = {&b->undo, &b->redo};
+  for (size_t l = 0; l < 2; l++) {
+    size_t count;
+    if (!bufferGetVarint(&p, end, &count))
+      return false;
+    for (size_t i = 0; i < count; i++) {
+      size_t offset, change_len, group_start, pieces;
+      BufferChange c = {0};
+      if (!bufferGetVarint(&p, end, &offset) ||
+          !bufferGetVarint(&p, end, &change_len) ||
+          !bufferGetVarint(&p, end, &group_start) ||
+          !bufferGetVarint(&p, end, &pieces) ||
+          !bufferGetTree(b, &p, end, pieces, &c.removed))
+        return false;
+      c.offset = offset;
+      c.len = change_len;
+      c.group_start = group_start != 0;
+      if (!bufferPushChange(lists[l], c)) {
+        bufferFreeTree(c.removed);
+        return false;
+      }
+    }
+  }
+  return p == end;
+}
+
+// Brings back a packed history. If it can't be, it's dropped, as when the
+// history can't grow.
+static inline bool bufferUnpackHistory(Buffer *b) {
+  if (!b->pack || !b->pack->history.data)
+    return true;
+  BufferPacked *packed = &b->pack->history;
+  char *bytes = tui_malloc(ALLOC_BUFFER, packed->size ? packed->size : 1);
+  bool ok = bytes &&
+            lz_decompress(packed->data, packed->len, bytes, packed->size) &&
+            bufferHistoryFromBytes(b, bytes, packed->size);
+  if (!ok) {
+    bufferFreeChanges(&b->undo);
+    bufferFreeChanges(&b->redo);
+  }
+  tui_free(ALLOC_BUFFER, bytes);
+  tui_free(ALLOC_BUFFER, packed->data);
+  packed->data = NULL;
+  b->pack->unpacks++;
+  return ok;
+}
+
+// Records a new edit, which also makes anything undone unreachable. Typing
+// on one line is folded into a single change. If the history can't grow it
+// is dropped, since its offsets would no longer line up.
+static inline void bufferRecord(Buffer *b, BufferChange change,
+                                bool typing) {
+  bufferUnpackHistory(b);
+  bufferFreeChanges(&b->redo);
+  BufferChange *last =
+      b->undo.count ? &b->undo.items[b->undo.count - 1] : NULL;
+  if (typing && !b->group_depth && last && last->group_start &&
+      !last->removed && last->offset + last->len == change.offset) {
+    last->len += change.len;
+    return;
+  }
+  change.group_start = !b->group_depth || b->group_pending;
+  b->group_pending = false;
+  if (!bufferPushChange(&b->undo, change)) {
+    bufferFreeTree(change.removed);
+    bufferFreeChanges(&b->undo);
+  }
+}
+
+// Edits made between these two calls are undone and redone as one. Groups
+// nest; only the outermost one counts.
+static inline void buffer_begin_group(Buffer *b) {
+  if (!b->group_depth++)
+    b->group_pending = true;
+}
+
+static inline void buffer_end_group(Buffer *b) {
+  if (b->group_depth)
+    b->group_depth--;
+}
+
+static inline bool buffer_modified(const Buffer *b) {
+  return b->version != b->saved_version;
+}
+
+// Notes that the buffer now matches its file.
+static inline void buffer_mark_saved(Buffer *b) {
+  b->saved_version = b->version;
+  for (size_t i = 0; i < b->num_listeners; i++)
+    if (b->listeners[i].saved)
+      b->listeners[i].saved(b, b->listeners[i].ctx);
+}
+
+// Appends typed text to the add blocks, returning it as a tree of pieces.
+static inline BufferNode *bufferAppend(Buffer *b, const char *text,
+                                       size_t len) {
+  BufferNode *tree = NULL;
+  while (len) {
+    if (!b->add_open || b->add_used == BUFFER_ADD_BLOCK) {
+      char *block = tui_malloc(ALLOC_BUFFER, BUFFER_ADD_BLOCK);
+      if (!block || !bufferAddSource(b, block)) {
+        tui_free(ALLOC_BUFFER, block);
+        bufferFreeTree(tree);
+        return NULL;
+      }
+      b->add_open = true;
+      b->add_used = 0;
+    }
+    size_t take = bufferMin(len, BUFFER_ADD_BLOCK - b->add_used);
+    uint32_t source = (uint32_t)b->num_sources - 1;
+    memcpy(bufferSource(b, source) + b->add_used, text, take);
+    BufferNode *n = bufferNewNode(b, source, b->add_used, take);
+    if (!n) {
+      bufferFreeTree(tree);
+      return NULL;
+    }
+    b->add_used += take;
+    tree = bufferMerge(tree, n);
+    text += take;
+    len -= take;
+  }
+  return tree;
+}
+
+// Puts a tree of pieces in at offset.
+static inline bool bufferInsertTree(Buffer *b, size_t offset,
+                                    BufferNode *middle) {
+  BufferEdit edit = {offset, 0, middle->total_len, buffer_line_of(b, offset),
+                     0, middle->total_newlines};
+  bufferNotify(b, &edit, false);
+  BufferNode *l, *r;
+  bool ok = bufferSplit(b, b->root, offset, &l, &r);
+  b->root = bufferMerge(bufferMerge(l, ok ? middle : NULL), r);
+  if (!ok)
+    return false;
+  b->version++;
+  bufferNotify(b, &edit, true);
+  return true;
+}
+
+// Takes len bytes at offset out as a tree of pieces.
+static inline bool bufferRemoveTree(Buffer *b, size_t offset, size_t len,
+                                    BufferNode **out) {
+  size_t line = buffer_line_of(b, offset);
+  BufferEdit edit = {offset, len, 0, line,
+                     buffer_line_of(b, offset + len) - line, 0};
+  bufferNotify(b, &edit, false);
+  BufferNode *l, *middle, *r;
+  if (!bufferSplit(b, b->root, offset, &l, &r)) {
+    b->root = bufferMerge(l, r);
+    return false;
+  }
+  if (!bufferSplit(b, r, len, &middle, &r)) {
+    b->root = bufferMerge(bufferMerge(l, middle), r);
+    return false;
+  }
+  b->root = bufferMerge(l, r);
+  b->version++;
+  bufferNotify(b, &edit, true);
+  *out = middle;
+  return true;
+}
+
+static inline bool buffer_insert(Buffer *b, size_t offset, const char *text,
+                                 size_t len) {
+  if (b->loading || offset > buffer_size(b))
+    return false;
+  if (!len)
+    return true;
+  BufferNode *middle = bufferAppend(b, text, len);
+  if (!middle)
+    return false;
+  if (!bufferInsertTree(b, offset, middle)) {
+    bufferFreeTree(middle);
+    return false;
+  }
+  bufferRecord(b, (BufferChange){offset, len, NULL, false},
+               !memchr(text, '\n', len));
+  return true;
+}
+
+static inline bool buffer_delete(Buffer *b, size_t offset, size_t len) {
+  if (b->loading || offset > buffer_size(b) || len > buffer_size(b) - offset)
+    return false;
+  if (!len)
+    return true;
+  BufferNode *middle;
+  if (!bufferRemoveTree(b, offset, len, &middle))
+    return false;
+  bufferRecord(b, (BufferChange){offset, len, middle, false}, false);
+  return true;
+}
+
+// Reverses one change, returning the change that reverses it back.
+static inline bool bufferInvert(Buffer *b, BufferChange *change) {
+  if (change->removed) {
+    if (!bufferInsertTree(b, change->offset, change->removed))
+      return false;
+    change->removed = NULL;
+    return true;
+  }
+  return bufferRemoveTree(b, change->offset, change->len, &change->removed);
+}
+
+// Moves the newest group from one history to the other, reversing it on
+// the way. The first change moved is the newest, so it ends up as the
+// oldest of its group on the other side.
+static inline bool bufferTravel(Buffer *b, BufferChanges *from,
+                                BufferChanges *to) {
+  if (!bufferUnpackHistory(b) || !from->count)
+    return false;
+  bool first = true, group_start = false;
+  while (from->count && !group_start) {
+    BufferChange change = from->items[from->count - 1];
+    group_start = change.group_start;
+    if (!bufferInvert(b, &change))
+      return false;
+    from->count--;
+    change.group_start = first;
+    first = false;
+    if (!bufferPushChange(to, change)) {
+      bufferFreeTree(change.removed);
+      bufferFreeChanges(to);
+    }
+  }
+  return true;
+}
+
+static inline bool buffer_undo(Buffer *b) {
+  return bufferTravel(b, &b->undo, &b->redo);
+}
+
+static inline bool buffer_redo(Buffer *b) {
+  return bufferTravel(b, &b->redo, &b->undo);
+}
+
+typedef struct {
+  BufferNode **items;
+  size_t count, cap;
+} BufferNodes;
+
+static inline bool bufferPushPiece(Buffer *b, BufferNodes *out,
+                                   const BufferNode *from, size_t skip,
+                                   size_t len) {
+  if (out->count == out->cap) {
+    size_t cap = out->cap ? out->cap * 2 : 256;
+    BufferNode **items =
+        tui_realloc(ALLOC_BUFFER, out->items, cap * sizeof(BufferNode *));
+    if (!items)
+      return false;
+    out->items = items;
+    out->cap = cap;
+  }
+  BufferNode *n;
+  if (!skip && len == from->len) {
+    // A whole piece keeps its newline count.
+    if (!(n = tui_malloc(ALLOC_BUFFER, sizeof(BufferNode))))
+      return false;
+    *n = *from;
+    n->priority = bufferRandom(b);
+  } else if (!(n = bufferNewNode(b, from->source, from->offset + skip,
+                                 len))) {
+    return false;
+  }
+  out->items[out->count++] = n;
+  return true;
+}
+
+// The pieces of removed with each match swapped for the pieces of with.
+// Matches are offsets into removed.
+static inline bool bufferSubstitute(Buffer *b, BufferNode *removed,
+                                    const size_t *matches, size_t count,
+                                    size_t len, BufferNode **with,
+                                    size_t num_with, BufferNodes *out) {
+  BufferNode **old = tui_malloc(
+      ALLOC_BUFFER, bufferCountNodes(removed) * sizeof(BufferNode *));
+  if (!old)
+    return false;
+  size_t num_old = 0, j = 0, at = 0;
+  bufferFlatten(removed, old, &num_old);
+  bool ok = true;
+  for (size_t i = 0; ok && i < num_old; at += old[i++]->len) {
+    for (size_t c = 0; ok && c < old[i]->len;) {
+      size_t pos = at + c;
+      size_t match = j < count ? matches[j] : SIZE_MAX;
+      if (pos < match) {
+        size_t take = bufferMin(match - pos, old[i]->len - c);
+        ok = bufferPushPiece(b, out, old[i], c, take);
+        c += take;
+        continue;
+      }
+      for (size_t k = 0; ok && pos == match && k < num_with; k++)
+        ok = bufferPushPiece(b, out, with[k], 0, with[k]->len);
+      c += bufferMin(match + len - pos, old[i]->len - c);
+      if (at + c == match + len)
+        j++;
+    }
+  }
+  tui_free(ALLOC_BUFFER, old);
+  return ok;
+}
+
+// Replaces the len bytes at each of offsets, which must be in order and
+// not overlap, with the same text. The pieces from the first match to the
+// end of the last are taken out and rebuilt once, in one pass, rather than
+// split and merged per match; listeners hear of one delete and one insert,
+// and it's undone as one.
+static inline bool buffer_replace_all(Buffer *b, const size_t *offsets,
+                                      size_t count, size_t len,
+                                      const char *with, size_t with_len) {
+  if (!count)
+    return true;
+  if (!len || b->loading)
+    return false;
+  for (size_t i = 0; i < count; i++)
+    if (offsets[i] > buffer_size(b) || len > buffer_size(b) - offsets[i] ||
+        (i && offsets[i] < offsets[i - 1] + len))
+      return false;
+  size_t lo = offsets[0], hi = offsets[count - 1] + len;
+
+  // The replacement text goes into the add blocks once and every match
+  // points at it.
+  BufferNode *text = with_len ? bufferAppend(b, with, with_len) : NULL;
+  size_t num_with = 0;
+  BufferNode **pieces = tui_malloc(
+      ALLOC_BUFFER, (bufferCountNodes(text) + 1) * sizeof(BufferNode *));
+  size_t *matches = tui_malloc(ALLOC_BUFFER, count * sizeof(size_t));
+  BufferNodes out = {0};
+  BufferNode *removed = NULL, *tree = NULL;
+  bool ok = (text || !with_len) && pieces && matches &&
+            bufferRemoveTree(b, lo, hi - lo, &removed);
+  if (ok) {
+    bufferFlatten(text, pieces, &num_with);
+    for (size_t i = 0; i < count; i++)
+      matches[i] = offsets[i] - lo;
+    ok = bufferSubstitute(b, removed, matches, count, len, pieces, num_with,
+                          &out);
+    BufferNode **spine =
+        ok ? tui_malloc(ALLOC_BUFFER, (out.count + 1) * sizeof(BufferNode *))
+           : NULL;
+    if (spine) {
+      tree = bufferBuild(out.items, out.count, spine);
+      out.count = 0;
+      tui_free(ALLOC_BUFFER, spine);
+    }
+    size_t inserted = tree ? tree->total_len : 0;
+    ok = spine && (!tree || bufferInsertTree(b, lo, tree));
+    if (ok) {
+      buffer_begin_group(b);
+      bufferRecord(b, (BufferChange){lo, hi - lo, removed, false}, false);
+      if (inserted)
+        bufferRecord(b, (BufferChange){lo, inserted, NULL, false}, false);
+      buffer_end_group(b);
+    } else {
+      bufferFreeTree(tree);
+      bufferInsertTree(b, lo, removed);
+    }
+  }
+  for (size_t i = 0; i < out.count; i++)
+    tui_free(ALLOC_BUFFER, out.items[i]);
+  tui_free(ALLOC_BUFFER, out.items);
+  bufferFreeTree(text);
+  tui_free(ALLOC_BUFFER, pieces);
+  tui_free(ALLOC_BUFFER, matches);
+  return ok;
+}
+
+static inline void bufferFillSpans(const Buffer *b, const BufferNode *n,
+                                   BufferSnapshot *snap) {
+  if (!n)
+    return;
+  bufferFillSpans(b, n->left, snap);
+  snap->spans[snap->num_spans++] =
+      (BufferSpan){bufferPieceText(b, n), n->len, n->newlines};
+  bufferFillSpans(b, n->right, snap);
+}
+
+static inline BufferSnapshot *buffer_snapshot(Buffer *b) {
+  size_t n = bufferCountNodes(b->root);
+  BufferSnapshot *snap =
+      tui_malloc(ALLOC_BUFFER, sizeof(BufferSnapshot) + n * sizeof(BufferSpan));
+  if (!snap)
+    return NULL;
+  b->snapshots++;
+  snap->buffer = b;
+  snap->size = buffer_size(b);
+  snap->newlines = b->root ? b->root->total_newlines : 0;
+  snap->num_spans = 0;
+  bufferFillSpans(b, b->root, snap);
+  return snap;
+}
+
+// Frees a snapshot. Call it from the buffer's thread.
+static inline void buffer_release(BufferSnapshot *snap) {
+  if (snap)
+    snap->buffer->snapshots--;
+  tui_free(ALLOC_BUFFER, snap);
+}
+
+// Packing is split so the slow part can run on the pool: starting picks
+// what to pack and copies the history out, running packs it without
+// touching the buffer, and finishing swaps it in, unless the buffer has
+// moved on in the meantime or a snapshot still shares its text.
+#define BUFFER_HISTORY UINT32_MAX
+
+typedef struct {
+  uint32_t source; // Or BUFFER_HISTORY.
+  const char *text;
+  BufferPacked packed;
+} BufferPackItem;
+
+typedef struct {
+  size_t version, num_sources, add_used;
+  BufferPackItem *items;
+  size_t count;
+  char *history; // As bytes, if it's among the items.
+} BufferPackJob;
+
+static inline void buffer_pack_free(BufferPackJob *job) {
+  if (!job)
+    return;
+  for (size_t i = 0; i < job->count; i++)
+    tui_free(ALLOC_BUFFER, job->items[i].packed.data);
+  tui_free(ALLOC_BUFFER, job->items);
+  tui_free(ALLOC_BUFFER, job->history);
+  tui_free(ALLOC_BUFFER, job);
+}
+
+// Returns NULL if there's nothing left to pack.
+static inline BufferPackJob *buffer_pack_start(Buffer *b) {
+  BufferPackJob *job = tui_calloc(ALLOC_BUFFER, 1, sizeof(BufferPackJob));
+  if (!job ||
+      !(job->items = tui_malloc(ALLOC_BUFFER, (b->num_sources + 1) *
+                                                  sizeof(BufferPackItem)))) {
+    tui_free(ALLOC_BUFFER, job);
+    return NULL;
+  }
+  job->version = b->version;
+  job->num_sources = b->num_sources;
+  job->add_used = b->add_used;
+  // Source 0 is the file, and every add block but the last is full.
+  for (uint32_t i = 1; i < b->num_sources; i++) {
+    size_t size = i + 1 < b->num_sources ? BUFFER_ADD_BLOCK : b->add_used;
+    if (b->sources[i] && size)
+      job->items[job->count++] =
+          (BufferPackItem){i, b->sources[i], {NULL, 0, size}};
+  }
+  size_t len;
+  if ((b->undo.count || b->redo.count) &&
+      (job->history = bufferHistoryBytes(b, &len)))
+    job->items[job->count++] =
+        (BufferPackItem){BUFFER_HISTORY, job->history, {NULL, 0, len}};
+  if (!job->count) {
+    buffer_pack_free(job);
+    return NULL;
+  }
+  return job;
+}
+
+// Packs everything the job picked, leaving alone what doesn't shrink by
+// at least an eighth.
+static inline void buffer_pack_run(BufferPackJob *job) {
+  for (size_t i = 0; i < job->count; i++) {
+    BufferPacked *packed = &job->items[i].packed;
+    char *data = tui_malloc(ALLOC_BUFFER, lz_bound(packed->size));
+    if (!data)
+      continue;
+    packed->len = lz_compress(job->items[i].text, packed->size, data);
+    if (packed->len > packed->size - packed->size / 8) {
+      tui_free(ALLOC_BUFFER, data);
+      continue;
+    }
+    char *shrunk =
+        tui_realloc(ALLOC_BUFFER, data, packed->len ? packed->len : 1);
+    packed->data = shrunk ? shrunk : data;
+  }
+}
+
+static inline bool bufferReservePack(Buffer *b) {
+  if (!b->pack && !(b->pack = tui_calloc(ALLOC_BUFFER, 1, sizeof(BufferPack))))
+    return false;
+  BufferPack *pack = b->pack;
+  if (pack->cap_sources >= b->num_sources)
+    return true;
+  BufferPacked *sources =
+      tui_realloc(ALLOC_BUFFER, pack->sources,
+                  b->cap_sources * sizeof(BufferPacked));
+  if (!sources)
+    return false;
+  memset(sources + pack->cap_sources, 0,
+         (b->cap_sources - pack->cap_sources) * sizeof(BufferPacked));
+  pack->sources = sources;
+  pack->cap_sources = b->cap_sources;
+  return true;
+}
+
+// Swaps in what the job packed and frees the job. Returns whether it did.
+static inline bool buffer_pack_finish(Buffer *b, BufferPackJob *job) {
+  bool ok = job->version == b->version &&
+            job->num_sources == b->num_sources &&
+            job->add_used == b->add_used && !b->snapshots &&
+            bufferReservePack(b);
+  for (size_t i = 0; ok && i < job->count; i++) {
+    BufferPackItem *item = &job->items[i];
+    if (!item->packed.data)
+      continue;
+    if (item->source == BUFFER_HISTORY) {
+      bufferFreeChanges(&b->undo);
+      bufferFreeChanges(&b->redo);
+      tui_free(ALLOC_BUFFER, b->undo.items);
+      tui_free(ALLOC_BUFFER, b->redo.items);
+      b->undo = b->redo = (BufferChanges){0};
+      b->pack->history = item->packed;
+    } else {
+      tui_free(ALLOC_BUFFER, b->sources[item->source]);
+      b->sources[item->source] = NULL;
+      b->pack->sources[item->source] = item->packed;
+    }
+    item->packed.data = NULL;
+  }
+  buffer_pack_free(job);
+  return ok;
+}
+
+static inline Buffer *buffer_new(void) {
+  Buffer *b = tui_calloc(ALLOC_BUFFER, 1, sizeof(Buffer));
+  if (!b)
+    return NULL;
+  b->seed = 0x9E3779B9u ^ (uint32_t)(uintptr_t)b;
+  if (!b->seed)
+    b->seed = 1;
+  // Source 0 is the loaded file, even when there isn't one.
+  char *empty = tui_calloc(ALLOC_BUFFER, 1, 1);
+  if (!empty || !bufferAddSource(b, empty)) {
+    tui_free(ALLOC_BUFFER, empty);
+    tui_free(ALLOC_BUFFER, b->sources);
+    tui_free(ALLOC_BUFFER, b);
+    return NULL;
+  }
+  return b;
+}
+
+static inline void buffer_close(Buffer *b) {
+  if (!b)
+    return;
+  bufferFreeTree(b->root);
+  bufferFreeChanges(&b->undo);
+  bufferFreeChanges(&b->redo);
+  tui_free(ALLOC_BUFFER, b->undo.items);
+  tui_free(ALLOC_BUFFER, b->redo.items);
+  for (size_t i = 0; i < b->num_sources; i++)
+    tui_free(ALLOC_BUFFER, b->sources[i]);
+  tui_free(ALLOC_BUFFER, b->sources);
+  if (b->pack) {
+    for (size_t i = 0; i < b->pack->cap_sources; i++)
+      tui_free(ALLOC_BUFFER, b->pack->sources[i].data);
+    tui_free(ALLOC_BUFFER, b->pack->sources);
+    tui_free(ALLOC_BUFFER, b->pack->history.data);
+    tui_free(ALLOC_BUFFER, b->pack);
+  }
+  free(b->path);
+  tui_free(ALLOC_BUFFER, b);
+}
+
+// The rest of a file opened with buffer_open_head(), read on the pool a
+// chunk per job.
+typedef struct {
+  size_t offset, len, got;
+  uint32_t seed;
+  BufferNode *rest; // Pieces over what was read.
+  bool failed;
+} BufferLoadChunk;
+
+typedef struct {
+  int fd;
+  char *text;        // Source 0, with room for the whole file decoded.
+  size_t head, size; // Bytes already in the buffer, and the file's.
+  Encoding encoding;
+  size_t count;
+  BufferLoadChunk chunks[];
+} BufferLoadJob;
+
+// Reads up to *len bytes from offset from of the file, setting *len to
+// how many there were before the end. Returns false on an error.
+static inline bool bufferReadFile(int fd, char *to, size_t from,
+                                  size_t *len) {
+  size_t got = 0;
+  while (got < *len) {
+    ssize_t n = pread(fd, to + got, *len - got, (off_t)(from + got));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      *len = got;
+      return n == 0;
+    }
+    got += (size_t)n;
+  }
+  return true;
+}
+
+// Opens a file, but if rest is given and the file is bigger than
+// BUFFER_HEAD_BYTES only reads that much of it. *rest is then a job whose
+// chunks buffer_load_run() reads, on any threads in any order, and the
+// buffer stays read-only until buffer_load_finish() adds them. *rest is
+// NULL if the whole file was read. A file that doesn't exist yet opens
+// as an empty buffer; one that can't be opened or read returns NULL.
+//
+// A file that isn't UTF-8 is decoded into a source 0 with room for twice
+// its bytes, each chunk at twice its offset in the file, so they can be
+// decoded apart. Whatever of that a chunk doesn't fill is never touched,
+// which for a large allocation means it never costs memory either.
+static inline Buffer *buffer_open_head(const char *path,
+                                       BufferLoadJob **rest) {
+  if (rest)
+    *rest = NULL;
+  Buffer *b = buffer_new();
+  if (!b || !(b->path = strdup(path))) {
+    buffer_close(b);
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 && errno == ENOENT)
+    return b; // A new file.
+  if (fd < 0) {
+    buffer_close(b);
+    return NULL;
+  }
+
+  struct stat st;
+  char *text = NULL;
+  size_t size = 0, file_size = 0, start = 0;
+  Encoding e = ENCODING_UTF8;
+  bool ok = true; // Until a read fails.
+  if (!fstat(fd, &st) &&
+      (text = tui_malloc(ALLOC_BUFFER, (size_t)st.st_size + 1))) {
+    file_size = (size_t)st.st_size;
+    size = bufferMin(file_size, BUFFER_HEAD_BYTES);
+    ok = bufferReadFile(fd, text, 0, &size);
+    e = encoding_detect(text, size, size < file_size, &start);
+  }
+  BufferLoadJob *job = NULL;
+  size_t count = (file_size - size + BUFFER_LOAD_CHUNK - 1) / BUFFER_LOAD_CHUNK;
+  if (ok && text && rest && size == BUFFER_HEAD_BYTES && size < file_size &&
+      (job = tui_calloc(ALLOC_BUFFER, 1,
+                        sizeof(BufferLoadJob) +
+                            count * sizeof(BufferLoadChunk)))) {
+    *job = (BufferLoadJob){fd, text, size, file_size, e, count};
+    for (size_t i = 0; i < count; i++) {
+      size_t at = size + i * BUFFER_LOAD_CHUNK;
+      job->chunks[i] = (BufferLoadChunk){
+          .offset = at,
+          .len = bufferMin(BUFFER_LOAD_CHUNK, file_size - at),
+          .seed = (b->seed ^ (uint32_t)(i * 0x9E3779B9u)) | 1};
+    }
+  } else if (ok && text) {
+    size_t more = file_size - size;
+    ok = bufferReadFile(fd, text + size, size, &more);
+    size += more;
+  }
+  char *decoded = NULL;
+  if (ok && text && e != ENCODING_UTF8 &&
+      (decoded = tui_malloc(ALLOC_BUFFER,
+                            encoding_decoded_max(e, file_size) + 4))) {
+    // With the next unit to hand, in case the head ends half way through
+    // a surrogate pair.
+    size_t next = job ? bufferMin(2, file_size - size) : 0;
+    ok = bufferReadFile(fd, text + size, size, &next);
+    size_t len = encoding_decode(e, text, start, size, size + next, decoded);
+    if (job)
+      job->text = decoded;
+    tui_free(ALLOC_BUFFER, text);
+    text = decoded;
+    size = len;
+  }
+  if (!job)
+    close(fd);
+  if (!ok || !text || (e != ENCODING_UTF8 && !decoded)) {
+    tui_free(ALLOC_BUFFER, text);
+    if (job)
+      close(fd);
+    tui_free(ALLOC_BUFFER, job);
+    buffer_close(b);
+    return NULL;
+  }
+  b->encoding = e;
+  b->bom = start > 0;
+  if (decoded)
+    start = 0;
+  tui_free(ALLOC_BUFFER, b->sources[0]);
+  b->sources[0] = text;
+  if (size > start && !(b->root = bufferPieces(b, 0, start, size - start))) {
+    if (job)
+      close(fd);
+    tui_free(ALLOC_BUFFER, job);
+    buffer_close(b);
+    return NULL;
+  }
+  b->loading = job != NULL;
+  if (rest)
+    *rest = job;
+  return b;
+}
+
+static inline Buffer *buffer_open(const char *path) {
+  return buffer_open_head(path, NULL);
+}
+
+static inline bool bufferWriteAll(int fd, const char *p, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+// Writes the text out in the file's encoding, a block at a time. A
+// character cut by the end of a block is carried over to the next.
+static inline bool bufferWriteEncoded(const Buffer *b, int fd) {
+  size_t bom_len = 0;
+  const char *bom = encoding_bom(b->encoding, &bom_len);
+  if (b->bom && !bufferWriteAll(fd, bom, bom_len))
+    return false;
+  char *in = tui_malloc(ALLOC_BUFFER, BUFFER_SAVE_BLOCK);
+  char *out = tui_malloc(ALLOC_BUFFER,
+                         encoding_encoded_max(b->encoding, BUFFER_SAVE_BLOCK));
+  bool ok = in && out;
+  size_t size = buffer_size(b), carry = 0;
+  for (size_t at = 0; ok && at < size;) {
+    size_t n = bufferMin(BUFFER_SAVE_BLOCK - carry, size - at);
+    buffer_read(b, at, n, in + carry);
+    at += n;
+    n += carry;
+    size_t used = 0, len = encoding_encode(b->encoding, in, n, out, &used);
+    ok = len != (size_t)-1 && (at < size || used == n) &&
+         bufferWriteAll(fd, out, len);
+    carry = n - used;
+    memmove(in, in + used, carry);
+  }
+  tui_free(ALLOC_BUFFER, in);
+  tui_free(ALLOC_BUFFER, out);
+  return ok;
+}
+
+// Fsyncs the directory holding path, so a rename into it lasts.
+static inline void bufferSyncDir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  size_t len = slash == path ? 1 : (size_t)(slash - path);
+  char *dir = slash ? strndup(path, len) : strdup(".");
+  int fd = dir ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+// Copies what was saved to from over the file at path, in place.
+static inline bool bufferCopyInto(int from, const char *path) {
+  int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+  char *block = tui_malloc(ALLOC_BUFFER, BUFFER_SAVE_BLOCK);
+  bool ok = fd >= 0 && block;
+  size_t at = 0, n = BUFFER_SAVE_BLOCK;
+  while (ok && n == BUFFER_SAVE_BLOCK) {
+    ok = bufferReadFile(from, block, at, &n) && bufferWriteAll(fd, block, n);
+    at += n;
+  }
+  ok = ok && !fsync(fd);
+  if (fd >= 0)
+    ok = !close(fd) && ok;
+  tui_free(ALLOC_BUFFER, block);
+  return ok;
+}
+
+// Writes the buffer to its file, in the encoding it was read in, and
+// marks it saved. It goes to a new file first, renamed over the old one,
+// so a failed save leaves the file as it was; that includes text the
+// encoding can't hold, like a character past U+00FF in a Latin-1 file.
+//
+// A symlink is followed, and the file it points to replaced. A file with
+// other hard links, or an owner the new file can't be given, is instead
+// written over in place once the new file is known good, so those stay.
+// A new file gets 0666 less the umask, as open() would give it.
+static inline bool buffer_save(Buffer *b) {
+  if (!b->path || b->loading)
+    return false;
+  char *target = realpath(b->path, NULL);
+  if (!target && errno == ENOENT)
+    target = strdup(b->path);
+  size_t len = target ? strlen(target) : 0;
+  char *tmp = target ? malloc(len + sizeof(".XXXXXX")) : NULL;
+  int fd = -1;
+  if (tmp) {
+    memcpy(tmp, target, len);
+    memcpy(tmp + len, ".XXXXXX", sizeof(".XXXXXX"));
+    fd = mkstemp(tmp);
+  }
+  if (fd < 0) {
+    free(tmp);
+    free(target);
+    return false;
+  }
+  struct stat st;
+  bool exists = !stat(target, &st), in_place = false;
+  if (exists) {
+    // Before the mode, since a change of owner can clear setuid bits.
+    in_place = st.st_nlink > 1 || fchown(fd, st.st_uid, st.st_gid);
+    fchmod(fd, st.st_mode & 07777);
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+  bool ok = bufferWriteEncoded(b, fd) && !fsync(fd);
+  if (ok && in_place)
+    ok = bufferCopyInto(fd, target);
+  ok = !close(fd) && ok && (in_place || !rename(tmp, target));
+  if (!ok || in_place)
+    unlink(tmp);
+  else
+    bufferSyncDir(target);
+  free(tmp);
+  free(target);
+  if (ok)
+    buffer_mark_saved(b);
+  return ok;
+}
+
+// Reads a chunk of the rest of the file, decoding it if need be, and cuts
+// it into pieces, counting their lines. Touches nothing of the buffer's
+// but the chunk's part of source 0, which nothing else reads yet, so it
+// can run while the buffer is in use.
+static inline void buffer_load_run(BufferLoadJob *job, size_t i) {
+  BufferLoadChunk *c = &job->chunks[i];
+  size_t start = c->offset, end;
+  if (job->encoding == ENCODING_UTF8) {
+    c->got = c->len;
+    c->failed =
+        !bufferReadFile(job->fd, job->text + start, start, &c->got);
+    end = start + c->got;
+  } else {
+    // With a unit either side, for surrogate pairs cut at the ends.
+    size_t n = c->len + 4;
+    char *raw = tui_malloc(ALLOC_BUFFER, n);
+    c->failed = !raw || !bufferReadFile(job->fd, raw, start - 2, &n);
+    c->got = n > 2 ? bufferMin(n - 2, c->len) : 0;
+    start = encoding_decoded_max(job->encoding, c->offset);
+    end = start + (c->failed ? 0
+                             : encoding_decode(job->encoding, raw, 2,
+                                               2 + c->got, n,
+                                               job->text + start));
+    tui_free(ALLOC_BUFFER, raw);
+  }
+  for (size_t at = start; !c->failed && at < end; at += BUFFER_MAX_PIECE) {
+    BufferNode *n = tui_malloc(ALLOC_BUFFER, sizeof(BufferNode));
+    if (!n) {
+      c->failed = true;
+      return;
+    }
+    size_t len = bufferMin(BUFFER_MAX_PIECE, end - at);
+    *n = (BufferNode){.priority = bufferXorshift(&c->seed),
+                      .offset = at,
+                      .len = len,
+                      .newlines = bufferCountNewlines(job->text + at, len)};
+    bufferUpdate(n);
+    c->rest = bufferMerge(c->rest, n);
+  }
+}
+
+static inline void buffer_load_free(BufferLoadJob *job) {
+  if (!job)
+    return;
+  close(job->fd);
+  for (size_t i = 0; i < job->count; i++)
+    bufferFreeTree(job->chunks[i].rest);
+  tui_free(ALLOC_BUFFER, job);
+}
+
+// Adds what the job read to the end of the buffer, as an edit listeners
+// hear about but undo doesn't, and frees the job. Once the chunks are all
+// read. If the file turned out shorter, it ends at the first chunk that
+// came up short. If it couldn't be read the buffer is left read-only,
+// rather than be saved cut short.
+static inline bool buffer_load_finish(Buffer *b, BufferLoadJob *job) {
+  BufferNode *rest = NULL;
+  bool ok = true;
+  for (size_t i = 0; ok && i < job->count; i++) {
+    BufferLoadChunk *c = &job->chunks[i];
+    ok = !c->failed;
+    rest = bufferMerge(rest, c->rest);
+    c->rest = NULL;
+    if (c->got < c->len)
+      break;
+  }
+  if (ok && rest)
+    ok = bufferInsertTree(b, buffer_size(b), rest);
+  if (!ok)
+    bufferFreeTree(rest);
+  buffer_load_free(job);
+  b->loading = !ok;
+  if (ok)
+    buffer_mark_saved(b);
+  return ok;
+}
+
+#endif
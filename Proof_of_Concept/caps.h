@@ -0,0 +1,316 @@
+#ifndef CAPS_H
+#define CAPS_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// What the terminal can do beyond the VT100 basics, so frames can use the
+// cheapest sequences it has. tui_init() asks the terminal, and goes on
+// without waiting for the answer: frames use only the basics until it
+// comes.
+//
+// The questions are XTVERSION (its name), DECRQM for mode 2026
+// (synchronized updates), DA2 and last DA1. Every terminal answers DA1,
+// and answers in order, so once its answer is in everything else that's
+// coming has come.
+// A terminal that hasn't answered DA1 within CAPS_TIMEOUT_NS isn't asked
+// again.
+//
+// The answers come in on the terminal's input, among the keys. Whoever
+// reads it reads through caps_read() (session_read() does), which takes
+// the answers out. While it's waiting for them, the start of an escape
+// sequence at the end of a read is held back for the next one, in case
+// it's an answer cut in two.
+//
+// What's found is kept on disk, one file per $TERM (and $TERM_PROGRAM,
+// since so many terminals say they're xterm), under
+// $XDG_CACHE_HOME/tui-caps or ~/.cache/tui-caps, so a terminal is only
+// asked once.
+
+#define CAPS_TIMEOUT_NS 1000000000u
+#define CAPS_MAX_REPLY 256 // Longer isn't an answer.
+
+typedef struct {
+  bool known; // Asked or cached; if not, only the basics are used.
+  bool rep;   // REP, repeating the last character.
+  bool ech;   // ECH, erasing characters without moving.
+  bool scroll_region; // DECSTBM, scrolled with LF and RI.
+  bool sync;          // Synchronized updates, mode 2026.
+  char name[64];      // From XTVERSION, or DA2 if it didn't answer.
+} TermCaps;
+
+typedef struct {
+  bool probing;
+  int fd;
+  uint64_t deadline;
+  TermCaps *into;
+  TermCaps found;
+  unsigned level; // DA1's first parameter, the conformance level.
+  int sync_mode;  // DECRQM's answer for 2026, 0 if none.
+  size_t held;
+  char hold[CAPS_MAX_REPLY];
+} CapsProbe;
+
+static CapsProbe caps_probe;
+
+// Sent in one go; DA1 last.
+static const char caps_queries[] = "\x1b[>0q"     // XTVERSION
+                                   "\x1b[?2026$p" // DECRQM 2026
+                                   "\x1b[>c"      // DA2
+                                   "\x1b[c";      // DA1
+
+// Copies an environment variable into a file name, without its slashes.
+static inline void capsName(char *out, size_t cap, const char *s) {
+  size_t n = 0;
+  for (; *s && n + 1 < cap; s++, n++)
+    out[n] = *s == '/' || (!n && *s == '.') ? '_' : *s;
+  out[n] = 0;
+}
+
+// The cache's directory, and if file the file for this terminal in it.
+// False if there's no $TERM to go on, or nowhere to keep it.
+static inline bool capsPath(char *path, size_t cap, bool file) {
+  const char *term = getenv("TERM");
+  const char *program = getenv("TERM_PROGRAM");
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (!term || !*term || ((!base || !*base) && (!home || !*home)))
+    return false;
+  char name[128], more[64];
+  capsName(name, sizeof(name), term);
+  capsName(more, sizeof(more), program ? program : "");
+  int n = base && *base ? snprintf(path, cap, "%s/tui-caps", base)
+                        : snprintf(path, cap, "%s/.cache/tui-caps", home);
+  if (file && n > 0 && (size_t)n < cap)
+    n += snprintf(path + n, cap - (size_t)n, "/%s%s%s", name,
+                  *more ? "+" : "", more);
+  return n > 0 && (size_t)n < cap;
+}
+
+// Reads what's known about this terminal from the cache.
+static inline bool caps_load(TermCaps *caps) {
+  char path[4096];
+  if (!capsPath(path, sizeof(path), true))
+    return false;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+  TermCaps c = {.known = true};
+  int rep, ech, scroll, sync;
+  int got = fscanf(f, "tui-caps 3 rep=%d ech=%d scroll=%d sync=%d "
+                      "name=%63[^\n]",
+                   &rep, &ech, &scroll, &sync, c.name);
+  fclose(f);
+  if (got < 4)
+    return false;
+  c.rep = rep, c.ech = ech, c.scroll_region = scroll, c.sync = sync;
+  *caps = c;
+  return true;
+}
+
+static inline bool caps_save(const TermCaps *caps) {
+  char dir[4096], path[4096], tmp[4200];
+  if (!capsPath(dir, sizeof(dir), false) ||
+      !capsPath(path, sizeof(path), true))
+    return false;
+  // ~/.cache may not be there yet either.
+  char *slash = strrchr(dir, '/');
+  *slash = 0;
+  mkdir(dir, 0700);
+  *slash = '/';
+  if (mkdir(dir, 0700) && errno != EEXIST)
+    return false;
+  snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+    return false;
+  fprintf(f, "tui-caps 3 rep=%d ech=%d scroll=%d sync=%d", caps->rep,
+          caps->ech, caps->scroll_region, caps->sync);
+  if (caps->name[0])
+    fprintf(f, " name=%s", caps->name);
+  fputc('\n', f);
+  bool ok = !fclose(f) && !rename(tmp, path);
+  if (!ok)
+    unlink(tmp);
+  return ok;
+}
+
+// Starts asking the terminal whose answers come in on fd. Returns what to
+// write to it; what's found goes into *into when it's all come.
+static inline const char *caps_probe_start(TermCaps *into, int fd,
+                                           uint64_t now) {
+  memset(&caps_probe, 0, sizeof(caps_probe));
+  caps_probe.probing = true;
+  caps_probe.fd = fd;
+  caps_probe.deadline = now + CAPS_TIMEOUT_NS;
+  caps_probe.into = into;
+  return caps_queries;
+}
+
+// Stops waiting for the terminal, if it's still being waited on.
+static inline void caps_probe_stop(void) { caps_probe.probing = false; }
+
+// Gives up on a terminal that hasn't answered in time.
+static inline void caps_poll(uint64_t now) {
+  if (caps_probe.probing && now > caps_probe.deadline)
+    caps_probe_stop();
+}
+
+// Terminals known to have REP, by the start of their XTVERSION answer.
+// It came with ECMA-48, not the DEC terminals, so no conformance level
+// promises it, and one that lacks it drops the repeats without a word.
+static const char *const caps_rep_terminals[] = {
+    "XTerm(", "foot(", "kitty(", "WezTerm ", "mintty ", "contour ",
+};
+
+// What the answers add up to. ECH is VT220, so it comes with answering
+// DA1 as a VT220 or better; VT100s (screen, among others) and VT102s
+// (the Linux console) may not have it. Scroll regions are VT100, so any
+// terminal that answers has them.
+static inline void capsFinish(void) {
+  CapsProbe *p = &caps_probe;
+  TermCaps *c = &p->found;
+  c->known = true;
+  c->scroll_region = true;
+  c->ech = p->level >= 62;
+  for (size_t i = 0;
+       i < sizeof(caps_rep_terminals) / sizeof(caps_rep_terminals[0]); i++)
+    if (!strncmp(c->name, caps_rep_terminals[i],
+                 strlen(caps_rep_terminals[i])))
+      c->rep = true;
+  c->sync = p->sync_mode == 1 || p->sync_mode == 2;
+  *p->into = *c;
+  p->probing = false;
+  caps_save(c);
+}
+
+// Takes in a CSI answer, s[0, n) from its ESC through its final byte.
+static inline void capsTakeCsi(const char *s, size_t n) {
+  CapsProbe *p = &caps_probe;
+  unsigned a = 0, b = 0, c = 0;
+  if (s[2] == '?' && s[n - 1] == 'c') {
+    sscanf(s + 3, "%u", &p->level);
+    capsFinish();
+  } else if (s[2] == '>' && s[n - 1] == 'c') {
+    if (!p->found.name[0] && sscanf(s + 3, "%u;%u;%u", &a, &b, &c) >= 2)
+      snprintf(p->found.name, sizeof(p->found.name), "DA2 %u;%u", a, b);
+  } else if (s[2] == '?' && sscanf(s + 3, "%u;%u", &a, &b) == 2 &&
+             a == 2026) {
+    p->sync_mode = (int)b;
+  }
+}
+
+// Takes in a DCS answer, s[0, n) from its ESC through its ST.
+static inline void capsTakeDcs(const char *s, size_t n) {
+  TermCaps *c = &caps_probe.found;
+  const char *body = s + 2, *end = s + n - 2;
+  size_t len = (size_t)(end - body);
+  if (len > 2 && !memcmp(body, ">|", 2)) {
+    len = len - 2 < sizeof(c->name) - 1 ? len - 2 : sizeof(c->name) - 1;
+    memcpy(c->name, body + 2, len);
+    c->name[len] = 0;
+    for (size_t i = 0; i < len; i++)
+      if ((unsigned char)c->name[i] < 0x20)
+        c->name[i] = ' ';
+  }
+}
+
+// Whether s[0, n), which starts with ESC, is an answer. Returns its length
+// if it is, 0 if it isn't, and -1 if it's cut off too soon to tell.
+static inline long capsAnswer(const char *s, size_t n) {
+  // Past CAPS_MAX_REPLY it isn't one, however it goes on.
+  size_t max = n < CAPS_MAX_REPLY ? n : CAPS_MAX_REPLY;
+  long cut = n < CAPS_MAX_REPLY ? -1 : 0;
+  if (max < 3)
+    return max < 2 || s[1] == '[' || s[1] == 'P' ? cut : 0;
+  if (s[1] == '[') {
+    if (s[2] != '?' && s[2] != '>')
+      return 0;
+    size_t i = 3;
+    while (i < max &&
+           ((s[i] >= '0' && s[i] <= '9') || s[i] == ';' || s[i] == ':'))
+      i++;
+    if (i == max)
+      return cut;
+    if (s[i] == 'c')
+      return (long)i + 1;
+    if (s[i] != '$' || s[2] != '?')
+      return 0;
+    if (i + 1 == max)
+      return cut;
+    return s[i + 1] == 'y' ? (long)i + 2 : 0;
+  }
+  if (s[1] != 'P')
+    return 0;
+  for (size_t i = 2; i + 1 < max; i++)
+    if (s[i] == '\x1b' && s[i + 1] == '\\')
+      return (long)i + 2;
+  return cut;
+}
+
+// Takes the answers out of n bytes of input, leaving the rest in place.
+// Returns how many bytes are left.
+static inline size_t capsFilter(char *bytes, size_t n) {
+  CapsProbe *p = &caps_probe;
+  size_t kept = 0;
+  for (size_t i = 0; i < n;) {
+    if (bytes[i] != '\x1b' || !p->probing) {
+      bytes[kept++] = bytes[i++];
+      continue;
+    }
+    long len = capsAnswer(bytes + i, n - i);
+    if (len < 0) {
+      memcpy(p->hold, bytes + i, n - i);
+      p->held = n - i;
+      break;
+    }
+    if (!len) {
+      bytes[kept++] = bytes[i++];
+      continue;
+    }
+    char answer[CAPS_MAX_REPLY + 1];
+    memcpy(answer, bytes + i, (size_t)len);
+    answer[len] = 0;
+    if (answer[1] == '[')
+      capsTakeCsi(answer, (size_t)len);
+    else
+      capsTakeDcs(answer, (size_t)len);
+    i += (size_t)len;
+  }
+  return kept;
+}
+
+// read() from the terminal, less the terminal's answers. A read that was
+// all answers returns -1, with errno EAGAIN, rather than 0 as if the
+// terminal had gone.
+static inline ssize_t caps_read(int fd, void *bytes, size_t n) {
+  CapsProbe *p = &caps_probe;
+  if (fd != p->fd || (!p->probing && !p->held) || n <= p->held)
+    return read(fd, bytes, n);
+  size_t held = p->held;
+  memcpy(bytes, p->hold, held);
+  p->held = 0;
+  ssize_t got = (ssize_t)held;
+  // What's held is let go once there's no more waiting for answers.
+  if (p->probing) {
+    got = read(fd, (char *)bytes + held, n - held);
+    if (got <= 0) {
+      memcpy(p->hold, bytes, held);
+      p->held = held;
+      return got;
+    }
+    got += (ssize_t)held;
+  }
+  size_t kept = capsFilter(bytes, (size_t)got);
+  if (!kept)
+    errno = EAGAIN;
+  return kept ? (ssize_t)kept : -1;
+}
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include "buffer.h"
+
+// Word completion from every buffer attached to the index. Words are kept
+// in a treap ordered by their bytes, each with the number of times it
+// occurs across the buffers, so a prefix query is one descent followed by
+// an in-order walk. Edits are applied by re-tokenizing just the lines they
+// touch: their words are taken out before the edit and put back after.
+
+#define WORDINDEX_MIN_WORD 2
+#define WORDINDEX_MAX_WORD 64
+#define WORDINDEX_MAX_BUFFERS 64
+
+typedef struct WordNode {
+  struct WordNode *left, *right;
+  uint32_t priority;
+  size_t count;
+  uint16_t len;
+  char word[];
+} WordNode;
+
+typedef struct {
+  WordNode *root;
+  size_t num_words;
+  uint32_t seed;
+  size_t num_buffers;
+  Buffer *buffers[WORDINDEX_MAX_BUFFERS];
+} WordIndex;
+
+static inline int wordCompare(const char *a, size_t alen, const char *b,
+                              size_t blen) {
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  return c ? c : (alen > blen) - (alen < blen);
+}
+
+static inline WordNode *wordMerge(WordNode *l, WordNode *r) {
+  if (!l || !r)
+    return l ? l : r;
+  if (l->priority > r->priority) {
+    l->right = wordMerge(l->right, r);
+    return l;
+  }
+  r->left = wordMerge(l, r->left);
+  return r;
+}
+
+// Splits into words below (word, len) and the rest.
+static inline void wordSplit(WordNode *t, const char *word, size_t len,
+                             WordNode **l, WordNode **r) {
+  if (!t) {
+    *l = *r = NULL;
+  } else if (wordCompare(t->word, t->len, word, len) < 0) {
+    wordSplit(t->right, word, len, &t->right, r);
+    *l = t;
+  } else {
+    wordSplit(t->left, word, len, l, &t->left);
+    *r = t;
+  }
+}
+
+static inline WordNode *wordFind(WordNode *t, const char *word, size_t len) {
+  while (t) {
+    int c = wordCompare(word, len, t->word, t->len);
+    if (!c)
+      return t;
+    t = c < 0 ? t->left : t->right;
+  }
+  return NULL;
+}
+
+static inline void wordAdd(WordIndex *idx, const char *word, size_t len) {
+  WordNode *found = wordFind(idx->root, word, len);
+  if (found) {
+    found->count++;
+    return;
+  }
+  WordNode *n = tui_malloc(ALLOC_COMPONENT, sizeof(WordNode) + len);
+  if (!n)
+    return;
+  uint32_t x = idx->seed;
+  x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+  *n = (WordNode){.priority = idx->seed = x, .count = 1, .len = (uint16_t)len};
+  memcpy(n->word, word, len);
+
+  WordNode *l, *r;
+  wordSplit(idx->root, word, len, &l, &r);
+  idx->root = wordMerge(wordMerge(l, n), r);
+  idx->num_words++;
+}
+
+static inline WordNode *wordRemoveFrom(WordNode *t, const char *word,
+                                       size_t len, bool *removed) {
+  if (!t)
+    return NULL;
+  int c = wordCompare(word, len, t->word, t->len);
+  if (c < 0) {
+    t->left = wordRemoveFrom(t->left, word, len, removed);
+  } else if (c > 0) {
+    t->right = wordRemoveFrom(t->right, word, len, removed);
+  } else if (!--t->count) {
+    WordNode *rest = wordMerge(t->left, t->right);
+    tui_free(ALLOC_COMPONENT, t);
+    *removed = true;
+    return rest;
+  }
+  return t;
+}
+
+static inline void wordRemove(WordIndex *idx, const char *word, size_t len) {
+  bool removed = false;
+  idx->root = wordRemoveFrom(idx->root, word, len, &removed);
+  idx->num_words -= removed;
+}
+
+static inline bool wordByte(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+// Adds or removes every word in a piece of text.
+static inline void wordTokenize(WordIndex *idx, const char *text, size_t len,
+                                bool add) {
+  size_t i = 0;
+  while (i < len) {
+    while (i < len && !wordByte((unsigned char)text[i]))
+      i++;
+    size_t start = i;
+    while (i < len && wordByte((unsigned char)text[i]))
+      i++;
+    size_t n = i - start;
+    if (n < WORDINDEX_MIN_WORD || n > WORDINDEX_MAX_WORD)
+      continue;
+    // Words starting with a digit are numbers, not worth completing.
+    if (text[start] >= '0' && text[start] <= '9')
+      continue;
+    if (add)
+      wordAdd(idx, text + start, n);
+    else
+      wordRemove(idx, text + start, n);
+  }
+}
+
+// Tokenizes lines [first, first + count] of a buffer, read in blocks so
+// that a large range never needs one big allocation.
+static inline void wordTokenizeLines(WordIndex *idx, Buffer *b, size_t first,
+                                     size_t count, bool add) {
+  size_t start = buffer_line_start(b, first);
+  size_t end = buffer_line_start(b, first + count + 1);
+  char block[16384];
+  while (start < end) {
+    size_t n = bufferMin(end - start, sizeof(block));
+    buffer_read(b, start, n, block);
+    // Don't cut a word in two at the end of a block.
+    if (start + n < end) {
+      size_t keep = n;
+      while (keep && wordByte((unsigned char)block[keep - 1]))
+        keep--;
+      if (keep)
+        n = keep;
+    }
+    wordTokenize(idx, block, n, add);
+    start += n;
+  }
+}
+
+static void wordBeforeEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  wordTokenizeLines(ctx, b, edit->line, edit->removed_lines, false);
+}
+
+static void wordAfterEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  wordTokenizeLines(ctx, b, edit->line, edit->inserted_lines, true);
+}
+
+static inline WordIndex *wordindex_new(void) {
+  WordIndex *idx = tui_calloc(ALLOC_COMPONENT, 1, sizeof(WordIndex));
+  if (idx)
+    idx->seed = 0x2545F491u;
+  return idx;
+}
+
+// Indexes a whole buffer once; after that only edited lines are looked at.
+static inline bool wordindex_attach(WordIndex *idx, Buffer *b) {
+  BufferListener listener = {
+      .before = wordBeforeEdit, .after = wordAfterEdit, .ctx = idx};
+  if (idx->num_buffers == WORDINDEX_MAX_BUFFERS || !buffer_listen(b, listener))
+    return false;
+  idx->buffers[idx->num_buffers++] = b;
+  wordTokenizeLines(idx, b, 0, buffer_num_lines(b), true);
+  return true;
+}
+
+static inline void wordindex_detach(WordIndex *idx, Buffer *b) {
+  for (size_t i = 0; i < idx->num_buffers; i++) {
+    if (idx->buffers[i] != b)
+      continue;
+    buffer_unlisten(b, idx);
+    wordTokenizeLines(idx, b, 0, buffer_num_lines(b), false);
+    idx->buffers[i] = idx->buffers[--idx->num_buffers];
+    return;
+  }
+}
+
+static inline void wordFreeTree(WordNode *t) {
+  if (!t)
+    return;
+  wordFreeTree(t->left);
+  wordFreeTree(t->right);
+  tui_free(ALLOC_COMPONENT, t);
+}
+
+static inline void wordindex_free(WordIndex *idx) {
+  if (!idx)
+    return;
+  for (size_t i = 0; i < idx->num_buffers; i++)
+    buffer_unlisten(idx->buffers[i], idx);
+  wordFreeTree(idx->root);
+  tui_free(ALLOC_COMPONENT, idx);
+}
+
+static inline void wordCollect(const WordNode *t, const char *prefix,
+                               size_t len, const WordNode **out, size_t max,
+                               size_t *n) {
+  if (!t || *n == max)
+    return;
+  int c = memcmp(t->word, prefix, t->len < len ? t->len : len);
+  bool below = c < 0 || (!c && t->len < len);
+  // Everything with the prefix sits in one contiguous run, so whole
+  // subtrees on the wrong side are skipped.
+  if (!below)
+    wordCollect(t->left, prefix, len, out, max, n);
+  if (*n == max)
+    return;
+  if (!c && t->len > len)
+    out[(*n)++] = t;
+  if (c <= 0)
+    wordCollect(t->right, prefix, len, out, max, n);
+}
+
+// Fills out with up to max words that extend the prefix, in byte order.
+static inline size_t wordindex_complete(const WordIndex *idx,
+                                        const char *prefix, size_t len,
+                                        const WordNode **out, size_t max) {
+  size_t n = 0;
+  wordCollect(idx->root, prefix, len, out, max, &n);
+  return n;
+}
+
+#endif
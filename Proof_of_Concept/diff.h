@@ -0,0 +1,680 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "buffer.h"
+#include "pool.h"
+
+#include <stdio.h>
+
+// Tracks how a buffer differs from the file it was loaded from, as a list
+// of hunks over line numbers. The diff itself (Myers, in linear space) only
+// ever runs on the pool, over a snapshot of the buffer.
+//
+// Edits are folded into the hunks right away: the touched lines become
+// part of a changed hunk, so the markers are never wrong by more than
+// being coarse. Those lines are also marked dirty, and the next job only
+// re-diffs a window around them against the matching saved lines, since
+// everything outside the window still lines up as before.
+
+#define DIFF_WINDOW_MARGIN 8
+#define DIFF_MAX_COST 4096 // Edit distance after which a region is just
+                           // reported as changed.
+
+typedef enum {
+  DIFF_NONE,
+  DIFF_ADDED,
+  DIFF_CHANGED,
+  DIFF_REMOVED, // Lines were removed just above this one.
+} DiffMarker;
+
+typedef struct {
+  size_t old_start, old_count;
+  size_t new_start, new_count;
+} DiffHunk;
+
+typedef struct {
+  DiffHunk *items;
+  size_t count, cap;
+  bool failed;
+} DiffHunks;
+
+typedef struct {
+  size_t line, removed, inserted;
+} DiffEdit;
+
+struct DiffState;
+
+typedef struct {
+  struct DiffState *state;
+  BufferSnapshot *snapshot;
+
+  // Input: the saved file's line hashes, or a path to load them from.
+  const uint64_t *saved;
+  size_t num_saved;
+  char *reload_path;
+  Encoding encoding; // Of the file, to read it like the buffer did.
+  bool bom;
+
+  // Input and output: the hunks to refine, in snapshot lines.
+  DiffHunks hunks;
+  bool full;
+  size_t dirty_start, dirty_end;
+
+  // Output, if reloaded.
+  uint64_t *new_saved;
+  size_t new_num_saved;
+  bool reloaded;
+} DiffJob;
+
+typedef struct DiffState {
+  Buffer *buffer;
+  uint64_t *saved;
+  size_t num_saved;
+  bool saved_stale; // The file on disk needs (re)reading.
+
+  DiffHunks hunks;
+  bool dirty, full;
+  size_t dirty_start, dirty_end;
+
+  // The job in flight, and the edits made since its snapshot, which get
+  // replayed onto its result.
+  DiffJob *job;
+  PoolGroup running;
+  DiffEdit *log;
+  size_t log_count, log_cap;
+} DiffState;
+
+static inline size_t diffMax(size_t a, size_t b) { return a > b ? a : b; }
+
+static inline uint64_t diffHashInit(void) { return 0xcbf29ce484222325ull; }
+
+static inline uint64_t diffHash(uint64_t h, const char *p, size_t n) {
+  // FNV-1a
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ (unsigned char)p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+static inline void diffPush(DiffHunks *h, DiffHunk hunk) {
+  if (!hunk.old_count && !hunk.new_count)
+    return;
+  // Hunks that touch are one hunk.
+  if (h->count) {
+    DiffHunk *last = &h->items[h->count - 1];
+    if (last->old_start + last->old_count == hunk.old_start &&
+        last->new_start + last->new_count == hunk.new_start) {
+      last->old_count += hunk.old_count;
+      last->new_count += hunk.new_count;
+      return;
+    }
+  }
+  if (h->count == h->cap) {
+    size_t cap = h->cap ? h->cap * 2 : 16;
+    DiffHunk *items =
+        tui_realloc(ALLOC_COMPONENT, h->items, cap * sizeof(DiffHunk));
+    if (!items) {
+      h->failed = true;
+      return;
+    }
+    h->items = items;
+    h->cap = cap;
+  }
+  h->items[h->count++] = hunk;
+}
+
+static inline bool diffCopyHunks(DiffHunks *to, const DiffHunks *from) {
+  *to = (DiffHunks){0};
+  if (!from->count)
+    return true;
+  if (!(to->items =
+            tui_malloc(ALLOC_COMPONENT, from->count * sizeof(DiffHunk))))
+    return false;
+  memcpy(to->items, from->items, from->count * sizeof(DiffHunk));
+  to->count = to->cap = from->count;
+  return true;
+}
+
+////////////////////////////
+// Myers, in linear space //
+////////////////////////////
+
+static inline void diffRegion(const uint64_t *a, size_t n, const uint64_t *b,
+                              size_t m, size_t a0, size_t b0, DiffHunks *out);
+
+// Finds the middle snake of the shortest edit script and splits the
+// problem there; both halves are solved the same way. Gives up on
+// regions that differ too much and reports them as one change.
+static inline void diffBisect(const uint64_t *a, size_t n, const uint64_t *b,
+                              size_t m, size_t a0, size_t b0, DiffHunks *out) {
+  long N = (long)n, M = (long)m;
+  long max_d = (N + M + 1) / 2;
+  long limit = max_d < DIFF_MAX_COST ? max_d : DIFF_MAX_COST;
+  long offset = limit + 1, length = 2 * limit + 3;
+  long *v1 = tui_malloc(ALLOC_COMPONENT, 2 * (size_t)length * sizeof(long));
+  if (!v1) {
+    out->failed = true;
+    return;
+  }
+  long *v2 = v1 + length;
+  for (long i = 0; i < length; i++)
+    v1[i] = v2[i] = -1;
+  v1[offset + 1] = v2[offset + 1] = 0;
+
+  long delta = N - M;
+  bool front = delta & 1;
+  long k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  for (long d = 0; d <= limit; d++) {
+    for (long k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      long i1 = offset + k1;
+      long x1 = (k1 == -d || (k1 != d && v1[i1 - 1] < v1[i1 + 1]))
+                    ? v1[i1 + 1]
+                    : v1[i1 - 1] + 1;
+      long y1 = x1 - k1;
+      while (x1 < N && y1 < M && a[x1] == b[y1])
+        x1++, y1++;
+      v1[i1] = x1;
+      if (x1 > N)
+        k1end += 2;
+      else if (y1 > M)
+        k1start += 2;
+      else if (front) {
+        long i2 = offset + delta - k1;
+        if (i2 >= 0 && i2 < length && v2[i2] != -1 && x1 >= N - v2[i2]) {
+          tui_free(ALLOC_COMPONENT, v1);
+          diffRegion(a, (size_t)x1, b, (size_t)y1, a0, b0, out);
+          diffRegion(a + x1, n - (size_t)x1, b + y1, m - (size_t)y1,
+                     a0 + (size_t)x1, b0 + (size_t)y1, out);
+          return;
+        }
+      }
+    }
+    for (long k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      long i2 = offset + k2;
+      long x2 = (k2 == -d || (k2 != d && v2[i2 - 1] < v2[i2 + 1]))
+                    ? v2[i2 + 1]
+                    : v2[i2 - 1] + 1;
+      long y2 = x2 - k2;
+      while (x2 < N && y2 < M && a[N - x2 - 1] == b[M - y2 - 1])
+        x2++, y2++;
+      v2[i2] = x2;
+      if (x2 > N)
+        k2end += 2;
+      else if (y2 > M)
+        k2start += 2;
+      else if (!front) {
+        long i1 = offset + delta - k2;
+        if (i1 >= 0 && i1 < length && v1[i1] != -1) {
+          long x1 = v1[i1], y1 = offset + x1 - i1;
+          if (x1 >= N - x2) {
+            tui_free(ALLOC_COMPONENT, v1);
+            diffRegion(a, (size_t)x1, b, (size_t)y1, a0, b0, out);
+            diffRegion(a + x1, n - (size_t)x1, b + y1, m - (size_t)y1,
+                       a0 + (size_t)x1, b0 + (size_t)y1, out);
+            return;
+          }
+        }
+      }
+    }
+  }
+  tui_free(ALLOC_COMPONENT, v1);
+  diffPush(out, (DiffHunk){a0, n, b0, m});
+}
+
+static inline void diffRegion(const uint64_t *a, size_t n, const uint64_t *b,
+                              size_t m, size_t a0, size_t b0, DiffHunks *out) {
+  // Common ends never need the expensive part.
+  while (n && m && a[0] == b[0])
+    a++, b++, n--, m--, a0++, b0++;
+  while (n && m && a[n - 1] == b[m - 1])
+    n--, m--;
+  if (!n || !m)
+    diffPush(out, (DiffHunk){a0, n, b0, m});
+  else
+    diffBisect(a, n, b, m, a0, b0, out);
+}
+
+/////////////////
+// Line hashes //
+/////////////////
+
+// Hashes lines [first, first + count) of a snapshot.
+static inline bool diffHashSnapshot(const BufferSnapshot *snap, size_t first,
+                                    size_t count, uint64_t *out) {
+  size_t line = 0, span = 0, at = 0;
+  // Skip whole spans, then lines inside the span where first starts.
+  while (span < snap->num_spans && line + snap->spans[span].newlines < first)
+    line += snap->spans[span++].newlines;
+  for (; line < first && span < snap->num_spans;) {
+    const BufferSpan *s = &snap->spans[span];
+    const char *nl = memchr(s->text + at, '\n', s->len - at);
+    if (!nl) {
+      span++, at = 0;
+      continue;
+    }
+    at = (size_t)(nl - s->text) + 1;
+    line++;
+  }
+
+  uint64_t h = diffHashInit();
+  size_t done = 0;
+  for (; span < snap->num_spans && done < count; span++, at = 0) {
+    const BufferSpan *s = &snap->spans[span];
+    while (at < s->len && done < count) {
+      const char *nl = memchr(s->text + at, '\n', s->len - at);
+      size_t end = nl ? (size_t)(nl - s->text) : s->len;
+      h = diffHash(h, s->text + at, end - at);
+      at = end;
+      if (nl) {
+        out[done++] = h;
+        h = diffHashInit();
+        at++;
+      }
+    }
+  }
+  if (done < count)
+    out[done++] = h; // The last line has no newline.
+  return done == count;
+}
+
+// Hashes the lines in text, carrying the last one, unfinished, in *h.
+static inline uint64_t *diffHashLines(uint64_t *lines, size_t *n,
+                                      size_t *cap, uint64_t *h,
+                                      const char *text, size_t len) {
+  for (size_t at = 0; lines && at < len;) {
+    const char *nl = memchr(text + at, '\n', len - at);
+    size_t end = nl ? (size_t)(nl - text) : len;
+    *h = diffHash(*h, text + at, end - at);
+    at = end;
+    if (!nl)
+      break;
+    if (*n + 1 == *cap) {
+      uint64_t *more = tui_realloc(ALLOC_COMPONENT, lines,
+                                   (*cap *= 2) * sizeof(uint64_t));
+      if (!more)
+        tui_free(ALLOC_COMPONENT, lines);
+      lines = more;
+      if (!lines)
+        break;
+    }
+    lines[(*n)++] = *h;
+    *h = diffHashInit();
+    at++;
+  }
+  return lines;
+}
+
+// Reads the rest of f and decodes it to UTF-8 like the buffer was.
+static inline char *diffDecodeFile(FILE *f, Encoding e, size_t *len) {
+  size_t size = 0, cap = 65536;
+  char *raw = tui_malloc(ALLOC_COMPONENT, cap), *decoded = NULL;
+  size_t got;
+  while (raw && (got = fread(raw + size, 1, cap - size, f))) {
+    if ((size += got) == cap) {
+      char *more = tui_realloc(ALLOC_COMPONENT, raw, cap *= 2);
+      if (!more)
+        tui_free(ALLOC_COMPONENT, raw);
+      raw = more;
+    }
+  }
+  if (raw)
+    decoded = encoding_decode_all(e, raw, size, len);
+  tui_free(ALLOC_COMPONENT, raw);
+  return decoded;
+}
+
+// Hashes the lines of the file as it was read into a buffer in encoding
+// e, with or without a byte order mark.
+static inline uint64_t *diffHashFile(const char *path, Encoding e, bool bom,
+                                     size_t *num_lines) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    // A file that isn't on disk yet is one empty line.
+    uint64_t *empty = tui_malloc(ALLOC_COMPONENT, sizeof(uint64_t));
+    if (empty)
+      *empty = diffHashInit(), *num_lines = 1;
+    return empty;
+  }
+  size_t cap = 1024, n = 0;
+  uint64_t *lines = tui_malloc(ALLOC_COMPONENT, cap * sizeof(uint64_t));
+  uint64_t h = diffHashInit();
+  if (e != ENCODING_UTF8 || bom) {
+    size_t len;
+    char *text = lines ? diffDecodeFile(f, e, &len) : NULL;
+    if (text) {
+      lines = diffHashLines(lines, &n, &cap, &h, text, len);
+    } else {
+      tui_free(ALLOC_COMPONENT, lines);
+      lines = NULL;
+    }
+    tui_free(ALLOC_BUFFER, text);
+  } else {
+    char block[65536];
+    size_t got;
+    while (lines && (got = fread(block, 1, sizeof(block), f)))
+      lines = diffHashLines(lines, &n, &cap, &h, block, got);
+  }
+  fclose(f);
+  if (lines)
+    lines[n++] = h, *num_lines = n;
+  return lines;
+}
+
+////////////////////
+// Edits on hunks //
+////////////////////
+
+// Moves a line number across an edit that replaced lines
+// [line, line + removed] with [line, line + inserted].
+static inline size_t diffShiftLine(size_t p, const DiffEdit *e) {
+  if (p > e->line + e->removed)
+    return p + e->inserted - e->removed;
+  if (p > e->line)
+    return e->line + e->inserted + 1;
+  return p;
+}
+
+// Folds an edit into the hunks: hunks it touches and the edited lines
+// merge into one changed hunk, later hunks shift.
+static inline void diffApplyEdit(DiffHunks *h, const DiffEdit *e) {
+  size_t start = e->line, end = e->line + e->removed + 1;
+  size_t first = 0;
+  long before = 0; // new - old, over the hunks before the edit.
+  while (first < h->count &&
+         h->items[first].new_start + h->items[first].new_count < start) {
+    before += (long)h->items[first].new_count - (long)h->items[first].old_count;
+    first++;
+  }
+  size_t last = first;
+  long inside = 0;
+  while (last < h->count && h->items[last].new_start <= end) {
+    const DiffHunk *k = &h->items[last];
+    start = bufferMin(start, k->new_start);
+    end = diffMax(end, k->new_start + k->new_count);
+    inside += (long)k->new_count - (long)k->old_count;
+    last++;
+  }
+
+  DiffHunk merged = {
+      .old_start = (size_t)((long)start - before),
+      .new_start = start,
+      .new_count = end - start + e->inserted - e->removed,
+  };
+  merged.old_count =
+      (size_t)((long)end - before - inside) - merged.old_start;
+
+  long shift = (long)e->inserted - (long)e->removed;
+  for (size_t i = last; i < h->count; i++)
+    h->items[i].new_start = (size_t)((long)h->items[i].new_start + shift);
+
+  // Replace hunks [first, last) with the merged one.
+  if (first == last) {
+    if (h->count == h->cap) {
+      size_t cap = h->cap ? h->cap * 2 : 16;
+      DiffHunk *items =
+          tui_realloc(ALLOC_COMPONENT, h->items, cap * sizeof(DiffHunk));
+      if (!items) {
+        h->failed = true;
+        return;
+      }
+      h->items = items;
+      h->cap = cap;
+    }
+    memmove(h->items + first + 1, h->items + first,
+            (h->count - first) * sizeof(DiffHunk));
+    h->count++;
+  } else if (last - first > 1) {
+    memmove(h->items + first + 1, h->items + last,
+            (h->count - last) * sizeof(DiffHunk));
+    h->count -= last - first - 1;
+  }
+  h->items[first] = merged;
+}
+
+/////////////////////
+// Background jobs //
+/////////////////////
+
+static void diffRun(void *arg) {
+  DiffJob *job = arg;
+  const uint64_t *saved = job->saved;
+  size_t num_saved = job->num_saved;
+  if (job->reload_path) {
+    job->new_saved = diffHashFile(job->reload_path, job->encoding, job->bom,
+                                  &job->new_num_saved);
+    job->reloaded = true;
+    if (!job->new_saved) {
+      job->hunks.failed = true;
+      return;
+    }
+    saved = job->new_saved;
+    num_saved = job->new_num_saved;
+  }
+
+  DiffHunks *h = &job->hunks;
+  size_t num_lines = job->snapshot->newlines + 1;
+  size_t ws = 0, we = num_lines, os = 0, oe = num_saved;
+  size_t first = 0, last = h->count;
+  if (!job->full) {
+    ws = job->dirty_start > DIFF_WINDOW_MARGIN
+             ? job->dirty_start - DIFF_WINDOW_MARGIN
+             : 0;
+    we = bufferMin(num_lines, job->dirty_end + DIFF_WINDOW_MARGIN);
+
+    // Grow the window over any hunk it cuts. Its edges are then lines
+    // that match, so the saved side of the window follows from the hunks
+    // before it.
+    long before = 0, inside = 0;
+    first = 0;
+    while (first < h->count &&
+           h->items[first].new_start + h->items[first].new_count < ws) {
+      before +=
+          (long)h->items[first].new_count - (long)h->items[first].old_count;
+      first++;
+    }
+    for (last = first; last < h->count && h->items[last].new_start <= we;
+         last++) {
+      const DiffHunk *k = &h->items[last];
+      ws = bufferMin(ws, k->new_start);
+      we = diffMax(we, k->new_start + k->new_count);
+      inside += (long)k->new_count - (long)k->old_count;
+    }
+    we = bufferMin(we, num_lines);
+    long o_start = (long)ws - before, o_end = (long)we - before - inside;
+    if (o_start < 0 || o_end < o_start || (size_t)o_end > num_saved) {
+      // The hunks don't fit the saved file; start over.
+      ws = 0, we = num_lines, os = 0, oe = num_saved;
+      first = 0, last = h->count;
+    } else {
+      os = (size_t)o_start, oe = (size_t)o_end;
+    }
+  }
+
+  uint64_t *current =
+      tui_malloc(ALLOC_COMPONENT, (we - ws + 1) * sizeof(uint64_t));
+  DiffHunks out = {0};
+  if (!current ||
+      !diffHashSnapshot(job->snapshot, ws, we - ws, current)) {
+    tui_free(ALLOC_COMPONENT, current);
+    h->failed = true;
+    return;
+  }
+  for (size_t i = 0; i < first; i++)
+    diffPush(&out, h->items[i]);
+  diffRegion(saved + os, oe - os, current, we - ws, os, ws, &out);
+  for (size_t i = last; i < h->count; i++)
+    diffPush(&out, h->items[i]);
+  tui_free(ALLOC_COMPONENT, current);
+
+  tui_free(ALLOC_COMPONENT, h->items);
+  *h = out;
+}
+
+static void diffAfterEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  (void)b;
+  DiffState *s = ctx;
+  DiffEdit e = {edit->line, edit->removed_lines, edit->inserted_lines};
+  diffApplyEdit(&s->hunks, &e);
+
+  if (s->job) {
+    if (s->log_count == s->log_cap) {
+      size_t cap = s->log_cap ? s->log_cap * 2 : 64;
+      DiffEdit *log =
+          tui_realloc(ALLOC_COMPONENT, s->log, cap * sizeof(DiffEdit));
+      if (log)
+        s->log = log, s->log_cap = cap;
+    }
+    if (s->log_count < s->log_cap)
+      s->log[s->log_count++] = e;
+    else
+      s->full = true; // Can't replay; the next job redoes everything.
+  }
+
+  size_t end = e.line + e.inserted + 1;
+  if (s->dirty) {
+    s->dirty_start = bufferMin(diffShiftLine(s->dirty_start, &e), e.line);
+    s->dirty_end = diffMax(diffShiftLine(s->dirty_end, &e), end);
+  } else {
+    s->dirty = true;
+    s->dirty_start = e.line;
+    s->dirty_end = end;
+  }
+}
+
+static inline void diffFreeJob(DiffJob *job) {
+  buffer_release(job->snapshot);
+  free(job->reload_path);
+  tui_free(ALLOC_COMPONENT, job->hunks.items);
+  tui_free(ALLOC_COMPONENT, job->new_saved);
+  tui_free(ALLOC_COMPONENT, job);
+}
+
+static inline void diffSubmit(DiffState *s) {
+  DiffJob *job = tui_calloc(ALLOC_COMPONENT, 1, sizeof(DiffJob));
+  if (!job)
+    return;
+  job->state = s;
+  job->snapshot = buffer_snapshot(s->buffer);
+  bool reload = s->saved_stale || !s->saved;
+  if (reload && s->buffer->path)
+    job->reload_path = strdup(s->buffer->path);
+  job->encoding = s->buffer->encoding;
+  job->bom = s->buffer->bom;
+  if (!job->snapshot || (reload && s->buffer->path && !job->reload_path) ||
+      !diffCopyHunks(&job->hunks, &s->hunks)) {
+    diffFreeJob(job);
+    return;
+  }
+  if (reload && !s->buffer->path) {
+    // Never saved: everything is new compared to one empty line.
+    tui_free(ALLOC_COMPONENT, s->saved);
+    if ((s->saved = tui_malloc(ALLOC_COMPONENT, sizeof(uint64_t))))
+      s->saved[0] = diffHashInit(), s->num_saved = 1;
+  }
+  job->saved = s->saved;
+  job->num_saved = s->num_saved;
+  job->full = s->full || reload;
+  job->dirty_start = s->dirty_start;
+  job->dirty_end = s->dirty_end;
+
+  s->dirty = s->full = s->saved_stale = false;
+  s->log_count = 0;
+  s->job = job;
+  // Only polled for, so a UI thread waiting on the pool needn't run it.
+  pool_submit_background(pool_shared(), &s->running, diffRun, job);
+}
+
+// Adopts a finished job and starts the next one if there are edits the
+// hunks haven't been refined for. Cheap enough to call every frame.
+static inline void diff_poll(DiffState *s) {
+  DiffJob *job = s->job;
+  if (job && pool_idle(&s->running)) {
+    if (job->reloaded && job->new_saved) {
+      tui_free(ALLOC_COMPONENT, s->saved);
+      s->saved = job->new_saved;
+      s->num_saved = job->new_num_saved;
+      job->new_saved = NULL;
+    }
+    if (job->hunks.failed) {
+      s->dirty = s->full = true;
+      s->saved_stale |= job->reloaded && !s->saved;
+    } else {
+      // The result is for the snapshot; bring it up to date.
+      tui_free(ALLOC_COMPONENT, s->hunks.items);
+      s->hunks = job->hunks;
+      job->hunks = (DiffHunks){0};
+      for (size_t i = 0; i < s->log_count; i++)
+        diffApplyEdit(&s->hunks, &s->log[i]);
+    }
+    s->log_count = 0;
+    s->job = NULL;
+    diffFreeJob(job);
+  }
+  if (!s->job && s->dirty)
+    diffSubmit(s);
+}
+
+static inline void diff_saved(DiffState *s);
+
+static void diffSaved(Buffer *b, void *ctx) {
+  (void)b;
+  DiffState *s = ctx;
+  // Nothing differs now; the hashes of the saved side catch up later.
+  s->hunks.count = 0;
+  diff_saved(s);
+}
+
+static inline DiffState *diff_attach(Buffer *b) {
+  DiffState *s = tui_calloc(ALLOC_COMPONENT, 1, sizeof(DiffState));
+  if (!s)
+    return NULL;
+  s->buffer = b;
+  if (!buffer_listen(b, (BufferListener){NULL, diffAfterEdit, s, diffSaved})) {
+    tui_free(ALLOC_COMPONENT, s);
+    return NULL;
+  }
+  s->saved_stale = s->dirty = s->full = true;
+  diff_poll(s);
+  return s;
+}
+
+// Call after the buffer has been written out: the saved side changed.
+static inline void diff_saved(DiffState *s) {
+  s->saved_stale = s->dirty = s->full = true;
+  diff_poll(s);
+}
+
+static inline void diff_detach(DiffState *s) {
+  if (!s)
+    return;
+  pool_wait(pool_shared(), &s->running);
+  if (s->job)
+    diffFreeJob(s->job);
+  buffer_unlisten(s->buffer, s);
+  tui_free(ALLOC_COMPONENT, s->hunks.items);
+  tui_free(ALLOC_COMPONENT, s->saved);
+  tui_free(ALLOC_COMPONENT, s->log);
+  tui_free(ALLOC_COMPONENT, s);
+}
+
+static inline DiffMarker diff_marker(const DiffState *s, size_t line) {
+  const DiffHunks *h = &s->hunks;
+  // Last hunk starting at or before the line.
+  size_t lo = 0, hi = h->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (h->items[mid].new_start <= line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!lo)
+    return DIFF_NONE;
+  const DiffHunk *k = &h->items[lo - 1];
+  if (!k->new_count)
+    return k->new_start == line ? DIFF_REMOVED : DIFF_NONE;
+  if (line >= k->new_start + k->new_count)
+    return DIFF_NONE;
+  return line - k->new_start < k->old_count ? DIFF_CHANGED : DIFF_ADDED;
+}
+
+#endif
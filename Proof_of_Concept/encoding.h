@@ -0,0 +1,350 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include "alloc.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Text encodings, without the C library's locale. Buffers always hold
+// UTF-8; a file in anything else is decoded as it's read and encoded back
+// when it's written.
+//
+// What a file is in is guessed from its head: a byte order mark if it has
+// one, then UTF-16 if every other byte is mostly zero, then UTF-8 if it's
+// valid UTF-8, and Latin-1 if not, since every byte means something in
+// Latin-1 and it comes back unchanged.
+//
+// Decoding works on any range of a file given the bytes either side of it,
+// so a large file can be decoded in chunks on separate threads.
+
+typedef enum {
+  ENCODING_UTF8,
+  ENCODING_UTF16LE,
+  ENCODING_UTF16BE,
+  ENCODING_LATIN1,
+  ENCODING_NUM
+} Encoding;
+
+static const char *const encoding_names[ENCODING_NUM] = {
+    "utf-8", "utf-16le", "utf-16be", "latin-1"};
+
+#define ENCODING_REPLACEMENT 0xFFFD
+#define ENCODING_SNIFF 4096 // Bytes looked at to tell UTF-16.
+
+///////////
+// UTF-8 //
+///////////
+
+// Writes c as UTF-8, returning how many bytes that took, or 0 if c isn't
+// a character (a surrogate, or past U+10FFFF).
+static inline size_t utf8_put(uint32_t c, char *out) {
+  if (c < 0x80) {
+    out[0] = (char)c;
+    return 1;
+  }
+  if (c < 0x800) {
+    out[0] = (char)(0xC0 | c >> 6);
+    out[1] = (char)(0x80 | (c & 0x3F));
+    return 2;
+  }
+  if (c < 0x10000) {
+    if (c >= 0xD800 && c < 0xE000)
+      return 0;
+    out[0] = (char)(0xE0 | c >> 12);
+    out[1] = (char)(0x80 | (c >> 6 & 0x3F));
+    out[2] = (char)(0x80 | (c & 0x3F));
+    return 3;
+  }
+  if (c < 0x110000) {
+    out[0] = (char)(0xF0 | c >> 18);
+    out[1] = (char)(0x80 | (c >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (c >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (c & 0x3F));
+    return 4;
+  }
+  return 0;
+}
+
+// Decodes the sequence at p into *c. Returns its length, 0 if it isn't
+// valid UTF-8 (overlong, a surrogate, too big), or -1 if it could be but
+// is cut short at n.
+static inline int utf8Decode(const unsigned char *p, size_t n, uint32_t *c) {
+  unsigned char b = p[0], lo = 0x80, hi = 0xBF;
+  int len;
+  if (b < 0x80) {
+    *c = b;
+    return 1;
+  }
+  if (b < 0xC2)
+    return 0;
+  if (b < 0xE0) {
+    len = 2, *c = b & 0x1F;
+  } else if (b < 0xF0) {
+    len = 3, *c = b & 0x0F;
+    lo = b == 0xE0 ? 0xA0 : lo;
+    hi = b == 0xED ? 0x9F : hi;
+  } else if (b < 0xF5) {
+    len = 4, *c = b & 0x07;
+    lo = b == 0xF0 ? 0x90 : lo;
+    hi = b == 0xF4 ? 0x8F : hi;
+  } else {
+    return 0;
+  }
+  for (int i = 1; i < len; i++) {
+    if ((size_t)i >= n)
+      return -1;
+    if (p[i] < lo || p[i] > hi)
+      return 0;
+    *c = *c << 6 | (p[i] & 0x3F);
+    lo = 0x80, hi = 0xBF;
+  }
+  return len;
+}
+
+// Like utf8Decode(), but a sequence cut short is just invalid.
+static inline size_t utf8_get(const unsigned char *p, size_t n, uint32_t *c) {
+  int len = n ? utf8Decode(p, n, c) : 0;
+  return len > 0 ? (size_t)len : 0;
+}
+
+// Bytes from the start of p that are ASCII, 16 at a time where it can.
+static inline size_t encodingAsciiRun(const unsigned char *p, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+    if (high)
+      return i + (size_t)__builtin_ctz((unsigned)high);
+  }
+#endif
+  while (i < n && p[i] < 0x80)
+    i++;
+  return i;
+}
+
+// Whether p is valid UTF-8. If there's more after it, as there is after
+// a file's head, the last sequence may be cut short at n. Text is mostly
+// ASCII, so that's skipped a vector at a time and only the rest decoded.
+static inline bool encoding_utf8_valid(const char *text, size_t n,
+                                       bool more) {
+  const unsigned char *p = (const unsigned char *)text;
+  for (size_t i = 0; i < n;) {
+    i += encodingAsciiRun(p + i, n - i);
+    if (i == n)
+      break;
+    uint32_t c;
+    int len = utf8Decode(p + i, n - i, &c);
+    if (len < 0)
+      return more;
+    if (!len)
+      return false;
+    i += (size_t)len;
+  }
+  return true;
+}
+
+///////////////
+// Detecting //
+///////////////
+
+// Guesses what the file starting with text[0, n) is in, and sets *bom to
+// the length of its byte order mark, if it has one. more says whether the
+// file goes on past n.
+static inline Encoding encoding_detect(const char *text, size_t n, bool more,
+                                       size_t *bom) {
+  const unsigned char *p = (const unsigned char *)text;
+  *bom = 0;
+  if (n >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) {
+    *bom = 3;
+    return ENCODING_UTF8;
+  }
+  if (n >= 2 && p[0] == 0xFF && p[1] == 0xFE) {
+    *bom = 2;
+    return ENCODING_UTF16LE;
+  }
+  if (n >= 2 && p[0] == 0xFE && p[1] == 0xFF) {
+    *bom = 2;
+    return ENCODING_UTF16BE;
+  }
+
+  // Without a mark, UTF-16 text that's mostly ASCII has a zero in every
+  // other byte, which UTF-8 text never does.
+  size_t zeros[2] = {0, 0};
+  size_t units = (n < ENCODING_SNIFF ? n : ENCODING_SNIFF) / 2;
+  for (size_t i = 0; i < 2 * units; i++)
+    zeros[i & 1] += !p[i];
+  if (units && zeros[1] * 2 >= units && zeros[0] * 16 < units)
+    return ENCODING_UTF16LE;
+  if (units && zeros[0] * 2 >= units && zeros[1] * 16 < units)
+    return ENCODING_UTF16BE;
+
+  return encoding_utf8_valid(text, n, more) ? ENCODING_UTF8 : ENCODING_LATIN1;
+}
+
+//////////////
+// Decoding //
+//////////////
+
+// Room encoding_decode() may need for n bytes. It's linear, so ranges of
+// a file decoded at encoding_decoded_max() of where they start never
+// overlap.
+static inline size_t encoding_decoded_max(Encoding e, size_t n) {
+  return e == ENCODING_UTF8 ? n : 2 * n;
+}
+
+static inline uint32_t encodingUnit(Encoding e, const unsigned char *p) {
+  return e == ENCODING_UTF16LE ? (uint32_t)(p[0] | p[1] << 8)
+                               : (uint32_t)(p[0] << 8 | p[1]);
+}
+
+static inline bool encodingHigh(uint32_t u) {
+  return u >= 0xD800 && u < 0xDC00;
+}
+
+static inline bool encodingLow(uint32_t u) {
+  return u >= 0xDC00 && u < 0xE000;
+}
+
+// Decodes text[from, to) to UTF-8 in out, returning the bytes written.
+// text runs on to n past to, and the bytes before from are there too, so
+// a surrogate pair cut in two by from or to goes with the range holding
+// its first half. Anything that doesn't decode becomes U+FFFD, except in
+// UTF-8, which is copied as it is.
+static inline size_t encoding_decode(Encoding e, const char *text,
+                                     size_t from, size_t to, size_t n,
+                                     char *out) {
+  const unsigned char *p = (const unsigned char *)text;
+  size_t o = 0;
+  switch (e) {
+  case ENCODING_UTF8:
+    memcpy(out, text + from, to - from);
+    return to - from;
+
+  case ENCODING_LATIN1:
+    for (size_t i = from; i < to;) {
+      size_t ascii = encodingAsciiRun(p + i, to - i);
+      memcpy(out + o, text + i, ascii);
+      o += ascii;
+      if ((i += ascii) < to)
+        o += utf8_put(p[i++], out + o);
+    }
+    return o;
+
+  case ENCODING_UTF16LE:
+  case ENCODING_UTF16BE: {
+    size_t i = from;
+    if (i + 2 <= to && i >= 2 && encodingLow(encodingUnit(e, p + i)) &&
+        encodingHigh(encodingUnit(e, p + i - 2)))
+      i += 2; // The previous range's.
+    for (; i + 2 <= to; i += 2) {
+      uint32_t c = encodingUnit(e, p + i);
+      if (encodingHigh(c) && i + 4 <= n &&
+          encodingLow(encodingUnit(e, p + i + 2))) {
+        c = 0x10000 + ((c - 0xD800) << 10) +
+            (encodingUnit(e, p + i + 2) - 0xDC00);
+        i += 2;
+      } else if (encodingHigh(c) || encodingLow(c)) {
+        c = ENCODING_REPLACEMENT;
+      }
+      o += utf8_put(c, out + o);
+    }
+    if (i < to && to == n) // An odd byte at the end.
+      o += utf8_put(ENCODING_REPLACEMENT, out + o);
+    return o;
+  }
+
+  default:
+    return 0;
+  }
+}
+
+// The byte order mark a file in e starts with, if it has one.
+static inline const char *encoding_bom(Encoding e, size_t *len) {
+  *len = e == ENCODING_UTF8 ? 3 : 2;
+  return e == ENCODING_UTF8      ? "\xEF\xBB\xBF"
+         : e == ENCODING_UTF16LE ? "\xFF\xFE"
+         : e == ENCODING_UTF16BE ? "\xFE\xFF"
+                                 : (*len = 0, "");
+}
+
+// Decodes a whole file into a new string, *len long, skipping its byte
+// order mark if it has one; free it as ALLOC_BUFFER. Returns NULL if out
+// of memory.
+static inline char *encoding_decode_all(Encoding e, const char *text,
+                                        size_t n, size_t *len) {
+  size_t bom;
+  const char *mark = encoding_bom(e, &bom);
+  if (bom > n || memcmp(text, mark, bom))
+    bom = 0;
+  char *out = tui_malloc(ALLOC_BUFFER, encoding_decoded_max(e, n) + 4);
+  if (out)
+    *len = encoding_decode(e, text, bom, n, n, out);
+  return out;
+}
+
+//////////////
+// Encoding //
+//////////////
+
+// Room encoding_encode() may need for n bytes of UTF-8.
+static inline size_t encoding_encoded_max(Encoding e, size_t n) {
+  return e == ENCODING_UTF16LE || e == ENCODING_UTF16BE ? 2 * n : n;
+}
+
+// Encodes UTF-8 text[0, n) into out, returning the bytes written. A
+// character cut short at n is left for next time, and *used says how
+// much of text was taken. Returns (size_t)-1 if text holds something the
+// encoding can't: a character past U+00FF in Latin-1, or bytes that
+// aren't UTF-8 in anything but UTF-8.
+static inline size_t encoding_encode(Encoding e, const char *text, size_t n,
+                                     char *out, size_t *used) {
+  const unsigned char *p = (const unsigned char *)text;
+  if (e == ENCODING_UTF8) {
+    memcpy(out, text, n);
+    *used = n;
+    return n;
+  }
+  size_t i = 0, o = 0;
+  while (i < n) {
+    size_t ascii = e == ENCODING_LATIN1 ? encodingAsciiRun(p + i, n - i) : 0;
+    memcpy(out + o, text + i, ascii);
+    o += ascii;
+    if ((i += ascii) == n)
+      break;
+    uint32_t c;
+    int len = utf8Decode(p + i, n - i, &c);
+    if (len < 0)
+      break;
+    if (!len || (e == ENCODING_LATIN1 && c > 0xFF))
+      return (size_t)-1;
+    i += (size_t)len;
+    if (e == ENCODING_LATIN1) {
+      out[o++] = (char)c;
+      continue;
+    }
+    uint32_t units[2] = {c, 0};
+    int num_units = 1;
+    if (c >= 0x10000) {
+      units[0] = 0xD800 + ((c - 0x10000) >> 10);
+      units[1] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+      num_units = 2;
+    }
+    for (int u = 0; u < num_units; u++) {
+      bool le = e == ENCODING_UTF16LE;
+      out[o++] = (char)(le ? units[u] & 0xFF : units[u] >> 8);
+      out[o++] = (char)(le ? units[u] >> 8 : units[u] & 0xFF);
+    }
+  }
+  *used = i;
+  return o;
+}
+
+#endif
@@ -0,0 +1,793 @@
+#ifndef FINDER_H
+#define FINDER_H
+
+#include "arena.h"
+#include "pool.h"
+#include "tui.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// A fuzzy file picker. The project tree is walked in parallel, one pool
+// job per directory, into an append-only arena of paths that never
+// moves, so queries can score entries while the walk is still adding
+// more. Each keystroke scores the arena in slices on the pool; the UI
+// thread only merges the per-slice winners and draws the visible rows.
+//
+// The walk's results are a FinderIndex of their own, which any number of
+// finders and searches can share; a server's clients (see server.h) each
+// get a finder, but the tree is only walked and kept once.
+
+#define FINDER_PAGE_ENTRIES 16384
+#define FINDER_MAX_PAGES 1024
+#define FINDER_SLICE 32768
+#define FINDER_MAX_RESULTS 1024
+#define FINDER_MAX_QUERY 256
+
+typedef struct {
+  const char *path; // Relative to the root, not terminated.
+  uint64_t mask;    // finderMask() of the path.
+  uint32_t len;
+  uint32_t base; // Offset of the basename.
+} FinderEntry;
+
+typedef struct {
+  size_t entry;
+  int score;
+} FinderResult;
+
+typedef struct {
+  char *pattern;
+  bool negate, dir_only, anchored;
+} FinderRule;
+
+// The rules of one ignore file. Rules of parent directories are
+// reached through parent, so a directory's job only needs one pointer.
+typedef struct FinderIgnore {
+  struct FinderIgnore *parent;
+  struct FinderIgnore *next; // All ignore files, for freeing.
+  char *dir;
+  size_t num_rules;
+  FinderRule rules[];
+} FinderIgnore;
+
+struct FileFinder;
+
+typedef struct {
+  struct FileFinder *finder;
+  struct FinderQuery *query;
+  size_t begin, end;
+  size_t matches;
+  size_t num_results;
+  FinderResult results[FINDER_MAX_RESULTS];
+} FinderSlice;
+
+// One query in flight. Superseded queries are cancelled and kept on the
+// retired list until their jobs have drained.
+typedef struct FinderQuery {
+  struct FinderQuery *next;
+  char text[FINDER_MAX_QUERY];
+  size_t len;
+  uint64_t mask;
+  size_t num_entries; // Entries this query covers.
+  atomic_bool cancelled;
+  PoolGroup scoring;
+  size_t num_slices;
+  FinderSlice *slices;
+} FinderQuery;
+
+typedef struct {
+  int rootfd;
+
+  // Path arena. Writers hold lock; readers only look at entries below
+  // num_entries, which is published after the entries are written.
+  pthread_mutex_t lock;
+  Arena paths;
+  FinderEntry *pages[FINDER_MAX_PAGES];
+  atomic_size_t num_entries;
+  FinderIgnore *ignores;
+
+  atomic_bool closing;
+  PoolGroup walking;
+} FinderIndex;
+
+typedef struct FileFinder {
+  FinderIndex *index;
+  bool owns_index;
+
+  char query[FINDER_MAX_QUERY];
+  size_t query_len;
+  FinderQuery *current, *retired;
+
+  // What is on screen: the merged results of the last finished query,
+  // which covered the first scored entries.
+  FinderResult results[FINDER_MAX_RESULTS];
+  size_t num_results, matches, scored;
+  size_t top, selected;
+} FileFinder;
+
+typedef struct {
+  FinderIndex *index;
+  FinderIgnore *ignore;
+  char path[]; // Relative directory, "" for the root.
+} FinderWalkJob;
+
+static inline FinderEntry *finder_entry(FinderIndex *x, size_t i) {
+  return &x->pages[i / FINDER_PAGE_ENTRIES][i % FINDER_PAGE_ENTRIES];
+}
+
+static inline char finderLower(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+}
+
+// One bit per letter or digit, the rest of the bytes hashed into the
+// remaining bits. A path can only match if it has every bit the query has,
+// which rejects most of the tree with a single AND.
+static inline uint64_t finderMaskChar(char c) {
+  unsigned char b = (unsigned char)finderLower(c);
+  if (b >= 'a' && b <= 'z')
+    return (uint64_t)1 << (b - 'a');
+  if (b >= '0' && b <= '9')
+    return (uint64_t)1 << (26 + b - '0');
+  return (uint64_t)1 << (36 + b % 28);
+}
+
+static inline uint64_t finderMask(const char *s, size_t n) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < n; i++)
+    mask |= finderMaskChar(s[i]);
+  return mask;
+}
+
+// Position of the first byte in s[from, n) equal to c, ignoring ASCII
+// case; c must already be lowercase. Returns n if there is none.
+static inline size_t finderFind(const char *s, size_t from, size_t n, char c) {
+  size_t i = from;
+  bool letter = c >= 'a' && c <= 'z';
+#ifdef __SSE2__
+  __m128i fold = _mm_set1_epi8(letter ? 0x20 : 0);
+  __m128i want = _mm_set1_epi8(c);
+  for (; i + 16 <= n; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(s + i));
+    int hits =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(bytes, fold), want));
+    if (hits)
+      return i + (size_t)__builtin_ctz((unsigned)hits);
+  }
+#endif
+  for (; i < n; i++)
+    if ((letter ? (char)(s[i] | 0x20) : s[i]) == c)
+      return i;
+  return n;
+}
+
+// Matches the query as a subsequence of s[from, n) and scores it, or
+// returns INT_MIN. Matches at word starts and runs of adjacent matches
+// score higher; gaps cost a little.
+static inline int finderScoreFrom(const char *s, size_t from, size_t n,
+                                  const char *query, size_t qlen) {
+  int score = 0;
+  size_t last = (size_t)-1;
+  size_t pos = from;
+  for (size_t q = 0; q < qlen; q++) {
+    pos = finderFind(s, pos, n, query[q]);
+    if (pos == n)
+      return INT_MIN;
+
+    score += 16;
+    char prev = pos ? s[pos - 1] : '/';
+    if (prev == '/')
+      score += 10;
+    else if (prev == '_' || prev == '-' || prev == '.' || prev == ' ')
+      score += 8;
+    else if (prev >= 'a' && prev <= 'z' && s[pos] >= 'A' && s[pos] <= 'Z')
+      score += 8;
+    if (last != (size_t)-1) {
+      if (pos == last + 1)
+        score += 12;
+      else
+        score -= (int)MIN(pos - last - 1, 16);
+    }
+    last = pos++;
+  }
+  return score;
+}
+
+static inline int finderScore(const FinderEntry *e, const char *query,
+                              size_t qlen) {
+  // Prefer matching inside the file name over matching across directories.
+  int score = finderScoreFrom(e->path, e->base, e->len, query, qlen);
+  if (score != INT_MIN)
+    score += 24;
+  else if ((score = finderScoreFrom(e->path, 0, e->len, query, qlen)) ==
+           INT_MIN)
+    return INT_MIN;
+  return score - (int)(e->len / 8);
+}
+
+// Keeps the best results of a slice in a min-heap on score.
+static inline void finderHeapPush(FinderResult *heap, size_t *n,
+                                  FinderResult r) {
+  size_t i;
+  if (*n < FINDER_MAX_RESULTS) {
+    i = (*n)++;
+    while (i && heap[(i - 1) / 2].score > r.score) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = r;
+    return;
+  }
+  if (r.score <= heap[0].score)
+    return;
+  i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= *n)
+      break;
+    if (child + 1 < *n && heap[child + 1].score < heap[child].score)
+      child++;
+    if (heap[child].score >= r.score)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = r;
+}
+
+static void finderScoreSlice(void *arg) {
+  FinderSlice *slice = arg;
+  FileFinder *f = slice->finder;
+  FinderQuery *q = slice->query;
+  for (size_t i = slice->begin; i < slice->end; i++) {
+    if ((i & 1023) == 0 && atomic_load(&q->cancelled))
+      return;
+    const FinderEntry *e = finder_entry(f->index, i);
+    if ((e->mask & q->mask) != q->mask)
+      continue;
+    int score = finderScore(e, q->text, q->len);
+    if (score == INT_MIN)
+      continue;
+    slice->matches++;
+    finderHeapPush(slice->results, &slice->num_results,
+                   (FinderResult){i, score});
+  }
+}
+
+static inline void finderFreeQuery(FinderQuery *q) {
+  tui_free(ALLOC_COMPONENT, q->slices);
+  tui_free(ALLOC_COMPONENT, q);
+}
+
+// Drops retired queries whose jobs have all returned.
+static inline void finderReap(FileFinder *f) {
+  FinderQuery **link = &f->retired;
+  while (*link) {
+    FinderQuery *q = *link;
+    if (pool_idle(&q->scoring)) {
+      *link = q->next;
+      finderFreeQuery(q);
+    } else {
+      link = &q->next;
+    }
+  }
+}
+
+static inline void finderStartQuery(FileFinder *f) {
+  if (f->current) {
+    atomic_store(&f->current->cancelled, true);
+    f->current->next = f->retired;
+    f->retired = f->current;
+    f->current = NULL;
+  }
+  finderReap(f);
+
+  FinderQuery *q = tui_calloc(ALLOC_COMPONENT, 1, sizeof(FinderQuery));
+  if (!q)
+    return;
+  for (size_t i = 0; i < f->query_len; i++)
+    q->text[i] = finderLower(f->query[i]);
+  q->len = f->query_len;
+  q->mask = finderMask(q->text, q->len);
+  q->num_entries = atomic_load(&f->index->num_entries);
+  q->num_slices = (q->num_entries + FINDER_SLICE - 1) / FINDER_SLICE;
+  if (q->num_slices &&
+      !(q->slices = tui_calloc(ALLOC_COMPONENT, q->num_slices,
+                               sizeof(FinderSlice)))) {
+    tui_free(ALLOC_COMPONENT, q);
+    return;
+  }
+  f->current = q;
+
+  Pool *pool = pool_shared();
+  for (size_t s = 0; s < q->num_slices; s++) {
+    FinderSlice *slice = &q->slices[s];
+    slice->finder = f;
+    slice->query = q;
+    slice->begin = s * FINDER_SLICE;
+    slice->end = MIN(slice->begin + FINDER_SLICE, q->num_entries);
+    pool_submit(pool, &q->scoring, finderScoreSlice, slice);
+  }
+}
+
+static int finderCompareResults(const void *a, const void *b) {
+  const FinderResult *x = a, *y = b;
+  if (x->score != y->score)
+    return x->score < y->score ? 1 : -1;
+  return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+// Adopts the results of the current query once all its slices are in.
+// The walk may have added entries since it started, or since the last
+// one finished; those are scored by a fresh query, until the results
+// cover them all.
+static inline void finderCollect(FileFinder *f) {
+  FinderQuery *q = f->current;
+  if (!q && atomic_load(&f->index->num_entries) != f->scored)
+    finderStartQuery(f);
+  if (!q || !pool_idle(&q->scoring) || atomic_load(&q->cancelled))
+    return;
+
+  size_t n = 0, matches = 0;
+  FinderResult *all = NULL;
+  size_t total = 0;
+  for (size_t s = 0; s < q->num_slices; s++)
+    total += q->slices[s].num_results;
+  if (total &&
+      !(all = tui_malloc(ALLOC_COMPONENT, total * sizeof(FinderResult))))
+    return;
+  for (size_t s = 0; s < q->num_slices; s++) {
+    memcpy(all + n, q->slices[s].results,
+           q->slices[s].num_results * sizeof(FinderResult));
+    n += q->slices[s].num_results;
+    matches += q->slices[s].matches;
+  }
+  if (n)
+    qsort(all, n, sizeof(FinderResult), finderCompareResults);
+
+  f->num_results = MIN(n, FINDER_MAX_RESULTS);
+  if (n)
+    memcpy(f->results, all, f->num_results * sizeof(FinderResult));
+  f->matches = matches;
+  if (f->selected >= f->num_results)
+    f->selected = f->num_results ? f->num_results - 1 : 0;
+  tui_free(ALLOC_COMPONENT, all);
+
+  f->scored = q->num_entries;
+  finderFreeQuery(q);
+  f->current = NULL;
+  if (atomic_load(&f->index->num_entries) != f->scored)
+    finderStartQuery(f);
+}
+
+/////////////////////
+// Directory walk  //
+/////////////////////
+
+static inline char *finderReadFile(int dirfd, const char *path, size_t *len) {
+  int fd = openat(dirfd, path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  char *text = NULL;
+  if (!fstat(fd, &st) &&
+      (text = tui_malloc(ALLOC_COMPONENT, (size_t)st.st_size + 1))) {
+    ssize_t n = read(fd, text, (size_t)st.st_size);
+    *len = n > 0 ? (size_t)n : 0;
+    text[*len] = 0;
+  }
+  close(fd);
+  return text;
+}
+
+// Parses dir/.gitignore, if there is one.
+static inline FinderIgnore *finderLoadIgnore(FinderIndex *x, const char *dir,
+                                             FinderIgnore *parent) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s.gitignore", dir, *dir ? "/" : "");
+  size_t len;
+  char *text = finderReadFile(x->rootfd, path, &len);
+  if (!text)
+    return parent;
+
+  size_t max_rules = 1;
+  for (size_t i = 0; i < len; i++)
+    max_rules += text[i] == '\n';
+  FinderIgnore *ig =
+      tui_calloc(ALLOC_COMPONENT, 1,
+                 sizeof(FinderIgnore) + max_rules * sizeof(FinderRule));
+  if (!ig || !(ig->dir = strdup(dir))) {
+    tui_free(ALLOC_COMPONENT, ig);
+    tui_free(ALLOC_COMPONENT, text);
+    return parent;
+  }
+  ig->parent = parent;
+
+  char *save;
+  for (char *line = strtok_r(text, "\n", &save); line;
+       line = strtok_r(NULL, "\n", &save)) {
+    size_t n = strlen(line);
+    while (n && (line[n - 1] == '\r' || line[n - 1] == ' '))
+      line[--n] = 0;
+    if (!n || line[0] == '#')
+      continue;
+    FinderRule r = {0};
+    if (line[0] == '!')
+      r.negate = true, line++, n--;
+    if (n && line[n - 1] == '/')
+      r.dir_only = true, line[--n] = 0;
+    if (n && line[0] == '/')
+      r.anchored = true, line++, n--;
+    else if (strchr(line, '/'))
+      r.anchored = true;
+    if (!n || !(r.pattern = strdup(line)))
+      continue;
+    ig->rules[ig->num_rules++] = r;
+  }
+  tui_free(ALLOC_COMPONENT, text);
+
+  pthread_mutex_lock(&x->lock);
+  ig->next = x->ignores;
+  x->ignores = ig;
+  pthread_mutex_unlock(&x->lock);
+  return ig;
+}
+
+// path is relative to the root. The nearest ignore file decides first,
+// and within a file the last matching rule wins, as in git.
+static inline bool finderIgnored(const FinderIgnore *ig, const char *path,
+                                 const char *name, bool is_dir) {
+  for (; ig; ig = ig->parent) {
+    size_t dlen = strlen(ig->dir);
+    const char *rel = path + (dlen ? dlen + 1 : 0);
+    for (size_t i = ig->num_rules; i-- > 0;) {
+      const FinderRule *r = &ig->rules[i];
+      if (r->dir_only && !is_dir)
+        continue;
+      bool hit = r->anchored ? !fnmatch(r->pattern, rel, FNM_PATHNAME)
+                             : !fnmatch(r->pattern, name, 0);
+      if (hit)
+        return !r->negate;
+    }
+  }
+  return false;
+}
+
+typedef struct {
+  char *names;
+  size_t len, cap;
+  size_t count;
+} FinderBatch;
+
+// Copies a directory's files into the arena in one go, then publishes
+// them to readers.
+static inline void finderPublish(FinderIndex *x, const char *dir,
+                                 FinderBatch *batch) {
+  size_t dlen = strlen(dir), prefix = dlen ? dlen + 1 : 0;
+  pthread_mutex_lock(&x->lock);
+  size_t n = atomic_load(&x->num_entries);
+  const char *name = batch->names;
+  for (size_t i = 0; i < batch->count; i++, name += strlen(name) + 1) {
+    size_t nlen = strlen(name), len = prefix + nlen;
+    if (len >= PATH_MAX)
+      continue;
+    size_t page = n / FINDER_PAGE_ENTRIES;
+    if (page == FINDER_MAX_PAGES)
+      break;
+    if (!x->pages[page] &&
+        !(x->pages[page] = tui_malloc(
+              ALLOC_COMPONENT, FINDER_PAGE_ENTRIES * sizeof(FinderEntry))))
+      break;
+
+    char path[PATH_MAX];
+    memcpy(path, dir, dlen);
+    if (dlen)
+      path[dlen] = '/';
+    memcpy(path + prefix, name, nlen);
+    const char *p = arena_copy(&x->paths, path, len);
+    if (!p)
+      break;
+
+    *finder_entry(x, n++) =
+        (FinderEntry){p, finderMask(p, len), (uint32_t)len, (uint32_t)prefix};
+  }
+  atomic_store(&x->num_entries, n);
+  pthread_mutex_unlock(&x->lock);
+}
+
+static inline void finderWalk(FinderIndex *x, const char *dir,
+                              FinderIgnore *ignore);
+
+static void finderWalkJob(void *arg) {
+  FinderWalkJob *job = arg;
+  if (!atomic_load(&job->index->closing))
+    finderWalk(job->index, job->path, job->ignore);
+  tui_free(ALLOC_COMPONENT, job);
+}
+
+static inline void finderWalk(FinderIndex *x, const char *dir,
+                              FinderIgnore *ignore) {
+  int fd = openat(x->rootfd, *dir ? dir : ".", O_RDONLY | O_DIRECTORY);
+  DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+  if (!d) {
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  ignore = finderLoadIgnore(x, dir, ignore);
+
+  size_t dlen = strlen(dir);
+  FinderBatch batch = {0};
+  char path[PATH_MAX];
+  struct dirent *ent;
+  while ((ent = readdir(d))) {
+    const char *name = ent->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, ".git"))
+      continue;
+    size_t nlen = strlen(name);
+    if (dlen + 1 + nlen >= sizeof(path))
+      continue;
+    snprintf(path, sizeof(path), "%s%s%s", dir, dlen ? "/" : "", name);
+
+    bool is_dir = ent->d_type == DT_DIR;
+    if (ent->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_dir = !fstatat(dirfd(d), name, &st, AT_SYMLINK_NOFOLLOW) &&
+               S_ISDIR(st.st_mode);
+    }
+    if (finderIgnored(ignore, path, name, is_dir))
+      continue;
+
+    if (is_dir) {
+      size_t plen = strlen(path);
+      FinderWalkJob *job =
+          tui_malloc(ALLOC_COMPONENT, sizeof(FinderWalkJob) + plen + 1);
+      if (!job)
+        continue;
+      job->index = x;
+      job->ignore = ignore;
+      memcpy(job->path, path, plen + 1);
+      pool_submit(pool_shared(), &x->walking, finderWalkJob, job);
+    } else {
+      if (batch.len + nlen + 1 > batch.cap) {
+        size_t cap = batch.cap ? batch.cap * 2 : 4096;
+        while (cap < batch.len + nlen + 1)
+          cap *= 2;
+        char *names = tui_realloc(ALLOC_COMPONENT, batch.names, cap);
+        if (!names)
+          continue;
+        batch.names = names;
+        batch.cap = cap;
+      }
+      memcpy(batch.names + batch.len, name, nlen + 1);
+      batch.len += nlen + 1;
+      batch.count++;
+    }
+  }
+  closedir(d);
+
+  if (batch.count)
+    finderPublish(x, dir, &batch);
+  tui_free(ALLOC_COMPONENT, batch.names);
+}
+
+// Starts walking the tree under root.
+static inline FinderIndex *finder_index_open(const char *root) {
+  FinderIndex *x = tui_calloc(ALLOC_COMPONENT, 1, sizeof(FinderIndex));
+  if (!x)
+    return NULL;
+  if ((x->rootfd = open(root, O_RDONLY | O_DIRECTORY)) < 0) {
+    tui_free(ALLOC_COMPONENT, x);
+    return NULL;
+  }
+  pthread_mutex_init(&x->lock, NULL);
+
+  FinderWalkJob *job = tui_malloc(ALLOC_COMPONENT, sizeof(FinderWalkJob) + 1);
+  if (job) {
+    job->index = x;
+    job->ignore = NULL;
+    job->path[0] = 0;
+    pool_submit(pool_shared(), &x->walking, finderWalkJob, job);
+  }
+  return x;
+}
+
+// Close every finder and search over the index first.
+static inline void finder_index_close(FinderIndex *x) {
+  if (!x)
+    return;
+  atomic_store(&x->closing, true);
+  pool_wait(pool_shared(), &x->walking);
+  while (x->ignores) {
+    FinderIgnore *ig = x->ignores;
+    x->ignores = ig->next;
+    for (size_t i = 0; i < ig->num_rules; i++)
+      free(ig->rules[i].pattern);
+    free(ig->dir);
+    tui_free(ALLOC_COMPONENT, ig);
+  }
+  arena_free(&x->paths);
+  for (size_t i = 0; i < FINDER_MAX_PAGES && x->pages[i]; i++)
+    tui_free(ALLOC_COMPONENT, x->pages[i]);
+  pthread_mutex_destroy(&x->lock);
+  close(x->rootfd);
+  tui_free(ALLOC_COMPONENT, x);
+}
+
+// A finder over an index it doesn't own, which has to outlive it.
+static inline FileFinder *finder_open_index(FinderIndex *index) {
+  FileFinder *f = tui_calloc(ALLOC_COMPONENT, 1, sizeof(FileFinder));
+  if (f)
+    f->index = index;
+  return f;
+}
+
+// A finder over an index of its own.
+static inline FileFinder *finder_open(const char *root) {
+  FinderIndex *index = finder_index_open(root);
+  FileFinder *f = index ? finder_open_index(index) : NULL;
+  if (!f) {
+    finder_index_close(index);
+    return NULL;
+  }
+  f->owns_index = true;
+  return f;
+}
+
+static inline void finder_close(FileFinder *f) {
+  if (!f)
+    return;
+  if (f->current) {
+    atomic_store(&f->current->cancelled, true);
+    f->current->next = f->retired;
+    f->retired = f->current;
+  }
+  for (FinderQuery *q = f->retired; q; q = q->next)
+    pool_wait(pool_shared(), &q->scoring);
+  finderReap(f);
+  if (f->owns_index)
+    finder_index_close(f->index);
+  tui_free(ALLOC_COMPONENT, f);
+}
+
+static inline void finder_set_query(FileFinder *f, const char *query,
+                                    size_t len) {
+  f->query_len = MIN(len, FINDER_MAX_QUERY);
+  memmove(f->query, query, f->query_len);
+  f->top = f->selected = 0;
+  finderStartQuery(f);
+}
+
+// Copies the selected path into out as a C string. Returns its length,
+// or 0 if nothing is selected.
+static inline size_t finder_selected(FileFinder *f, char *out, size_t cap) {
+  if (!f->num_results || !cap)
+    return 0;
+  const FinderEntry *e =
+      finder_entry(f->index, f->results[f->selected].entry);
+  size_t n = MIN(e->len, cap - 1);
+  memcpy(out, e->path, n);
+  out[n] = 0;
+  return n;
+}
+
+static void finder_render(Component *self, TMT *screen) {
+  FileFinder *f = self->finder;
+  Position pos = self->pos;
+  finderCollect(f);
+  if (!pos.height || !pos.width)
+    return;
+
+  char prompt[FINDER_MAX_QUERY + 64];
+  int n = snprintf(prompt, sizeof(prompt), "> %.*s  (%zu/%zu%s)",
+                   (int)f->query_len, f->query, f->matches,
+                   atomic_load(&f->index->num_entries),
+                   pool_idle(&f->index->walking) ? "" : "…");
+  moveCursor(screen, pos.x, pos.y);
+  drawText(screen, prompt, (size_t)MIN(n, sizeof(prompt) - 1), pos.width);
+
+  // Only the rows that fit are drawn, however many results there are.
+  uint16_t rows = pos.height - 1;
+  if (f->selected < f->top)
+    f->top = f->selected;
+  else if (rows && f->selected >= f->top + rows)
+    f->top = f->selected - rows + 1;
+
+  for (uint16_t i = 0; i < rows; i++) {
+    size_t r = f->top + i;
+    moveCursor(screen, pos.x, pos.y + 1 + i);
+    if (r >= f->num_results) {
+      drawText(screen, "", 0, pos.width);
+      continue;
+    }
+    const FinderEntry *e = finder_entry(f->index, f->results[r].entry);
+    bool selected = r == f->selected;
+    if (selected)
+      tmt_write(screen, "\x1b[7m", 4);
+    drawText(screen, e->path, e->len, pos.width);
+    if (selected)
+      tmt_write(screen, "\x1b[0m", 4);
+  }
+}
+
+static void finder_resize(Component *self, Position new_pos) {
+  self->pos = new_pos;
+}
+
+static int finder_onKeypress(Component *self, KeyEvent event) {
+  FileFinder *f = self->finder;
+  switch (event.key) {
+  case 0x0e: // ^N
+    if (f->selected + 1 < f->num_results)
+      f->selected++;
+    return 1;
+  case 0x10: // ^P
+    if (f->selected)
+      f->selected--;
+    return 1;
+  case 0x08:
+  case 0x7f: {
+    size_t len = f->query_len;
+    // Back up over a whole utf8 sequence.
+    while (len && ((unsigned char)f->query[len - 1] & 0xC0) == 0x80)
+      len--;
+    finder_set_query(f, f->query, len ? len - 1 : 0);
+    return 1;
+  }
+  default: {
+    if (event.key < 0x20)
+      return 0;
+    char bytes[4];
+    size_t len = utf8_put((uint32_t)event.key, bytes);
+    if (!len || f->query_len + len > FINDER_MAX_QUERY)
+      return 1;
+    char query[FINDER_MAX_QUERY];
+    memcpy(query, f->query, f->query_len);
+    memcpy(query + f->query_len, bytes, len);
+    finder_set_query(f, query, f->query_len + len);
+    return 1;
+  }
+  }
+}
+
+static inline Component *finderComponent(GlobalContext *context,
+                                         FileFinder *f) {
+  Component *c = f ? tui_calloc(ALLOC_COMPONENT, 1, sizeof(Component)) : NULL;
+  if (!c) {
+    finder_close(f);
+    return NULL;
+  }
+  c->finder = f;
+  c->context = context;
+  c->kind = COMPONENT_FINDER;
+  c->render = finder_render;
+  c->resize = finder_resize;
+  c->onKeypress = finder_onKeypress;
+  finder_set_query(c->finder, "", 0);
+  return c;
+}
+
+static inline Component *finder_new(GlobalContext *context, const char *root) {
+  return finderComponent(context, finder_open(root));
+}
+
+// A finder over a shared index, which has to outlive it.
+static inline Component *finder_new_shared(GlobalContext *context,
+                                           FinderIndex *index) {
+  return finderComponent(context, finder_open_index(index));
+}
+
+static inline void finder_free(Component *c) {
+  if (!c)
+    return;
+  finder_close(c->finder);
+  tui_free(ALLOC_COMPONENT, c);
+}
+
+#endif
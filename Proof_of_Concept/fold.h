@@ -0,0 +1,436 @@
+#ifndef FOLD_H
+#define FOLD_H
+
+#include "buffer.h"
+
+// Fold regions over the lines of a buffer. A fold covers its start line
+// and the len lines after it; closed, it shows only the start line.
+//
+// Folds either nest or don't touch, so the folds at one level of nesting
+// never overlap, and a treap ordered by start line is all the interval
+// tree they need. Each fold keeps the folds nested in it in a treap of its
+// own, positioned relative to its start, so moving a fold moves everything
+// inside it for free. Shifting every fold below an edit is a lazy tag on
+// one subtree, which is how the folds stay anchored to their lines.
+//
+// Every node also sums the lines hidden in its subtree, counting a closed
+// fold as its whole body and an open one as whatever its children hide.
+// That prefix sum is what maps buffer lines to screen rows and back, in
+// O(log n) per level of nesting.
+
+typedef struct FoldNode {
+  struct FoldNode *left, *right;
+  uint32_t priority;
+
+  size_t start, len;
+  bool closed;
+  ptrdiff_t lazy; // Still to be added to the starts below this node.
+
+  struct FoldNode *children; // Starts relative to this start.
+  size_t hidden, total_hidden;
+} FoldNode;
+
+typedef enum {
+  FOLD_NONE,
+  FOLD_OPEN,   // A fold starts on this line and is open.
+  FOLD_CLOSED, // A fold starts on this line and is closed.
+} FoldMarker;
+
+typedef struct FoldSet {
+  Buffer *buffer;
+  FoldNode *root;
+  uint32_t seed;
+  size_t after; // First line an edit in progress moves.
+} FoldSet;
+
+static inline void foldPush(FoldNode *n) {
+  if (!n->lazy)
+    return;
+  if (n->left)
+    n->left->start += n->lazy, n->left->lazy += n->lazy;
+  if (n->right)
+    n->right->start += n->lazy, n->right->lazy += n->lazy;
+  n->lazy = 0;
+}
+
+static inline void foldUpdate(FoldNode *n) {
+  n->hidden = n->closed ? n->len
+                        : (n->children ? n->children->total_hidden : 0);
+  n->total_hidden = n->hidden;
+  if (n->left)
+    n->total_hidden += n->left->total_hidden;
+  if (n->right)
+    n->total_hidden += n->right->total_hidden;
+}
+
+static inline void foldShift(FoldNode *t, ptrdiff_t by) {
+  if (t)
+    t->start += by, t->lazy += by;
+}
+
+static inline FoldNode *foldMerge(FoldNode *l, FoldNode *r) {
+  if (!l || !r)
+    return l ? l : r;
+  if (l->priority > r->priority) {
+    foldPush(l);
+    l->right = foldMerge(l->right, r);
+    foldUpdate(l);
+    return l;
+  }
+  foldPush(r);
+  r->left = foldMerge(l, r->left);
+  foldUpdate(r);
+  return r;
+}
+
+// Splits into folds starting before line and the rest.
+static inline void foldSplit(FoldNode *t, size_t line, FoldNode **l,
+                             FoldNode **r) {
+  if (!t) {
+    *l = *r = NULL;
+    return;
+  }
+  foldPush(t);
+  if (t->start < line) {
+    foldSplit(t->right, line, &t->right, r);
+    *l = t;
+  } else {
+    foldSplit(t->left, line, l, &t->left);
+    *r = t;
+  }
+  foldUpdate(t);
+}
+
+static inline FoldNode *foldLast(FoldNode *t) {
+  for (; t && (foldPush(t), t->right); t = t->right)
+    ;
+  return t;
+}
+
+static inline void foldFreeTree(FoldNode *t) {
+  if (!t)
+    return;
+  foldFreeTree(t->left);
+  foldFreeTree(t->right);
+  foldFreeTree(t->children);
+  tui_free(ALLOC_COMPONENT, t);
+}
+
+// The fold at this level whose lines include line.
+static inline FoldNode *foldFind(FoldNode *t, size_t line) {
+  while (t) {
+    foldPush(t);
+    if (line < t->start)
+      t = t->left;
+    else if (line <= t->start + t->len)
+      return t;
+    else
+      t = t->right;
+  }
+  return NULL;
+}
+
+// Recomputes the sums on the path down to the fold starting at start,
+// after something below it changed. foldFind has already pushed it.
+static inline void foldRefresh(FoldNode *t, size_t start) {
+  if (t->start != start)
+    foldRefresh(start < t->start ? t->left : t->right, start);
+  foldUpdate(t);
+}
+
+// Lifts a fold's children up to its own level.
+static inline FoldNode *foldUnwrap(FoldNode *n) {
+  FoldNode *children = n->children;
+  foldShift(children, (ptrdiff_t)n->start);
+  tui_free(ALLOC_COMPONENT, n);
+  return children;
+}
+
+static inline bool foldAddTo(FoldNode **root, size_t start, size_t end,
+                             FoldNode *n) {
+  FoldNode *c = foldFind(*root, start);
+  if (c && end <= c->start + c->len) {
+    if (c->start == start && c->start + c->len == end)
+      return false; // Already there.
+    if (!foldAddTo(&c->children, start - c->start, end - c->start, n))
+      return false;
+    foldRefresh(*root, c->start);
+    return true;
+  }
+
+  // Whatever starts inside the new fold must also end inside it.
+  FoldNode *l, *m, *r, *last;
+  foldSplit(*root, start, &l, &r);
+  foldSplit(r, end + 1, &m, &r);
+  if (((last = foldLast(l)) && last->start + last->len >= start) ||
+      ((last = foldLast(m)) && last->start + last->len > end)) {
+    *root = foldMerge(foldMerge(l, m), r);
+    return false;
+  }
+  foldShift(m, -(ptrdiff_t)start);
+  n->start = start;
+  n->len = end - start;
+  n->children = m;
+  foldUpdate(n);
+  *root = foldMerge(foldMerge(l, n), r);
+  return true;
+}
+
+// Adds a fold over lines [start, end]. It fails if the fold would cross
+// the boundary of another one, or is already there.
+static inline bool fold_add(FoldSet *f, size_t start, size_t end,
+                            bool closed) {
+  if (end <= start || end >= buffer_num_lines(f->buffer))
+    return false;
+  FoldNode *n = tui_calloc(ALLOC_COMPONENT, 1, sizeof(FoldNode));
+  if (!n)
+    return false;
+  uint32_t x = f->seed;
+  x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+  n->priority = f->seed = x;
+  n->closed = closed;
+  if (!foldAddTo(&f->root, start, end, n)) {
+    tui_free(ALLOC_COMPONENT, n);
+    return false;
+  }
+  return true;
+}
+
+static inline bool foldRemoveFrom(FoldNode **root, size_t line) {
+  FoldNode *c = foldFind(*root, line);
+  if (!c)
+    return false;
+  if (foldRemoveFrom(&c->children, line - c->start)) {
+    foldRefresh(*root, c->start);
+    return true;
+  }
+  FoldNode *l, *m, *r;
+  foldSplit(*root, c->start, &l, &r);
+  foldSplit(r, c->start + 1, &m, &r);
+  *root = foldMerge(foldMerge(l, foldUnwrap(m)), r);
+  return true;
+}
+
+// Removes the innermost fold containing line, keeping the ones in it.
+static inline bool fold_remove(FoldSet *f, size_t line) {
+  return foldRemoveFrom(&f->root, line);
+}
+
+static inline bool foldToggleIn(FoldNode *root, size_t line) {
+  FoldNode *c = foldFind(root, line);
+  if (!c)
+    return false;
+  // A line hidden by a closed fold belongs to it, not to what's inside.
+  if (c->closed || !foldToggleIn(c->children, line - c->start))
+    c->closed = !c->closed;
+  foldRefresh(root, c->start);
+  return true;
+}
+
+// Opens the closed fold that hides or starts at line; failing that,
+// closes the innermost fold containing it.
+static inline bool fold_toggle(FoldSet *f, size_t line) {
+  return foldToggleIn(f->root, line);
+}
+
+// Lines of the buffer above line that don't show.
+static inline size_t foldHiddenBefore(const FoldNode *t, size_t line) {
+  size_t hidden = 0;
+  ptrdiff_t lazy = 0;
+  while (t) {
+    size_t start = t->start + (size_t)lazy;
+    if (line <= start) {
+      lazy += t->lazy;
+      t = t->left;
+      continue;
+    }
+    if (t->left)
+      hidden += t->left->total_hidden;
+    if (line > start + t->len) {
+      hidden += t->hidden;
+      lazy += t->lazy;
+      t = t->right;
+      continue;
+    }
+    // Inside this fold.
+    if (t->closed)
+      return hidden + (line - start);
+    t = t->children;
+    line -= start;
+    lazy = 0;
+  }
+  return hidden;
+}
+
+// The screen row a line shows on, or the row of the fold hiding it.
+static inline size_t fold_row_of(const FoldSet *f, size_t line) {
+  return line - foldHiddenBefore(f->root, line);
+}
+
+// The line shown on a screen row.
+static inline size_t fold_line_of(const FoldSet *f, size_t row) {
+  const FoldNode *t = f->root;
+  size_t base = 0;    // Where the current level starts.
+  size_t skipped = 0; // Hidden lines at this level left of t's subtree.
+  ptrdiff_t lazy = 0;
+  while (t) {
+    size_t start = t->start + (size_t)lazy;
+    size_t left_hidden = t->left ? t->left->total_hidden : 0;
+    size_t before = start - skipped - left_hidden; // Rows above start.
+    if (row < before) {
+      lazy += t->lazy;
+      t = t->left;
+      continue;
+    }
+    if (row - before <= t->len - t->hidden) {
+      // On a row inside this fold.
+      if (t->closed)
+        return base + start;
+      row -= before;
+      base += start;
+      skipped = 0;
+      lazy = 0;
+      t = t->children;
+      continue;
+    }
+    skipped += left_hidden + t->hidden;
+    lazy += t->lazy;
+    t = t->right;
+  }
+  return base + row + skipped;
+}
+
+static inline size_t fold_num_rows(const FoldSet *f) {
+  return buffer_num_lines(f->buffer) -
+         (f->root ? f->root->total_hidden : 0);
+}
+
+static inline FoldMarker fold_marker(const FoldSet *f, size_t line) {
+  const FoldNode *t = f->root;
+  ptrdiff_t lazy = 0;
+  while (t) {
+    size_t start = t->start + (size_t)lazy;
+    if (line == start)
+      return t->closed ? FOLD_CLOSED : FOLD_OPEN;
+    if (line < start) {
+      lazy += t->lazy;
+      t = t->left;
+    } else if (line <= start + t->len) {
+      if (t->closed)
+        return FOLD_NONE;
+      line -= start;
+      lazy = 0;
+      t = t->children;
+    } else {
+      lazy += t->lazy;
+      t = t->right;
+    }
+  }
+  return FOLD_NONE;
+}
+
+// Where a line ends up after an edit that merged lines [after, after + r)
+// into the line above and then added i lines below it.
+static inline size_t foldMap(size_t line, size_t after, size_t r, size_t i) {
+  if (line < after)
+    return line;
+  if (line >= after + r)
+    return line + i - r;
+  return after - 1 + bufferMin(line - after + 1, i);
+}
+
+static inline FoldNode *foldEdit(FoldNode *root, size_t after, size_t r,
+                                 size_t i);
+
+// Drops folds whose start line went away, keeping what was inside them.
+static inline FoldNode *foldDrop(FoldNode *t, size_t after, size_t r,
+                                 size_t i) {
+  if (!t)
+    return NULL;
+  foldPush(t);
+  FoldNode *l = foldDrop(t->left, after, r, i);
+  FoldNode *right = t->right;
+  FoldNode *inner = foldEdit(foldUnwrap(t), after, r, i);
+  return foldMerge(foldMerge(l, inner), foldDrop(right, after, r, i));
+}
+
+// Moves the folds at one level for an edit. Folds below it shift, folds
+// starting on lines it removed are dropped, and the one fold that can
+// contain it (the last one starting above it) grows or shrinks.
+static inline FoldNode *foldEdit(FoldNode *root, size_t after, size_t r,
+                                 size_t i) {
+  FoldNode *a, *b, *c;
+  foldSplit(root, after, &a, &c);
+  foldSplit(c, after + r, &b, &c);
+  foldShift(c, (ptrdiff_t)i - (ptrdiff_t)r);
+  b = foldDrop(b, after, r, i);
+
+  FoldNode *last = foldLast(a);
+  if (last && last->start + last->len >= after) {
+    size_t start = last->start;
+    size_t end = foldMap(start + last->len, after, r, i);
+    last->children =
+        foldEdit(last->children, after - start, r, i);
+    if (end > start) {
+      last->len = end - start;
+      // A child shrunk to the same lines as this fold is merged into it,
+      // keeping hidden whatever either of them hid.
+      FoldNode *same, *rest;
+      foldSplit(last->children, 1, &same, &rest);
+      if (same && same->len == last->len) {
+        last->closed |= same->closed;
+        same = foldUnwrap(same);
+      }
+      last->children = foldMerge(same, rest);
+      foldRefresh(a, start);
+    } else {
+      FoldNode *m;
+      foldSplit(a, start, &a, &m);
+      a = foldMerge(a, foldUnwrap(m));
+    }
+  }
+  return foldMerge(foldMerge(a, b), c);
+}
+
+static void foldBeforeEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  FoldSet *f = ctx;
+  // Whole lines put in or taken out at the start of a line move that line
+  // too; anything else leaves it where it is.
+  size_t end = buffer_line_start(b, edit->line + edit->removed_lines);
+  bool whole = edit->offset == buffer_line_start(b, edit->line) &&
+               (edit->removed ? edit->offset + edit->removed == end
+                              : edit->inserted_lines > 0);
+  f->after = whole ? edit->line : edit->line + 1;
+}
+
+static void foldAfterEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  (void)b;
+  FoldSet *f = ctx;
+  if (edit->removed_lines || edit->inserted_lines)
+    f->root = foldEdit(f->root, f->after, edit->removed_lines,
+                       edit->inserted_lines);
+}
+
+static inline FoldSet *fold_attach(Buffer *b) {
+  FoldSet *f = tui_calloc(ALLOC_COMPONENT, 1, sizeof(FoldSet));
+  if (!f)
+    return NULL;
+  f->buffer = b;
+  f->seed = 0x6D2B79F5u;
+  BufferListener listener = {foldBeforeEdit, foldAfterEdit, f, NULL};
+  if (!buffer_listen(b, listener)) {
+    tui_free(ALLOC_COMPONENT, f);
+    return NULL;
+  }
+  return f;
+}
+
+static inline void fold_detach(FoldSet *f) {
+  if (!f)
+    return;
+  buffer_unlisten(f->buffer, f);
+  foldFreeTree(f->root);
+  tui_free(ALLOC_COMPONENT, f);
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef HUD_H
+#define HUD_H
+
+#include "tui.h"
+
+// A box of frame statistics in the top right corner, drawn over
+// everything else. It only formats what tui_stats already counted, so
+// it's cheap enough to leave on. ^G shows and hides it.
+//
+// Counts are for the last whole frame, which includes drawing the HUD
+// itself. The tty backlog is what the terminal hadn't read yet when that
+// frame ended. Key latencies are over the whole run.
+
+#define HUD_WIDTH 34
+#define HUD_ROWS 5
+#define HUD_TOGGLE_KEY 0x07 // ^G
+
+typedef struct Hud {
+  bool visible;
+} Hud;
+
+static inline void hudFormatBytes(char *out, size_t n, size_t bytes) {
+  if (bytes < 10240)
+    snprintf(out, n, "%zuB", bytes);
+  else if (bytes < ((size_t)10240 << 10))
+    snprintf(out, n, "%zuK", bytes >> 10);
+  else
+    snprintf(out, n, "%zuM", bytes >> 20);
+}
+
+static void hud_render(Component *self, TMT *screen) {
+  if (!self->hud->visible)
+    return;
+  const TMTSCREEN *s = tmt_screen(screen);
+  if (s->ncol < HUD_WIDTH || s->nline < HUD_ROWS)
+    return;
+  const TuiStats *st = &tui_stats;
+  const TuiFrameCounts *c = &st->last;
+  char out[16], backlog[16], rows[HUD_ROWS][64]; // Clipped when drawn.
+  hudFormatBytes(out, sizeof(out), c->output_bytes);
+  if (st->tty_backlog < 0)
+    snprintf(backlog, sizeof(backlog), "?");
+  else
+    hudFormatBytes(backlog, sizeof(backlog), (size_t)st->tty_backlog);
+  snprintf(rows[0], sizeof(rows[0]), " frame %.1fms p50 %.1f p99 %.1f",
+           (double)st->frame_ns / 1e6, (double)tui_frame_percentile(50) / 1e6,
+           (double)tui_frame_percentile(99) / 1e6);
+  snprintf(rows[1], sizeof(rows[1]), " events %zu  dirty rows %zu",
+           c->events, c->dirty_rows);
+  snprintf(rows[2], sizeof(rows[2]), " cells %zu  out %s  tty %s", c->cells,
+           out, backlog);
+  snprintf(rows[3], sizeof(rows[3]), " allocs %zu  frames %zu",
+           c->allocations, st->frames);
+  snprintf(rows[4], sizeof(rows[4]), " key p50 %.1fms p99 %.1f max %.1f",
+           (double)tui_latency_percentile(50) / 1e6,
+           (double)tui_latency_percentile(99) / 1e6,
+           (double)st->latency.max / 1e6);
+
+  uint16_t x = (uint16_t)(s->ncol - HUD_WIDTH);
+  for (uint16_t y = 0; y < HUD_ROWS; y++) {
+    moveCursor(screen, x, y);
+    tmt_write(screen, "\x1b[7m", 0);
+    drawText(screen, rows[y], strlen(rows[y]), HUD_WIDTH);
+    tmt_write(screen, "\x1b[0m", 0);
+  }
+}
+
+static inline void hud_toggle(Component *c) {
+  c->hud->visible = !c->hud->visible;
+  // What it covered has to be drawn again.
+  if (!c->hud->visible)
+    (c->context ? c->context : tui_context)->repaint = true;
+}
+
+static int hud_onKeypress(Component *self, KeyEvent event) {
+  if (event.key != HUD_TOGGLE_KEY)
+    return 0;
+  hud_toggle(self);
+  return 1;
+}
+
+// Makes a hidden HUD and sets it as the context's overlay.
+static inline Component *hud_new(GlobalContext *context) {
+  Component *c = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Component));
+  Hud *h = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Hud));
+  if (!c || !h) {
+    tui_free(ALLOC_COMPONENT, c);
+    tui_free(ALLOC_COMPONENT, h);
+    return NULL;
+  }
+  c->hud = h;
+  c->context = context;
+  c->kind = COMPONENT_HUD;
+  c->render = hud_render;
+  c->onKeypress = hud_onKeypress;
+  if (context)
+    context->overlay = c;
+  return c;
+}
+
+static inline void hud_free(Component *c) {
+  if (!c)
+    return;
+  if (c->context && c->context->overlay == c)
+    c->context->overlay = NULL;
+  tui_free(ALLOC_COMPONENT, c->hud);
+  tui_free(ALLOC_COMPONENT, c);
+}
+
+#endif
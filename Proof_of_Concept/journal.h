@@ -0,0 +1,348 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "buffer.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+// Crash recovery. Every edit to a buffer is appended to a journal next to
+// its file (".name.journal") as a few bytes: an op, two varints, any
+// inserted text and a checksum. Nothing is ever rewritten in place.
+//
+// Records collect in memory and are written out together when the editor
+// goes idle, or once JOURNAL_MAX_DELAY_MS has passed with edits pending,
+// whichever comes first. The fdatasync that makes them durable runs on the
+// pool, so the UI thread never waits for the disk. The main loop waits no
+// longer than the deadline, and tells the journal which it was:
+//
+//   int ready = poll(fds, num_fds, journal_timeout(j));
+//   ... handle what came in ...
+//   if (ready > 0)
+//     journal_poll(j);
+//   else
+//     journal_idle(j);
+//
+// The journal starts with the identity of the file it applies to. When the
+// buffer is opened again and the file hasn't changed, the records are
+// replayed onto it, up to the first one that's torn or doesn't fit. Once
+// the buffer is saved the journal starts over.
+
+#define JOURNAL_MAX_DELAY_MS 500
+#define JOURNAL_MAX_PENDING ((size_t)64 << 10)
+#define JOURNAL_MAGIC "edjrnl01"
+
+typedef struct {
+  char magic[8];
+  uint64_t size, ino;
+  int64_t mtime_sec, mtime_nsec;
+} JournalHeader;
+
+enum { JOURNAL_INSERT = 'i', JOURNAL_DELETE = 'd' };
+
+typedef struct {
+  Buffer *buffer;
+  char *path;
+  int fd;
+
+  char *pending;
+  size_t num_pending, cap_pending;
+  struct timespec oldest; // When the oldest pending record was added.
+
+  bool unsynced; // Written, but not known to be on disk.
+  PoolGroup syncing;
+} Journal;
+
+static inline uint32_t journalChecksum(const unsigned char *p, size_t n) {
+  // FNV-1a
+  uint32_t h = 0x811c9dc5u;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ p[i]) * 0x01000193u;
+  return h;
+}
+
+static inline size_t journalPutVarint(unsigned char *p, uint64_t v) {
+  size_t n = 0;
+  for (; v >= 0x80; v >>= 7)
+    p[n++] = (unsigned char)(v | 0x80);
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+// Returns the bytes used, or 0 if the varint runs past the end.
+static inline size_t journalGetVarint(const unsigned char *p, size_t n,
+                                      uint64_t *v) {
+  *v = 0;
+  for (size_t i = 0; i < n && i < 10; i++) {
+    *v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+    if (!(p[i] & 0x80))
+      return i + 1;
+  }
+  return 0;
+}
+
+static inline long journalElapsedMs(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long)(now.tv_sec - since->tv_sec) * 1000 +
+         (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static inline JournalHeader journalIdentity(const char *path) {
+  JournalHeader h = {0};
+  memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+  struct stat st;
+  if (!stat(path, &st)) {
+    h.size = (uint64_t)st.st_size;
+    h.ino = (uint64_t)st.st_ino;
+    h.mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    h.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+  }
+  return h;
+}
+
+static inline bool journalWriteAll(int fd, const void *p, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p = (const char *)p + w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+static void journalSync(void *arg) {
+  Journal *j = arg;
+  fdatasync(j->fd);
+}
+
+// Writes out what's pending and starts making it durable. If a sync is
+// still running, the next flush picks the new records up.
+static inline void journal_flush(Journal *j) {
+  if (j->num_pending) {
+    if (!journalWriteAll(j->fd, j->pending, j->num_pending))
+      return; // Keep it; the disk may have room later.
+    j->num_pending = 0;
+    j->unsynced = true;
+  }
+  if (j->unsynced && pool_idle(&j->syncing)) {
+    j->unsynced = false;
+    pool_submit(pool_shared(), &j->syncing, journalSync, j);
+  }
+}
+
+// Call when there's no input waiting.
+static inline void journal_idle(Journal *j) {
+  if (j)
+    journal_flush(j);
+}
+
+// For the main loop's poll timeout: milliseconds until the pending
+// records are due, or -1 if there are none.
+static inline int journal_timeout(const Journal *j) {
+  if (!j || !j->num_pending)
+    return -1;
+  long left = JOURNAL_MAX_DELAY_MS - journalElapsedMs(&j->oldest);
+  return left > 0 ? (int)left : 0;
+}
+
+// Writes out what's pending once it's due, however busy the editor is.
+// Never blocks; call it every time around the main loop.
+static inline void journal_poll(Journal *j) {
+  if (j && j->num_pending &&
+      journalElapsedMs(&j->oldest) >= JOURNAL_MAX_DELAY_MS)
+    journal_flush(j);
+}
+
+static inline bool journalReserve(Journal *j, size_t n) {
+  if (j->num_pending + n <= j->cap_pending)
+    return true;
+  size_t cap = j->cap_pending ? j->cap_pending : 4096;
+  while (cap < j->num_pending + n)
+    cap *= 2;
+  char *pending = realloc(j->pending, cap);
+  if (!pending)
+    return false;
+  j->pending = pending;
+  j->cap_pending = cap;
+  return true;
+}
+
+static void journalAfterEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  Journal *j = ctx;
+  // A delete and an insert never come in the same edit.
+  size_t len = edit->inserted ? edit->inserted : edit->removed;
+  if (!journalReserve(j, 1 + 10 + 10 + len + 4))
+    return;
+  unsigned char *start = (unsigned char *)j->pending + j->num_pending;
+  unsigned char *p = start;
+  *p++ = edit->inserted ? JOURNAL_INSERT : JOURNAL_DELETE;
+  p += journalPutVarint(p, edit->offset);
+  p += journalPutVarint(p, len);
+  if (edit->inserted) {
+    buffer_read(b, edit->offset, len, (char *)p);
+    p += len;
+  }
+  uint32_t sum = journalChecksum(start, (size_t)(p - start));
+  memcpy(p, &sum, sizeof(sum));
+  p += sizeof(sum);
+
+  if (!j->num_pending)
+    clock_gettime(CLOCK_MONOTONIC, &j->oldest);
+  j->num_pending += (size_t)(p - start);
+  if (j->num_pending >= JOURNAL_MAX_PENDING ||
+      journalElapsedMs(&j->oldest) >= JOURNAL_MAX_DELAY_MS)
+    journal_flush(j);
+}
+
+// The journal starts over from the file as it now is on disk.
+static inline void journalReset(Journal *j) {
+  JournalHeader h = journalIdentity(j->buffer->path);
+  j->num_pending = 0;
+  if (ftruncate(j->fd, 0) || lseek(j->fd, 0, SEEK_SET) ||
+      !journalWriteAll(j->fd, &h, sizeof(h)))
+    return;
+  j->unsynced = true;
+  journal_flush(j);
+}
+
+static void journalSaved(Buffer *b, void *ctx) {
+  (void)b;
+  journalReset(ctx);
+}
+
+// Replays records onto the buffer, returning the length of the good ones.
+static inline size_t journalReplay(Buffer *b, const unsigned char *p,
+                                   size_t n) {
+  size_t at = 0;
+  buffer_begin_group(b);
+  while (at < n) {
+    const unsigned char *r = p + at;
+    size_t left = n - at, used = 1, k;
+    uint64_t offset, len;
+    if (left < 1 || (r[0] != JOURNAL_INSERT && r[0] != JOURNAL_DELETE))
+      break;
+    if (!(k = journalGetVarint(r + used, left - used, &offset)))
+      break;
+    used += k;
+    if (!(k = journalGetVarint(r + used, left - used, &len)))
+      break;
+    used += k;
+    size_t text = used;
+    if (r[0] == JOURNAL_INSERT) {
+      if (len > left - used)
+        break;
+      used += len;
+    }
+    uint32_t sum;
+    if (left - used < sizeof(sum))
+      break;
+    memcpy(&sum, r + used, sizeof(sum));
+    if (sum != journalChecksum(r, used))
+      break;
+    bool ok = r[0] == JOURNAL_INSERT
+                  ? buffer_insert(b, offset, (const char *)r + text, len)
+                  : buffer_delete(b, offset, len);
+    if (!ok)
+      break;
+    at += used + sizeof(sum);
+  }
+  buffer_end_group(b);
+  return at;
+}
+
+static inline char *journalPath(const char *path) {
+  const char *slash = strrchr(path, '/');
+  size_t dir = slash ? (size_t)(slash - path) + 1 : 0;
+  size_t n = strlen(path) + sizeof("/..journal");
+  char *out = malloc(n);
+  if (out)
+    snprintf(out, n, "%.*s.%s.journal", (int)dir, path, path + dir);
+  return out;
+}
+
+// Reads whatever journal the buffer's file has left behind, applies it if
+// it's for the file as it is now, and starts journaling from there. A
+// journal for some other version of the file is moved aside to
+// ".name.journal.old" rather than lost. Call right after buffer_open.
+static inline Journal *journal_open(Buffer *b) {
+  if (!b->path)
+    return NULL;
+  Journal *j = calloc(1, sizeof(Journal));
+  if (!j || !(j->path = journalPath(b->path))) {
+    free(j);
+    return NULL;
+  }
+  j->buffer = b;
+
+  JournalHeader want = journalIdentity(b->path);
+  int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  unsigned char *old = NULL;
+  size_t size = 0;
+  if (fd >= 0 && !fstat(fd, &st) && st.st_size > 0 &&
+      (old = malloc((size_t)st.st_size))) {
+    ssize_t n;
+    while (size < (size_t)st.st_size &&
+           (n = read(fd, old + size, (size_t)st.st_size - size)) > 0)
+      size += (size_t)n;
+  }
+  if (fd >= 0)
+    close(fd);
+
+  size_t keep = 0;
+  if (size >= sizeof(JournalHeader) && !memcmp(old, &want, sizeof(want))) {
+    keep = sizeof(want) +
+           journalReplay(b, old + sizeof(want), size - sizeof(want));
+  } else if (size) {
+    size_t n = strlen(j->path) + sizeof(".old");
+    char *aside = malloc(n);
+    if (aside) {
+      snprintf(aside, n, "%s.old", j->path);
+      rename(j->path, aside);
+      free(aside);
+    }
+  }
+  free(old);
+
+  // Anything past the last good record is a torn write; cut it off.
+  j->fd = open(j->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (j->fd < 0 || ftruncate(j->fd, (off_t)keep) ||
+      lseek(j->fd, 0, SEEK_END) != (off_t)keep ||
+      (!keep && !journalWriteAll(j->fd, &want, sizeof(want))) ||
+      !buffer_listen(b, (BufferListener){NULL, journalAfterEdit, j,
+                                         journalSaved})) {
+    if (j->fd >= 0)
+      close(j->fd);
+    free(j->path);
+    free(j);
+    return NULL;
+  }
+  j->unsynced = true;
+  journal_flush(j);
+  return j;
+}
+
+// Makes everything durable and stops journaling. The journal is removed
+// if the buffer has nothing unsaved in it.
+static inline void journal_close(Journal *j) {
+  if (!j)
+    return;
+  buffer_unlisten(j->buffer, j);
+  pool_wait(pool_shared(), &j->syncing);
+  journal_flush(j);
+  pool_wait(pool_shared(), &j->syncing);
+  close(j->fd);
+  if (!buffer_modified(j->buffer))
+    unlink(j->path);
+  free(j->pending);
+  free(j->path);
+  free(j);
+}
+
+#endif
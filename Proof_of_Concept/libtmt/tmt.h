@@ -38,6 +38,22 @@
 #define TMT_INVALID_CHAR ((wchar_t)0xfffd)
 #endif
 
+/**** TRACING HOOKS */
+/* Define both to time tmt_write(), e.g. by including trace.h first. */
+#ifndef TMT_TRACE_BEGIN
+#define TMT_TRACE_BEGIN(span, name)
+#define TMT_TRACE_END(span)
+#endif
+
+/**** ALLOCATION HOOKS */
+/* Define all four to count or redirect allocations, e.g. with alloc.h. */
+#ifndef TMT_MALLOC
+#define TMT_MALLOC(n) malloc(n)
+#define TMT_CALLOC(c, n) calloc(c, n)
+#define TMT_REALLOC(p, n) realloc(p, n)
+#define TMT_FREE(p) free(p)
+#endif
+
 /**** INPUT SEQUENCES */
 #define TMT_KEY_UP             "\033[A"
 #define TMT_KEY_DOWN           "\033[B"
@@ -222,7 +238,7 @@ struct TMT{
     TMTPOINT curs, oldcurs;
     TMTATTRS attrs, oldattrs;
 
-    bool dirty, acs, ignored;
+    bool dirty, acs, ignored, wrap;
     TMTSCREEN screen;
     TMTLINE *tabs;
 
@@ -430,35 +446,39 @@ handlechar(TMT *vt, char i)
     #define ON(S, C, A) if (vt->state == (S) && strchr(C, i)){ A; return true;}
     #define DO(S, C, A) ON(S, C, consumearg(vt); if (!vt->ignored) {A;} \
                                  fixcursor(vt); resetparser(vt););
+    /* Moving the cursor disarms a pending wrap; anything else, like SGR
+     * between the last column and the next character, leaves it armed.
+     */
+    #define MV(S, C, A) DO(S, C, vt->wrap = false; A)
 
     DO(S_NUL, "\x07",       CB(vt, TMT_MSG_BELL, NULL))
-    DO(S_NUL, "\x08",       if (c->c) c->c--)
-    DO(S_NUL, "\x09",       while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
-    DO(S_NUL, "\x0a",       c->r < s->nline - 1? (void)c->r++ : scrup(vt, 0, 1))
-    DO(S_NUL, "\x0d",       c->c = 0)
+    MV(S_NUL, "\x08",       if (c->c) c->c--)
+    MV(S_NUL, "\x09",       while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
+    MV(S_NUL, "\x0a",       c->r < s->nline - 1? (void)c->r++ : scrup(vt, 0, 1))
+    MV(S_NUL, "\x0d",       c->c = 0)
     ON(S_NUL, "\x1b",       vt->state = S_ESC)
     ON(S_ESC, "\x1b",       vt->state = S_ESC)
     DO(S_ESC, "H",          t[c->c].c = L'*')
     DO(S_ESC, "7",          vt->oldcurs = vt->curs; vt->oldattrs = vt->attrs)
-    DO(S_ESC, "8",          vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
+    MV(S_ESC, "8",          vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
     ON(S_ESC, "+*()",       vt->ignored = true; vt->state = S_ARG)
     DO(S_ESC, "c",          tmt_reset(vt))
-    DO(S_ESC, "M",          if (c->r) c->r--)
+    MV(S_ESC, "M",          if (c->r) c->r--)
     ON(S_ESC, "[",          vt->state = S_ARG)
     ON(S_ARG, "\x1b",       vt->state = S_ESC)
     ON(S_ARG, ";",          consumearg(vt))
     ON(S_ARG, "?",          (void)0)
     ON(S_ARG, "0123456789", vt->arg = vt->arg * 10 + atoi(cs))
-    DO(S_ARG, "A",          c->r = MAX(c->r - P1(0), 0))
-    DO(S_ARG, "B",          c->r = MIN(c->r + P1(0), s->nline - 1))
-    DO(S_ARG, "C",          c->c = MIN(c->c + P1(0), s->ncol - 1))
-    DO(S_ARG, "D",          c->c = MIN(c->c - P1(0), c->c))
-    DO(S_ARG, "E",          c->c = 0; c->r = MIN(c->r + P1(0), s->nline - 1))
-    DO(S_ARG, "F",          c->c = 0; c->r = MAX(c->r - P1(0), 0))
-    DO(S_ARG, "G",          c->c = MIN(P1(0) - 1, s->ncol - 1))
-    DO(S_ARG, "d",          c->r = MIN(P1(0) - 1, s->nline - 1))
-    DO(S_ARG, "Hf",         c->r = P1(0) - 1; c->c = P1(1) - 1)
-    DO(S_ARG, "I",          while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
+    MV(S_ARG, "A",          c->r = MAX(c->r - P1(0), 0))
+    MV(S_ARG, "B",          c->r = MIN(c->r + P1(0), s->nline - 1))
+    MV(S_ARG, "C",          c->c = MIN(c->c + P1(0), s->ncol - 1))
+    MV(S_ARG, "D",          c->c = MIN(c->c - P1(0), c->c))
+    MV(S_ARG, "E",          c->c = 0; c->r = MIN(c->r + P1(0), s->nline - 1))
+    MV(S_ARG, "F",          c->c = 0; c->r = MAX(c->r - P1(0), 0))
+    MV(S_ARG, "G",          c->c = MIN(P1(0) - 1, s->ncol - 1))
+    MV(S_ARG, "d",          c->r = MIN(P1(0) - 1, s->nline - 1))
+    MV(S_ARG, "Hf",         c->r = P1(0) - 1; c->c = P1(1) - 1)
+    MV(S_ARG, "I",          while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
     DO(S_ARG, "J",          ed(vt))
     DO(S_ARG, "K",          el(vt))
     DO(S_ARG, "L",          scrdn(vt, c->r, P1(0)))
@@ -467,7 +487,7 @@ handlechar(TMT *vt, char i)
     DO(S_ARG, "S",          scrup(vt, 0, P1(0)))
     DO(S_ARG, "T",          scrdn(vt, 0, P1(0)))
     DO(S_ARG, "X",          clearline(vt, l, c->c, P1(0)))
-    DO(S_ARG, "Z",          while (c->c && t[--c->c].c != L'*'))
+    MV(S_ARG, "Z",          while (c->c && t[--c->c].c != L'*'))
     DO(S_ARG, "b",          rep(vt));
     DO(S_ARG, "c",          CB(vt, TMT_MSG_ANSWER, "\033[?6c"))
     DO(S_ARG, "g",          if (P0(0) == 3) clearline(vt, vt->tabs, 0, s->ncol))
@@ -477,7 +497,7 @@ handlechar(TMT *vt, char i)
     DO(S_ARG, "i",          (void)0)
     DO(S_ARG, "l",          if (P0(0) == 25) CB(vt, TMT_MSG_CURSOR, "f"))
     DO(S_ARG, "s",          vt->oldcurs = vt->curs; vt->oldattrs = vt->attrs)
-    DO(S_ARG, "u",          vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
+    MV(S_ARG, "u",          vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
     DO(S_ARG, "@",          ich(vt))
 
     return resetparser(vt), false;
@@ -493,7 +513,8 @@ notify(TMT *vt, bool update, bool moved)
 static inline TMTLINE *
 allocline(TMT *vt, TMTLINE *o, size_t n, size_t pc)
 {
-    TMTLINE *l = (TMTLINE *)realloc(o, sizeof(TMTLINE) + n * sizeof(TMTCHAR));
+    TMTLINE *l = (TMTLINE *)TMT_REALLOC(o,
+                                        sizeof(TMTLINE) + n * sizeof(TMTCHAR));
     if (!l) return NULL;
 
     clearline(vt, l, pc, n);
@@ -504,19 +525,19 @@ static inline void
 freelines(TMT *vt, size_t s, size_t n, bool screen)
 {
     for (size_t i = s; vt->screen.lines && i < s + n; i++){
-        free(vt->screen.lines[i]);
+        TMT_FREE(vt->screen.lines[i]);
         vt->screen.lines[i] = NULL;
     }
-    if (screen) free(vt->screen.lines);
+    if (screen) TMT_FREE(vt->screen.lines);
 }
 
 static inline TMT *
 tmt_open(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
          const wchar_t *acs)
 {
-    TMT *vt = (TMT*)calloc(1, sizeof(TMT));
+    TMT *vt = (TMT*)TMT_CALLOC(1, sizeof(TMT));
     if (!nline || !ncol || !vt){
-        free(vt);
+        TMT_FREE(vt);
         return NULL;
     }
 
@@ -536,9 +557,9 @@ tmt_open(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
 static inline void
 tmt_close(TMT *vt)
 {
-    free(vt->tabs);
+    TMT_FREE(vt->tabs);
     freelines(vt, 0, vt->screen.nline, true);
-    free(vt);
+    TMT_FREE(vt);
 }
 
 static inline bool
@@ -548,7 +569,7 @@ tmt_resize(TMT *vt, size_t nline, size_t ncol)
     if (nline < vt->screen.nline)
         freelines(vt, nline, vt->screen.nline - nline, false);
 
-    TMTLINE **l = (TMTLINE **)realloc(vt->screen.lines, nline * sizeof(TMTLINE *));
+    TMTLINE **l = (TMTLINE **)TMT_REALLOC(vt->screen.lines, nline * sizeof(TMTLINE *));
     if (!l) return false;
 
     size_t pc = vt->screen.ncol;
@@ -567,11 +588,12 @@ tmt_resize(TMT *vt, size_t nline, size_t ncol)
     vt->screen.nline = nline;
 
     vt->tabs = allocline(vt, vt->tabs, ncol, 0);
-    if (!vt->tabs) return free(l), false;
+    if (!vt->tabs) return TMT_FREE(l), false;
     vt->tabs->chars[0].c = vt->tabs->chars[ncol - 1].c = L'*';
     for (size_t i = 0; i < ncol; i++) if (i % TAB == 0)
         vt->tabs->chars[i].c = L'*';
 
+    vt->wrap = false;
     fixcursor(vt);
     dirtylines(vt, 0, nline);
     notify(vt, true, true);
@@ -589,21 +611,28 @@ writecharatcurs(TMT *vt, wchar_t w)
     if (wcwidth(w) < 0) return;
     #endif
 
+    /* Like xterm, writing the last column only arms the wrap; it happens
+     * when the next character arrives. Otherwise filling the bottom-right
+     * cell would scroll the whole screen.
+     */
+    if (vt->wrap){
+        vt->wrap = false;
+        c->c = 0;
+        c->r++;
+        if (c->r >= s->nline){
+            c->r = s->nline - 1;
+            scrup(vt, 0, 1);
+        }
+    }
+
     CLINE(vt)->chars[vt->curs.c].c = w;
     CLINE(vt)->chars[vt->curs.c].a = vt->attrs;
     CLINE(vt)->dirty = vt->dirty = true;
 
     if (c->c < s->ncol - 1)
         c->c++;
-    else{
-        c->c = 0;
-        c->r++;
-    }
-
-    if (c->r >= s->nline){
-        c->r = s->nline - 1;
-        scrup(vt, 0, 1);
-    }
+    else
+        vt->wrap = true;
 }
 
 static inline size_t
@@ -625,6 +654,7 @@ getmbchar(TMT *vt)
 static inline void
 tmt_write(TMT *vt, const char *s, size_t n)
 {
+    TMT_TRACE_BEGIN(span, "tmt_write");
     TMTPOINT oc = vt->curs;
     n = n? n : strlen(s);
 
@@ -647,6 +677,7 @@ tmt_write(TMT *vt, const char *s, size_t n)
     }
 
     notify(vt, vt->dirty, memcmp(&oc, &vt->curs, sizeof(oc)) != 0);
+    TMT_TRACE_END(span);
 }
 
 static inline const TMTSCREEN *
@@ -671,7 +702,7 @@ tmt_clean(TMT *vt)
 static inline void
 tmt_reset(TMT *vt)
 {
-    vt->curs.r = vt->curs.c = vt->oldcurs.r = vt->oldcurs.c = vt->acs = (bool)0;
+    vt->curs.r = vt->curs.c = vt->oldcurs.r = vt->oldcurs.c = vt->acs = vt->wrap = (bool)0;
     resetparser(vt);
     vt->attrs = vt->oldattrs = defattrs;
     memset(&vt->ms, 0, sizeof(vt->ms));
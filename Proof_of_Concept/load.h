@@ -0,0 +1,76 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+#include "buffer.h"
+#include "pool.h"
+
+// Opening a file without making the first frame wait for it. load_open()
+// reads only the file's head (BUFFER_HEAD_BYTES), which is more than any
+// screen shows, and reads the rest on the pool; load_poll() adds it to the
+// buffer once it's all there. Meanwhile the buffer can be shown, scrolled
+// and searched like any other, but not edited.
+//
+// The rest is read a chunk (BUFFER_LOAD_CHUNK) per background job, so
+// it's only ever read by workers with nothing better to do, and never by
+// the UI thread while it waits on the pool for something else.
+//
+// Startup goes:
+//
+//   tui_init();
+//   FileLoad *load = load_open(path);
+//   ...build the components, with a text view over load->buffer...
+//   render_window(); // The first frame.
+//   for (;;) { load_poll(load); ...handle_event(), render_window()... }
+//
+// Whatever else startup wants (a finder's walk, say) is already on the
+// pool. Open a journal (see journal.h) only once load_poll() says the
+// load is done, since it replays onto the whole file.
+
+typedef struct {
+  Buffer *buffer; // The caller's to close, after load_free().
+  BufferLoadJob *job; // NULL once done.
+  PoolGroup running;
+  atomic_size_t next; // The next chunk for a job to take.
+  bool failed; // The rest couldn't be read; the buffer stays read-only.
+} FileLoad;
+
+static void loadRun(void *arg) {
+  FileLoad *l = arg;
+  buffer_load_run(l->job, atomic_fetch_add(&l->next, 1));
+}
+
+static inline FileLoad *load_open(const char *path) {
+  FileLoad *l = calloc(1, sizeof(FileLoad));
+  if (!l)
+    return NULL;
+  if (!(l->buffer = buffer_open_head(path, &l->job))) {
+    free(l);
+    return NULL;
+  }
+  for (size_t i = 0; l->job && i < l->job->count; i++)
+    pool_submit_background(pool_shared(), &l->running, loadRun, l);
+  return l;
+}
+
+// Adds the rest of the file once it's been read. Never blocks; returns
+// whether the load is over, read or not.
+static inline bool load_poll(FileLoad *l) {
+  if (!l->job)
+    return true;
+  if (!pool_idle(&l->running))
+    return false;
+  l->failed = !buffer_load_finish(l->buffer, l->job);
+  l->job = NULL;
+  return true;
+}
+
+// Waits for the rest of the file if it's still being read, and drops it.
+static inline void load_free(FileLoad *l) {
+  if (!l)
+    return;
+  pool_wait(pool_shared(), &l->running);
+  buffer_load_free(l->job);
+  free(l);
+}
+
+#endif
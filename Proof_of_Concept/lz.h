@@ -0,0 +1,185 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// A small LZ77 codec in the style of LZ4, for squeezing text that sits in
+// memory unused. Unpacking is a loop of memcpys; packing searches harder
+// for matches than LZ4 does, since it happens in the background.
+//
+// The output is a run of sequences, each a token byte (literal count in
+// the high four bits, match length less LZ_MIN_MATCH in the low four),
+// the rest of the literal count if it didn't fit, the literals, then a
+// two byte little-endian distance back and the rest of the match length.
+// A count that doesn't fit its four bits goes on in bytes of 255 and one
+// less. The last sequence has literals only and ends the input.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 0xffff
+#define LZ_HASH_BITS 14
+#define LZ_MAX_CHAIN 32
+
+// Room lz_compress() may need for n bytes.
+static inline size_t lz_bound(size_t n) { return n + n / 255 + 16; }
+
+static inline uint32_t lzRead32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t lzHash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline unsigned char *lzPutCount(unsigned char *out, size_t n) {
+  for (; n >= 255; n -= 255)
+    *out++ = 255;
+  *out++ = (unsigned char)n;
+  return out;
+}
+
+static inline unsigned char *lzPutLiterals(unsigned char *out,
+                                           unsigned char *token,
+                                           const char *p, size_t n) {
+  *token = (unsigned char)((n < 15 ? n : 15) << 4);
+  if (n >= 15)
+    out = lzPutCount(out, n - 15);
+  memcpy(out, p, n);
+  return out + n;
+}
+
+// The longest match for in + i among earlier positions with the same hash,
+// following the chain back at most LZ_MAX_CHAIN steps.
+static inline size_t lzLongest(const char *in, size_t n, size_t i,
+                               const uint32_t *table, const uint16_t *chain,
+                               size_t *from) {
+  uint32_t v = lzRead32(in + i);
+  size_t best = 0, at = table[lzHash(v)];
+  for (int steps = 0; at-- && i - at <= LZ_MAX_DISTANCE &&
+                      steps < LZ_MAX_CHAIN;
+       steps++) {
+    // A match as long as best can only be beaten if it goes on past it.
+    if (lzRead32(in + at) == v &&
+        (best < LZ_MIN_MATCH ||
+         (i + best < n && in[at + best] == in[i + best]))) {
+      size_t len = LZ_MIN_MATCH;
+      while (i + len < n && in[at + len] == in[i + len])
+        len++;
+      if (len > best) {
+        best = len;
+        *from = at;
+      }
+    }
+    size_t back = chain[at & LZ_MAX_DISTANCE];
+    if (!back || back > at)
+      break;
+    at -= back - 1;
+  }
+  return best;
+}
+
+static inline void lzInsert(const char *in, size_t i, uint32_t *table,
+                            uint16_t *chain) {
+  uint32_t *slot = &table[lzHash(lzRead32(in + i))];
+  size_t back = *slot ? i + 1 - *slot : 0;
+  chain[i & LZ_MAX_DISTANCE] = (uint16_t)(back > LZ_MAX_DISTANCE ? 0 : back);
+  *slot = (uint32_t)(i + 1);
+}
+
+// Compresses n bytes into out, which needs lz_bound(n) bytes of room, and
+// returns how many it took. Each position is hashed on its first four
+// bytes, and the positions sharing a hash are chained, so the longest of
+// the last few matches is taken.
+static inline size_t lz_compress(const char *in, size_t n, char *out) {
+  uint32_t table[1 << LZ_HASH_BITS]; // Position + 1; 0 is none.
+  uint16_t chain[LZ_MAX_DISTANCE + 1]; // Distance to the one before.
+  memset(table, 0, sizeof(table));
+  unsigned char *o = (unsigned char *)out;
+  size_t anchor = 0;
+  for (size_t i = 0; n >= LZ_MIN_MATCH && i <= n - LZ_MIN_MATCH;) {
+    size_t from = 0;
+    size_t len = lzLongest(in, n, i, table, chain, &from);
+    lzInsert(in, i, table, chain);
+    if (len < LZ_MIN_MATCH) {
+      i++;
+      continue;
+    }
+
+    unsigned char *token = o++;
+    o = lzPutLiterals(o, token, in + anchor, i - anchor);
+    size_t distance = i - from;
+    *o++ = (unsigned char)(distance & 0xff);
+    *o++ = (unsigned char)(distance >> 8);
+    size_t extra = len - LZ_MIN_MATCH;
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    if (extra >= 15)
+      o = lzPutCount(o, extra - 15);
+
+    for (size_t j = i + 1; j < i + len && j <= n - LZ_MIN_MATCH; j++)
+      lzInsert(in, j, table, chain);
+    i += len;
+    anchor = i;
+  }
+  unsigned char *token = o++;
+  o = lzPutLiterals(o, token, in + anchor, n - anchor);
+  return (size_t)(o - (unsigned char *)out);
+}
+
+static inline bool lzGetCount(const unsigned char **p,
+                              const unsigned char *end, size_t *n) {
+  unsigned char c;
+  do {
+    if (*p == end)
+      return false;
+    c = *(*p)++;
+    *n += c;
+  } while (c == 255);
+  return true;
+}
+
+// Decompresses n bytes of lz_compress() output into exactly size bytes at
+// out. Returns false, having written no further than size, if the input
+// is damaged or doesn't come to size.
+static inline bool lz_decompress(const char *in, size_t n, char *out,
+                                 size_t size) {
+  const unsigned char *p = (const unsigned char *)in, *end = p + n;
+  size_t o = 0;
+  while (p < end) {
+    unsigned token = *p++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !lzGetCount(&p, end, &literals))
+      return false;
+    if (literals > (size_t)(end - p) || literals > size - o)
+      return false;
+    memcpy(out + o, p, literals);
+    p += literals;
+    o += literals;
+    if (p == end)
+      break;
+
+    if (end - p < 2)
+      return false;
+    size_t distance = p[0] | (size_t)p[1] << 8;
+    p += 2;
+    size_t len = token & 15;
+    if (len == 15 && !lzGetCount(&p, end, &len))
+      return false;
+    len += LZ_MIN_MATCH;
+    if (!distance || distance > o || len > size - o)
+      return false;
+    if (distance >= len) {
+      memcpy(out + o, out + o - distance, len);
+    } else {
+      for (size_t i = 0; i < len; i++)
+        out[o + i] = out[o + i - distance];
+    }
+    o += len;
+  }
+  return o == size;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include "buffer.h"
+#include "tui.h"
+
+#include <time.h>
+
+// Keyboard macros. While one is being recorded, every key a component
+// handles is kept. Replaying feeds the keys straight to the component's
+// onKeypress, run after run, without going through handle_event() or
+// rendering anything in between; the screen is drawn once at the end.
+// Whatever keeps derived state off the buffer (the bracket index, say)
+// only catches up when it's next asked, so that's once too.
+//
+// A replay is one undo group, however many runs it makes. Since nothing
+// is drawn while it goes, a progress bar is written straight to the
+// terminal's bottom row.
+
+#define MACRO_MAX_KEYS 4096
+#define MACRO_PROGRESS_MS 100
+
+typedef struct {
+  KeyEvent keys[MACRO_MAX_KEYS];
+  size_t num_keys;
+  bool recording, replaying;
+} Macro;
+
+typedef void (*MacroProgress)(size_t done, size_t total, void *ctx);
+
+static inline void macro_start(Macro *m) {
+  m->num_keys = 0;
+  m->recording = true;
+}
+
+static inline void macro_stop(Macro *m) { m->recording = false; }
+
+// Call with each key the component handled.
+static inline void macro_record(Macro *m, KeyEvent event) {
+  if (m->recording && !m->replaying && m->num_keys < MACRO_MAX_KEYS)
+    m->keys[m->num_keys++] = event;
+}
+
+// Draws "done/total" and a bar on the terminal's bottom row, leaving the
+// cursor and the screen model alone.
+static inline void macro_show_progress(size_t done, size_t total, void *ctx) {
+  (void)ctx;
+  if (!_tui_active || !tui_context->window_width || !total)
+    return;
+  char label[64], line[512];
+  int len = snprintf(label, sizeof(label), " %zu/%zu ", done, total);
+  int n = snprintf(line, sizeof(line), "\x1b" "7\x1b[%u;1H\x1b[7m%s",
+                   (unsigned)tui_context->window_height, label);
+  size_t width = bufferMin(tui_context->window_width, 256);
+  size_t bar = width > (size_t)len ? width - (size_t)len : 0;
+  for (size_t i = 0; i < bar; i++)
+    line[n++] = i < bar * done / total ? '#' : ' ';
+  n += snprintf(line + n, sizeof(line) - (size_t)n, "\x1b[0m\x1b" "8");
+  tuiWrite(line, (size_t)n);
+}
+
+static inline long macroElapsedMs(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long)(now.tv_sec - since->tv_sec) * 1000 +
+         (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Replays the macro into target up to times times, grouping the edits to
+// buffer (if given) as one undo step. Stops early if a whole run goes
+// unhandled or the editor is told to exit. Returns the runs made.
+static inline size_t macro_replay(Macro *m, Component *target,
+                                  Buffer *buffer, size_t times,
+                                  MacroProgress progress, void *ctx) {
+  if (m->recording || m->replaying || !m->num_keys || !target->onKeypress)
+    return 0;
+  m->replaying = true;
+  if (buffer)
+    buffer_begin_group(buffer);
+  struct timespec shown;
+  clock_gettime(CLOCK_MONOTONIC, &shown);
+  size_t run = 0;
+  for (; run < times && !tui_context->_exiting; run++) {
+    bool handled = false;
+    for (size_t i = 0; i < m->num_keys; i++)
+      handled |= target->onKeypress(target, m->keys[i]) != 0;
+    if (!handled)
+      break;
+    if (progress && macroElapsedMs(&shown) >= MACRO_PROGRESS_MS) {
+      progress(run + 1, times, ctx);
+      clock_gettime(CLOCK_MONOTONIC, &shown);
+    }
+  }
+  if (buffer)
+    buffer_end_group(buffer);
+  m->replaying = false;
+  return run;
+}
+
+#endif
@@ -0,0 +1,795 @@
+#ifndef MINIMAP_H
+#define MINIMAP_H
+
+#include "buffer.h"
+#include "pool.h"
+#include "textview.h"
+#include "tui.h"
+
+// A narrow overview of a whole buffer in braille dots: each dot is a few
+// columns of one or more lines, set if there's any text there. Rows are
+// colored for search hits and comment lines, and the part the text view
+// shows is shaded.
+//
+// Every line is boiled down to a 16-bit mask of which dot columns have
+// text, plus a couple of flags, kept in pages of lines with per-block sums.
+// Squeezing a buffer into the rows on screen then only ever reads those
+// sums, never the text. Edits resummarize just the lines they touch; the
+// first pass over a file, a new search query, or an edit too big to do on
+// the spot is done on the pool over a snapshot, in parallel chunks, and
+// the edits made meanwhile are replayed onto its result.
+
+#define MINIMAP_PAGE 4096
+#define MINIMAP_BLOCK 64
+#define MINIMAP_DOTS 16       // Dot columns, two per cell.
+#define MINIMAP_DOT_COLUMNS 4 // Text columns per dot column.
+#define MINIMAP_SYNC_LINES 1024
+#define MINIMAP_MAX_LOG 4096
+#define MINIMAP_CHUNK ((size_t)4 << 20)
+#define MINIMAP_MAX_QUERY 256
+#define MINIMAP_MAX_CHUNKS 1024
+
+enum {
+  MINIMAP_COMMENT = 1,
+  MINIMAP_HIT = 2,
+  MINIMAP_STALE = 4, // Not summarized yet.
+};
+
+typedef struct {
+  uint16_t mask;
+  uint8_t flags;
+} MinimapLine;
+
+typedef struct {
+  uint16_t mask;
+  uint32_t lines, comments, hits;
+} MinimapSum;
+
+typedef struct {
+  size_t count;
+  MinimapSum blocks[MINIMAP_PAGE / MINIMAP_BLOCK];
+  MinimapLine lines[MINIMAP_PAGE];
+} MinimapPage;
+
+typedef struct {
+  size_t line, removed, inserted;
+} MinimapEdit;
+
+struct MinimapJob;
+
+typedef struct {
+  struct MinimapJob *job;
+  size_t first_span, end_span;
+  MinimapLine *lines;
+  size_t count, cap;
+  bool failed;
+} MinimapChunk;
+
+typedef struct MinimapJob {
+  BufferSnapshot *snapshot;
+  char query[MINIMAP_MAX_QUERY];
+  size_t query_len;
+
+  size_t num_chunks;
+  MinimapChunk chunks[MINIMAP_MAX_CHUNKS];
+  PoolGroup chunking;
+
+  // Output.
+  MinimapPage **pages;
+  size_t num_pages, num_lines;
+  bool failed;
+} MinimapJob;
+
+typedef struct Minimap {
+  Buffer *buffer;
+  TextView *view; // Whose viewport gets shaded, if any.
+  char query[MINIMAP_MAX_QUERY];
+  size_t query_len;
+
+  bool ready; // Whether the pages describe the buffer yet.
+  MinimapPage **pages;
+  size_t num_pages, num_lines;
+  // The line each page starts at, and one past the last, for finding a
+  // line's page by bisection. Worked out again once pages have changed.
+  size_t *page_starts;
+  bool starts_valid;
+
+  MinimapJob *job;
+  PoolGroup running;
+  bool rebuild;
+  MinimapEdit *log;
+  size_t log_count;
+  bool log_overflow;
+
+  // What was last squeezed into dot rows, kept until something changes.
+  MinimapSum *rows;
+  size_t num_rows, lines_per_row, rows_for;
+  bool rows_stale;
+} Minimap;
+
+static inline bool minimapContains(const char *hay, size_t n,
+                                   const char *needle, size_t m) {
+  if (!m || m > n)
+    return false;
+  for (const char *p = hay, *end = hay + n - m + 1;
+       (p = memchr(p, needle[0], (size_t)(end - p))); p++)
+    if (!memcmp(p, needle, m))
+      return true;
+  return false;
+}
+
+static inline MinimapLine minimapSummarize(const char *text, size_t len,
+                                           const char *query,
+                                           size_t query_len) {
+  MinimapLine out = {0, 0};
+  size_t col = 0;
+  for (size_t i = 0; i < len && col < MINIMAP_DOTS * MINIMAP_DOT_COLUMNS;
+       i++) {
+    unsigned char c = (unsigned char)text[i];
+    if (c == '\t') {
+      col = (col / 8 + 1) * 8;
+    } else if ((c & 0xC0) != 0x80) {
+      if (c > ' ')
+        out.mask |= (uint16_t)(1u << (col / MINIMAP_DOT_COLUMNS));
+      col++;
+    }
+  }
+  size_t i = 0;
+  while (i < len && (text[i] == ' ' || text[i] == '\t'))
+    i++;
+  // Whatever most languages start a comment line with.
+  if (i < len && (text[i] == '#' || text[i] == ';' || text[i] == '*' ||
+                  (i + 1 < len && text[i] == '/' &&
+                   (text[i + 1] == '/' || text[i + 1] == '*')) ||
+                  (i + 1 < len && text[i] == '-' && text[i + 1] == '-')))
+    out.flags |= MINIMAP_COMMENT;
+  if (minimapContains(text, len, query, query_len))
+    out.flags |= MINIMAP_HIT;
+  return out;
+}
+
+static inline void minimapAdd(MinimapSum *sum, MinimapLine line) {
+  sum->mask |= line.mask;
+  sum->lines++;
+  sum->comments += (line.flags & MINIMAP_COMMENT) != 0;
+  sum->hits += (line.flags & MINIMAP_HIT) != 0;
+}
+
+static inline void minimapMerge(MinimapSum *sum, const MinimapSum *more) {
+  sum->mask |= more->mask;
+  sum->lines += more->lines;
+  sum->comments += more->comments;
+  sum->hits += more->hits;
+}
+
+static inline void minimapSumBlock(MinimapPage *p, size_t block) {
+  MinimapSum *sum = &p->blocks[block];
+  *sum = (MinimapSum){0};
+  size_t end = bufferMin(p->count, (block + 1) * MINIMAP_BLOCK);
+  for (size_t i = block * MINIMAP_BLOCK; i < end; i++)
+    minimapAdd(sum, p->lines[i]);
+}
+
+static inline void minimapSumPage(MinimapPage *p) {
+  for (size_t b = 0; b < MINIMAP_PAGE / MINIMAP_BLOCK; b++)
+    minimapSumBlock(p, b);
+}
+
+////////////////////////
+// Pages of summaries //
+////////////////////////
+
+static inline MinimapPage *minimapNewPage(void) {
+  MinimapPage *p = tui_malloc(ALLOC_COMPONENT, sizeof(MinimapPage));
+  if (p)
+    p->count = 0;
+  return p;
+}
+
+static inline void minimapFreePages(MinimapPage **pages, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    tui_free(ALLOC_COMPONENT, pages[i]);
+  tui_free(ALLOC_COMPONENT, pages);
+}
+
+static inline void minimapIndexPages(Minimap *m) {
+  size_t *starts = tui_realloc(ALLOC_COMPONENT, m->page_starts,
+                               (m->num_pages + 1) * sizeof(size_t));
+  if (!starts)
+    return;
+  starts[0] = 0;
+  for (size_t p = 0; p < m->num_pages; p++)
+    starts[p + 1] = starts[p] + m->pages[p]->count;
+  m->page_starts = starts;
+  m->starts_valid = true;
+}
+
+// Finds the page holding line, or the end of the last page for the line
+// one past the end. Walks the pages if there's no index to search.
+static inline size_t minimapLocate(Minimap *m, size_t *line) {
+  if (!m->starts_valid)
+    minimapIndexPages(m);
+  size_t p = 0;
+  if (!m->starts_valid || !m->num_pages) {
+    while (p + 1 < m->num_pages && *line >= m->pages[p]->count)
+      *line -= m->pages[p++]->count;
+    return p;
+  }
+  // The last page starting at or before line.
+  size_t hi = m->num_pages - 1;
+  while (p < hi) {
+    size_t mid = p + (hi - p + 1) / 2;
+    if (m->page_starts[mid] <= *line)
+      p = mid;
+    else
+      hi = mid - 1;
+  }
+  *line -= m->page_starts[p];
+  return p;
+}
+
+// Lays n lines out as full pages, for putting in between others.
+static inline MinimapPage **minimapStalePages(size_t n, size_t *num) {
+  *num = (n + MINIMAP_PAGE - 1) / MINIMAP_PAGE;
+  MinimapPage **pages =
+      tui_calloc(ALLOC_COMPONENT, *num ? *num : 1, sizeof(MinimapPage *));
+  for (size_t i = 0; pages && i < *num; i++) {
+    if (!(pages[i] = minimapNewPage())) {
+      minimapFreePages(pages, i);
+      return NULL;
+    }
+    pages[i]->count = bufferMin(MINIMAP_PAGE, n - i * MINIMAP_PAGE);
+    for (size_t j = 0; j < pages[i]->count; j++)
+      pages[i]->lines[j] = (MinimapLine){0, MINIMAP_STALE};
+    minimapSumPage(pages[i]);
+  }
+  return pages;
+}
+
+// Replaces pages [at, at + remove) with the given ones.
+static inline bool minimapSplice(Minimap *m, size_t at, size_t remove,
+                                 MinimapPage **pages, size_t n) {
+  size_t total = m->num_pages - remove + n;
+  MinimapPage **all = tui_malloc(ALLOC_COMPONENT,
+                                 (total ? total : 1) * sizeof(MinimapPage *));
+  if (!all)
+    return false;
+  if (at)
+    memcpy(all, m->pages, at * sizeof(MinimapPage *));
+  if (n)
+    memcpy(all + at, pages, n * sizeof(MinimapPage *));
+  if (m->num_pages > at + remove)
+    memcpy(all + at + n, m->pages + at + remove,
+           (m->num_pages - at - remove) * sizeof(MinimapPage *));
+  for (size_t i = at; i < at + remove; i++)
+    tui_free(ALLOC_COMPONENT, m->pages[i]);
+  tui_free(ALLOC_COMPONENT, m->pages);
+  m->pages = all;
+  m->num_pages = total;
+  m->starts_valid = false;
+  return true;
+}
+
+static inline bool minimapInsertLines(Minimap *m, size_t line, size_t n) {
+  if (!n)
+    return true;
+  size_t at = line, p = minimapLocate(m, &at);
+  MinimapPage *page = m->num_pages ? m->pages[p] : NULL;
+  if (page && page->count + n <= MINIMAP_PAGE) {
+    memmove(page->lines + at + n, page->lines + at,
+            (page->count - at) * sizeof(MinimapLine));
+    for (size_t i = at; i < at + n; i++)
+      page->lines[i] = (MinimapLine){0, MINIMAP_STALE};
+    page->count += n;
+    minimapSumPage(page);
+    m->num_lines += n;
+    m->starts_valid = false;
+    return true;
+  }
+
+  // Cut the page in two and put whole pages of new lines in between.
+  size_t num;
+  MinimapPage **fresh = minimapStalePages(n, &num);
+  MinimapPage *tail = page ? minimapNewPage() : NULL;
+  MinimapPage **parts =
+      fresh ? tui_malloc(ALLOC_COMPONENT, (num + 2) * sizeof(MinimapPage *))
+            : NULL;
+  if (!fresh || (page && !tail) || !parts) {
+    if (fresh)
+      minimapFreePages(fresh, num);
+    tui_free(ALLOC_COMPONENT, tail);
+    tui_free(ALLOC_COMPONENT, parts);
+    return false;
+  }
+  size_t k = 0;
+  if (page) {
+    MinimapPage *head = minimapNewPage();
+    if (!head) {
+      minimapFreePages(fresh, num);
+      tui_free(ALLOC_COMPONENT, tail);
+      tui_free(ALLOC_COMPONENT, parts);
+      return false;
+    }
+    head->count = at;
+    memcpy(head->lines, page->lines, at * sizeof(MinimapLine));
+    minimapSumPage(head);
+    parts[k++] = head;
+  }
+  memcpy(parts + k, fresh, num * sizeof(MinimapPage *));
+  k += num;
+  if (tail) {
+    tail->count = page->count - at;
+    memcpy(tail->lines, page->lines + at, tail->count * sizeof(MinimapLine));
+    minimapSumPage(tail);
+    parts[k++] = tail;
+  }
+  tui_free(ALLOC_COMPONENT, fresh);
+  bool ok = minimapSplice(m, p, page ? 1 : 0, parts, k);
+  if (ok)
+    m->num_lines += n;
+  else
+    for (size_t i = 0; i < k; i++)
+      tui_free(ALLOC_COMPONENT, parts[i]);
+  tui_free(ALLOC_COMPONENT, parts);
+  return ok;
+}
+
+static inline void minimapRemoveLines(Minimap *m, size_t line, size_t n) {
+  size_t at = line, p = minimapLocate(m, &at);
+  m->num_lines -= n;
+  if (n)
+    m->starts_valid = false;
+  while (n && p < m->num_pages) {
+    MinimapPage *page = m->pages[p];
+    size_t take = bufferMin(n, page->count - at);
+    memmove(page->lines + at, page->lines + at + take,
+            (page->count - at - take) * sizeof(MinimapLine));
+    page->count -= take;
+    n -= take;
+    if (!page->count && m->num_pages > 1) {
+      minimapSplice(m, p, 1, NULL, 0);
+    } else {
+      minimapSumPage(page);
+      p++;
+    }
+    at = 0;
+  }
+  // Keep a run of small pages from building up.
+  if (p && p < m->num_pages &&
+      m->pages[p - 1]->count + m->pages[p]->count <= MINIMAP_PAGE / 2) {
+    MinimapPage *a = m->pages[p - 1], *b = m->pages[p];
+    memcpy(a->lines + a->count, b->lines, b->count * sizeof(MinimapLine));
+    a->count += b->count;
+    minimapSumPage(a);
+    minimapSplice(m, p, 1, NULL, 0);
+  }
+}
+
+static inline void minimapSet(Minimap *m, size_t line, MinimapLine value) {
+  size_t at = line, p = minimapLocate(m, &at);
+  MinimapPage *page = m->pages[p];
+  page->lines[at] = value;
+  minimapSumBlock(page, at / MINIMAP_BLOCK);
+}
+
+static inline void minimapResummarize(Minimap *m, size_t first,
+                                      size_t count) {
+  for (size_t line = first; line < first + count; line++) {
+    size_t len;
+    char *text = buffer_line(m->buffer, line, &len);
+    if (!text)
+      return;
+    minimapSet(m, line, minimapSummarize(text, len, m->query, m->query_len));
+    free(text);
+  }
+  m->rows_stale = true;
+}
+
+// Mirrors an edit in the pages: lines [line, line + removed] became
+// [line, line + inserted], and those are stale until summarized again.
+static inline bool minimapApplyEdit(Minimap *m, const MinimapEdit *e) {
+  minimapRemoveLines(m, e->line + 1, e->removed);
+  if (!minimapInsertLines(m, e->line + 1, e->inserted))
+    return false;
+  for (size_t i = e->line; i <= e->line + e->inserted; i++)
+    minimapSet(m, i, (MinimapLine){0, MINIMAP_STALE});
+  m->rows_stale = true;
+  return true;
+}
+
+/////////////////////////
+// Summarizing on pool //
+/////////////////////////
+
+static inline bool minimapPush(MinimapChunk *c, MinimapLine line) {
+  if (c->count == c->cap) {
+    size_t cap = c->cap ? c->cap * 2 : 4096;
+    MinimapLine *lines =
+        tui_realloc(ALLOC_COMPONENT, c->lines, cap * sizeof(MinimapLine));
+    if (!lines)
+      return c->failed = true, false;
+    c->lines = lines;
+    c->cap = cap;
+  }
+  c->lines[c->count++] = line;
+  return true;
+}
+
+// Summarizes the lines that start in the chunk's spans; the last one may
+// run on into the spans after.
+static void minimapChunk(void *arg) {
+  MinimapChunk *c = arg;
+  const BufferSnapshot *snap = c->job->snapshot;
+  const char *query = c->job->query;
+  size_t query_len = c->job->query_len;
+  size_t span = c->first_span, at = 0;
+
+  // A line that started in an earlier chunk belongs to that chunk.
+  if (span) {
+    const BufferSpan *prev = &snap->spans[span - 1];
+    bool skip = prev->text[prev->len - 1] != '\n';
+    while (skip && span < snap->num_spans) {
+      const BufferSpan *s = &snap->spans[span];
+      const char *nl = memchr(s->text + at, '\n', s->len - at);
+      if (nl) {
+        at = (size_t)(nl - s->text) + 1;
+        skip = false;
+      } else {
+        span++, at = 0;
+      }
+      if (at == s->len)
+        span++, at = 0;
+    }
+    if (skip)
+      return;
+  }
+
+  char *line = NULL;
+  size_t len = 0, cap = 0;
+  bool last_chunk = c->end_span == snap->num_spans;
+  while (span < c->end_span || (span == snap->num_spans && last_chunk)) {
+    // Gather one line, reading into later spans if it runs on.
+    len = 0;
+    bool ended = false;
+    while (span < snap->num_spans && !ended) {
+      const BufferSpan *s = &snap->spans[span];
+      const char *nl = memchr(s->text + at, '\n', s->len - at);
+      size_t end = nl ? (size_t)(nl - s->text) : s->len;
+      if (len + end - at > cap) {
+        size_t more = (len + end - at) * 2;
+        char *grown = tui_realloc(ALLOC_COMPONENT, line, more);
+        if (!grown) {
+          c->failed = true;
+          tui_free(ALLOC_COMPONENT, line);
+          return;
+        }
+        line = grown;
+        cap = more;
+      }
+      memcpy(line + len, s->text + at, end - at);
+      len += end - at;
+      at = nl ? end + 1 : s->len;
+      ended = nl != NULL;
+      if (at == s->len)
+        span++, at = 0;
+    }
+    if (!minimapPush(c, minimapSummarize(line, len, query, query_len)))
+      break;
+    // After a final newline the loop goes round once more for the empty
+    // line that follows, in the last chunk only.
+    if (!ended || (span == snap->num_spans && !last_chunk))
+      break;
+  }
+  tui_free(ALLOC_COMPONENT, line);
+}
+
+static void minimapRun(void *arg) {
+  MinimapJob *job = arg;
+  const BufferSnapshot *snap = job->snapshot;
+
+  // Chunks of whole spans, at least MINIMAP_CHUNK bytes each.
+  size_t per = snap->size / (MINIMAP_MAX_CHUNKS - 1) + 1;
+  if (per < MINIMAP_CHUNK)
+    per = MINIMAP_CHUNK;
+  size_t bytes = 0, first = 0;
+  for (size_t i = 0; i < snap->num_spans; i++) {
+    bytes += snap->spans[i].len;
+    if (bytes >= per || i + 1 == snap->num_spans) {
+      job->chunks[job->num_chunks++] =
+          (MinimapChunk){.job = job, .first_span = first, .end_span = i + 1};
+      first = i + 1;
+      bytes = 0;
+    }
+  }
+  if (!job->num_chunks)
+    job->chunks[job->num_chunks++] =
+        (MinimapChunk){.job = job, .first_span = 0, .end_span = 0};
+  for (size_t i = 0; i < job->num_chunks; i++)
+    pool_submit(pool_shared(), &job->chunking, minimapChunk, &job->chunks[i]);
+  pool_wait(pool_shared(), &job->chunking);
+
+  // Stitch the chunks into pages.
+  size_t total = 0;
+  for (size_t i = 0; i < job->num_chunks; i++) {
+    job->failed |= job->chunks[i].failed;
+    total += job->chunks[i].count;
+  }
+  if (job->failed || total != snap->newlines + 1 ||
+      !(job->pages = minimapStalePages(total, &job->num_pages))) {
+    job->failed = true;
+    return;
+  }
+  size_t line = 0;
+  for (size_t i = 0; i < job->num_chunks; i++)
+    for (size_t j = 0; j < job->chunks[i].count; j++, line++)
+      job->pages[line / MINIMAP_PAGE]->lines[line % MINIMAP_PAGE] =
+          job->chunks[i].lines[j];
+  for (size_t i = 0; i < job->num_pages; i++)
+    minimapSumPage(job->pages[i]);
+  job->num_lines = total;
+}
+
+static inline void minimapFreeJob(MinimapJob *job) {
+  for (size_t i = 0; i < job->num_chunks; i++)
+    tui_free(ALLOC_COMPONENT, job->chunks[i].lines);
+  if (job->pages)
+    minimapFreePages(job->pages, job->num_pages);
+  buffer_release(job->snapshot);
+  tui_free(ALLOC_COMPONENT, job);
+}
+
+static inline void minimapSubmit(Minimap *m) {
+  MinimapJob *job = tui_calloc(ALLOC_COMPONENT, 1, sizeof(MinimapJob));
+  if (!job || !(job->snapshot = buffer_snapshot(m->buffer))) {
+    tui_free(ALLOC_COMPONENT, job);
+    return;
+  }
+  memcpy(job->query, m->query, m->query_len);
+  job->query_len = m->query_len;
+  m->rebuild = false;
+  m->log_count = 0;
+  m->log_overflow = false;
+  m->job = job;
+  pool_submit(pool_shared(), &m->running, minimapRun, job);
+}
+
+static void minimapAfterEdit(Buffer *b, const BufferEdit *edit, void *ctx) {
+  (void)b;
+  Minimap *m = ctx;
+  MinimapEdit e = {edit->line, edit->removed_lines, edit->inserted_lines};
+  if (m->job) {
+    if (m->log_count == MINIMAP_MAX_LOG)
+      m->log_overflow = true;
+    else
+      m->log[m->log_count++] = e;
+  }
+  if (!m->ready)
+    return;
+  if (!minimapApplyEdit(m, &e) || e.inserted >= MINIMAP_SYNC_LINES)
+    m->rebuild = true;
+  else
+    minimapResummarize(m, e.line, e.inserted + 1);
+}
+
+// Adopts a finished summary and starts another if one is owed.
+static inline void minimap_poll(Minimap *m) {
+  MinimapJob *job = m->job;
+  if (job && pool_idle(&m->running)) {
+    m->job = NULL;
+    if (job->failed || m->log_overflow) {
+      m->rebuild = true;
+    } else {
+      minimapFreePages(m->pages, m->num_pages);
+      m->pages = job->pages;
+      m->num_pages = job->num_pages;
+      m->num_lines = job->num_lines;
+      m->starts_valid = false;
+      job->pages = NULL;
+      m->ready = m->rows_stale = true;
+      // Bring it up to date, then fill in what the edits left stale.
+      bool ok = true;
+      for (size_t i = 0; ok && i < m->log_count; i++)
+        ok = minimapApplyEdit(m, &m->log[i]);
+      size_t line = 0, stale = 0;
+      for (size_t p = 0; ok && p < m->num_pages; p++) {
+        MinimapPage *page = m->pages[p];
+        for (size_t i = 0; i < page->count; i++, line++)
+          if ((page->lines[i].flags & MINIMAP_STALE) &&
+              stale++ < MINIMAP_SYNC_LINES)
+            minimapResummarize(m, line, 1);
+      }
+      m->rebuild |= !ok || stale > MINIMAP_SYNC_LINES;
+    }
+    m->log_count = 0;
+    minimapFreeJob(job);
+  }
+  if (!m->job && m->rebuild)
+    minimapSubmit(m);
+}
+
+// Lines containing query are marked as hits.
+static inline void minimap_set_query(Minimap *m, const char *query,
+                                     size_t len) {
+  len = bufferMin(len, MINIMAP_MAX_QUERY);
+  if (len == m->query_len && !memcmp(query, m->query, len))
+    return;
+  memcpy(m->query, query, len);
+  m->query_len = len;
+  m->rebuild = true;
+  minimap_poll(m);
+}
+
+/////////////
+// Drawing //
+/////////////
+
+// Sums lines [line, line + n) into one dot row, a block at a time where
+// the range covers whole blocks.
+static inline MinimapSum minimapSumLines(Minimap *m, size_t line, size_t n) {
+  MinimapSum sum = {0};
+  size_t p = minimapLocate(m, &line);
+  while (n && p < m->num_pages) {
+    const MinimapPage *page = m->pages[p];
+    if (line == page->count) {
+      p++, line = 0;
+      continue;
+    }
+    if (line % MINIMAP_BLOCK == 0 && line + MINIMAP_BLOCK <= page->count &&
+        n >= MINIMAP_BLOCK) {
+      minimapMerge(&sum, &page->blocks[line / MINIMAP_BLOCK]);
+      line += MINIMAP_BLOCK;
+      n -= MINIMAP_BLOCK;
+    } else {
+      minimapAdd(&sum, page->lines[line++]);
+      n--;
+    }
+  }
+  return sum;
+}
+
+// Squeezes the buffer into dot_rows rows (four to a screen row).
+static inline void minimapDownsample(Minimap *m, size_t dot_rows) {
+  if (!m->rows_stale && m->rows_for == dot_rows)
+    return;
+  size_t per = dot_rows ? (m->num_lines + dot_rows - 1) / dot_rows : 1;
+  if (!per)
+    per = 1;
+  size_t n = (m->num_lines + per - 1) / per;
+  MinimapSum *rows =
+      tui_realloc(ALLOC_COMPONENT, m->rows, (n ? n : 1) * sizeof(MinimapSum));
+  if (!rows)
+    return;
+  m->rows = rows;
+  for (size_t i = 0; i < n; i++)
+    rows[i] = minimapSumLines(m, i * per, per);
+  m->num_rows = n;
+  m->lines_per_row = per;
+  m->rows_for = dot_rows;
+  m->rows_stale = false;
+}
+
+static void minimap_render(Component *self, TMT *screen) {
+  Minimap *m = self->minimap;
+  Position pos = self->pos;
+  minimap_poll(m);
+  if (!pos.width || !pos.height)
+    return;
+  if (m->ready)
+    minimapDownsample(m, (size_t)pos.height * 4);
+
+  // The lines the text view shows.
+  size_t view_first = 1, view_last = 0;
+  if (m->view && m->view->rows) {
+    view_first = fold_line_of(m->view->folds, m->view->top);
+    view_last = fold_line_of(m->view->folds,
+                             m->view->top + m->view->rows - 1);
+  }
+
+  uint16_t cells = bufferMin(pos.width, MINIMAP_DOTS / 2);
+  for (uint16_t y = 0; y < pos.height; y++) {
+    char out[MINIMAP_DOTS / 2 * 3 + 32];
+    size_t n = 0;
+    MinimapSum cell = {0};
+    uint8_t dots[MINIMAP_DOTS / 2] = {0};
+    for (size_t k = 0; k < 4; k++) {
+      size_t r = (size_t)y * 4 + k;
+      if (!m->ready || r >= m->num_rows)
+        break;
+      const MinimapSum *row = &m->rows[r];
+      minimapMerge(&cell, row);
+      // Braille: dots 1-3 and 7 on the left, 4-6 and 8 on the right.
+      static const uint8_t left[4] = {0x01, 0x02, 0x04, 0x40};
+      static const uint8_t right[4] = {0x08, 0x10, 0x20, 0x80};
+      for (uint16_t x = 0; x < cells; x++) {
+        if (row->mask & (1u << (2 * x)))
+          dots[x] |= left[k];
+        if (row->mask & (1u << (2 * x + 1)))
+          dots[x] |= right[k];
+      }
+    }
+    size_t first = (size_t)y * 4 * m->lines_per_row;
+    size_t last = first + 4 * m->lines_per_row - 1;
+    bool shaded = m->ready && first <= view_last && last >= view_first;
+    n += (size_t)sprintf(out + n, "\x1b[%d;%dm",
+                         cell.hits                     ? 33
+                         : cell.comments * 2 > cell.lines ? 32
+                                                         : 37,
+                         shaded ? 44 : 49);
+    for (uint16_t x = 0; x < cells; x++) {
+      // U+2800 plus the dots, as UTF-8.
+      out[n++] = (char)0xE2;
+      out[n++] = (char)(0xA0 | (dots[x] >> 6));
+      out[n++] = (char)(0x80 | (dots[x] & 0x3F));
+    }
+    n += (size_t)sprintf(out + n, "\x1b[0m");
+    moveCursor(screen, pos.x, pos.y + y);
+    tmt_write(screen, out, n);
+    if (pos.width > cells)
+      drawText(screen, "", 0, pos.width - cells);
+  }
+}
+
+static void minimap_resize(Component *self, Position new_pos) {
+  self->pos = new_pos;
+}
+
+// Clicking moves the text view's cursor to the line under the mouse.
+static int minimap_onClick(Component *self, MouseEvent event) {
+  Minimap *m = self->minimap;
+  if (!m->view || !m->ready || event.mouse_action != MOUSE_BUTTON_1)
+    return 0;
+  size_t line = (size_t)(event.mouse_y - self->pos.y) * 4 * m->lines_per_row;
+  TextView *t = m->view;
+  t->cursor_line = bufferMin(line, m->num_lines - 1);
+  t->cursor_col =
+      bufferMin(t->cursor_col, textviewLineLength(t->buffer, t->cursor_line));
+  return 1;
+}
+
+// Shows an overview of buffer; view, if given, is shaded where it's
+// scrolled to and follows clicks.
+static inline Component *minimap_new(GlobalContext *context, Buffer *buffer,
+                                     TextView *view) {
+  Component *c = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Component));
+  Minimap *m = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Minimap));
+  if (m)
+    m->log = tui_malloc(ALLOC_COMPONENT, MINIMAP_MAX_LOG * sizeof(MinimapEdit));
+  if (!c || !m || !m->log ||
+      !buffer_listen(buffer,
+                     (BufferListener){NULL, minimapAfterEdit, m, NULL})) {
+    if (m)
+      tui_free(ALLOC_COMPONENT, m->log);
+    tui_free(ALLOC_COMPONENT, c);
+    tui_free(ALLOC_COMPONENT, m);
+    return NULL;
+  }
+  m->buffer = buffer;
+  m->view = view;
+  m->rebuild = true;
+  minimap_poll(m);
+  c->minimap = m;
+  c->context = context;
+  c->kind = COMPONENT_MINIMAP;
+  c->render = minimap_render;
+  c->resize = minimap_resize;
+  c->onClick = minimap_onClick;
+  return c;
+}
+
+static inline void minimap_free(Component *c) {
+  if (!c)
+    return;
+  Minimap *m = c->minimap;
+  pool_wait(pool_shared(), &m->running);
+  if (m->job)
+    minimapFreeJob(m->job);
+  buffer_unlisten(m->buffer, m);
+  minimapFreePages(m->pages, m->num_pages);
+  tui_free(ALLOC_COMPONENT, m->page_starts);
+  tui_free(ALLOC_COMPONENT, m->rows);
+  tui_free(ALLOC_COMPONENT, m->log);
+  tui_free(ALLOC_COMPONENT, m);
+  tui_free(ALLOC_COMPONENT, c);
+}
+
+#endif
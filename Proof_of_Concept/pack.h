@@ -0,0 +1,121 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include "buffer.h"
+#include "pool.h"
+
+#include <time.h>
+
+// Packs the add blocks and undo history of buffers nobody has touched in
+// a while, to give the memory back during long sessions with many files
+// open. The packing itself runs on the pool; the UI thread only picks what
+// to pack and swaps the result in. Nothing else needs to know: a packed
+// block or history comes back by itself the next time it's needed (see
+// buffer.h).
+//
+// A buffer counts as touched when it's edited, or when something of it had
+// to be unpacked, as when it's drawn again. It's packed once it's been
+// left alone for PACKER_IDLE_SECONDS, and not again until it's touched.
+
+#define PACKER_MAX_BUFFERS 1024
+#define PACKER_IDLE_SECONDS 30
+
+typedef struct {
+  Buffer *buffer;
+  size_t version, unpacks; // As last seen.
+  time_t since;            // When the buffer was last touched.
+  bool done;               // Packed since.
+  BufferPackJob *job;
+  PoolGroup running;
+} PackedBuffer;
+
+typedef struct {
+  size_t num_buffers;
+  PackedBuffer *buffers[PACKER_MAX_BUFFERS];
+} BufferPacker;
+
+static inline time_t packerNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static inline size_t packerUnpacks(const Buffer *b) {
+  return b->pack ? b->pack->unpacks : 0;
+}
+
+static void packerRun(void *arg) { buffer_pack_run(arg); }
+
+static inline BufferPacker *packer_new(void) {
+  return calloc(1, sizeof(BufferPacker));
+}
+
+static inline bool packer_add(BufferPacker *p, Buffer *b) {
+  if (p->num_buffers == PACKER_MAX_BUFFERS)
+    return false;
+  PackedBuffer *f = calloc(1, sizeof(PackedBuffer));
+  if (!f)
+    return false;
+  f->buffer = b;
+  f->version = b->version;
+  f->unpacks = packerUnpacks(b);
+  f->since = packerNow();
+  p->buffers[p->num_buffers++] = f;
+  return true;
+}
+
+static inline void packer_remove(BufferPacker *p, Buffer *b) {
+  for (size_t i = 0; i < p->num_buffers; i++) {
+    PackedBuffer *f = p->buffers[i];
+    if (f->buffer != b)
+      continue;
+    pool_wait(pool_shared(), &f->running);
+    buffer_pack_free(f->job);
+    p->buffers[i] = p->buffers[--p->num_buffers];
+    free(f);
+    return;
+  }
+}
+
+static inline void packer_free(BufferPacker *p) {
+  if (!p)
+    return;
+  while (p->num_buffers)
+    packer_remove(p, p->buffers[0]->buffer);
+  free(p);
+}
+
+// Swaps in finished packs and starts packing buffers that have gone idle.
+// Never blocks; call it every time around the main loop.
+static inline void packer_poll(BufferPacker *p) {
+  time_t now = packerNow();
+  for (size_t i = 0; i < p->num_buffers; i++) {
+    PackedBuffer *f = p->buffers[i];
+    Buffer *b = f->buffer;
+    if (f->job) {
+      if (!pool_idle(&f->running))
+        continue;
+      // Beaten by an edit or a live snapshot; try again later.
+      f->done = buffer_pack_finish(b, f->job);
+      f->job = NULL;
+      if (!f->done)
+        f->since = now;
+    }
+    if (b->version != f->version || packerUnpacks(b) != f->unpacks) {
+      f->version = b->version;
+      f->unpacks = packerUnpacks(b);
+      f->since = now;
+      f->done = false;
+      continue;
+    }
+    if (f->done || now - f->since < PACKER_IDLE_SECONDS)
+      continue;
+    if (!(f->job = buffer_pack_start(b))) {
+      f->done = true;
+      continue;
+    }
+    pool_submit(pool_shared(), &f->running, packerRun, f->job);
+  }
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// A fixed set of worker threads shared by every component that wants to
+// get work off the UI thread. Jobs are grouped so that a caller can wait
+// for exactly the work it submitted.
+//
+// Each worker has its own deque. Jobs submitted from inside a job go to
+// the submitting worker's deque, which it pops newest-first; idle workers
+// steal the oldest jobs from the others. Jobs from outside the pool go
+// through a shared injector queue.
+//
+// Background jobs have a queue of their own, which only workers take from
+// and only when there's nothing else. A thread outside the pool helping
+// out in pool_wait() never picks one up, so the UI thread can't end up
+// doing a long load while it waits for a quick search.
+
+#define POOL_MAX_WORKERS 64
+
+typedef void (*PoolFn)(void *arg);
+
+typedef struct {
+  atomic_size_t pending;
+} PoolGroup;
+
+typedef struct {
+  PoolFn fn;
+  void *arg;
+  PoolGroup *group;
+} PoolJob;
+
+typedef struct {
+  pthread_mutex_t lock;
+  PoolJob *jobs; // Ring buffer, grown on demand.
+  size_t head, count, capacity;
+} PoolDeque;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // Signalled when a job is queued or we shut down.
+  pthread_cond_t done; // Signalled when a job of any group finishes.
+
+  atomic_size_t queued; // Jobs sitting in any deque but background.
+  atomic_size_t background_queued;
+  PoolDeque injector;
+  PoolDeque background;
+  PoolDeque deques[POOL_MAX_WORKERS];
+
+  bool stopping;
+  size_t num_workers;
+  pthread_t workers[POOL_MAX_WORKERS];
+} Pool;
+
+typedef struct {
+  Pool *pool;
+  size_t index;
+} PoolWorkerArg;
+
+static Pool *_pool_shared;
+// Which worker of which pool the current thread is, if any.
+static _Thread_local Pool *_pool_self;
+static _Thread_local size_t _pool_self_index;
+
+static inline bool poolPush(PoolDeque *d, PoolJob job) {
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->capacity) {
+    size_t capacity = d->capacity ? d->capacity * 2 : 64;
+    PoolJob *jobs = malloc(capacity * sizeof(PoolJob));
+    if (!jobs) {
+      pthread_mutex_unlock(&d->lock);
+      return false;
+    }
+    for (size_t i = 0; i < d->count; i++)
+      jobs[i] = d->jobs[(d->head + i) % d->capacity];
+    free(d->jobs);
+    d->jobs = jobs;
+    d->head = 0;
+    d->capacity = capacity;
+  }
+  d->jobs[(d->head + d->count) % d->capacity] = job;
+  d->count++;
+  pthread_mutex_unlock(&d->lock);
+  return true;
+}
+
+static inline bool poolPop(PoolDeque *d, PoolJob *job, bool newest) {
+  pthread_mutex_lock(&d->lock);
+  bool found = d->count > 0;
+  if (found) {
+    if (newest) {
+      *job = d->jobs[(d->head + d->count - 1) % d->capacity];
+    } else {
+      *job = d->jobs[d->head];
+      d->head = (d->head + 1) % d->capacity;
+    }
+    d->count--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Finds a job for the calling thread: its own newest, then the injector,
+// then the oldest of some other worker's.
+static inline bool poolTake(Pool *pool, PoolJob *job) {
+  bool own = _pool_self == pool;
+  if (!atomic_load(&pool->queued))
+    goto background;
+  if (own && poolPop(&pool->deques[_pool_self_index], job, true))
+    goto found;
+  if (poolPop(&pool->injector, job, false))
+    goto found;
+  size_t start = own ? _pool_self_index + 1 : 0;
+  for (size_t i = 0; i < pool->num_workers; i++) {
+    size_t victim = (start + i) % pool->num_workers;
+    if (poolPop(&pool->deques[victim], job, false))
+      goto found;
+  }
+
+background:
+  if (!own || !atomic_load(&pool->background_queued) ||
+      !poolPop(&pool->background, job, false))
+    return false;
+  atomic_fetch_sub(&pool->background_queued, 1);
+  return true;
+
+found:
+  atomic_fetch_sub(&pool->queued, 1);
+  return true;
+}
+
+static inline void poolRun(Pool *pool, PoolJob job) {
+  job.fn(job.arg);
+  if (job.group && atomic_fetch_sub(&job.group->pending, 1) == 1) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *poolWorker(void *arg) {
+  PoolWorkerArg self = *(PoolWorkerArg *)arg;
+  free(arg);
+  Pool *pool = self.pool;
+  _pool_self = pool;
+  _pool_self_index = self.index;
+
+  for (;;) {
+    PoolJob job;
+    if (poolTake(pool, &job)) {
+      poolRun(pool, job);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping && !atomic_load(&pool->queued) &&
+           !atomic_load(&pool->background_queued))
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    bool stopping = pool->stopping;
+    pthread_mutex_unlock(&pool->lock);
+    if (stopping)
+      break;
+  }
+  return NULL;
+}
+
+// Passing 0 workers uses one per online CPU.
+static inline Pool *pool_create(size_t num_workers) {
+  if (!num_workers) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = n > 0 ? (size_t)n : 1;
+  }
+  if (num_workers > POOL_MAX_WORKERS)
+    num_workers = POOL_MAX_WORKERS;
+
+  Pool *pool = calloc(1, sizeof(Pool));
+  if (!pool)
+    return NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pthread_mutex_init(&pool->injector.lock, NULL);
+  pthread_mutex_init(&pool->background.lock, NULL);
+  for (size_t i = 0; i < POOL_MAX_WORKERS; i++)
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+  // Workers only steal from indices below num_workers, so it has to be
+  // final before the first one starts.
+  pool->num_workers = num_workers;
+  for (size_t i = 0; i < num_workers; i++) {
+    PoolWorkerArg *arg = malloc(sizeof(PoolWorkerArg));
+    if (arg)
+      *arg = (PoolWorkerArg){pool, i};
+    if (!arg || pthread_create(&pool->workers[i], NULL, poolWorker, arg)) {
+      free(arg);
+      pool->num_workers = i;
+      break;
+    }
+  }
+  return pool;
+}
+
+static inline void pool_destroy(Pool *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->num_workers; i++)
+    pthread_join(pool->workers[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->injector.lock);
+  free(pool->injector.jobs);
+  pthread_mutex_destroy(&pool->background.lock);
+  free(pool->background.jobs);
+  for (size_t i = 0; i < POOL_MAX_WORKERS; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].jobs);
+  }
+  free(pool);
+}
+
+// The pool everything in the editor shares. Created on first use.
+static inline Pool *pool_shared(void) {
+  if (!_pool_shared)
+    _pool_shared = pool_create(0);
+  return _pool_shared;
+}
+
+// Queues fn(arg). If the queue can't grow, runs it on the calling thread.
+static inline void pool_submit(Pool *pool, PoolGroup *group, PoolFn fn,
+                               void *arg) {
+  PoolJob job = {fn, arg, group};
+  if (group)
+    atomic_fetch_add(&group->pending, 1);
+
+  PoolDeque *d = _pool_self == pool ? &pool->deques[_pool_self_index]
+                                    : &pool->injector;
+  if (!pool->num_workers || !poolPush(d, job)) {
+    poolRun(pool, job);
+    return;
+  }
+  atomic_fetch_add(&pool->queued, 1);
+
+  // Sleepers check queued under the lock, so taking it here means none of
+  // them can miss this job.
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Queues fn(arg) behind everything else, for a worker to run when it has
+// nothing else to do. Waiting for it from outside the pool just waits.
+static inline void pool_submit_background(Pool *pool, PoolGroup *group,
+                                          PoolFn fn, void *arg) {
+  PoolJob job = {fn, arg, group};
+  if (group)
+    atomic_fetch_add(&group->pending, 1);
+  if (!pool->num_workers || !poolPush(&pool->background, job)) {
+    poolRun(pool, job);
+    return;
+  }
+  atomic_fetch_add(&pool->background_queued, 1);
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static inline bool pool_idle(PoolGroup *group) {
+  return atomic_load(&group->pending) == 0;
+}
+
+// Blocks until every job in the group has finished. The waiting thread
+// runs queued jobs itself in the meantime, so waiting from inside a job
+// can't deadlock the pool.
+static inline void pool_wait(Pool *pool, PoolGroup *group) {
+  while (!pool_idle(group)) {
+    PoolJob job;
+    if (poolTake(pool, &job)) {
+      poolRun(pool, job);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (!pool_idle(group) && !atomic_load(&pool->queued))
+      pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// A sampling profiler for when perf can't be had. With $TUI_PROFILE_FILE
+// set, tui_init() starts a SIGPROF timer (setitimer(ITIMER_PROF), so it
+// only counts CPU time) and every tick keeps the interrupted thread's
+// stack. At exit the stacks are written to that file folded, one per line
+// with its count, which flamegraph.pl and speedscope read as they are.
+// $TUI_PROFILE_HZ sets the rate, PROFILE_DEFAULT_HZ if not.
+//
+// The handler only calls backtrace() and writes into slots allocated up
+// front; once they're full, later samples are counted and dropped. glibc's
+// backtrace() loads libgcc the first time it's called, which isn't safe
+// in a handler, so profile_start() calls it once first.
+//
+// Frames are named by backtrace_symbols(), which only knows exported
+// symbols; build with -rdynamic for the rest. What it still can't name is
+// written as module+offset, for addr2line.
+
+#define PROFILE_DEFAULT_HZ 997 // Off the beat of anything periodic.
+#define PROFILE_MAX_SAMPLES ((size_t)1 << 16)
+#define PROFILE_MAX_DEPTH 48
+#define PROFILE_SKIP_FRAMES 2 // The handler and the signal trampoline.
+
+typedef struct {
+  uint8_t depth;
+  void *frames[PROFILE_MAX_DEPTH]; // Innermost first.
+} ProfileSample;
+
+// Past this many ticks the handler writes nothing; stopping jumps there.
+#define PROFILE_STOPPED (SIZE_MAX / 2)
+
+typedef struct {
+  ProfileSample *samples;
+  atomic_size_t taken; // Ticks seen; past PROFILE_MAX_SAMPLES, dropped.
+  atomic_uint busy;    // Handlers running, on whichever threads.
+  bool running;
+  char *path;
+} Profiler;
+
+static Profiler profiler;
+
+static void profileTick(int sig) {
+  (void)sig;
+  int saved = errno;
+  atomic_fetch_add(&profiler.busy, 1);
+  size_t i = atomic_fetch_add(&profiler.taken, 1);
+  if (i < PROFILE_MAX_SAMPLES) {
+    ProfileSample *s = &profiler.samples[i];
+    int n = backtrace(s->frames, PROFILE_MAX_DEPTH);
+    s->depth = (uint8_t)(n > 0 ? n : 0);
+  }
+  atomic_fetch_sub(&profiler.busy, 1);
+  errno = saved;
+}
+
+static inline int profileCompare(const void *a, const void *b) {
+  const ProfileSample *x = a, *y = b;
+  size_t n = x->depth < y->depth ? x->depth : y->depth;
+  int c = memcmp(x->frames, y->frames, n * sizeof(void *));
+  return c ? c : (x->depth > y->depth) - (x->depth < y->depth);
+}
+
+typedef struct {
+  char *text;
+  size_t len, cap, count;
+} ProfileLine;
+
+static inline bool profilePutChar(ProfileLine *l, char c) {
+  if (l->len + 1 >= l->cap) {
+    size_t cap = l->cap ? 2 * l->cap : 256;
+    char *grown = realloc(l->text, cap);
+    if (!grown)
+      return false;
+    l->text = grown;
+    l->cap = cap;
+  }
+  l->text[l->len++] = c;
+  l->text[l->len] = 0;
+  return true;
+}
+
+static inline bool profilePut(ProfileLine *l, const char *from,
+                              const char *to) {
+  for (; from < to; from++)
+    if (*from != ';' && *from != ' ' && // They'd break the line up.
+        !profilePutChar(l, *from))
+      return false;
+  return true;
+}
+
+// Adds a frame from backtrace_symbols(), "module(symbol+offset) [addr]",
+// as just the symbol, or as module+offset when there isn't one.
+static inline bool profilePutFrame(ProfileLine *l, const char *symbol) {
+  const char *open = strchr(symbol, '(');
+  const char *close = open ? strchr(open, ')') : NULL;
+  const char *plus = close ? memchr(open, '+', (size_t)(close - open)) : NULL;
+  if (!plus)
+    return profilePut(l, symbol, symbol + strlen(symbol));
+  if (plus > open + 1)
+    return profilePut(l, open + 1, plus);
+  const char *module = open;
+  while (module > symbol && module[-1] != '/')
+    module--;
+  return profilePut(l, module, open) && profilePut(l, plus, close);
+}
+
+static inline int profileCompareLines(const void *a, const void *b) {
+  const ProfileLine *x = a, *y = b;
+  return strcmp(x->text ? x->text : "", y->text ? y->text : "");
+}
+
+// Writes the samples folded: each distinct stack once, outermost frame
+// first, then how many samples had it. Samples with the same addresses
+// are named once; stacks only the same by name are merged after.
+static inline bool profileWrite(const char *path, ProfileSample *samples,
+                                size_t n) {
+  qsort(samples, n, sizeof(ProfileSample), profileCompare);
+  ProfileLine *lines = calloc(n + 1, sizeof(ProfileLine));
+  if (!lines)
+    return false;
+  size_t num_lines = 0;
+  for (size_t i = 0, run; i < n; i += run) {
+    for (run = 1; i + run < n && !profileCompare(&samples[i],
+                                                 &samples[i + run]);
+         run++)
+      ;
+    ProfileSample *s = &samples[i];
+    char **symbols = s->depth > PROFILE_SKIP_FRAMES
+                         ? backtrace_symbols(s->frames, s->depth)
+                         : NULL;
+    if (!symbols)
+      continue;
+    ProfileLine *l = &lines[num_lines++];
+    l->count = run;
+    for (size_t d = s->depth; d-- > PROFILE_SKIP_FRAMES;)
+      if (!profilePutFrame(l, symbols[d]) ||
+          (d > PROFILE_SKIP_FRAMES && !profilePutChar(l, ';')))
+        break;
+    free(symbols);
+  }
+
+  qsort(lines, num_lines, sizeof(ProfileLine), profileCompareLines);
+  FILE *f = fopen(path, "w");
+  for (size_t i = 0, run; i < num_lines; i += run) {
+    size_t count = lines[i].count;
+    for (run = 1; i + run < num_lines &&
+                  !profileCompareLines(&lines[i], &lines[i + run]);
+         run++)
+      count += lines[i + run].count;
+    if (f && lines[i].text)
+      fprintf(f, "%s %zu\n", lines[i].text, count);
+  }
+  for (size_t i = 0; i < num_lines; i++)
+    free(lines[i].text);
+  free(lines);
+  return f && !fclose(f);
+}
+
+static inline void profileTimer(long interval_us) {
+  struct timeval every = {interval_us / 1000000, interval_us % 1000000};
+  struct itimerval timer = {every, every};
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Stops sampling and writes what was taken to the path it was started
+// with. Returns false if it wasn't running or the file couldn't be written.
+//
+// The handler stays installed, since a tick may still be on its way; it
+// just doesn't write anything any more.
+static inline bool profile_stop(void) {
+  if (!profiler.running)
+    return false;
+  profiler.running = false;
+  profileTimer(0);
+  size_t n = atomic_exchange(&profiler.taken, PROFILE_STOPPED);
+  while (atomic_load(&profiler.busy))
+    ; // A handler on another thread, finishing its sample.
+  if (n > PROFILE_MAX_SAMPLES) {
+    fprintf(stderr, "profile: %zu of %zu samples dropped\n",
+            n - PROFILE_MAX_SAMPLES, n);
+    n = PROFILE_MAX_SAMPLES;
+  }
+  bool ok = profileWrite(profiler.path, profiler.samples, n);
+  free(profiler.samples);
+  free(profiler.path);
+  profiler.samples = NULL;
+  profiler.path = NULL;
+  return ok;
+}
+
+static void profileAtExit(void) { profile_stop(); }
+
+// Starts sampling hz times a second of CPU time, to be written to path by
+// profile_stop() or at exit.
+static inline bool profile_start(const char *path, long hz) {
+  if (profiler.running || hz <= 0 || hz > 1000000)
+    return false;
+  void *warm[1];
+  backtrace(warm, 1);
+  profiler.samples = calloc(PROFILE_MAX_SAMPLES, sizeof(ProfileSample));
+  if (!profiler.samples || !(profiler.path = strdup(path))) {
+    free(profiler.samples);
+    profiler.samples = NULL;
+    return false;
+  }
+  atomic_store(&profiler.taken, 0);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profileTick;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+  static bool registered;
+  if (!registered) {
+    registered = true;
+    atexit(profileAtExit);
+  }
+  profiler.running = true;
+  profileTimer(1000000 / hz);
+  return true;
+}
+
+// Starts sampling if $TUI_PROFILE_FILE is set.
+static inline bool profile_from_env(void) {
+  const char *path = getenv("TUI_PROFILE_FILE");
+  if (!path || !*path)
+    return false;
+  const char *hz = getenv("TUI_PROFILE_HZ");
+  return profile_start(path, hz && *hz ? atol(hz) : PROFILE_DEFAULT_HZ);
+}
+
+#endif
@@ -0,0 +1,436 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include "buffer.h"
+#include "diff.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <sys/inotify.h>
+
+// Notices when the file behind a buffer changes on disk and brings the
+// buffer up to date with the fewest edits it can, so undo, listeners and
+// everything derived from the buffer carry on as if the change had been
+// typed. A reload is one undo group.
+//
+// Directories are watched rather than files, since tools like git replace
+// a file by renaming a new one over it. All of the reading and comparing
+// happens on the pool: equal bytes at both ends are skipped with memcmp,
+// and only the lines in between are diffed. The UI thread just applies the
+// resulting edits, so a small change to a large file costs a small edit.
+//
+// A buffer with unsaved edits is never reloaded; it's flagged instead.
+
+#define WATCHER_MAX_FILES 256
+
+typedef struct {
+  size_t offset, removed; // In the snapshot.
+  size_t from, inserted;  // In the new text.
+} ReloadEdit;
+
+typedef struct {
+  char *path;
+  BufferSnapshot *snapshot;
+  size_t version; // Of the buffer when the snapshot was taken.
+  Encoding encoding;
+  bool bom;
+
+  char *text;
+  size_t size;
+  ReloadEdit *edits;
+  size_t num_edits, cap_edits;
+  bool failed;
+} ReloadJob;
+
+typedef struct {
+  Buffer *buffer;
+  int wd;
+  const char *name; // Inside the buffer's path.
+  bool changed;     // Seen an event, not reloaded yet.
+  bool conflict;    // Changed on disk while the buffer had unsaved edits.
+  ReloadJob *job;
+  PoolGroup running;
+} WatchedFile;
+
+typedef struct {
+  int fd;
+  size_t num_files;
+  WatchedFile *files[WATCHER_MAX_FILES];
+} FileWatcher;
+
+static inline void reloadPush(ReloadJob *job, ReloadEdit edit) {
+  if (job->num_edits == job->cap_edits) {
+    size_t cap = job->cap_edits ? job->cap_edits * 2 : 16;
+    ReloadEdit *edits = realloc(job->edits, cap * sizeof(ReloadEdit));
+    if (!edits) {
+      job->failed = true;
+      return;
+    }
+    job->edits = edits;
+    job->cap_edits = cap;
+  }
+  job->edits[job->num_edits++] = edit;
+}
+
+static inline size_t reloadCommonPrefix(const char *a, const char *b,
+                                        size_t n) {
+  size_t i = 0;
+  while (i + 4096 <= n && !memcmp(a + i, b + i, 4096))
+    i += 4096;
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+// Like reloadCommonPrefix, backwards from the ends of a and b.
+static inline size_t reloadCommonSuffix(const char *a, const char *b,
+                                        size_t n) {
+  size_t i = 0;
+  while (i + 4096 <= n && !memcmp(a - i - 4096, b - i - 4096, 4096))
+    i += 4096;
+  while (i < n && a[-(ptrdiff_t)i - 1] == b[-(ptrdiff_t)i - 1])
+    i++;
+  return i;
+}
+
+static inline void reloadCopy(const BufferSnapshot *snap, size_t offset,
+                              size_t len, char *out) {
+  for (size_t i = 0; i < snap->num_spans && len; i++) {
+    const BufferSpan *s = &snap->spans[i];
+    if (offset >= s->len) {
+      offset -= s->len;
+      continue;
+    }
+    size_t take = bufferMin(len, s->len - offset);
+    memcpy(out, s->text + offset, take);
+    out += take;
+    len -= take;
+    offset = 0;
+  }
+}
+
+// Splits text into lines that keep their newline, returning the start of
+// each and, one past the last, the end of the text.
+static inline size_t *reloadLines(const char *text, size_t len,
+                                  uint64_t **hashes, size_t *count) {
+  size_t n = bufferCountNewlines(text, len);
+  if (len && text[len - 1] != '\n')
+    n++;
+  size_t *starts = malloc((n + 1) * sizeof(size_t));
+  *hashes = malloc((n ? n : 1) * sizeof(uint64_t));
+  if (!starts || !*hashes) {
+    free(starts);
+    free(*hashes);
+    return NULL;
+  }
+  size_t at = 0;
+  for (size_t i = 0; i < n; i++) {
+    const char *nl = memchr(text + at, '\n', len - at);
+    size_t end = nl ? (size_t)(nl - text) + 1 : len;
+    starts[i] = at;
+    (*hashes)[i] = diffHash(diffHashInit(), text + at, end - at);
+    at = end;
+  }
+  starts[n] = len;
+  *count = n;
+  return starts;
+}
+
+// Reads the file whole. A read that fails, or comes up short of the size
+// the file had when opened, fails the job: the file was being written,
+// and the writer closing it will bring another event.
+static inline bool reloadRead(ReloadJob *job) {
+  int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0)
+    return false;
+  if (fstat(fd, &st) ||
+      !(job->text = tui_malloc(ALLOC_BUFFER, (size_t)st.st_size + 1))) {
+    close(fd);
+    return false;
+  }
+  while (job->size < (size_t)st.st_size) {
+    ssize_t n = read(fd, job->text + job->size,
+                     (size_t)st.st_size - job->size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    job->size += (size_t)n;
+  }
+  close(fd);
+  if (job->size < (size_t)st.st_size)
+    return false;
+  if (job->encoding == ENCODING_UTF8 && !job->bom)
+    return true;
+  size_t len;
+  char *decoded = encoding_decode_all(job->encoding, job->text, job->size,
+                                      &len);
+  if (!decoded)
+    return false;
+  tui_free(ALLOC_BUFFER, job->text);
+  job->text = decoded;
+  job->size = len;
+  return true;
+}
+
+// Diffs the lines of old and new text, both starting at the same line
+// boundary, into edits. Hashes can collide, so lines the diff calls equal
+// are compared for real; if any differ the whole range is one edit.
+static inline void reloadDiffLines(ReloadJob *job, const char *old,
+                                   size_t old_len, const char *new,
+                                   size_t new_len, size_t base) {
+  uint64_t *ah = NULL, *bh = NULL;
+  size_t na = 0, nb = 0;
+  size_t *as = reloadLines(old, old_len, &ah, &na);
+  size_t *bs = as ? reloadLines(new, new_len, &bh, &nb) : NULL;
+  DiffHunks hunks = {0};
+  if (bs)
+    diffRegion(ah, na, bh, nb, 0, 0, &hunks);
+
+  bool exact = bs && !hunks.failed;
+  size_t a = 0, b = 0;
+  for (size_t i = 0; exact && i <= hunks.count; i++) {
+    size_t until = i < hunks.count ? hunks.items[i].old_start : na;
+    for (; a < until; a++, b++)
+      if (as[a + 1] - as[a] != bs[b + 1] - bs[b] ||
+          memcmp(old + as[a], new + bs[b], as[a + 1] - as[a])) {
+        exact = false;
+        break;
+      }
+    if (exact && i < hunks.count) {
+      a += hunks.items[i].old_count;
+      b += hunks.items[i].new_count;
+    }
+  }
+
+  if (!exact) {
+    reloadPush(job, (ReloadEdit){base, old_len, base, new_len});
+  } else {
+    for (size_t i = 0; i < hunks.count; i++) {
+      const DiffHunk *h = &hunks.items[i];
+      size_t from = as[h->old_start], to = as[h->old_start + h->old_count];
+      size_t nfrom = bs[h->new_start], nto = bs[h->new_start + h->new_count];
+      reloadPush(job, (ReloadEdit){base + from, to - from, base + nfrom,
+                                   nto - nfrom});
+    }
+  }
+  free(hunks.items);
+  free(as);
+  free(bs);
+  free(ah);
+  free(bh);
+}
+
+static void reloadRun(void *arg) {
+  ReloadJob *job = arg;
+  if (!reloadRead(job)) {
+    job->failed = true;
+    return;
+  }
+  const BufferSnapshot *snap = job->snapshot;
+  size_t old_size = snap->size, new_size = job->size;
+
+  size_t prefix = 0;
+  for (size_t i = 0; i < snap->num_spans && prefix < new_size; i++) {
+    const BufferSpan *s = &snap->spans[i];
+    size_t n = bufferMin(s->len, new_size - prefix);
+    size_t k = reloadCommonPrefix(s->text, job->text + prefix, n);
+    prefix += k;
+    if (k < s->len)
+      break;
+  }
+  size_t most = bufferMin(old_size, new_size) - prefix, suffix = 0;
+  for (size_t i = snap->num_spans; i-- && suffix < most;) {
+    const BufferSpan *s = &snap->spans[i];
+    size_t n = bufferMin(s->len, most - suffix);
+    size_t k = reloadCommonSuffix(s->text + s->len,
+                                  job->text + new_size - suffix, n);
+    suffix += k;
+    if (k < s->len)
+      break;
+  }
+  if (prefix == old_size && prefix == new_size)
+    return;
+
+  // Widen the middle to whole lines, so it can be diffed by line.
+  while (prefix && job->text[prefix - 1] != '\n')
+    prefix--;
+  const char *nl = memchr(job->text + new_size - suffix, '\n', suffix);
+  suffix = nl ? new_size - (size_t)(nl - job->text) - 1 : 0;
+
+  size_t old_len = old_size - suffix - prefix;
+  char *old = malloc(old_len + 1);
+  if (!old) {
+    job->failed = true;
+    return;
+  }
+  reloadCopy(snap, prefix, old_len, old);
+  reloadDiffLines(job, old, old_len, job->text + prefix,
+                  new_size - suffix - prefix, prefix);
+  free(old);
+}
+
+static inline void reloadFreeJob(ReloadJob *job) {
+  free(job->path);
+  buffer_release(job->snapshot);
+  tui_free(ALLOC_BUFFER, job->text);
+  free(job->edits);
+  free(job);
+}
+
+static inline void reloadSubmit(WatchedFile *f) {
+  ReloadJob *job = calloc(1, sizeof(ReloadJob));
+  if (!job)
+    return;
+  job->path = strdup(f->buffer->path);
+  job->snapshot = buffer_snapshot(f->buffer);
+  job->version = f->buffer->version;
+  job->encoding = f->buffer->encoding;
+  job->bom = f->buffer->bom;
+  if (!job->path || !job->snapshot) {
+    reloadFreeJob(job);
+    return;
+  }
+  f->job = job;
+  pool_submit(pool_shared(), &f->running, reloadRun, job);
+}
+
+// Applies a finished job, last edit first so the snapshot's offsets stay
+// valid all the way through.
+static inline void reloadFinish(WatchedFile *f) {
+  ReloadJob *job = f->job;
+  Buffer *b = f->buffer;
+  f->job = NULL;
+  if (job->failed) {
+    reloadFreeJob(job);
+    return;
+  }
+  if (job->version != b->version) {
+    // Edited while we were diffing; look again.
+    f->changed = true;
+    reloadFreeJob(job);
+    return;
+  }
+  bool ok = true;
+  buffer_begin_group(b);
+  for (size_t i = job->num_edits; ok && i--;) {
+    const ReloadEdit *e = &job->edits[i];
+    ok = buffer_delete(b, e->offset, e->removed) &&
+         buffer_insert(b, e->offset, job->text + e->from, e->inserted);
+  }
+  buffer_end_group(b);
+  if (ok)
+    buffer_mark_saved(b);
+  else
+    f->conflict = true;
+  reloadFreeJob(job);
+}
+
+static inline FileWatcher *watcher_new(void) {
+  FileWatcher *w = calloc(1, sizeof(FileWatcher));
+  if (!w)
+    return NULL;
+  if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+// For the main loop to poll on; readable when something may have changed.
+static inline int watcher_fd(const FileWatcher *w) { return w->fd; }
+
+static inline bool watcher_add(FileWatcher *w, Buffer *b) {
+  if (!b->path || w->num_files == WATCHER_MAX_FILES)
+    return false;
+  WatchedFile *f = calloc(1, sizeof(WatchedFile));
+  if (!f)
+    return false;
+  const char *slash = strrchr(b->path, '/');
+  char *dir = slash ? strndup(b->path, (size_t)(slash - b->path) + 1)
+                    : strdup(".");
+  // Adding the same directory twice gives back the same watch. A file
+  // that's created is only worth reading once it's closed or moved in.
+  f->wd = dir ? inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)
+              : -1;
+  free(dir);
+  if (f->wd < 0) {
+    free(f);
+    return false;
+  }
+  f->buffer = b;
+  f->name = slash ? slash + 1 : b->path;
+  w->files[w->num_files++] = f;
+  return true;
+}
+
+static inline void watcher_remove(FileWatcher *w, Buffer *b) {
+  for (size_t i = 0; i < w->num_files; i++) {
+    WatchedFile *f = w->files[i];
+    if (f->buffer != b)
+      continue;
+    pool_wait(pool_shared(), &f->running);
+    if (f->job)
+      reloadFreeJob(f->job);
+    w->files[i] = w->files[--w->num_files];
+    bool shared = false;
+    for (size_t j = 0; j < w->num_files; j++)
+      shared |= w->files[j]->wd == f->wd;
+    if (!shared)
+      inotify_rm_watch(w->fd, f->wd);
+    free(f);
+    return;
+  }
+}
+
+static inline void watcher_free(FileWatcher *w) {
+  if (!w)
+    return;
+  while (w->num_files)
+    watcher_remove(w, w->files[0]->buffer);
+  close(w->fd);
+  free(w);
+}
+
+// Whether the file changed on disk while the buffer had unsaved edits.
+static inline bool watcher_conflict(const FileWatcher *w, const Buffer *b) {
+  for (size_t i = 0; i < w->num_files; i++)
+    if (w->files[i]->buffer == b)
+      return w->files[i]->conflict;
+  return false;
+}
+
+// Reads pending events, applies finished reloads and starts new ones.
+// Never blocks; call it every time around the main loop.
+static inline void watcher_poll(FileWatcher *w) {
+  _Alignas(struct inotify_event) char events[4096];
+  ssize_t n;
+  while ((n = read(w->fd, events, sizeof(events))) > 0) {
+    const struct inotify_event *e;
+    for (char *p = events; p < events + n; p += sizeof(*e) + e->len) {
+      e = (const struct inotify_event *)p;
+      for (size_t i = 0; i < w->num_files; i++) {
+        WatchedFile *f = w->files[i];
+        if ((e->mask & IN_Q_OVERFLOW) ||
+            (f->wd == e->wd && e->len && !strcmp(e->name, f->name)))
+          f->changed = true;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < w->num_files; i++) {
+    WatchedFile *f = w->files[i];
+    if (f->job && pool_idle(&f->running))
+      reloadFinish(f);
+    if (f->job || !f->changed)
+      continue;
+    f->changed = false;
+    if (buffer_modified(f->buffer))
+      f->conflict = true;
+    else
+      reloadSubmit(f);
+  }
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef REPLACE_H
+#define REPLACE_H
+
+#include "buffer.h"
+#include "pool.h"
+#include "search.h"
+
+// Replace-all in a buffer. The buffer is cut into segments and each is
+// searched by its own job over a snapshot; the matches are then applied
+// with buffer_replace_all, so a million replacements are still one edit:
+// one pass over the pieces, one undo group, and one delete and one insert
+// for listeners to catch up on.
+//
+// Matches don't overlap and are taken leftmost first, as a single search
+// from the start would find them.
+
+#define REPLACE_SEGMENT ((size_t)1 << 20)
+
+typedef struct {
+  const BufferSnapshot *snapshot;
+  const size_t *span_starts;
+  const char *needle;
+  size_t needle_len;
+  bool ignore_case;
+
+  size_t begin, end; // Matches starting in here are this job's.
+  size_t *matches;
+  size_t count, cap;
+  bool failed;
+} ReplaceSegment;
+
+// Copies n bytes of the snapshot's text from offset on.
+static inline void replaceCopy(const BufferSnapshot *snap,
+                               const size_t *starts, size_t offset,
+                               size_t n, char *out) {
+  size_t lo = 0, hi = snap->num_spans;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (starts[mid] <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  for (size_t i = lo; n; i++) {
+    size_t skip = offset - starts[i];
+    size_t take = bufferMin(n, snap->spans[i].len - skip);
+    memcpy(out, snap->spans[i].text + skip, take);
+    out += take;
+    offset += take;
+    n -= take;
+  }
+}
+
+static inline bool replacePush(ReplaceSegment *seg, size_t offset) {
+  if (seg->count == seg->cap) {
+    size_t cap = seg->cap ? seg->cap * 2 : 256;
+    size_t *matches = realloc(seg->matches, cap * sizeof(size_t));
+    if (!matches)
+      return false;
+    seg->matches = matches;
+    seg->cap = cap;
+  }
+  seg->matches[seg->count++] = offset;
+  return true;
+}
+
+static void replaceSearch(void *arg) {
+  ReplaceSegment *seg = arg;
+  seg->count = 0;
+  if (seg->begin >= seg->end)
+    return;
+  // A match starting near the end runs on past it.
+  size_t n = bufferMin(seg->end + seg->needle_len - 1,
+                       seg->snapshot->size) - seg->begin;
+  char *text = malloc(n);
+  if (!text) {
+    seg->failed = true;
+    return;
+  }
+  replaceCopy(seg->snapshot, seg->span_starts, seg->begin, n, text);
+  size_t limit = seg->end - seg->begin;
+  for (size_t at = 0; at < limit;) {
+    size_t found = searchFind(text + at, n - at, seg->needle,
+                              seg->needle_len, seg->ignore_case);
+    if (found == n - at || at + found >= limit)
+      break;
+    if (!replacePush(seg, seg->begin + at + found)) {
+      seg->failed = true;
+      break;
+    }
+    at += found + seg->needle_len;
+  }
+  free(text);
+}
+
+// Replaces every match of needle in the buffer with the given text, as
+// one edit. *replaced is set to the number of matches.
+static inline bool replace_all(Buffer *b, const char *needle,
+                               size_t needle_len, const char *with,
+                               size_t with_len, bool ignore_case,
+                               size_t *replaced) {
+  *replaced = 0;
+  if (!needle_len)
+    return false;
+  BufferSnapshot *snap = buffer_snapshot(b);
+  size_t num_segments = snap ? snap->size / REPLACE_SEGMENT + 1 : 0;
+  size_t *starts = snap ? malloc((snap->num_spans + 1) * sizeof(size_t))
+                        : NULL;
+  ReplaceSegment *segs =
+      starts ? calloc(num_segments, sizeof(ReplaceSegment)) : NULL;
+  if (!segs) {
+    buffer_release(snap);
+    free(starts);
+    return false;
+  }
+  for (size_t i = 0, at = 0; i < snap->num_spans; i++) {
+    starts[i] = at;
+    at += snap->spans[i].len;
+  }
+
+  PoolGroup group = {0};
+  for (size_t i = 0; i < num_segments; i++) {
+    segs[i] = (ReplaceSegment){
+        .snapshot = snap,
+        .span_starts = starts,
+        .needle = needle,
+        .needle_len = needle_len,
+        .ignore_case = ignore_case,
+        .begin = i * REPLACE_SEGMENT,
+        .end = bufferMin((i + 1) * REPLACE_SEGMENT, snap->size),
+    };
+    pool_submit(pool_shared(), &group, replaceSearch, &segs[i]);
+  }
+  pool_wait(pool_shared(), &group);
+
+  // Gather them in order. A segment whose first match overlaps the last
+  // one before it started out of step with a search from the start, so
+  // it's searched again from the end of that match.
+  size_t total = 0, end = 0;
+  bool ok = true;
+  for (size_t i = 0; i < num_segments; i++) {
+    if (segs[i].count && segs[i].matches[0] < end) {
+      segs[i].begin = end;
+      replaceSearch(&segs[i]);
+    }
+    ok &= !segs[i].failed;
+    total += segs[i].count;
+    if (segs[i].count)
+      end = segs[i].matches[segs[i].count - 1] + needle_len;
+  }
+  size_t *matches = ok ? malloc((total ? total : 1) * sizeof(size_t)) : NULL;
+  if (matches) {
+    size_t n = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+      if (segs[i].count)
+        memcpy(matches + n, segs[i].matches,
+               segs[i].count * sizeof(size_t));
+      n += segs[i].count;
+    }
+    ok = buffer_replace_all(b, matches, total, needle_len, with, with_len);
+    if (ok)
+      *replaced = total;
+  }
+  for (size_t i = 0; i < num_segments; i++)
+    free(segs[i].matches);
+  free(segs);
+  free(matches);
+  free(starts);
+  buffer_release(snap);
+  return matches && ok;
+}
+
+#endif
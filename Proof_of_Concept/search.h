@@ -0,0 +1,567 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "arena.h"
+#include "finder.h"
+#include "pool.h"
+#include "tui.h"
+
+#include <regex.h>
+#include <sys/mman.h>
+
+// Project-wide grep over the file index the finder builds. A search is a
+// tree of range jobs: each splits its range of files in half until it is
+// small enough to scan, pushing the other half onto its worker's deque
+// for idle workers to steal. Hits are published per file as they are
+// found, so the list fills in while the search runs. Changing the query
+// cancels the running search and starts a new one.
+
+#define SEARCH_SPLIT 32
+#define SEARCH_MMAP_MIN ((size_t)32 << 10)
+#define SEARCH_BINARY_PROBE 8192
+#define SEARCH_MAX_LINE 512
+#define SEARCH_MAX_QUERY 256
+#define SEARCH_PAGE_HITS 16384
+#define SEARCH_MAX_PAGES 8
+#define SEARCH_MAX_HITS (SEARCH_PAGE_HITS * SEARCH_MAX_PAGES)
+
+typedef struct {
+  size_t file; // Index into the finder's entries.
+  size_t line; // 1-based.
+  const char *text;
+  uint32_t len;
+} SearchHit;
+
+typedef struct SearchRun {
+  struct SearchRun *next;
+  FinderIndex *files;
+  size_t num_files; // Entries of the index this run covers.
+
+  // What to look for. The literal is a string every match has to
+  // contain; it is found first and the regex only runs on lines that
+  // have it. A pattern that is all literal never runs the regex.
+  char literal[SEARCH_MAX_QUERY];
+  size_t literal_len;
+  bool use_regex, ignore_case, compiled;
+  regex_t regex;
+
+  atomic_bool cancelled;
+  PoolGroup scanning;
+  atomic_size_t files_done;
+
+  // Hits, in the order files finished. Appends hold lock; readers only
+  // look below num_hits.
+  pthread_mutex_t lock;
+  Arena text;
+  SearchHit *pages[SEARCH_MAX_PAGES];
+  atomic_size_t num_hits;
+  atomic_bool truncated;
+} SearchRun;
+
+typedef struct {
+  SearchRun *run;
+  size_t begin, end;
+} SearchRange;
+
+typedef struct {
+  size_t line;
+  size_t start, len;
+} SearchLocalHit;
+
+typedef struct ProjectSearch {
+  FinderIndex *files;
+  char query[SEARCH_MAX_QUERY];
+  size_t query_len;
+  bool ignore_case, bad_pattern;
+  SearchRun *current, *retired;
+  size_t top, selected;
+} ProjectSearch;
+
+static inline SearchHit *search_hit(SearchRun *run, size_t i) {
+  return &run->pages[i / SEARCH_PAGE_HITS][i % SEARCH_PAGE_HITS];
+}
+
+static inline bool searchIsLetter(char c) {
+  return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+static inline char searchFold(char c, bool ignore_case) {
+  return ignore_case && searchIsLetter(c) ? (char)(c | 0x20) : c;
+}
+
+static inline bool searchEqual(const char *a, const char *b, size_t n,
+                               bool ignore_case) {
+  if (!ignore_case)
+    return !memcmp(a, b, n);
+  for (size_t i = 0; i < n; i++)
+    if (searchFold(a[i], true) != searchFold(b[i], true))
+      return false;
+  return true;
+}
+
+// Offset of the first occurrence of needle in hay, or n. Candidates are
+// positions where both the first and the last byte of the needle line up,
+// checked 16 at a time; only those get compared in full.
+static inline size_t searchFind(const char *hay, size_t n, const char *needle,
+                                size_t m, bool ignore_case) {
+  if (!m || m > n)
+    return m ? n : 0;
+  char first = searchFold(needle[0], ignore_case);
+  char last = searchFold(needle[m - 1], ignore_case);
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i fold_first = _mm_set1_epi8(
+      ignore_case && searchIsLetter(first) ? 0x20 : 0);
+  __m128i fold_last = _mm_set1_epi8(
+      ignore_case && searchIsLetter(last) ? 0x20 : 0);
+  __m128i want_first = _mm_set1_epi8(first);
+  __m128i want_last = _mm_set1_epi8(last);
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i)),
+                             fold_first);
+    __m128i b = _mm_or_si128(
+        _mm_loadu_si128((const __m128i *)(hay + i + m - 1)), fold_last);
+    unsigned hits = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(a, want_first), _mm_cmpeq_epi8(b, want_last)));
+    while (hits) {
+      size_t at = i + (size_t)__builtin_ctz(hits);
+      if (searchEqual(hay + at + 1, needle + 1, m - 1, ignore_case))
+        return at;
+      hits &= hits - 1;
+    }
+  }
+#endif
+  for (; i + m <= n; i++)
+    if (searchFold(hay[i], ignore_case) == first &&
+        searchEqual(hay + i, needle, m, ignore_case))
+      return i;
+  return n;
+}
+
+// Picks the longest run of plain characters that every match of an
+// extended regex must contain. Alternation and groups make that hard to
+// know, so those patterns get no literal. Returns whether the whole
+// pattern was plain.
+static inline bool searchExtractLiteral(SearchRun *run, const char *pattern,
+                                        size_t len) {
+  run->literal_len = 0;
+  if (memchr(pattern, '|', len) || memchr(pattern, '(', len))
+    return false;
+
+  char current[SEARCH_MAX_QUERY];
+  size_t n = 0;
+  bool plain = true;
+  for (size_t i = 0; i <= len; i++) {
+    char c = i < len ? pattern[i] : 0;
+    bool meta = !c || strchr(".[]^$*+?{}\\", c);
+    if (!meta) {
+      current[n++] = c;
+      continue;
+    }
+    if (c)
+      plain = false;
+    // The character before an optional quantifier isn't required.
+    if (n && (c == '*' || c == '?' || c == '{'))
+      n--;
+    if (n > run->literal_len) {
+      memcpy(run->literal, current, n);
+      run->literal_len = n;
+    }
+    n = 0;
+    if (c == '\\')
+      i++;
+    else if (c == '[') {
+      // Skip the bracket expression; a ] right after [ or [^ is literal.
+      i++;
+      if (i < len && pattern[i] == '^')
+        i++;
+      if (i < len && pattern[i] == ']')
+        i++;
+      while (i < len && pattern[i] != ']')
+        i++;
+    } else if (c == '{') {
+      // Skip the bounds, whose digits aren't in the text.
+      while (i < len && pattern[i] != '}')
+        i++;
+    }
+  }
+  return plain;
+}
+
+static inline size_t searchCountLines(const char *p, const char *end) {
+  size_t n = 0;
+  while ((p = memchr(p, '\n', (size_t)(end - p))))
+    n++, p++;
+  return n;
+}
+
+// Copies one file's hits in and makes them visible.
+static inline void searchPublish(SearchRun *run, size_t file, const char *data,
+                                 SearchLocalHit *hits, size_t count) {
+  pthread_mutex_lock(&run->lock);
+  size_t n = atomic_load(&run->num_hits);
+  for (size_t i = 0; i < count; i++) {
+    size_t page = n / SEARCH_PAGE_HITS;
+    if (page == SEARCH_MAX_PAGES) {
+      atomic_store(&run->truncated, true);
+      break;
+    }
+    if (!run->pages[page] &&
+        !(run->pages[page] = tui_malloc(ALLOC_COMPONENT,
+                                        SEARCH_PAGE_HITS * sizeof(SearchHit))))
+      break;
+    size_t len = MIN(hits[i].len, SEARCH_MAX_LINE);
+    const char *text = arena_copy(&run->text, data + hits[i].start, len);
+    if (!text)
+      break;
+    *search_hit(run, n++) = (SearchHit){file, hits[i].line, text, (uint32_t)len};
+  }
+  atomic_store(&run->num_hits, n);
+  pthread_mutex_unlock(&run->lock);
+}
+
+static inline void searchScan(SearchRun *run, size_t file, const char *data,
+                              size_t size) {
+  SearchLocalHit *hits = NULL;
+  size_t num_hits = 0, cap_hits = 0;
+
+  const char *end = data + size;
+  const char *pos = data, *counted = data;
+  size_t line = 1;
+  while (pos < end) {
+    const char *line_start, *line_end;
+    if (run->literal_len) {
+      size_t at = searchFind(pos, (size_t)(end - pos), run->literal,
+                             run->literal_len, run->ignore_case);
+      if (at == (size_t)(end - pos))
+        break;
+      const char *hit = pos + at;
+      line_start = hit;
+      while (line_start > pos && line_start[-1] != '\n')
+        line_start--;
+      line_end = memchr(hit, '\n', (size_t)(end - hit));
+      line_end = line_end ? line_end : end;
+
+      if (run->use_regex) {
+        regmatch_t m = {.rm_so = 0, .rm_eo = line_end - line_start};
+        if (regexec(&run->regex, line_start, 1, &m, REG_STARTEND)) {
+          pos = line_end + 1;
+          continue;
+        }
+      }
+    } else {
+      regmatch_t m = {.rm_so = 0, .rm_eo = end - pos};
+      if (regexec(&run->regex, pos, 1, &m, REG_STARTEND))
+        break;
+      const char *hit = pos + m.rm_so;
+      line_start = hit;
+      while (line_start > pos && line_start[-1] != '\n')
+        line_start--;
+      line_end = memchr(hit, '\n', (size_t)(end - hit));
+      line_end = line_end ? line_end : end;
+    }
+
+    line += searchCountLines(counted, line_start);
+    if (num_hits == cap_hits) {
+      size_t cap = cap_hits ? cap_hits * 2 : 16;
+      SearchLocalHit *more =
+          tui_realloc(ALLOC_COMPONENT, hits, cap * sizeof(SearchLocalHit));
+      if (!more)
+        break;
+      hits = more;
+      cap_hits = cap;
+    }
+    hits[num_hits++] = (SearchLocalHit){line, (size_t)(line_start - data),
+                                        (size_t)(line_end - line_start)};
+    pos = counted = line_end + 1;
+    line++;
+  }
+
+  if (num_hits)
+    searchPublish(run, file, data, hits, num_hits);
+  tui_free(ALLOC_COMPONENT, hits);
+}
+
+static inline void searchFile(SearchRun *run, size_t file) {
+  const FinderEntry *e = finder_entry(run->files, file);
+  char path[PATH_MAX];
+  if (e->len >= sizeof(path))
+    return;
+  memcpy(path, e->path, e->len);
+  path[e->len] = 0;
+
+  int fd = openat(run->files->rootfd, path, O_RDONLY | O_NOCTTY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+    close(fd);
+    return;
+  }
+
+  // Small files are cheaper to read than to map.
+  size_t size = (size_t)st.st_size;
+  char small[SEARCH_MMAP_MIN];
+  const char *data = small;
+  bool mapped = size >= SEARCH_MMAP_MIN;
+  if (mapped) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+  } else {
+    ssize_t n = read(fd, small, size);
+    size = n > 0 ? (size_t)n : 0;
+  }
+  close(fd);
+
+  // Same heuristic as grep: a NUL near the start means binary.
+  if (size && !memchr(data, 0, MIN(size, SEARCH_BINARY_PROBE)))
+    searchScan(run, file, data, size);
+
+  if (mapped)
+    munmap((void *)data, (size_t)st.st_size);
+}
+
+static void searchRange(void *arg) {
+  SearchRange r = *(SearchRange *)arg;
+  tui_free(ALLOC_COMPONENT, arg);
+  SearchRun *run = r.run;
+
+  // Split until the range is small, leaving halves for others to steal.
+  while (r.end - r.begin > SEARCH_SPLIT) {
+    size_t mid = r.begin + (r.end - r.begin) / 2;
+    SearchRange *half = tui_malloc(ALLOC_COMPONENT, sizeof(SearchRange));
+    if (!half)
+      break;
+    *half = (SearchRange){run, mid, r.end};
+    pool_submit(pool_shared(), &run->scanning, searchRange, half);
+    r.end = mid;
+  }
+
+  for (size_t i = r.begin; i < r.end; i++) {
+    if (atomic_load(&run->cancelled))
+      return;
+    searchFile(run, i);
+    atomic_fetch_add(&run->files_done, 1);
+  }
+}
+
+static inline void searchFreeRun(SearchRun *run) {
+  if (run->compiled)
+    regfree(&run->regex);
+  for (size_t i = 0; i < SEARCH_MAX_PAGES; i++)
+    tui_free(ALLOC_COMPONENT, run->pages[i]);
+  arena_free(&run->text);
+  pthread_mutex_destroy(&run->lock);
+  tui_free(ALLOC_COMPONENT, run);
+}
+
+static inline void searchReap(ProjectSearch *s) {
+  SearchRun **link = &s->retired;
+  while (*link) {
+    SearchRun *run = *link;
+    if (pool_idle(&run->scanning)) {
+      *link = run->next;
+      searchFreeRun(run);
+    } else {
+      link = &run->next;
+    }
+  }
+}
+
+static inline void searchRetire(ProjectSearch *s) {
+  if (!s->current)
+    return;
+  atomic_store(&s->current->cancelled, true);
+  s->current->next = s->retired;
+  s->retired = s->current;
+  s->current = NULL;
+}
+
+// Cancels the running search, if any, and starts one for the current
+// query. The old search's jobs wind down on their own.
+static inline void search_restart(ProjectSearch *s) {
+  searchRetire(s);
+  searchReap(s);
+  s->top = s->selected = 0;
+  s->bad_pattern = false;
+  if (!s->query_len)
+    return;
+
+  SearchRun *run = tui_calloc(ALLOC_COMPONENT, 1, sizeof(SearchRun));
+  if (!run)
+    return;
+  run->files = s->files;
+  run->ignore_case = s->ignore_case;
+  pthread_mutex_init(&run->lock, NULL);
+
+  char pattern[SEARCH_MAX_QUERY + 1];
+  memcpy(pattern, s->query, s->query_len);
+  pattern[s->query_len] = 0;
+  bool plain = searchExtractLiteral(run, pattern, s->query_len);
+  run->use_regex = !plain && run->literal_len;
+  if (!plain) {
+    int flags = REG_EXTENDED | REG_NEWLINE | (s->ignore_case ? REG_ICASE : 0);
+    if (regcomp(&run->regex, pattern, flags)) {
+      s->bad_pattern = true;
+      searchFreeRun(run);
+      return;
+    }
+    run->compiled = true;
+  }
+
+  run->num_files = atomic_load(&s->files->num_entries);
+  s->current = run;
+  SearchRange *all = tui_malloc(ALLOC_COMPONENT, sizeof(SearchRange));
+  if (!all)
+    return;
+  *all = (SearchRange){run, 0, run->num_files};
+  pool_submit(pool_shared(), &run->scanning, searchRange, all);
+}
+
+// files has to outlive the search.
+static inline ProjectSearch *search_open(FinderIndex *files) {
+  ProjectSearch *s = tui_calloc(ALLOC_COMPONENT, 1, sizeof(ProjectSearch));
+  if (s)
+    s->files = files;
+  return s;
+}
+
+static inline void search_close(ProjectSearch *s) {
+  if (!s)
+    return;
+  searchRetire(s);
+  for (SearchRun *run = s->retired; run; run = run->next)
+    pool_wait(pool_shared(), &run->scanning);
+  searchReap(s);
+  tui_free(ALLOC_COMPONENT, s);
+}
+
+static inline void search_set_query(ProjectSearch *s, const char *query,
+                                    size_t len) {
+  s->query_len = MIN(len, SEARCH_MAX_QUERY);
+  memmove(s->query, query, s->query_len);
+  search_restart(s);
+}
+
+static void search_render(Component *self, TMT *screen) {
+  ProjectSearch *s = self->search;
+  Position pos = self->pos;
+  searchReap(s);
+  if (!pos.height || !pos.width)
+    return;
+
+  SearchRun *run = s->current;
+  size_t num_hits = run ? atomic_load(&run->num_hits) : 0;
+  char prompt[SEARCH_MAX_QUERY + 96];
+  int n;
+  if (s->bad_pattern)
+    n = snprintf(prompt, sizeof(prompt), "/%.*s  (bad pattern)",
+                 (int)s->query_len, s->query);
+  else
+    n = snprintf(prompt, sizeof(prompt), "/%.*s  (%zu%s hits, %zu/%zu files)%s",
+                 (int)s->query_len, s->query, num_hits,
+                 run && atomic_load(&run->truncated) ? "+" : "",
+                 run ? atomic_load(&run->files_done) : 0,
+                 run ? run->num_files : 0, s->ignore_case ? " [i]" : "");
+  moveCursor(screen, pos.x, pos.y);
+  drawText(screen, prompt, (size_t)MIN(n, sizeof(prompt) - 1), pos.width);
+
+  uint16_t rows = pos.height - 1;
+  if (s->selected >= num_hits)
+    s->selected = num_hits ? num_hits - 1 : 0;
+  if (s->selected < s->top)
+    s->top = s->selected;
+  else if (rows && s->selected >= s->top + rows)
+    s->top = s->selected - rows + 1;
+
+  for (uint16_t i = 0; i < rows; i++) {
+    size_t h = s->top + i;
+    moveCursor(screen, pos.x, pos.y + 1 + i);
+    if (h >= num_hits) {
+      drawText(screen, "", 0, pos.width);
+      continue;
+    }
+    const SearchHit *hit = search_hit(run, h);
+    const FinderEntry *e = finder_entry(s->files, hit->file);
+    char line[SEARCH_MAX_LINE + PATH_MAX + 32];
+    int len = snprintf(line, sizeof(line), "%.*s:%zu: %.*s", (int)e->len,
+                       e->path, hit->line, (int)hit->len, hit->text);
+    if (h == s->selected)
+      tmt_write(screen, "\x1b[7m", 4);
+    drawText(screen, line, (size_t)MIN(len, sizeof(line) - 1), pos.width);
+    if (h == s->selected)
+      tmt_write(screen, "\x1b[0m", 4);
+  }
+}
+
+static void search_resize(Component *self, Position new_pos) {
+  self->pos = new_pos;
+}
+
+static int search_onKeypress(Component *self, KeyEvent event) {
+  ProjectSearch *s = self->search;
+  switch (event.key) {
+  case 0x0e: // ^N
+    s->selected++;
+    return 1;
+  case 0x10: // ^P
+    if (s->selected)
+      s->selected--;
+    return 1;
+  case 0x09: // Tab toggles case sensitivity.
+    s->ignore_case = !s->ignore_case;
+    search_restart(s);
+    return 1;
+  case 0x08:
+  case 0x7f: {
+    size_t len = s->query_len;
+    while (len && ((unsigned char)s->query[len - 1] & 0xC0) == 0x80)
+      len--;
+    search_set_query(s, s->query, len ? len - 1 : 0);
+    return 1;
+  }
+  default: {
+    if (event.key < 0x20)
+      return 0;
+    char bytes[4];
+    size_t len = utf8_put((uint32_t)event.key, bytes);
+    if (!len || s->query_len + len > SEARCH_MAX_QUERY)
+      return 1;
+    char query[SEARCH_MAX_QUERY];
+    memcpy(query, s->query, s->query_len);
+    memcpy(query + s->query_len, bytes, len);
+    search_set_query(s, query, s->query_len + len);
+    return 1;
+  }
+  }
+}
+
+static inline Component *search_new(GlobalContext *context,
+                                    FinderIndex *files) {
+  Component *c = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Component));
+  if (!c)
+    return NULL;
+  if (!(c->search = search_open(files))) {
+    tui_free(ALLOC_COMPONENT, c);
+    return NULL;
+  }
+  c->context = context;
+  c->kind = COMPONENT_SEARCH;
+  c->render = search_render;
+  c->resize = search_resize;
+  c->onKeypress = search_onKeypress;
+  return c;
+}
+
+static inline void search_free(Component *c) {
+  if (!c)
+    return;
+  search_close(c->search);
+  tui_free(ALLOC_COMPONENT, c);
+}
+
+#endif
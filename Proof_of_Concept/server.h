@@ -0,0 +1,335 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "session.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// One editor process for any number of terminals. The server owns what
+// is worth having once: buffers, file indexes (see FinderIndex), caches
+// and the pool. Each terminal runs a thin client that attaches over a
+// local socket, and gets a context of its own (see tui_context_open()):
+// its own components, and its own screen model, so each is only sent
+// what changed on its own screen. A new window costs a connect and a
+// frame; nothing is loaded or walked again.
+//
+// A client speaks the session format (see session.h) to the server, the
+// same records a session file has: its size first, then its input and
+// resizes as they come. The server sends back what the client writes to
+// its terminal, as it is.
+//
+// A server, say with a finder per window over one shared index:
+//
+//   tui_init_headless(80, 24); // The server has no terminal of its own.
+//   FinderIndex *index = finder_index_open(".");
+//   EditorServer *s = server_listen(path, open_window, close_window, index);
+//   for (;;)
+//     server_poll(s, -1);
+//
+// where open_window() sets context->rootComponent to a
+// finder_new_shared(context, index), and close_window() frees it. And in
+// each terminal, client_attach(path).
+//
+// Everything runs on the server's one thread, a client at a time, with
+// tui_context pointing at the client being handled. Frames are written
+// whole, so a client that stops reading holds the others up; it's a local
+// socket, and a client that isn't reading has usually gone. The stats in
+// tui_stats are the whole server's. Clients' frames use only the basic
+// sequences (see caps.h); what their terminals can do stays with them.
+
+#define SERVER_MAX_CLIENTS 32
+#define SERVER_MAX_INPUT 65536 // Unread input past this drops the client.
+
+// Makes a new client's components in context, from whatever the server
+// shares through arg. Returns false to turn the client away.
+typedef bool (*ServerOpenFn)(GlobalContext *context, void *arg);
+// Frees the components of a client that's gone.
+typedef void (*ServerCloseFn)(GlobalContext *context, void *arg);
+
+typedef struct {
+  int fd;
+  bool attached; // Its size has come, and its context is open.
+  GlobalContext context;
+  size_t len;
+  unsigned char input[SERVER_MAX_INPUT];
+} ServerClient;
+
+typedef struct {
+  int fd;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  ServerOpenFn open;
+  ServerCloseFn close;
+  void *arg;
+  size_t num_clients;
+  ServerClient *clients[SERVER_MAX_CLIENTS];
+} EditorServer;
+
+static inline bool serverAddress(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  size_t n = strlen(path);
+  if (!n || n >= sizeof(addr->sun_path))
+    return false;
+  memcpy(addr->sun_path, path, n + 1);
+  return true;
+}
+
+// Listens on the socket at path. A socket left there by a server that's
+// gone is replaced; one with a server still behind it isn't, and NULL is
+// returned.
+static inline EditorServer *server_listen(const char *path,
+                                          ServerOpenFn open_fn,
+                                          ServerCloseFn close_fn, void *arg) {
+  struct sockaddr_un addr;
+  if (!serverAddress(path, &addr))
+    return NULL;
+  EditorServer *s = calloc(1, sizeof(EditorServer));
+  if (!s)
+    return NULL;
+  s->open = open_fn;
+  s->close = close_fn;
+  s->arg = arg;
+  memcpy(s->path, addr.sun_path, sizeof(s->path));
+
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool taken =
+      probe >= 0 && !connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+  if (probe >= 0)
+    close(probe);
+  if (taken || (s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    free(s);
+    return NULL;
+  }
+  unlink(path);
+  // Only its owner should be typing into someone's editor.
+  mode_t mask = umask(077);
+  bool bound = !bind(s->fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (!bound || listen(s->fd, SERVER_MAX_CLIENTS)) {
+    close(s->fd);
+    free(s);
+    return NULL;
+  }
+  // A client gone mid-frame is noticed by the next read, not by dying.
+  signal(SIGPIPE, SIG_IGN);
+  return s;
+}
+
+static inline void serverDrop(EditorServer *s, size_t i) {
+  ServerClient *c = s->clients[i];
+  if (c->attached) {
+    tui_context = &c->context;
+    if (s->close)
+      s->close(&c->context, s->arg);
+    tui_context_close(&c->context);
+  }
+  close(c->fd);
+  free(c);
+  s->clients[i] = s->clients[--s->num_clients];
+  s->clients[s->num_clients] = NULL;
+}
+
+static inline void serverAccept(EditorServer *s) {
+  int fd = accept(s->fd, NULL, NULL);
+  if (fd < 0)
+    return;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  ServerClient *c = s->num_clients < SERVER_MAX_CLIENTS
+                        ? calloc(1, sizeof(ServerClient))
+                        : NULL;
+  if (!c) {
+    close(fd);
+    return;
+  }
+  c->fd = fd;
+  s->clients[s->num_clients++] = c;
+}
+
+// Opens the client's context once its size has come.
+static inline bool serverAttach(EditorServer *s, ServerClient *c,
+                                uint64_t width, uint64_t height) {
+  if (!width || !height || width > UINT16_MAX || height > UINT16_MAX ||
+      !tui_context_open(&c->context, (uint16_t)width, (uint16_t)height,
+                        c->fd))
+    return false;
+  c->attached = true;
+  if (!s->open || !s->open(&c->context, s->arg) ||
+      !c->context.rootComponent) {
+    c->context._exiting = true;
+    return true;
+  }
+  resizeRoot();
+  return true;
+}
+
+// Handles whatever whole records the client has sent. Returns false if
+// what it sent isn't a session.
+static inline bool serverHandle(EditorServer *s, ServerClient *c) {
+  const unsigned char *p = c->input, *end = c->input + c->len;
+  tui_context = &c->context;
+  if (!c->attached) {
+    size_t magic = sizeof(SESSION_MAGIC) - 1;
+    uint64_t width, height;
+    if (memcmp(p, SESSION_MAGIC, MIN(c->len, magic)))
+      return false;
+    if (!sessionGetHeader(&p, end, &width, &height))
+      return c->len < magic + 20; // Two varints could still be coming.
+    if (!serverAttach(s, c, width, height))
+      return false;
+  }
+  SessionRecord r;
+  while (!c->context._exiting && sessionGetRecord(&p, end, &r)) {
+    if (r.op == SESSION_INPUT) {
+      tui_note_input();
+      sessionSendKeys(r.bytes, r.a);
+    } else if (r.a && r.b && r.a <= UINT16_MAX && r.b <= UINT16_MAX) {
+      sessionResize((uint16_t)r.a, (uint16_t)r.b);
+    }
+  }
+  if (p < end && *p != SESSION_INPUT && *p != SESSION_RESIZE)
+    return false;
+  c->len = (size_t)(end - p);
+  memmove(c->input, p, c->len);
+  return true;
+}
+
+// Reads what the client sent. Returns false once it's gone, or has sent
+// more than it could mean.
+static inline bool serverRead(ServerClient *c) {
+  if (c->len == sizeof(c->input))
+    return false;
+  ssize_t got = read(c->fd, c->input + c->len, sizeof(c->input) - c->len);
+  if (got < 0)
+    return errno == EINTR || errno == EAGAIN;
+  c->len += (size_t)got;
+  return got > 0;
+}
+
+// Redraws every client. Call when something they share has changed other
+// than through their input, such as a file having finished loading;
+// server_poll() already redraws after any client's input.
+static inline void server_render_all(EditorServer *s) {
+  for (size_t i = 0; i < s->num_clients; i++) {
+    ServerClient *c = s->clients[i];
+    if (!c->attached || c->context._exiting)
+      continue;
+    tui_context = &c->context;
+    render_window();
+  }
+  tui_context = &tui_globalcontext;
+}
+
+// Waits up to timeout milliseconds (-1 for as long as it takes) for new
+// clients and input, handles it, and redraws. Returns whether anything
+// came.
+static inline bool server_poll(EditorServer *s, int timeout) {
+  struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+  size_t n = s->num_clients;
+  fds[0] = (struct pollfd){.fd = s->fd, .events = POLLIN};
+  for (size_t i = 0; i < n; i++)
+    fds[i + 1] = (struct pollfd){.fd = s->clients[i]->fd, .events = POLLIN};
+  if (poll(fds, n + 1, timeout) <= 0)
+    return false;
+
+  // Backwards, since a client dropped takes the last one's place.
+  bool handled = false;
+  for (size_t i = n; i-- > 0;) {
+    if (!fds[i + 1].revents)
+      continue;
+    ServerClient *c = s->clients[i];
+    if (!serverRead(c) || !serverHandle(s, c) || c->context._exiting)
+      serverDrop(s, i);
+    handled = true;
+  }
+  tui_context = &tui_globalcontext;
+  if (fds[0].revents & POLLIN)
+    serverAccept(s);
+  // Shared state may have changed under any of them.
+  if (handled)
+    server_render_all(s);
+  return handled || fds[0].revents;
+}
+
+static inline void server_close(EditorServer *s) {
+  if (!s)
+    return;
+  while (s->num_clients)
+    serverDrop(s, s->num_clients - 1);
+  tui_context = &tui_globalcontext;
+  close(s->fd);
+  unlink(s->path);
+  free(s);
+}
+
+/////////////
+// Client  //
+/////////////
+
+// Attaches this terminal to the server at path, until the server lets it
+// go or the terminal is closed. Returns false if there was no server to
+// attach to.
+static inline bool client_attach(const char *path) {
+  struct sockaddr_un addr;
+  int fd = serverAddress(path, &addr)
+               ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)
+               : -1;
+  if (fd < 0)
+    return false;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return false;
+  }
+  tui_init();
+  FILE *out = fdopen(fd, "wb");
+  SessionRecorder *to_server =
+      out ? session_record_stream(out, tui_globalcontext.window_width,
+                                  tui_globalcontext.window_height)
+          : NULL;
+  if (!to_server) {
+    if (!out)
+      close(fd);
+    tui_deinit();
+    return false;
+  }
+
+  char bytes[65536];
+  while (!tui_globalcontext._exiting) {
+    if (tui_globalcontext._needs_resize) {
+      tui_globalcontext._needs_resize = 0;
+      updateSize();
+      session_record_resize(to_server, tui_globalcontext.window_width,
+                            tui_globalcontext.window_height);
+    }
+    struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                            {.fd = fd, .events = POLLIN}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue; // A resize, or time to go.
+      break;
+    }
+    if (fds[0].revents) {
+      // The terminal's answers to tui_init() are its own business.
+      ssize_t got = caps_read(STDIN_FILENO, bytes, sizeof(bytes));
+      if (got < 0 && errno == EAGAIN)
+        continue;
+      if (got <= 0)
+        break;
+      session_record_input(to_server, bytes, (size_t)got);
+    }
+    if (fds[1].revents) {
+      ssize_t got = read(fd, bytes, sizeof(bytes));
+      if (got <= 0)
+        break;
+      tuiWrite(bytes, (size_t)got);
+    }
+  }
+  session_record_stop(to_server);
+  tui_deinit();
+  return true;
+}
+
+#endif
@@ -0,0 +1,399 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "tui.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Recording sessions and replaying them, to reproduce a slow session from
+// a real terminal without one. What's recorded is what came in: the raw
+// bytes read from stdin, each read with when it happened, and the window's
+// size whenever it changed.
+//
+// Replay runs against the headless backend (tui_init_headless()) with a
+// simulated clock. Input is taken in order of its recorded time; whatever
+// arrived while the previous frame was still being made is handled in one
+// go before the next frame, as it would have been. The report gives, for
+// each read and resize, how long until the frame showing it was done, and
+// which frame that was.
+//
+// A session file starts with SESSION_MAGIC and the starting width and
+// height, then has records of an op, the nanoseconds since the last record
+// and either a length and that many bytes, or a new width and height. All
+// numbers are varints.
+
+#define SESSION_MAGIC "edsess01"
+
+enum { SESSION_INPUT = 'i', SESSION_RESIZE = 'r' };
+
+typedef struct {
+  FILE *file;
+  uint64_t last; // When the last record was made.
+  uint16_t width, height;
+} SessionRecorder;
+
+typedef struct {
+  uint64_t at;      // Recorded time, from the start of the session.
+  uint64_t latency; // From then until its frame was done.
+  uint64_t work;    // What making that frame really took.
+  size_t frame;
+  size_t output_bytes; // Of that frame.
+  char kind;           // SESSION_INPUT or SESSION_RESIZE.
+} SessionEvent;
+
+typedef struct {
+  SessionEvent *events;
+  size_t num_events;
+  size_t frames, keys;
+  uint64_t duration; // Simulated, to the end of the last frame.
+} SessionReport;
+
+static inline size_t sessionPutVarint(unsigned char *p, uint64_t v) {
+  size_t n = 0;
+  for (; v >= 0x80; v >>= 7)
+    p[n++] = (unsigned char)(v | 0x80);
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+static inline bool sessionGetVarint(const unsigned char **p,
+                                    const unsigned char *end, uint64_t *v) {
+  *v = 0;
+  for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char c = *(*p)++;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static inline bool sessionWriteRecord(SessionRecorder *r, char op,
+                                      uint64_t a, uint64_t b,
+                                      const void *bytes) {
+  unsigned char head[32];
+  uint64_t now = tuiNow();
+  size_t n = 0;
+  head[n++] = (unsigned char)op;
+  n += sessionPutVarint(head + n, now - r->last);
+  n += sessionPutVarint(head + n, a);
+  if (op == SESSION_RESIZE)
+    n += sessionPutVarint(head + n, b);
+  r->last = now;
+  bool ok = fwrite(head, 1, n, r->file) == n;
+  if (bytes)
+    ok &= fwrite(bytes, 1, a, r->file) == a;
+  // A session is most wanted when the editor didn't get to exit cleanly.
+  return fflush(r->file) == 0 && ok;
+}
+
+// Starts recording to f, which the recorder then owns, for a window of the
+// given size. Records are flushed as they're made, so f can as well be a
+// socket as a file; a client of an editor server (see server.h) sends its
+// terminal's input this way.
+static inline SessionRecorder *session_record_stream(FILE *f, uint16_t width,
+                                                     uint16_t height) {
+  SessionRecorder *r = calloc(1, sizeof(SessionRecorder));
+  if (!r) {
+    fclose(f);
+    return NULL;
+  }
+  r->file = f;
+  unsigned char head[sizeof(SESSION_MAGIC) + 8];
+  size_t n = sizeof(SESSION_MAGIC) - 1;
+  memcpy(head, SESSION_MAGIC, n);
+  n += sessionPutVarint(head + n, width);
+  n += sessionPutVarint(head + n, height);
+  r->width = width;
+  r->height = height;
+  r->last = tuiNow();
+  if (fwrite(head, 1, n, r->file) != n || fflush(r->file)) {
+    fclose(r->file);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+// Starts recording to path, for a window of the given size.
+static inline SessionRecorder *session_record_start(const char *path,
+                                                    uint16_t width,
+                                                    uint16_t height) {
+  FILE *f = fopen(path, "wb");
+  return f ? session_record_stream(f, width, height) : NULL;
+}
+
+// Records to the file named by $TUI_SESSION_FILE, if it's set, at the
+// window's current size. Call after tui_init().
+static inline SessionRecorder *session_record_from_env(void) {
+  const char *path = getenv("TUI_SESSION_FILE");
+  if (!path || !*path)
+    return NULL;
+  return session_record_start(path, tui_globalcontext.window_width,
+                              tui_globalcontext.window_height);
+}
+
+// The recording calls all take a NULL recorder, and do nothing with it.
+static inline void session_record_input(SessionRecorder *r, const void *bytes,
+                                        size_t n) {
+  if (r && n)
+    sessionWriteRecord(r, SESSION_INPUT, n, 0, bytes);
+}
+
+// Call with each RESIZE event's size; sizes that didn't change are left
+// out.
+static inline void session_record_resize(SessionRecorder *r, uint16_t width,
+                                         uint16_t height) {
+  if (!r || (width == r->width && height == r->height))
+    return;
+  r->width = width;
+  r->height = height;
+  sessionWriteRecord(r, SESSION_RESIZE, width, height, NULL);
+}
+
+// read(), less the terminal's answers to tui_init()'s questions (see
+// caps_read()), recording whatever it got and timing it for the latency
+// histogram (see tui_note_input()).
+static inline ssize_t session_read(SessionRecorder *r, int fd, void *bytes,
+                                   size_t n) {
+  ssize_t got = caps_read(fd, bytes, n);
+  if (got > 0) {
+    tui_note_input();
+    session_record_input(r, bytes, (size_t)got);
+  }
+  return got;
+}
+
+static inline bool session_record_stop(SessionRecorder *r) {
+  if (!r)
+    return true;
+  bool ok = fclose(r->file) == 0;
+  free(r);
+  return ok;
+}
+
+// Feeds a read's bytes to the components as keys, a character at a time.
+// Nothing parses escape sequences yet, so they come through as their
+// bytes; bytes that aren't UTF-8 come through as themselves.
+static inline size_t sessionSendKeys(const unsigned char *p, size_t n) {
+  size_t keys = 0;
+  while (n && !tui_context->_exiting) {
+    uint32_t c;
+    size_t used = utf8_get(p, n, &c);
+    if (!used) {
+      c = *p;
+      used = 1;
+    }
+    Event e = {.kind = KEY, .keyEvent = {(wchar_t)c}};
+    tui_stats.current.events++;
+    dispatchEvent(&e);
+    p += used;
+    n -= used;
+    keys++;
+  }
+  return keys;
+}
+
+static inline void sessionResize(uint16_t width, uint16_t height) {
+  tui_context->window_width = width;
+  tui_context->window_height = height;
+  tmt_resize(tui_context->screen, height, width);
+  resizeRoot();
+  tui_stats.current.events++;
+}
+
+typedef struct {
+  char op;
+  uint64_t at, a, b;
+  const unsigned char *bytes;
+} SessionRecord;
+
+// Reads a session's magic and starting size from *p, moving it past them.
+static inline bool sessionGetHeader(const unsigned char **p,
+                                    const unsigned char *end, uint64_t *width,
+                                    uint64_t *height) {
+  size_t magic = sizeof(SESSION_MAGIC) - 1;
+  if ((size_t)(end - *p) < magic || memcmp(*p, SESSION_MAGIC, magic))
+    return false;
+  *p += magic;
+  return sessionGetVarint(p, end, width) && sessionGetVarint(p, end, height);
+}
+
+// Reads the record at *p, with the time since the last one as its at, and
+// moves *p past it. Returns false, leaving *p alone, if the record is cut
+// off before end or isn't one.
+static inline bool sessionGetRecord(const unsigned char **p,
+                                    const unsigned char *end,
+                                    SessionRecord *record) {
+  const unsigned char *q = *p;
+  if (q == end)
+    return false;
+  SessionRecord r = {.op = (char)*q++};
+  if (r.op != SESSION_INPUT && r.op != SESSION_RESIZE)
+    return false;
+  if (!sessionGetVarint(&q, end, &r.at) || !sessionGetVarint(&q, end, &r.a))
+    return false;
+  if (r.op == SESSION_RESIZE && !sessionGetVarint(&q, end, &r.b))
+    return false;
+  if (r.op == SESSION_INPUT) {
+    if (r.a > (uint64_t)(end - q))
+      return false;
+    r.bytes = q;
+    q += r.a;
+  }
+  *record = r;
+  *p = q;
+  return true;
+}
+
+// Reads every record of a session, or none if it's damaged. A record cut
+// off at the end, as when the editor died mid-write, ends the session.
+static inline SessionRecord *sessionParse(const unsigned char *p, size_t n,
+                                          uint64_t *width, uint64_t *height,
+                                          size_t *count) {
+  const unsigned char *end = p + n;
+  if (!sessionGetHeader(&p, end, width, height))
+    return NULL;
+  SessionRecord *records = NULL;
+  size_t cap = 0;
+  uint64_t at = 0;
+  for (*count = 0; p < end; (*count)++) {
+    SessionRecord r;
+    if (!sessionGetRecord(&p, end, &r))
+      break;
+    r.at = at += r.at;
+    if (*count == cap) {
+      cap = cap ? 2 * cap : 256;
+      SessionRecord *grown = realloc(records, cap * sizeof(SessionRecord));
+      if (!grown) {
+        free(records);
+        return NULL;
+      }
+      records = grown;
+    }
+    records[*count] = r;
+  }
+  return records ? records : calloc(1, sizeof(SessionRecord));
+}
+
+// Replays the session at path into the components of the headless screen,
+// from the size it was recorded at. Each frame is taken to cost frame_ns
+// of simulated time, or if that's 0 what it really took; a fixed cost
+// makes which input lands in which frame the same on every machine.
+// Returns false if the session couldn't be read or the screen isn't
+// headless.
+static inline bool session_replay(const char *path, uint64_t frame_ns,
+                                  SessionReport *report) {
+  memset(report, 0, sizeof(*report));
+  if (!_tui_headless || !tui_context->rootComponent)
+    return false;
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+  unsigned char *data = NULL;
+  size_t n = 0, cap = 0;
+  for (;;) {
+    if (n == cap) {
+      unsigned char *grown = realloc(data, cap = cap ? 2 * cap : 65536);
+      if (!grown)
+        break;
+      data = grown;
+    }
+    size_t got = fread(data + n, 1, cap - n, f);
+    if (!got)
+      break;
+    n += got;
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+
+  uint64_t width, height;
+  size_t count = 0;
+  SessionRecord *records =
+      ok ? sessionParse(data, n, &width, &height, &count) : NULL;
+  if (!records || !width || !height || width > UINT16_MAX ||
+      height > UINT16_MAX ||
+      !(report->events = calloc(count + 1, sizeof(SessionEvent)))) {
+    free(records);
+    free(data);
+    return false;
+  }
+
+  sessionResize((uint16_t)width, (uint16_t)height);
+  render_window();
+  uint64_t now = 0;
+  for (size_t i = 0; i < count && !tui_context->_exiting;) {
+    if (records[i].at > now)
+      now = records[i].at; // Idle until it came.
+    uint64_t start = tuiNow();
+    size_t j = i;
+    for (; j < count && records[j].at <= now; j++) {
+      if (records[j].op == SESSION_INPUT)
+        report->keys += sessionSendKeys(records[j].bytes, records[j].a);
+      else if (records[j].a && records[j].b && records[j].a <= UINT16_MAX &&
+               records[j].b <= UINT16_MAX)
+        sessionResize((uint16_t)records[j].a, (uint16_t)records[j].b);
+    }
+    render_window();
+    uint64_t work = tuiNow() - start;
+    now += frame_ns ? frame_ns : work;
+    for (; i < j; i++)
+      report->events[report->num_events++] = (SessionEvent){
+          .at = records[i].at,
+          .latency = now - records[i].at,
+          .work = work,
+          .frame = report->frames,
+          .output_bytes = tui_stats.last.output_bytes,
+          .kind = records[i].op,
+      };
+    report->frames++;
+  }
+  report->duration = now;
+  free(records);
+  free(data);
+  return true;
+}
+
+static inline int sessionCompareLatency(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Writes a line for each event, then the latency percentiles over all of
+// them.
+static inline void session_report_print(FILE *f,
+                                        const SessionReport *report) {
+  fprintf(f, "%12s %4s %10s %10s %8s %10s\n", "at ms", "kind", "latency",
+          "work", "frame", "out B");
+  for (size_t i = 0; i < report->num_events; i++) {
+    const SessionEvent *e = &report->events[i];
+    fprintf(f, "%12.3f %4c %10.3f %10.3f %8zu %10zu\n", (double)e->at / 1e6,
+            e->kind, (double)e->latency / 1e6, (double)e->work / 1e6,
+            e->frame, e->output_bytes);
+  }
+  fprintf(f, "%zu events, %zu keys, %zu frames over %.3f ms\n",
+          report->num_events, report->keys, report->frames,
+          (double)report->duration / 1e6);
+  uint64_t *sorted = malloc((report->num_events + 1) * sizeof(uint64_t));
+  if (!sorted || !report->num_events) {
+    free(sorted);
+    return;
+  }
+  for (size_t i = 0; i < report->num_events; i++)
+    sorted[i] = report->events[i].latency;
+  qsort(sorted, report->num_events, sizeof(uint64_t), sessionCompareLatency);
+  size_t last = report->num_events - 1;
+  fprintf(f, "latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+          (double)sorted[last / 2] / 1e6, (double)sorted[last * 99 / 100] / 1e6,
+          (double)sorted[last] / 1e6);
+  free(sorted);
+}
+
+static inline void session_report_free(SessionReport *report) {
+  free(report->events);
+  memset(report, 0, sizeof(*report));
+}
+
+#endif
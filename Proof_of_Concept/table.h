@@ -0,0 +1,546 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include "pool.h"
+#include "tui.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A read-only view of a CSV/TSV file. The file is mapped, never copied:
+// opening it only builds an index of where each row starts, in parallel
+// chunks, and fields are split out of the mapping for the rows on screen.
+
+#define TABLE_CHUNK_SIZE ((size_t)8 << 20)
+#define TABLE_MAX_COLUMNS 256
+#define TABLE_SAMPLE_ROWS 512
+#define TABLE_MAX_COLUMN_WIDTH 40
+
+typedef struct {
+  const char *start;
+  size_t len;
+} TableField;
+
+// Per-chunk state for the parallel index build.
+typedef struct {
+  const char *data;
+  size_t begin, end;
+  size_t quotes;   // Pass 1: number of '"' in the chunk.
+  bool in_quote;   // Pass 2: whether the chunk starts inside a quoted field.
+  uint64_t *rows;  // Pass 2: offsets of rows starting in this chunk.
+  size_t num_rows, cap_rows;
+  bool failed;
+} TableChunk;
+
+typedef struct TableView {
+  const char *data;
+  size_t size;
+  char delim;
+
+  // Byte offset of each row. rows[num_rows] == size, so a row always ends
+  // where the next one starts. Row 0 is the header.
+  uint64_t *rows;
+  size_t num_rows;
+
+  uint16_t num_columns;
+  uint16_t widths[TABLE_MAX_COLUMNS];
+
+  size_t top_row; // First data row on screen, as an index into the order.
+  uint16_t left_column;
+
+  // Display order of the data rows (row - 1), or NULL for file order.
+  // The sort thread hands a finished order over through pending_order
+  // and the UI thread adopts it on its next render.
+  size_t *order;
+  _Atomic(size_t *) pending_order;
+  atomic_uint sort_generation;
+  uint16_t sort_column;
+  bool sort_descending;
+  PoolGroup sorting;
+} TableView;
+
+typedef struct {
+  TableView *table;
+  unsigned generation;
+  uint16_t column;
+  bool descending;
+} TableSortJob;
+
+typedef struct {
+  size_t row;
+  const char *start;
+  size_t len;
+  bool numeric;
+  double number;
+} TableSortKey;
+
+static void tableCountQuotes(void *arg) {
+  TableChunk *chunk = arg;
+  const char *p = chunk->data + chunk->begin, *end = chunk->data + chunk->end;
+  size_t quotes = 0;
+  while ((p = memchr(p, '"', (size_t)(end - p)))) {
+    quotes++;
+    if (++p == end)
+      break;
+  }
+  chunk->quotes = quotes;
+}
+
+static inline bool tablePushRow(TableChunk *chunk, uint64_t offset) {
+  if (chunk->num_rows == chunk->cap_rows) {
+    size_t cap = chunk->cap_rows ? chunk->cap_rows * 2 : 1024;
+    uint64_t *rows =
+        tui_realloc(ALLOC_COMPONENT, chunk->rows, cap * sizeof(uint64_t));
+    if (!rows)
+      return chunk->failed = true, false;
+    chunk->rows = rows;
+    chunk->cap_rows = cap;
+  }
+  chunk->rows[chunk->num_rows++] = offset;
+  return true;
+}
+
+// Records every row that starts after a newline in this chunk. Once the
+// first pass has fixed the quote state at the chunk's start, each chunk
+// can be split on its own.
+static void tableFindRows(void *arg) {
+  TableChunk *chunk = arg;
+  const char *data = chunk->data;
+  size_t i = chunk->begin, end = chunk->end;
+  bool in_quote = chunk->in_quote;
+
+  while (i < end) {
+    if (!in_quote) {
+      // Outside quotes only two bytes matter; let memchr skip the rest.
+      const char *nl = memchr(data + i, '\n', end - i);
+      const char *q = memchr(data + i, '"', (nl ? (size_t)(nl - data) : end) - i);
+      if (q) {
+        in_quote = true;
+        i = (size_t)(q - data) + 1;
+      } else if (nl) {
+        i = (size_t)(nl - data) + 1;
+        if (!tablePushRow(chunk, i))
+          return;
+      } else {
+        break;
+      }
+    } else {
+      // An escaped quote ("") toggles twice, which is the same as not at all.
+      const char *q = memchr(data + i, '"', end - i);
+      if (!q)
+        break;
+      in_quote = false;
+      i = (size_t)(q - data) + 1;
+    }
+  }
+}
+
+static inline size_t tableSplitRow(const TableView *t, size_t row,
+                                   TableField *fields, size_t max_fields) {
+  const char *p = t->data + t->rows[row];
+  const char *end = t->data + t->rows[row + 1];
+  // Drop the line terminator.
+  if (end > p && end[-1] == '\n')
+    end--;
+  if (end > p && end[-1] == '\r')
+    end--;
+
+  size_t n = 0;
+  const char *field = p;
+  bool in_quote = false;
+  for (; p < end; p++) {
+    if (*p == '"')
+      in_quote = !in_quote;
+    else if (*p == t->delim && !in_quote) {
+      if (n < max_fields)
+        fields[n] = (TableField){field, (size_t)(p - field)};
+      n++;
+      field = p + 1;
+    }
+  }
+  if (n < max_fields)
+    fields[n] = (TableField){field, (size_t)(end - field)};
+  return n + 1;
+}
+
+// Strips the surrounding quotes of a field and collapses "" into ".
+static inline size_t tableUnquote(TableField f, char *out, size_t cap) {
+  if (f.len < 2 || f.start[0] != '"') {
+    size_t n = f.len < cap ? f.len : cap;
+    memcpy(out, f.start, n);
+    return n;
+  }
+  size_t n = 0;
+  const char *end = f.start + f.len - (f.start[f.len - 1] == '"');
+  for (const char *p = f.start + 1; p < end && n < cap; p++) {
+    out[n++] = *p;
+    if (*p == '"' && p + 1 < end && p[1] == '"')
+      p++;
+  }
+  return n;
+}
+
+static inline uint16_t tableTextWidth(const char *s, size_t n) {
+  size_t w = 0;
+  for (size_t i = 0; i < n; i++)
+    w += ((unsigned char)s[i] & 0xC0) != 0x80;
+  return w > UINT16_MAX ? UINT16_MAX : (uint16_t)w;
+}
+
+static inline void tableMeasureRow(TableView *t, size_t row) {
+  TableField fields[TABLE_MAX_COLUMNS];
+  char text[TABLE_MAX_COLUMN_WIDTH * 4];
+  size_t n = tableSplitRow(t, row, fields, TABLE_MAX_COLUMNS);
+  if (n > TABLE_MAX_COLUMNS)
+    n = TABLE_MAX_COLUMNS;
+  if (n > t->num_columns)
+    t->num_columns = (uint16_t)n;
+  for (size_t c = 0; c < n; c++) {
+    size_t len = tableUnquote(fields[c], text, sizeof(text));
+    uint16_t w = tableTextWidth(text, len);
+    if (w > TABLE_MAX_COLUMN_WIDTH)
+      w = TABLE_MAX_COLUMN_WIDTH;
+    if (w > t->widths[c])
+      t->widths[c] = w;
+  }
+}
+
+// Column widths come from the first rows plus rows spread evenly through
+// the rest of the file; measuring every row of a huge file isn't worth it.
+static inline void tableSampleWidths(TableView *t) {
+  size_t head = TABLE_SAMPLE_ROWS / 2;
+  for (size_t r = 0; r < t->num_rows && r < head; r++)
+    tableMeasureRow(t, r);
+  if (t->num_rows > head) {
+    size_t step = (t->num_rows - head) / (TABLE_SAMPLE_ROWS / 2) + 1;
+    for (size_t r = head; r < t->num_rows; r += step)
+      tableMeasureRow(t, r);
+  }
+  for (size_t c = 0; c < t->num_columns; c++)
+    if (!t->widths[c])
+      t->widths[c] = 1;
+}
+
+static inline bool tableBuildIndex(TableView *t) {
+  size_t num_chunks = t->size / TABLE_CHUNK_SIZE + 1;
+  TableChunk *chunks =
+      tui_calloc(ALLOC_COMPONENT, num_chunks, sizeof(TableChunk));
+  if (!chunks)
+    return false;
+  for (size_t k = 0; k < num_chunks; k++) {
+    chunks[k].data = t->data;
+    chunks[k].begin = k * TABLE_CHUNK_SIZE;
+    chunks[k].end = k + 1 == num_chunks ? t->size : (k + 1) * TABLE_CHUNK_SIZE;
+  }
+
+  Pool *pool = pool_shared();
+  PoolGroup group = {0};
+
+  // Pass 1: the quote parity before each chunk tells it whether it starts
+  // in the middle of a quoted field.
+  for (size_t k = 0; k < num_chunks; k++)
+    pool_submit(pool, &group, tableCountQuotes, &chunks[k]);
+  pool_wait(pool, &group);
+  size_t quotes = 0;
+  for (size_t k = 0; k < num_chunks; k++) {
+    chunks[k].in_quote = quotes & 1;
+    quotes += chunks[k].quotes;
+  }
+
+  // Pass 2: find row starts.
+  for (size_t k = 0; k < num_chunks; k++)
+    pool_submit(pool, &group, tableFindRows, &chunks[k]);
+  pool_wait(pool, &group);
+
+  size_t total = 1;
+  bool failed = false;
+  for (size_t k = 0; k < num_chunks; k++) {
+    total += chunks[k].num_rows;
+    failed |= chunks[k].failed;
+  }
+  if (!failed)
+    t->rows = tui_malloc(ALLOC_COMPONENT, (total + 1) * sizeof(uint64_t));
+  if (t->rows) {
+    size_t n = 0;
+    t->rows[n++] = 0;
+    for (size_t k = 0; k < num_chunks; k++) {
+      memcpy(t->rows + n, chunks[k].rows, chunks[k].num_rows * sizeof(uint64_t));
+      n += chunks[k].num_rows;
+    }
+    // A trailing newline doesn't start another row.
+    if (n > 1 && t->rows[n - 1] == t->size)
+      n--;
+    t->rows[n] = t->size;
+    t->num_rows = n;
+  }
+
+  for (size_t k = 0; k < num_chunks; k++)
+    tui_free(ALLOC_COMPONENT, chunks[k].rows);
+  tui_free(ALLOC_COMPONENT, chunks);
+  return t->rows != NULL;
+}
+
+// delim 0 guesses between tab and comma from the first line.
+static inline TableView *table_open(const char *path, char delim) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  TableView *t = tui_calloc(ALLOC_COMPONENT, 1, sizeof(TableView));
+  if (!t) {
+    close(fd);
+    return NULL;
+  }
+  t->size = (size_t)st.st_size;
+  t->data = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (t->data == MAP_FAILED) {
+    tui_free(ALLOC_COMPONENT, t);
+    return NULL;
+  }
+  madvise((void *)t->data, t->size, MADV_SEQUENTIAL);
+
+  if (!delim) {
+    const char *nl = memchr(t->data, '\n', t->size);
+    size_t len = nl ? (size_t)(nl - t->data) : t->size;
+    size_t tabs = 0, commas = 0;
+    for (size_t i = 0; i < len; i++)
+      tabs += t->data[i] == '\t', commas += t->data[i] == ',';
+    delim = tabs > commas ? '\t' : ',';
+  }
+  t->delim = delim;
+
+  if (!tableBuildIndex(t)) {
+    munmap((void *)t->data, t->size);
+    tui_free(ALLOC_COMPONENT, t);
+    return NULL;
+  }
+  madvise((void *)t->data, t->size, MADV_RANDOM);
+  tableSampleWidths(t);
+  return t;
+}
+
+static inline void table_close(TableView *t) {
+  if (!t)
+    return;
+  atomic_fetch_add(&t->sort_generation, 1);
+  pool_wait(pool_shared(), &t->sorting);
+  tui_free(ALLOC_COMPONENT, atomic_exchange(&t->pending_order, NULL));
+  tui_free(ALLOC_COMPONENT, t->order);
+  tui_free(ALLOC_COMPONENT, t->rows);
+  munmap((void *)t->data, t->size);
+  tui_free(ALLOC_COMPONENT, t);
+}
+
+static inline size_t table_data_rows(const TableView *t) {
+  return t->num_rows ? t->num_rows - 1 : 0;
+}
+
+static int tableCompareKeys(const void *a, const void *b) {
+  const TableSortKey *x = a, *y = b;
+  int c;
+  if (x->numeric && y->numeric)
+    c = (x->number > y->number) - (x->number < y->number);
+  else if (x->numeric != y->numeric)
+    c = x->numeric ? -1 : 1; // Numbers before text.
+  else {
+    c = memcmp(x->start, y->start, x->len < y->len ? x->len : y->len);
+    if (!c)
+      c = (x->len > y->len) - (x->len < y->len);
+  }
+  return c ? c : (x->row > y->row) - (x->row < y->row);
+}
+
+static void tableSort(void *arg) {
+  TableSortJob *job = arg;
+  TableView *t = job->table;
+  size_t n = table_data_rows(t);
+  TableSortKey *keys = tui_malloc(ALLOC_COMPONENT, n * sizeof(TableSortKey));
+  size_t *order = tui_malloc(ALLOC_COMPONENT, n * sizeof(size_t));
+  if (!keys || !order)
+    goto out;
+
+  TableField fields[TABLE_MAX_COLUMNS];
+  for (size_t i = 0; i < n; i++) {
+    // Give up early if a newer sort has been asked for.
+    if ((i & 0xFFFF) == 0 &&
+        atomic_load(&t->sort_generation) != job->generation)
+      goto out;
+    size_t nf = tableSplitRow(t, i + 1, fields, TABLE_MAX_COLUMNS);
+    TableField f = job->column < nf && job->column < TABLE_MAX_COLUMNS
+                       ? fields[job->column]
+                       : (TableField){"", 0};
+    if (f.len >= 2 && f.start[0] == '"')
+      f.start++, f.len -= 2;
+
+    char num[64];
+    char *endp = num;
+    size_t len = f.len < sizeof(num) - 1 ? f.len : sizeof(num) - 1;
+    memcpy(num, f.start, len);
+    num[len] = 0;
+    double value = len ? strtod(num, &endp) : 0;
+    keys[i] = (TableSortKey){i, f.start, f.len, len && !*endp, value};
+  }
+
+  qsort(keys, n, sizeof(TableSortKey), tableCompareKeys);
+  for (size_t i = 0; i < n; i++)
+    order[i] = keys[job->descending ? n - 1 - i : i].row;
+
+  if (atomic_load(&t->sort_generation) == job->generation) {
+    tui_free(ALLOC_COMPONENT, atomic_exchange(&t->pending_order, order));
+    order = NULL;
+  }
+
+out:
+  tui_free(ALLOC_COMPONENT, keys);
+  tui_free(ALLOC_COMPONENT, order);
+  tui_free(ALLOC_COMPONENT, job);
+}
+
+// Starts sorting the data rows by a column. Any sort still running is
+// abandoned; the result shows up on a later render.
+static inline void table_sort(TableView *t, uint16_t column, bool descending) {
+  TableSortJob *job = tui_malloc(ALLOC_COMPONENT, sizeof(TableSortJob));
+  if (!job)
+    return;
+  t->sort_column = column;
+  t->sort_descending = descending;
+  *job = (TableSortJob){t, atomic_fetch_add(&t->sort_generation, 1) + 1,
+                        column, descending};
+  pool_submit(pool_shared(), &t->sorting, tableSort, job);
+}
+
+static inline void tableDrawRow(TableView *t, TMT *screen, Position pos,
+                                uint16_t y, size_t row) {
+  TableField fields[TABLE_MAX_COLUMNS];
+  char text[TABLE_MAX_COLUMN_WIDTH * 4];
+  size_t nf = tableSplitRow(t, row, fields, TABLE_MAX_COLUMNS);
+
+  moveCursor(screen, pos.x, y);
+  uint16_t used = 0;
+  for (uint16_t c = t->left_column; c < t->num_columns && used < pos.width;
+       c++) {
+    uint16_t w = t->widths[c];
+    if (w > pos.width - used)
+      w = pos.width - used;
+    size_t len = c < nf ? tableUnquote(fields[c], text, sizeof(text)) : 0;
+    drawText(screen, text, len, w);
+    used += w;
+    if (used < pos.width) {
+      drawText(screen, "│", sizeof("│") - 1, 1);
+      used++;
+    }
+  }
+  if (used < pos.width)
+    drawText(screen, "", 0, pos.width - used);
+}
+
+static void table_render(Component *self, TMT *screen) {
+  TableView *t = self->table;
+  Position pos = self->pos;
+
+  size_t *order = atomic_exchange(&t->pending_order, NULL);
+  if (order) {
+    tui_free(ALLOC_COMPONENT, t->order);
+    t->order = order;
+  }
+
+  if (!pos.height || !pos.width)
+    return;
+
+  // The header stays put; only the rows under it scroll.
+  tableDrawRow(t, screen, pos, pos.y, 0);
+  size_t n = table_data_rows(t);
+  for (uint16_t i = 1; i < pos.height; i++) {
+    size_t index = t->top_row + i - 1;
+    if (index < n) {
+      size_t row = 1 + (t->order ? t->order[index] : index);
+      tableDrawRow(t, screen, pos, pos.y + i, row);
+    } else {
+      moveCursor(screen, pos.x, pos.y + i);
+      drawText(screen, "", 0, pos.width);
+    }
+  }
+}
+
+static void table_resize(Component *self, Position new_pos) {
+  self->pos = new_pos;
+}
+
+static int table_onKeypress(Component *self, KeyEvent event) {
+  TableView *t = self->table;
+  size_t n = table_data_rows(t);
+  size_t page = self->pos.height > 1 ? self->pos.height - 1 : 1;
+
+  switch (event.key) {
+  case L'j':
+    if (t->top_row + 1 < n)
+      t->top_row++;
+    break;
+  case L'k':
+    if (t->top_row)
+      t->top_row--;
+    break;
+  case L' ':
+    t->top_row = t->top_row + page < n ? t->top_row + page : t->top_row;
+    break;
+  case L'b':
+    t->top_row = t->top_row > page ? t->top_row - page : 0;
+    break;
+  case L'g':
+    t->top_row = 0;
+    break;
+  case L'G':
+    t->top_row = n > page ? n - page : 0;
+    break;
+  case L'l':
+    if (t->left_column + 1 < t->num_columns)
+      t->left_column++;
+    break;
+  case L'h':
+    if (t->left_column)
+      t->left_column--;
+    break;
+  case L's':
+    // Sorting the same column again flips the direction.
+    table_sort(t, t->left_column,
+               t->order && t->sort_column == t->left_column &&
+                   !t->sort_descending);
+    break;
+  default:
+    return 0;
+  }
+  return 1;
+}
+
+static inline Component *table_new(GlobalContext *context, const char *path,
+                                   char delim) {
+  Component *c = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Component));
+  if (!c)
+    return NULL;
+  if (!(c->table = table_open(path, delim))) {
+    tui_free(ALLOC_COMPONENT, c);
+    return NULL;
+  }
+  c->context = context;
+  c->kind = COMPONENT_TABLE;
+  c->render = table_render;
+  c->resize = table_resize;
+  c->onKeypress = table_onKeypress;
+  return c;
+}
+
+static inline void table_free(Component *c) {
+  if (!c)
+    return;
+  table_close(c->table);
+  tui_free(ALLOC_COMPONENT, c);
+}
+
+#endif
@@ -0,0 +1,512 @@
+#ifndef TERMINAL_H
+#define TERMINAL_H
+
+#include "pool.h"
+#include "tui.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+// A terminal pane: a shell on a pty, emulated by a TMT of its own. A
+// thread of the pane's own drains the pty as fast as the shell writes and
+// parses it into that TMT; what it answers, like a cursor position report,
+// is written back to the shell. So a shell flooding the pane never blocks
+// on a full pty, however slowly the editor draws.
+//
+// The drawing side only looks at the TMT when the thread says it changed,
+// which is at most once a frame however much was parsed in between. The
+// thread also skips output that would scroll off before it could ever be
+// seen (see terminalSkip), so something like yes(1) costs little more
+// than the read()s.
+//
+// Drawing copies the pane's cells straight into the screen model rather
+// than replaying them as escape sequences, and only marks the lines that
+// actually changed as dirty. Keys the pane gets go to the shell.
+
+#define TERMINAL_BATCH ((size_t)1 << 20) // Most read before parsing it.
+#define TERMINAL_MAX_ANSWER 256
+
+typedef struct Terminal {
+  TMT *vt; // Only touched under lock once the reader has started.
+  pthread_mutex_t lock;
+  pthread_t reader;
+  int master;
+  pid_t child;
+  bool exited;
+  int status; // As from waitpid, once exited.
+
+  // The reader writes a byte to notify when changed goes up, and stops
+  // when stop is written to.
+  atomic_bool changed, hungup;
+  int notify[2], stop[2];
+  Position shown; // Where the pane was last drawn.
+  size_t skipped; // Bytes of output never parsed.
+
+  bool cursor_visible;
+  // Answers the shell couldn't take yet, under lock; the reader adds to
+  // them and terminal_poll() sends what's left.
+  char answer[TERMINAL_MAX_ANSWER];
+  size_t answer_len;
+} Terminal;
+
+static inline size_t terminalMin(size_t a, size_t b) { return a < b ? a : b; }
+
+static inline void terminalFlushAnswer(Terminal *t) {
+  while (t->answer_len) {
+    ssize_t n = write(t->master, t->answer, t->answer_len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    memmove(t->answer, t->answer + n, t->answer_len - (size_t)n);
+    t->answer_len -= (size_t)n;
+  }
+}
+
+static void terminalCallback(tmt_msg_t m, TMT *vt, const void *arg,
+                             void *p) {
+  (void)vt;
+  Terminal *t = p;
+  switch (m) {
+  case TMT_MSG_ANSWER: {
+    size_t n = strlen(arg);
+    if (t->answer_len + n <= sizeof(t->answer)) {
+      memcpy(t->answer + t->answer_len, arg, n);
+      t->answer_len += n;
+    }
+    terminalFlushAnswer(t);
+    break;
+  }
+  case TMT_MSG_CURSOR:
+    t->cursor_visible = *(const char *)arg == 't';
+    break;
+  default:
+    break;
+  }
+}
+
+// Bytes that only write characters or move the cursor along or down a
+// line: no escapes, no bell, no utf8 (whose decoding state would matter).
+static inline bool terminalPlain(unsigned char c) {
+  return (c >= 0x20 && c < 0x7f) || c == '\r' || c == '\n' || c == '\t' ||
+         c == '\b';
+}
+
+// How much of p can go unparsed without changing what the pane ends up
+// showing. With the cursor on the bottom row and plain output, every row
+// from a carriage return on is the same whatever came before it, and once
+// that's followed by a screenful of line feeds, each of which scrolls,
+// nothing from before it is left on the screen either. So everything
+// before the last such carriage return can go. TMT keeps no scrollback,
+// so nothing would have kept those lines anyway.
+static inline size_t terminalSkip(const TMT *vt, const char *p, size_t n) {
+  const TMTSCREEN *s = &vt->screen;
+  if (vt->state != S_NUL || vt->nmb || vt->curs.r != s->nline - 1)
+    return 0;
+  size_t plain = 0;
+  while (plain < n && terminalPlain((unsigned char)p[plain]))
+    plain++;
+  size_t feeds = 0;
+  for (size_t i = plain; i-- > 0;) {
+    if (p[i] == '\n')
+      feeds++;
+    else if (p[i] == '\r' && feeds >= s->nline)
+      return i;
+  }
+  return 0;
+}
+
+static inline void terminalChanged(Terminal *t) {
+  if (!atomic_exchange(&t->changed, true)) {
+    char byte = 0;
+    write(t->notify[1], &byte, 1);
+  }
+}
+
+// The reader: waits for output, reads all there is (up to TERMINAL_BATCH),
+// and parses what terminalSkip leaves of it in one go.
+static void *terminalRead(void *arg) {
+  Terminal *t = arg;
+  char *batch = tui_malloc(ALLOC_COMPONENT, TERMINAL_BATCH);
+  struct pollfd fds[2] = {{.fd = t->master, .events = POLLIN},
+                          {.fd = t->stop[0], .events = POLLIN}};
+  bool gone = !batch;
+  while (!gone) {
+    if (poll(fds, 2, -1) < 0 && errno != EINTR)
+      break;
+    if (fds[1].revents)
+      break;
+    size_t len = 0;
+    while (len < TERMINAL_BATCH) {
+      ssize_t n = read(t->master, batch + len, TERMINAL_BATCH - len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        // EIO means the last process holding the other end has gone.
+        gone = n == 0 || errno != EAGAIN;
+        break;
+      }
+      len += (size_t)n;
+    }
+    if (len) {
+      pthread_mutex_lock(&t->lock);
+      size_t skip = terminalSkip(t->vt, batch, len);
+      tmt_write(t->vt, batch + skip, len - skip);
+      t->skipped += skip;
+      pthread_mutex_unlock(&t->lock);
+    }
+    if (gone)
+      atomic_store(&t->hungup, true);
+    if (len || gone)
+      terminalChanged(t);
+  }
+  tui_free(ALLOC_COMPONENT, batch);
+  return NULL;
+}
+
+static inline void terminalReap(Terminal *t) {
+  if (t->exited)
+    return;
+  int status;
+  if (waitpid(t->child, &status, WNOHANG) == t->child) {
+    t->exited = true;
+    t->status = status;
+  }
+}
+
+// Takes the reader's wake-up, sends answers the shell wasn't ready for,
+// and sees whether the shell has exited. Call when terminal_fd() is
+// readable; drawing the pane does too.
+static inline void terminal_poll(Terminal *t) {
+  char drain[64];
+  while (read(t->notify[0], drain, sizeof(drain)) > 0)
+    ;
+  pthread_mutex_lock(&t->lock);
+  terminalFlushAnswer(t);
+  pthread_mutex_unlock(&t->lock);
+  terminalReap(t);
+}
+
+// For the main loop to wait on: readable when the pane has something new
+// to draw. -1 once the shell has gone and that's been drawn.
+static inline int terminal_fd(const Terminal *t) {
+  return atomic_load(&t->hungup) && !atomic_load(&t->changed)
+             ? -1
+             : t->notify[0];
+}
+
+static inline void terminalSetSize(Terminal *t, Position pos) {
+  struct winsize ws = {.ws_row = pos.height, .ws_col = pos.width};
+  if (t->master >= 0)
+    ioctl(t->master, TIOCSWINSZ, &ws);
+}
+
+static void terminal_render(Component *self, TMT *screen) {
+  Terminal *t = self->terminal;
+  Position pos = self->pos;
+  terminal_poll(t);
+  // Nothing new, and drawn here already, unless the frame starts afresh.
+  if (!atomic_exchange(&t->changed, false) && !tui_context->repaint &&
+      !memcmp(&pos, &t->shown, sizeof(pos)))
+    return;
+  t->shown = pos;
+  const TMTSCREEN *to = tmt_screen(screen);
+  if (pos.y >= to->nline || pos.x >= to->ncol)
+    return;
+  pthread_mutex_lock(&t->lock);
+  const TMTSCREEN *from = tmt_screen(t->vt);
+  const TMTPOINT *cursor = tmt_cursor(t->vt);
+  bool cursor_visible = t->cursor_visible && !atomic_load(&t->hungup);
+  size_t rows =
+      terminalMin(terminalMin(from->nline, pos.height), to->nline - pos.y);
+  size_t cols =
+      terminalMin(terminalMin(from->ncol, pos.width), to->ncol - pos.x);
+  for (size_t r = 0; r < rows; r++) {
+    TMTCHAR line[cols ? cols : 1];
+    memcpy(line, from->lines[r]->chars, cols * sizeof(TMTCHAR));
+    if (cursor_visible && cursor->r == r && cursor->c < cols)
+      line[cursor->c].a.reverse = !line[cursor->c].a.reverse;
+    TMTLINE *dst = to->lines[pos.y + r];
+    if (!memcmp(dst->chars + pos.x, line, cols * sizeof(TMTCHAR)))
+      continue;
+    memcpy(dst->chars + pos.x, line, cols * sizeof(TMTCHAR));
+    dst->dirty = true;
+  }
+  tmt_clean(t->vt);
+  pthread_mutex_unlock(&t->lock);
+}
+
+static void terminal_resize(Component *self, Position new_pos) {
+  Terminal *t = self->terminal;
+  self->pos = new_pos;
+  if (!new_pos.width || !new_pos.height)
+    return;
+  pthread_mutex_lock(&t->lock);
+  bool resized = tmt_resize(t->vt, new_pos.height, new_pos.width);
+  pthread_mutex_unlock(&t->lock);
+  if (resized)
+    terminalSetSize(t, new_pos);
+  atomic_store(&t->changed, true);
+}
+
+// Encodes a key as xterm sends it, which is what programs expect whatever
+// TERM says. Characters go as utf8, made control characters by Ctrl and
+// led by ESC with Alt. Cursor keys, Home, End and F1-F4 are a final byte
+// after CSI (SS3 for F1-F4), the rest CSI, a number and ~; modifiers go
+// in a parameter, as 1 plus their bits. Returns 0 for no key at all.
+static inline size_t terminalEncodeKey(KeyEvent event, char out[16]) {
+  uint32_t key = (uint32_t)event.key;
+  unsigned mods = event.mods;
+  if (key < TUI_KEY_UP) {
+    size_t n = 0;
+    if (mods & TUI_MOD_ALT)
+      out[n++] = '\x1b';
+    if ((mods & TUI_MOD_CTRL) &&
+        ((key >= '@' && key <= '_') || (key >= 'a' && key <= 'z')))
+      key &= 0x1f;
+    else if ((mods & TUI_MOD_CTRL) && (key == ' ' || key == '?'))
+      key = key == ' ' ? 0 : 0x7f;
+    size_t len = utf8_put(key, out + n);
+    return len ? n + len : 0;
+  }
+
+  static const unsigned numbers[] = {15, 17, 18, 19, 20, 21, 23, 24};
+  char final = 0;
+  unsigned number = 0;
+  switch (key) {
+  case TUI_KEY_UP:
+    final = 'A';
+    break;
+  case TUI_KEY_DOWN:
+    final = 'B';
+    break;
+  case TUI_KEY_RIGHT:
+    final = 'C';
+    break;
+  case TUI_KEY_LEFT:
+    final = 'D';
+    break;
+  case TUI_KEY_HOME:
+    final = 'H';
+    break;
+  case TUI_KEY_END:
+    final = 'F';
+    break;
+  case TUI_KEY_INSERT:
+    number = 2;
+    break;
+  case TUI_KEY_DELETE:
+    number = 3;
+    break;
+  case TUI_KEY_PAGE_UP:
+    number = 5;
+    break;
+  case TUI_KEY_PAGE_DOWN:
+    number = 6;
+    break;
+  default:
+    if (key >= TUI_KEY_F1 && key < TUI_KEY_F1 + 4)
+      final = "PQRS"[key - TUI_KEY_F1];
+    else if (key > TUI_KEY_F1 + 3 && key <= TUI_KEY_F12)
+      number = numbers[key - TUI_KEY_F1 - 4];
+    else
+      return 0;
+  }
+  int n;
+  if (number && mods)
+    n = snprintf(out, 16, "\x1b[%u;%u~", number, 1 + mods);
+  else if (number)
+    n = snprintf(out, 16, "\x1b[%u~", number);
+  else if (mods)
+    n = snprintf(out, 16, "\x1b[1;%u%c", 1 + mods, final);
+  else
+    n = snprintf(out, 16, key >= TUI_KEY_F1 ? "\x1bO%c" : "\x1b[%c", final);
+  return (size_t)n;
+}
+
+// Every key goes to the shell, as xterm would send it.
+static int terminal_onKeypress(Component *self, KeyEvent event) {
+  Terminal *t = self->terminal;
+  if (atomic_load(&t->hungup))
+    return 0;
+  char bytes[16];
+  size_t len = terminalEncodeKey(event, bytes);
+  for (size_t at = 0; at < len;) {
+    ssize_t n = write(t->master, bytes + at, len - at);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    at += (size_t)n;
+  }
+  return 1;
+}
+
+// A pipe neither end of which blocks or goes to the shell.
+static inline bool terminalPipe(int fds[2]) {
+  if (pipe(fds))
+    return false;
+  for (int i = 0; i < 2; i++) {
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+  }
+  return true;
+}
+
+extern char **environ;
+
+// The shell's environment: the editor's, with TERM set to what the pane
+// emulates. Made before fork(), since the child can't allocate.
+static inline char **terminalEnv(void) {
+  size_t n = 0;
+  while (environ[n])
+    n++;
+  char **env = tui_malloc(ALLOC_COMPONENT, (n + 2) * sizeof(char *));
+  if (!env)
+    return NULL;
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++)
+    if (strncmp(environ[i], "TERM=", 5))
+      env[m++] = environ[i];
+  env[m++] = "TERM=ansi";
+  env[m] = NULL;
+  return env;
+}
+
+// Starts $SHELL (or /bin/sh) on a new pty, sized to pos.
+static inline Component *terminal_new(GlobalContext *context, Position pos) {
+  Component *c = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Component));
+  Terminal *t = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Terminal));
+  if (!c || !t)
+    goto fail;
+  t->master = t->notify[0] = t->notify[1] = t->stop[0] = t->stop[1] = -1;
+  t->cursor_visible = true;
+  pthread_mutex_init(&t->lock, NULL);
+  t->vt = tmt_open(pos.height ? pos.height : 1, pos.width ? pos.width : 1,
+                   terminalCallback, t, NULL);
+  if (!t->vt || !terminalPipe(t->notify) || !terminalPipe(t->stop))
+    goto fail;
+
+  // posix_openpt() and friends, without needing _XOPEN_SOURCE before
+  // every other include.
+  unsigned number;
+  int unlock = 0;
+  char name[32];
+  t->master = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (t->master < 0 || ioctl(t->master, TIOCSPTLCK, &unlock) ||
+      ioctl(t->master, TIOCGPTN, &number))
+    goto fail;
+  snprintf(name, sizeof(name), "/dev/pts/%u", number);
+  terminalSetSize(t, pos);
+
+  const char *shell = getenv("SHELL");
+  if (!shell || !*shell)
+    shell = "/bin/sh";
+  char **env = terminalEnv();
+  if (!env)
+    goto fail;
+  t->child = fork();
+  if (!t->child) {
+    // The shell gets a session of its own with the pty as its terminal,
+    // and the default signal handling the editor changed. Only what's
+    // safe between fork() and exec() in a threaded process is done here.
+    setsid();
+    int slave = open(name, O_RDWR);
+    if (slave < 0)
+      _exit(127);
+    ioctl(slave, TIOCSCTTY, 0);
+    dup2(slave, 0);
+    dup2(slave, 1);
+    dup2(slave, 2);
+    if (slave > 2)
+      close(slave);
+    struct sigaction dfl = {.sa_handler = SIG_DFL};
+    sigemptyset(&dfl.sa_mask);
+    const int sigs[] = {SIGINT, SIGTERM, SIGWINCH, SIGPIPE};
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(*sigs); i++)
+      sigaction(sigs[i], &dfl, NULL);
+    char *argv[] = {(char *)shell, NULL};
+    execve(shell, argv, env);
+    _exit(127);
+  }
+  tui_free(ALLOC_COMPONENT, env);
+  if (t->child < 0)
+    goto fail;
+  fcntl(t->master, F_SETFL, fcntl(t->master, F_GETFL) | O_NONBLOCK);
+  if (pthread_create(&t->reader, NULL, terminalRead, t)) {
+    kill(-t->child, SIGKILL);
+    waitpid(t->child, NULL, 0);
+    goto fail;
+  }
+  atomic_store(&t->changed, true);
+
+  c->terminal = t;
+  c->context = context;
+  c->pos = pos;
+  c->kind = COMPONENT_TERMINAL;
+  c->render = terminal_render;
+  c->resize = terminal_resize;
+  c->onKeypress = terminal_onKeypress;
+  return c;
+
+fail:
+  if (t) {
+    int fds[] = {t->master, t->notify[0], t->notify[1], t->stop[0],
+                 t->stop[1]};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(*fds); i++)
+      if (fds[i] >= 0)
+        close(fds[i]);
+    if (t->vt)
+      tmt_close(t->vt);
+    pthread_mutex_destroy(&t->lock);
+  }
+  tui_free(ALLOC_COMPONENT, t);
+  tui_free(ALLOC_COMPONENT, c);
+  return NULL;
+}
+
+// Gives a shell that's been hung up on a moment to go quietly before
+// making it, and reaps it. On the pool, so closing a pane never waits.
+static void terminalReapLater(void *arg) {
+  pid_t child = (pid_t)(intptr_t)arg;
+  for (int i = 0; i < 10; i++) {
+    if (waitpid(child, NULL, WNOHANG) == child)
+      return;
+    usleep(10000);
+  }
+  kill(-child, SIGKILL);
+  waitpid(child, NULL, 0);
+}
+
+// Hangs up on the shell, which is reaped in the background.
+static inline void terminal_free(Component *c) {
+  if (!c)
+    return;
+  Terminal *t = c->terminal;
+  char byte = 0;
+  write(t->stop[1], &byte, 1);
+  pthread_join(t->reader, NULL);
+  close(t->master);
+  terminalReap(t);
+  if (!t->exited) {
+    kill(-t->child, SIGHUP);
+    // Background, so a thread in pool_wait() never ends up sleeping in it.
+    pool_submit_background(pool_shared(), NULL, terminalReapLater,
+                           (void *)(intptr_t)t->child);
+  }
+  int fds[] = {t->notify[0], t->notify[1], t->stop[0], t->stop[1]};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(*fds); i++)
+    close(fds[i]);
+  tmt_close(t->vt);
+  pthread_mutex_destroy(&t->lock);
+  tui_free(ALLOC_COMPONENT, t);
+  tui_free(ALLOC_COMPONENT, c);
+}
+
+#endif
@@ -1,11 +1,1016 @@
+#define _GNU_SOURCE // For nftw().
+
+#include "bracket.h"
+#include "complete.h"
+#include "diff.h"
+#include "finder.h"
+#include "fold.h"
+#include "hud.h"
+#include "journal.h"
+#include "load.h"
+#include "lz.h"
+#include "macro.h"
+#include "minimap.h"
+#include "reload.h"
+#include "replace.h"
+#include "search.h"
+#include "server.h"
+#include "session.h"
+#include "table.h"
+#include "terminal.h"
 #include "tui.h"
 
+#include <assert.h>
+#include <ftw.h>
+
+static char test_dir[] = "/tmp/tui-test-XXXXXX";
+
+// Where a file called name goes in the test directory. Each call has a
+// buffer of its own until four more calls have been made.
+static const char *testPath(const char *name) {
+  static char paths[4][256];
+  static unsigned next;
+  char *path = paths[next++ % 4];
+  snprintf(path, sizeof(paths[0]), "%s/%s", test_dir, name);
+  return path;
+}
+
+static const char *testWrite(const char *name, const char *text) {
+  const char *path = testPath(name);
+  FILE *f = fopen(path, "wb");
+  assert(f);
+  fputs(text, f);
+  fclose(f);
+  return path;
+}
+
+static const char *testMkdir(const char *name) {
+  const char *path = testPath(name);
+  assert(!mkdir(path, 0700));
+  return path;
+}
+
+static int testRemove(const char *path, const struct stat *st, int flag,
+                      struct FTW *ftw) {
+  (void)st, (void)flag, (void)ftw;
+  return remove(path);
+}
+
+// The characters on a row of the screen, as ASCII.
+static const char *testRow(TMT *vt, size_t row) {
+  static char text[256];
+  const TMTSCREEN *s = tmt_screen(vt);
+  size_t n = 0;
+  for (; n < s->ncol && n + 1 < sizeof(text); n++)
+    text[n] = (char)s->lines[row]->chars[n].c;
+  text[n] = 0;
+  return text;
+}
+
+// The whole of a small buffer, as a string.
+static const char *testText(const Buffer *b) {
+  static char text[256];
+  size_t n = buffer_size(b);
+  assert(n < sizeof(text));
+  buffer_read(b, 0, n, text);
+  text[n] = 0;
+  return text;
+}
+
+// Reads a small file into a static buffer, setting *n to its length.
+static const char *testRead(const char *name, size_t *n) {
+  static char text[256];
+  FILE *f = fopen(testPath(name), "rb");
+  assert(f);
+  *n = fread(text, 1, sizeof(text), f);
+  fclose(f);
+  return text;
+}
+
+static void testTable(void) {
+  const char *path = testWrite("table.csv", "name,count,note\n"
+                                            "b,10,\"two\nlines\"\n"
+                                            "a,9,\"with \"\"quotes\"\", too\"\n"
+                                            "c,x,plain\n");
+  TableView *t = table_open(path, 0);
+  assert(t && t->delim == ',' && t->num_columns == 3);
+  // A newline or a comma in quotes doesn't end the row or the field.
+  assert(table_data_rows(t) == 3);
+  TableField fields[TABLE_MAX_COLUMNS];
+  assert(tableSplitRow(t, 2, fields, TABLE_MAX_COLUMNS) == 3);
+  assert(fields[0].len == 1 && fields[0].start[0] == 'a');
+
+  // Numbers sort as numbers, before text.
+  table_sort(t, 1, false);
+  pool_wait(pool_shared(), &t->sorting);
+  size_t *order = atomic_load(&t->pending_order);
+  assert(order && order[0] == 1 && order[1] == 0 && order[2] == 2);
+  table_close(t);
+}
+
+// A line filled to its last column wraps on the next character, even with
+// an SGR in between, but not once the cursor has been moved.
+static void testPendingWrap(void) {
+  TMT *vt = tmt_open(3, 5, NULL, NULL, NULL);
+  const char *colored = "abcde\x1b[31mX";
+  tmt_write(vt, colored, strlen(colored));
+  assert(!strcmp(testRow(vt, 0), "abcde") && testRow(vt, 1)[0] == 'X');
+  const char *returned = "\x1b[H\x1b[2Jabcde\rZ";
+  tmt_write(vt, returned, strlen(returned));
+  assert(!strcmp(testRow(vt, 0), "Zbcde") && testRow(vt, 1)[0] == ' ');
+  tmt_close(vt);
+}
+
+// The walk skips .git and what .gitignore says to, and a query's results
+// cover every entry walked once it's been collected.
+static void testFinder(void) {
+  testMkdir("tree");
+  testMkdir("tree/src");
+  testMkdir("tree/build");
+  testMkdir("tree/.git");
+  testWrite("tree/src/main.c", "");
+  testWrite("tree/src/util.c", "");
+  testWrite("tree/README", "");
+  testWrite("tree/build/main.o", "");
+  testWrite("tree/.git/HEAD", "");
+  testWrite("tree/.gitignore", "build/\n");
+  FileFinder *f = finder_open(testPath("tree"));
+  assert(f);
+  pool_wait(pool_shared(), &f->index->walking);
+  size_t n = atomic_load(&f->index->num_entries);
+  for (size_t i = 0; i < n; i++) {
+    const FinderEntry *e = finder_entry(f->index, i);
+    assert(!memmem(e->path, e->len, "build", 5));
+    assert(!memmem(e->path, e->len, ".git/", 5));
+  }
+
+  finder_set_query(f, "mainc", 5);
+  pool_wait(pool_shared(), &f->current->scoring);
+  finderCollect(f);
+  assert(!f->current && f->scored == n && f->num_results == 1);
+  char path[64];
+  assert(finder_selected(f, path, sizeof(path)) && !strcmp(path, "src/main.c"));
+  finder_close(f);
+}
+
+// A bounded repeat leaves no digits in the literal searched for first,
+// and lines the literal finds still have to match the whole pattern.
+static void testSearch(void) {
+  SearchRun probe = {0};
+  assert(!searchExtractLiteral(&probe, "abc{0,12}", 9));
+  assert(probe.literal_len == 2 && !memcmp(probe.literal, "ab", 2));
+  assert(searchExtractLiteral(&probe, "hello", 5) && probe.literal_len == 5);
+
+  testMkdir("grep");
+  testWrite("grep/a.txt", "one\nabc\nabbc\nabbbc\nxyz\n");
+  testWrite("grep/b.txt", "nothing here\n");
+  FinderIndex *x = finder_index_open(testPath("grep"));
+  assert(x);
+  pool_wait(pool_shared(), &x->walking);
+  ProjectSearch *s = search_open(x);
+  search_set_query(s, "ab{1,2}c", 8);
+  assert(s->current && s->current->use_regex);
+  pool_wait(pool_shared(), &s->current->scanning);
+  assert(atomic_load(&s->current->num_hits) == 2);
+  assert(search_hit(s->current, 0)->line == 2);
+  assert(search_hit(s->current, 1)->line == 3);
+
+  search_set_query(s, "xyz", 3);
+  pool_wait(pool_shared(), &s->current->scanning);
+  SearchHit *hit = search_hit(s->current, 0);
+  assert(atomic_load(&s->current->num_hits) == 1 && hit->line == 5);
+  assert(hit->len == 3 && !memcmp(hit->text, "xyz", 3));
+
+  search_set_query(s, "a(", 2);
+  assert(s->bad_pattern && !s->current);
+  search_close(s);
+  finder_index_close(x);
+}
+
+// Lines are found through the tree's newline counts across piece splits,
+// and the word index follows edits to the lines they touch.
+static void testWords(void) {
+  Buffer *b = buffer_new();
+  const char *text = "alpha beta\ngamma\n";
+  assert(b && buffer_insert(b, 0, text, strlen(text)));
+  WordIndex *idx = wordindex_new();
+  assert(idx && wordindex_attach(idx, b));
+  assert(buffer_insert(b, 6, "alphabet\nalpha ", 15));
+  assert(buffer_num_lines(b) == 4 && buffer_line_start(b, 1) == 15);
+  assert(buffer_line_of(b, 14) == 0 && buffer_line_of(b, 15) == 1);
+  size_t len;
+  char *line = buffer_line(b, 1, &len);
+  assert(len == 10 && !memcmp(line, "alpha beta", len));
+  free(line);
+
+  const WordNode *words[4];
+  assert(wordindex_complete(idx, "alp", 3, words, 4) == 2);
+  assert(words[0]->len == 5 && words[0]->count == 2);
+  assert(words[1]->len == 8 && words[1]->count == 1);
+  assert(buffer_delete(b, 6, 9));
+  assert(wordindex_complete(idx, "alp", 3, words, 4) == 1);
+  assert(words[0]->count == 2);
+  wordindex_free(idx);
+  buffer_close(b);
+}
+
+// Markers against the saved file come out right once the diff settles.
+static void testDiff(void) {
+  Buffer *b = buffer_open(testWrite("diff.txt", "a\nb\nc\nd\ne\n"));
+  assert(b);
+  DiffState *d = diff_attach(b);
+  assert(d);
+  assert(buffer_delete(b, 2, 1) && buffer_insert(b, 2, "B", 1));
+  assert(buffer_insert(b, 6, "new\n", 4));
+  assert(buffer_delete(b, 12, 2));
+  while (d->job || d->dirty) {
+    pool_wait(pool_shared(), &d->running);
+    diff_poll(d);
+  }
+  DiffMarker want[] = {DIFF_NONE, DIFF_CHANGED, DIFF_NONE,
+                       DIFF_ADDED, DIFF_NONE, DIFF_REMOVED};
+  for (size_t i = 0; i < 6; i++)
+    assert(diff_marker(d, i) == want[i]);
+
+  assert(buffer_save(b));
+  while (d->job || d->dirty) {
+    pool_wait(pool_shared(), &d->running);
+    diff_poll(d);
+  }
+  assert(!d->hunks.count);
+  diff_detach(d);
+  buffer_close(b);
+}
+
+// A change on disk comes in as edits that undo as one group, as does a
+// group made by hand.
+static void testReload(void) {
+  const char *path = testWrite("reload.txt", "one\ntwo\nthree\n");
+  Buffer *b = buffer_open(path);
+  FileWatcher *w = watcher_new();
+  assert(b && w && watcher_add(w, b));
+  testWrite("reload.txt", "one\n2\nthree\nfour\n");
+  for (int i = 0; i < 2000 && buffer_size(b) != 17; i++) {
+    watcher_poll(w);
+    usleep(1000);
+  }
+  assert(!strcmp(testText(b), "one\n2\nthree\nfour\n"));
+  assert(!buffer_modified(b) && !watcher_conflict(w, b));
+  assert(buffer_undo(b) && !strcmp(testText(b), "one\ntwo\nthree\n"));
+  assert(buffer_redo(b) && !strcmp(testText(b), "one\n2\nthree\nfour\n"));
+
+  buffer_begin_group(b);
+  assert(buffer_insert(b, 0, "zero\n", 5) && buffer_delete(b, 5, 4));
+  buffer_end_group(b);
+  assert(!strcmp(testText(b), "zero\n2\nthree\nfour\n"));
+  assert(buffer_undo(b) && !strcmp(testText(b), "one\n2\nthree\nfour\n"));
+  assert(buffer_undo(b) && !buffer_undo(b));
+  watcher_free(w);
+  buffer_close(b);
+}
+
+// Edits left in a journal are replayed when the file is opened again, up
+// to a torn record at the end, which is cut off.
+static void testJournal(void) {
+  const char *path = testWrite("journal.txt", "hello\n");
+  Buffer *b = buffer_open(path);
+  Journal *j = b ? journal_open(b) : NULL;
+  assert(j);
+  assert(buffer_insert(b, 0, "A", 1) && buffer_insert(b, 6, " world", 6));
+  assert(buffer_delete(b, 0, 1));
+  journal_close(j);
+  buffer_close(b);
+
+  const char *journal = testPath(".journal.txt.journal");
+  struct stat st;
+  assert(!stat(journal, &st));
+  off_t good = st.st_size;
+  FILE *f = fopen(journal, "ab");
+  assert(f);
+  fputs("i\x03\x02xy", f);
+  fclose(f);
+
+  b = buffer_open(testPath("journal.txt"));
+  j = b ? journal_open(b) : NULL;
+  assert(j && !strcmp(testText(b), "hello world\n"));
+  assert(!stat(journal, &st) && st.st_size == good);
+  assert(buffer_undo(b) && !strcmp(testText(b), "hello\n"));
+  // Once saved there's nothing to recover, and the journal goes.
+  assert(buffer_save(b));
+  journal_close(j);
+  buffer_close(b);
+  assert(stat(journal, &st));
+}
+
+// Lines map to rows and back around nested folds, and the folds move with
+// the lines they're on.
+static void testFold(void) {
+  Buffer *b = buffer_new();
+  const char *text = "0\n1\n2\n3\n4\n5\n6\n7\n8\n9\n10\n";
+  assert(b && buffer_insert(b, 0, text, strlen(text)));
+  FoldSet *f = fold_attach(b);
+  assert(f && fold_add(f, 2, 8, false) && fold_add(f, 3, 5, true));
+  assert(fold_add(f, 9, 10, true) && !fold_add(f, 4, 7, false));
+  assert(fold_num_rows(f) == 9);
+  assert(fold_row_of(f, 5) == 3 && fold_row_of(f, 6) == 4);
+  assert(fold_line_of(f, 4) == 6 && fold_line_of(f, 7) == 9);
+  assert(fold_line_of(f, 8) == 11);
+
+  assert(buffer_insert(b, 0, "a\nb\n", 4));
+  assert(fold_marker(f, 5) == FOLD_CLOSED && fold_marker(f, 4) == FOLD_OPEN);
+  assert(fold_toggle(f, 4) && fold_num_rows(f) == 7);
+  for (size_t row = 0; row < fold_num_rows(f); row++)
+    assert(fold_row_of(f, fold_line_of(f, row)) == row);
+  assert(fold_line_of(f, 5) == 11);
+  fold_detach(f);
+  buffer_close(b);
+}
+
+static void testMinimapSettle(Minimap *m) {
+  while (!m->ready || m->job || m->rebuild) {
+    pool_wait(pool_shared(), &m->running);
+    minimap_poll(m);
+  }
+}
+
+// Lines are found by bisecting the page starts, which are redone after an
+// edit moves them, and the sums over any range match the text.
+static void testMinimap(void) {
+  size_t num = 10000, n = 0;
+  char *text = malloc(num * 12);
+  assert(text);
+  for (size_t i = 0; i < num; i++)
+    n += (size_t)sprintf(text + n, "%s\n", i == 7001 ? "code needle"
+                                          : i % 4     ? "code"
+                                                      : "// note");
+  Buffer *b = buffer_new();
+  assert(b && buffer_insert(b, 0, text, n));
+  free(text);
+  Component *c = minimap_new(&tui_globalcontext, b, NULL);
+  assert(c);
+  Minimap *m = c->minimap;
+  minimap_set_query(m, "needle", 6);
+  testMinimapSettle(m);
+  assert(m->num_pages > 2 && m->num_lines == num + 1);
+
+  assert(buffer_insert(b, buffer_line_start(b, 100), "a\nb\nc\n", 6));
+  minimap_poll(m);
+  assert(m->num_lines == num + 4);
+  for (size_t i = 0; i < m->num_lines; i += 331) {
+    size_t line = i, walked = i, p = 0;
+    while (p + 1 < m->num_pages && walked >= m->pages[p]->count)
+      walked -= m->pages[p++]->count;
+    assert(minimapLocate(m, &line) == p && line == walked);
+  }
+  MinimapSum all = minimapSumLines(m, 0, m->num_lines);
+  assert(all.lines == num + 4 && all.comments == num / 4 && all.hits == 1);
+  assert(minimapSumLines(m, 7004, 1).hits == 1);
+  minimap_free(c);
+  buffer_close(b);
+}
+
+// Brackets in comments and strings don't count, even in a // comment cut
+// in half by a chunk boundary, and matches follow edits.
+static void testBracket(void) {
+  size_t size = BRACKET_CHUNK * 3, n = 0;
+  char *text = malloc(size + 64);
+  assert(text);
+  n += (size_t)sprintf(text, "{\n");
+  memset(text + n, ' ', BRACKET_CHUNK - 1 - n);
+  n = BRACKET_CHUNK - 1;
+  text[n++] = '/';
+  text[n++] = '/';
+  memset(text + n, '(', size - n);
+  n = size;
+  n += (size_t)sprintf(text + n, "\n/* ( */ f(\"(\", a[1]);\n}\n");
+  Buffer *b = buffer_new();
+  assert(b && buffer_insert(b, 0, text, n));
+  free(text);
+  BracketIndex *x = bracket_attach(b);
+  assert(x);
+  size_t match, call = size + 10;
+  assert(bracket_match(x, 0, &match) && match == n - 2);
+  assert(bracket_match(x, n - 2, &match) && !match);
+  assert(bracket_match(x, call, &match) && match == n - 5);
+  assert(!bracket_match(x, size - 1, &match));
+
+  // Ending the // comment early makes the brackets after it count.
+  assert(buffer_insert(b, BRACKET_CHUNK + 1, "\n", 1));
+  assert(!bracket_match(x, 0, &match));
+  assert(bracket_match(x, call + 1, &match) && match == n - 4);
+  bracket_detach(x);
+  buffer_close(b);
+}
+
+// Matches are taken leftmost first without overlapping, also where a run
+// crosses from one search segment into the next, and undo as one edit.
+static void testReplace(void) {
+  Buffer *b = buffer_new();
+  assert(b && buffer_insert(b, 0, "aaa bab aaaa", 12));
+  size_t replaced;
+  assert(replace_all(b, "aa", 2, "x", 1, false, &replaced) && replaced == 3);
+  assert(!strcmp(testText(b), "xa bab xx"));
+  assert(buffer_undo(b) && !strcmp(testText(b), "aaa bab aaaa"));
+  assert(replace_all(b, "AB", 2, "", 0, true, &replaced) && replaced == 1);
+  assert(!strcmp(testText(b), "aaa b aaaa"));
+  buffer_close(b);
+
+  size_t n = REPLACE_SEGMENT + 3;
+  char *text = malloc(n);
+  assert(text && (b = buffer_new()));
+  memset(text, 'a', n);
+  assert(buffer_insert(b, 0, text, n));
+  assert(replace_all(b, "aa", 2, "b", 1, false, &replaced));
+  assert(replaced == n / 2 && buffer_size(b) == n / 2 + 1);
+  buffer_read(b, 0, n / 2 + 1, text);
+  assert(text[0] == 'b' && text[n / 2 - 1] == 'b' && text[n / 2] == 'a');
+  free(text);
+  buffer_close(b);
+}
+
+// A recorded macro replays down the rest of the buffer, and the whole
+// replay undoes in one step.
+static void testMacro(void) {
+  Buffer *b = buffer_new();
+  assert(b && buffer_insert(b, 0, "one\ntwo\nthree\n", 14));
+  Component *c = textview_new(&tui_globalcontext, b, false);
+  assert(c);
+  // Record "- " and a move to the start of the next line, then replay.
+  const wchar_t keys[] = {0x12, '-', ' ', 0x0e, 0x02, 0x02, 0x12, 0x14};
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    assert(c->onKeypress(c, (KeyEvent){keys[i], 0}));
+  assert(c->text->macro.num_keys == 5);
+  assert(!strcmp(testText(b), "- one\n- two\n- three\n- "));
+  assert(c->onKeypress(c, (KeyEvent){0x1f, 0})); // ^_
+  assert(!strcmp(testText(b), "- one\ntwo\nthree\n"));
+  textview_free(c);
+  buffer_close(b);
+}
+
+// Keys go to the shell as xterm sends them, and what the shell writes
+// back ends up on the pane's screen.
+static void testTerminal(void) {
+  char out[16];
+  KeyEvent key = {'c', TUI_MOD_CTRL | TUI_MOD_ALT};
+  size_t n = terminalEncodeKey(key, out);
+  assert(n == 2 && !memcmp(out, "\x1b\x03", 2));
+  n = terminalEncodeKey((KeyEvent){TUI_KEY_UP, TUI_MOD_SHIFT}, out);
+  assert(n == 6 && !memcmp(out, "\x1b[1;2A", 6));
+  n = terminalEncodeKey((KeyEvent){TUI_KEY_F1 + 4, 0}, out);
+  assert(n == 5 && !memcmp(out, "\x1b[15~", 5));
+  n = terminalEncodeKey((KeyEvent){TUI_KEY_F1 + 1, 0}, out);
+  assert(n == 3 && !memcmp(out, "\x1bOQ", 3));
+
+  setenv("SHELL", "/bin/sh", 1);
+  Component *c = terminal_new(&tui_globalcontext, (Position){0, 0, 30, 5});
+  assert(c);
+  Terminal *t = c->terminal;
+  const char *typed = "echo hi$((1+1)); exit\r";
+  for (; *typed; typed++)
+    assert(c->onKeypress(c, (KeyEvent){(wchar_t)*typed, 0}));
+  for (int i = 0; i < 5000 && !atomic_load(&t->hungup); i++)
+    usleep(1000);
+  assert(atomic_load(&t->hungup));
+  bool echoed = false;
+  pthread_mutex_lock(&t->lock);
+  for (size_t row = 0; row < 5; row++)
+    echoed |= strstr(testRow(t->vt, row), "hi2") != NULL;
+  pthread_mutex_unlock(&t->lock);
+  assert(echoed);
+  terminal_free(c);
+}
+
+// Output that would scroll off before it's seen is skipped, and the
+// screen comes out the same as if it had all been parsed.
+static void testTerminalSkip(void) {
+  TMT *full = tmt_open(3, 5, NULL, NULL, NULL);
+  TMT *skipped = tmt_open(3, 5, NULL, NULL, NULL);
+  const char *out = "a\r\nb\r\nc\r\nd\r\ne";
+  size_t n = strlen(out);
+  assert(!terminalSkip(full, out, n)); // Not on the bottom row yet.
+  tmt_write(full, "\n\n", 2);
+  tmt_write(skipped, "\n\n", 2);
+  size_t skip = terminalSkip(skipped, out, n);
+  assert(skip == 4);
+  tmt_write(full, out, n);
+  tmt_write(skipped, out + skip, n - skip);
+  for (size_t row = 0; row < 3; row++) {
+    char line[8];
+    strcpy(line, testRow(full, row));
+    assert(!strcmp(line, testRow(skipped, row)));
+  }
+  assert(testRow(full, 0)[0] == 'c' && testRow(full, 2)[0] == 'e');
+  // An escape sequence stops it; it may change what's left.
+  const char *cleared = "\x1b[2Jx\r\n\n\n\n";
+  assert(!terminalSkip(full, cleared, strlen(cleared)));
+  tmt_close(full);
+  tmt_close(skipped);
+}
+
+// Text packs and unpacks to the same bytes, damage is caught, and a
+// packed buffer reads and undoes as before.
+static void testPack(void) {
+  char text[4096], packed[lz_bound(4096)], back[4096];
+  size_t n = 0;
+  while (n + 16 < sizeof(text))
+    n += (size_t)sprintf(text + n, "line %zu\n", n % 7);
+  memset(text + n, 'z', sizeof(text) - n); // An overlapping match.
+  n = sizeof(text);
+  size_t len = lz_compress(text, n, packed);
+  assert(len < n / 4);
+  assert(lz_decompress(packed, len, back, n) && !memcmp(text, back, n));
+  assert(!lz_decompress(packed, len / 2, back, n));
+  assert(!lz_decompress(packed, len, back, n - 1));
+
+  Buffer *b = buffer_new();
+  assert(b && buffer_insert(b, 0, text, n));
+  for (int i = 0; i < 100; i++)
+    assert(buffer_delete(b, 0, 1));
+  BufferPackJob *job = buffer_pack_start(b);
+  assert(job);
+  buffer_pack_run(job);
+  assert(buffer_pack_finish(b, job));
+  assert(!b->sources[1] && b->pack->sources[1].data);
+  assert(!b->undo.count && b->pack->history.data);
+  buffer_read(b, 0, n - 100, back);
+  assert(!memcmp(back, text + 100, n - 100));
+  for (int i = 0; i < 101; i++)
+    assert(buffer_undo(b));
+  assert(!buffer_size(b) && !buffer_undo(b));
+  buffer_close(b);
+}
+
+static void testTraceJob(void *arg) {
+  (void)arg;
+  TRACE_BEGIN(span, "test job");
+  TRACE_END(span);
+}
+
+// Spans from every thread end up in the dump; without TUI_TRACE there's
+// nothing to dump.
+static void testTrace(void) {
+  TRACE_BEGIN(span, "test main");
+  PoolGroup group = {0};
+  pool_submit(pool_shared(), &group, testTraceJob, NULL);
+  pool_wait(pool_shared(), &group);
+  TRACE_END(span);
+  const char *path = testPath("trace.json");
+#ifdef TUI_TRACE
+  assert(trace_dump(path));
+  struct stat st;
+  assert(!stat(path, &st));
+  char *json = calloc(1, (size_t)st.st_size + 1);
+  FILE *f = fopen(path, "rb");
+  assert(json && f && fread(json, 1, (size_t)st.st_size, f));
+  fclose(f);
+  assert(!strncmp(json, "{\"traceEvents\":[", 16));
+  assert(strstr(json, "\"name\":\"test main\",\"ph\":\"X\""));
+  assert(strstr(json, "\"name\":\"test job\""));
+  free(json);
+#else
+  assert(!trace_dump(path));
+#endif
+}
+
+// Frame times land in buckets good to a quarter of a power of two, and
+// the HUD shows them in the corner once toggled on.
+static void testHud(void) {
+  tui_stats = (TuiStats){0};
+  for (int i = 0; i < 9; i++)
+    tuiEndFrame(1000000);
+  tuiEndFrame(40000000);
+  uint64_t p90 = tui_frame_percentile(90), top = tui_frame_percentile(100);
+  assert(p90 >= 1000000 && p90 <= 1250000);
+  assert(top >= 40000000 && top <= 50000000);
+
+  TMT *vt = tmt_open(HUD_ROWS + 1, HUD_WIDTH + 6, NULL, NULL, NULL);
+  Component *c = hud_new(NULL);
+  assert(vt && c);
+  c->render(c, vt);
+  assert(testRow(vt, 0)[6] == ' ' && testRow(vt, 0)[7] == ' ');
+  assert(c->onKeypress(c, (KeyEvent){HUD_TOGGLE_KEY, 0}));
+  c->render(c, vt);
+  assert(!strncmp(testRow(vt, 0) + 6, " frame 40.0ms", 13));
+  assert(strstr(testRow(vt, 3), "frames 10"));
+  hud_free(c);
+  tmt_close(vt);
+  tui_stats = (TuiStats){0};
+}
+
+// Each tag counts what's live under it, its calls and frees, and what a
+// frame added; a buffer gives back all it took.
+static void testAlloc(void) {
+  alloc_end_frame();
+  AllocStats before = alloc_stats(ALLOC_OTHER);
+  char *p = tui_malloc(ALLOC_OTHER, 100);
+  assert(p && (p = tui_realloc(ALLOC_OTHER, p, 5000)));
+  AllocStats during = alloc_stats(ALLOC_OTHER);
+  assert(during.bytes >= before.bytes + 5000 && during.peak >= during.bytes);
+  assert(during.calls == before.calls + 2);
+  assert(during.frees == before.frees + 1);
+  alloc_end_frame();
+  AllocStats frame = alloc_stats(ALLOC_OTHER);
+  assert(frame.frame_calls == 2);
+  assert(frame.frame_bytes == (long)(during.bytes - before.bytes));
+  tui_free(ALLOC_OTHER, p);
+  assert(alloc_stats(ALLOC_OTHER).bytes == before.bytes);
+
+  size_t buffers = alloc_stats(ALLOC_BUFFER).bytes;
+  Buffer *b = buffer_new();
+  assert(b && buffer_insert(b, 0, "text", 4) && buffer_delete(b, 1, 2));
+  assert(alloc_stats(ALLOC_BUFFER).bytes > buffers);
+  buffer_close(b);
+  assert(alloc_stats(ALLOC_BUFFER).bytes == buffers);
+}
+
+static size_t testKeys;
+static wchar_t testLastKey;
+static Position testLastSize;
+
+static int testSessionKey(Component *self, KeyEvent event) {
+  (void)self;
+  testKeys++;
+  testLastKey = event.key;
+  return 1;
+}
+
+static void testSessionRender(Component *self, TMT *screen) {
+  (void)self, (void)screen;
+}
+
+static void testSessionResize(Component *self, Position pos) {
+  self->pos = testLastSize = pos;
+}
+
+// A recorded session replays its keys and resizes into the headless
+// screen, and one cut off mid-record replays up to the cut.
+static void testSession(void) {
+  const char *path = testPath("session");
+  SessionRecorder *r = session_record_start(path, 80, 24);
+  assert(r);
+  session_record_input(r, "ab", 2);
+  session_record_resize(r, 80, 24); // Not a change.
+  session_record_resize(r, 100, 30);
+  session_record_input(r, "\xc3\xa9x", 3);
+  assert(session_record_stop(r));
+
+  tui_init_headless(40, 10);
+  Component root = {.context = &tui_globalcontext,
+                    .render = testSessionRender,
+                    .resize = testSessionResize,
+                    .onKeypress = testSessionKey};
+  tui_globalcontext.rootComponent = tui_globalcontext.componentList[0] = &root;
+  tui_globalcontext.num_components = 1;
+  SessionReport report;
+  assert(session_replay(path, 500000, &report));
+  assert(report.num_events == 3 && report.keys == 4 && testKeys == 4);
+  assert(testLastKey == 'x' && testLastSize.width == 100);
+  for (size_t i = 0; i < report.num_events; i++)
+    assert(report.events[i].latency >= 500000);
+  session_report_free(&report);
+
+  struct stat st;
+  assert(!stat(path, &st) && !truncate(path, st.st_size - 1));
+  testKeys = 0;
+  assert(session_replay(path, 500000, &report));
+  assert(report.num_events == 2 && testKeys == 2);
+  session_report_free(&report);
+  tui_globalcontext.rootComponent = NULL;
+  tui_globalcontext.num_components = 0;
+  tui_deinit();
+  tmt_close(tui_globalcontext.screen);
+  tui_globalcontext.screen = NULL;
+}
+
+static void testLatencyRecord(uint64_t ns) {
+  tui_stats.latency.pending[0] = 1000000000;
+  tui_stats.latency.num_pending = 1;
+  tuiRecordLatency(1000000000 + ns);
+}
+
+// Latencies are kept to within a bucket of about 3%, and the dump is in
+// HdrHistogram's percentile format.
+static void testLatency(void) {
+  tui_stats = (TuiStats){0};
+  testLatencyRecord(1000);
+  for (int i = 0; i < 98; i++)
+    testLatencyRecord(2000000);
+  testLatencyRecord(50000000);
+  for (uint64_t ns = 1; ns <= 50000000; ns = ns * 3 / 2 + 1) {
+    uint64_t top = tuiLatencyBucketTop(tuiLatencyBucket(ns));
+    assert(top >= ns && top <= ns + ns / 32);
+  }
+  uint64_t p50 = tui_latency_percentile(50);
+  assert(p50 >= 2000000 && p50 <= 2000000 + 2000000 / 32);
+  assert(tui_latency_percentile(100) == 50000000);
+  assert(tui_latency_percentile(0) <= 1000 + 1000 / 32);
+
+  const char *path = testPath("latency.hgrm");
+  assert(tui_latency_dump(path));
+  char text[2048] = {0};
+  FILE *f = fopen(path, "rb");
+  assert(f && fread(text, 1, sizeof(text) - 1, f));
+  fclose(f);
+  assert(strstr(text, "#[Total count    =          100]"));
+  assert(strstr(text, "Max            =       50.000]"));
+  tui_stats = (TuiStats){0};
+}
+
+// Frames are named by symbol, or by module and offset without one, and
+// the stacks sampled are written folded, a count to each.
+static void testProfile(void) {
+  ProfileLine line = {0};
+  assert(profilePutFrame(&line, "./editor(main+0x1f) [0x4011]"));
+  assert(profilePutChar(&line, ';'));
+  assert(profilePutFrame(&line, "/lib/libc.so.6(+0x2a1ca) [0x7f00]"));
+  assert(!strcmp(line.text, "main;libc.so.6+0x2a1ca"));
+  free(line.text);
+
+  const char *path = testPath("profile.folded");
+  assert(!profile_stop() && profile_start(path, 997));
+  assert(!profile_start(path, 997));
+  clock_t start = clock();
+  volatile double spin = 0;
+  while (clock() - start < CLOCKS_PER_SEC / 20)
+    spin += 0.5;
+  assert(profile_stop());
+
+  FILE *f = fopen(path, "rb");
+  assert(f);
+  char text[8192];
+  size_t samples = 0, count;
+  while (fgets(text, sizeof(text), f)) {
+    char *space = strrchr(text, ' ');
+    assert(space && sscanf(space, " %zu", &count) == 1 && count);
+    samples += count;
+  }
+  fclose(f);
+  assert(samples);
+}
+
+// A big file shows its head at once and is read-only until the rest has
+// been read in; the load isn't an edit to undo.
+static void testLoad(void) {
+  const char *path = testPath("load.txt");
+  FILE *f = fopen(path, "wb");
+  assert(f);
+  size_t lines = (BUFFER_HEAD_BYTES + BUFFER_LOAD_CHUNK) / 13 + 100;
+  for (size_t i = 0; i < lines; i++)
+    fprintf(f, "line %07zu\n", i);
+  fclose(f);
+
+  FileLoad *l = load_open(path);
+  assert(l && l->job);
+  Buffer *b = l->buffer;
+  assert(buffer_size(b) == BUFFER_HEAD_BYTES && !buffer_insert(b, 0, "x", 1));
+  while (!load_poll(l))
+    pool_wait(pool_shared(), &l->running);
+  assert(!l->failed && buffer_size(b) == lines * 13);
+  assert(buffer_num_lines(b) == lines + 1 && !buffer_modified(b));
+  size_t len;
+  char *last = buffer_line(b, lines - 1, &len);
+  assert(last && len == 12 && atoi(last + 5) == (int)lines - 1);
+  free(last);
+  assert(!buffer_undo(b) && buffer_insert(b, 0, "x", 1));
+  load_free(l);
+  buffer_close(b);
+
+  // A small file is read whole, and a missing one is a new buffer.
+  l = load_open(testWrite("small.txt", "small\n"));
+  assert(l && !l->job && load_poll(l) && buffer_size(l->buffer) == 6);
+  buffer_close(l->buffer);
+  load_free(l);
+  b = buffer_open(testPath("missing.txt"));
+  assert(b && !buffer_size(b));
+  buffer_close(b);
+}
+
+// Files are decoded to UTF-8 as they're read, surrogate pairs and all,
+// and written back in what they came in; text Latin-1 can't hold isn't
+// saved at all rather than saved wrong.
+static void testEncoding(void) {
+  size_t bom, n;
+  assert(encoding_detect("h\0i\0", 4, false, &bom) == ENCODING_UTF16LE);
+  assert(encoding_detect("\0h\0i", 4, false, &bom) == ENCODING_UTF16BE);
+  assert(encoding_detect("caf\xe9", 4, false, &bom) == ENCODING_LATIN1);
+  assert(encoding_detect("caf\xc3", 4, true, &bom) == ENCODING_UTF8);
+  assert(encoding_detect("\xef\xbb\xbfx", 4, false, &bom) == ENCODING_UTF8);
+  assert(bom == 3);
+
+  const char utf16[] = "\xff\xfeh\0\xe9\0\x3d\xd8\x00\xde\n\0";
+  FILE *f = fopen(testPath("utf16.txt"), "wb");
+  assert(f && fwrite(utf16, 1, sizeof(utf16) - 1, f) == sizeof(utf16) - 1);
+  fclose(f);
+  Buffer *b = buffer_open(testPath("utf16.txt"));
+  assert(b && b->encoding == ENCODING_UTF16LE && b->bom);
+  assert(!strcmp(testText(b), "h\xc3\xa9\xf0\x9f\x98\x80\n"));
+  assert(buffer_insert(b, 0, "x", 1) && buffer_save(b));
+  const char *saved = testRead("utf16.txt", &n);
+  assert(n == sizeof(utf16) + 1 && !memcmp(saved, "\xff\xfex\0", 4));
+  assert(!memcmp(saved + 4, utf16 + 2, sizeof(utf16) - 3));
+  buffer_close(b);
+
+  b = buffer_open(testWrite("latin1.txt", "caf\xe9\n"));
+  assert(b && b->encoding == ENCODING_LATIN1);
+  assert(buffer_insert(b, 0, "\xe6\x97\xa5", 3) && !buffer_save(b));
+  saved = testRead("latin1.txt", &n);
+  assert(n == 5 && !memcmp(saved, "caf\xe9\n", 5));
+  assert(buffer_delete(b, 0, 3) && buffer_insert(b, 0, "\xc3\xbc", 2));
+  assert(buffer_save(b));
+  saved = testRead("latin1.txt", &n);
+  assert(n == 6 && !memcmp(saved, "\xfc" "caf\xe9\n", 6));
+  buffer_close(b);
+}
+
+static int testWindows;
+
+static bool testServerOpen(GlobalContext *context, void *arg) {
+  context->rootComponent = finder_new_shared(context, arg);
+  context->componentList[context->num_components++] = context->rootComponent;
+  testWindows++;
+  return context->rootComponent != NULL;
+}
+
+static void testServerClose(GlobalContext *context, void *arg) {
+  (void)arg;
+  finder_free(context->rootComponent);
+  testWindows--;
+}
+
+static int testServerConnect(const char *path, SessionRecorder **to_server,
+                             uint16_t width, uint16_t height) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(serverAddress(path, &addr) &&
+         !connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+  *to_server = session_record_stream(fdopen(dup(fd), "wb"), width, height);
+  assert(*to_server);
+  return fd;
+}
+
+// Whatever the server has sent fd so far, as a string.
+static const char *testServerFrames(int fd) {
+  static char frames[1 << 16];
+  size_t n = 0;
+  struct pollfd p = {.fd = fd, .events = POLLIN};
+  while (n < sizeof(frames) - 1 && poll(&p, 1, 50) > 0) {
+    ssize_t got = read(fd, frames + n, sizeof(frames) - 1 - n);
+    if (got <= 0)
+      break;
+    n += (size_t)got;
+  }
+  frames[n] = 0;
+  return frames;
+}
+
+// Each client gets a window of its own size over the one shared index,
+// its keys go only to its own window, and one that doesn't speak the
+// session format is dropped.
+static void testServer(void) {
+  tui_init_headless(80, 24);
+  FinderIndex *index = finder_index_open(testPath("tree"));
+  pool_wait(pool_shared(), &index->walking);
+  const char *path = testPath("server.sock");
+  EditorServer *s =
+      server_listen(path, testServerOpen, testServerClose, index);
+  assert(s && !server_listen(path, testServerOpen, testServerClose, index));
+
+  SessionRecorder *to_a, *to_b;
+  int a = testServerConnect(path, &to_a, 60, 10);
+  int b = testServerConnect(path, &to_b, 40, 5);
+  for (int i = 0; i < 8 && testWindows < 2; i++)
+    server_poll(s, 50);
+  assert(s->num_clients == 2 && testWindows == 2);
+  const char *frames = testServerFrames(a);
+  assert(strstr(frames, "\x1b[10;1H") && !strstr(frames, "\x1b[11;1H"));
+  frames = testServerFrames(b);
+  assert(strstr(frames, "\x1b[5;1H") && !strstr(frames, "\x1b[6;1H"));
+
+  session_record_input(to_b, "util", 4);
+  for (int i = 0; i < 4; i++)
+    server_poll(s, 20);
+  for (int i = 0; i < 20; i++) {
+    usleep(5000);
+    server_render_all(s);
+  }
+  assert(strstr(testServerFrames(b), "util.c"));
+  assert(!strstr(testServerFrames(a), "> util"));
+
+  assert(write(b, "zzz", 3) == 3);
+  for (int i = 0; i < 4 && s->num_clients > 1; i++)
+    server_poll(s, 20);
+  assert(s->num_clients == 1 && testWindows == 1);
+  session_record_stop(to_b);
+  close(b);
+
+  session_record_stop(to_a);
+  close(a);
+  for (int i = 0; i < 4 && s->num_clients; i++)
+    server_poll(s, 20);
+  assert(!s->num_clients && !testWindows);
+  server_close(s);
+  struct stat st;
+  assert(stat(path, &st));
+  finder_index_close(index);
+  tui_deinit();
+  tmt_close(tui_globalcontext.screen);
+  tui_globalcontext.screen = NULL;
+}
+
+// Writes text to the terminal's end of p, and returns what caps_read()
+// lets through of it.
+static const char *testCapsRead(int p[2], const char *text) {
+  static char keys[256];
+  size_t n = 0;
+  assert(write(p[1], text, strlen(text)) == (ssize_t)strlen(text));
+  for (ssize_t got; (got = caps_read(p[0], keys + n, 64)) > 0;)
+    n += (size_t)got;
+  keys[n] = 0;
+  return keys;
+}
+
+// Answers are taken out of the input wherever the reads cut them, add up
+// to what the terminal can do, and are cached; after the timeout they're
+// keys again.
+static void testCaps(void) {
+  char *term = getenv("TERM");
+  setenv("XDG_CACHE_HOME", testPath("cache"), 1);
+  setenv("TERM", "xterm/test", 1);
+  unsetenv("TERM_PROGRAM");
+  int p[2];
+  assert(!pipe(p) && !fcntl(p[0], F_SETFL, O_NONBLOCK));
+  TermCaps caps = {0}, cached;
+  assert(!caps_load(&cached));
+  const char *queries = caps_probe_start(&caps, p[0], 0);
+  assert(!strcmp(queries + strlen(queries) - 3, "\x1b[c"));
+  char keys[64] = "";
+  strcat(keys, testCapsRead(p, "ab\x1bP>|XTerm(390)\x1b\\"));
+  strcat(keys, testCapsRead(p, "\x1b[?2026;2$y"));
+  strcat(keys, testCapsRead(p, "c\x1b[>41;390;0c\x1b[A\x1b[?6"));
+  assert(caps_probe.probing && caps_probe.held == 4);
+  strcat(keys, testCapsRead(p, "4;1c"));
+  assert(!strcmp(keys, "abc\x1b[A") && !caps_probe.probing);
+  assert(caps.known && caps.rep && caps.ech && caps.scroll_region);
+  assert(caps.sync && !strcmp(caps.name, "XTerm(390)"));
+  assert(caps_load(&cached) && !memcmp(&cached, &caps, sizeof(caps)));
+
+  // The Linux console: a VT102, with no name and no mode 2026.
+  setenv("TERM", "linux", 1);
+  memset(&caps, 0, sizeof(caps));
+  caps_probe_start(&caps, p[0], 0);
+  assert(!*testCapsRead(p, "\x1b[?2026;0$y\x1b[?6c"));
+  assert(caps.known && !caps.rep && !caps.ech && caps.scroll_region);
+  assert(!caps.sync && !caps.name[0]);
+
+  caps_probe_start(&caps, p[0], 0);
+  caps_poll(CAPS_TIMEOUT_NS);
+  assert(caps_probe.probing);
+  caps_poll(CAPS_TIMEOUT_NS + 1);
+  assert(!strcmp(testCapsRead(p, "\x1b[?6c"), "\x1b[?6c"));
+  close(p[0]);
+  close(p[1]);
+  if (term)
+    setenv("TERM", term, 1);
+  else
+    unsetenv("TERM");
+}
+
 int main(void) {
   tui_init();
 
   TMT *tmt = tui_globalcontext.screen;
 
   tui_deinit();
+
+  assert(mkdtemp(test_dir));
+  testTable();
+  testPendingWrap();
+  testFinder();
+  testSearch();
+  testWords();
+  testDiff();
+  testReload();
+  testJournal();
+  testFold();
+  testMinimap();
+  testBracket();
+  testReplace();
+  testMacro();
+  testTerminal();
+  testTerminalSkip();
+  testPack();
+  testTrace();
+  testHud();
+  testAlloc();
+  testSession();
+  testLatency();
+  testProfile();
+  testLoad();
+  testEncoding();
+  testServer();
+  testCaps();
+  nftw(test_dir, testRemove, 16, FTW_DEPTH | FTW_PHYS);
+  puts("All tests passed.");
 }
 
 /*
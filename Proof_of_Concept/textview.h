@@ -0,0 +1,339 @@
+#ifndef TEXTVIEW_H
+#define TEXTVIEW_H
+
+#include "bracket.h"
+#include "buffer.h"
+#include "diff.h"
+#include "fold.h"
+#include "macro.h"
+#include "tui.h"
+
+// Shows a buffer and edits it. Only the lines on screen are ever read
+// from the buffer. The first column is a gutter showing how each line
+// differs from the saved file, the second where folds start.
+//
+// Folded lines take no rows, so scrolling is in screen rows and the cursor
+// moves by row; both go through the fold set's line/row mapping.
+//
+// When the cursor is on a bracket, the one it pairs with is underlined.
+//
+// ^R starts and stops recording a macro; ^T replays it once for every line
+// from the cursor down.
+
+#define TEXTVIEW_GUTTER 2
+#define TEXTVIEW_MAX_LINE_BYTES 4096
+
+typedef struct TextView {
+  Buffer *buffer;
+  DiffState *diff; // NULL when not tracking the saved file.
+  FoldSet *folds;
+  BracketIndex *brackets; // NULL if the buffer couldn't be indexed.
+  Macro macro;
+  size_t top;  // A screen row.
+  size_t rows; // How many were shown, as of the last render.
+  size_t cursor_line, cursor_col; // The column is a byte offset.
+} TextView;
+
+static inline size_t textviewLineLength(const Buffer *b, size_t line) {
+  size_t start = buffer_line_start(b, line);
+  size_t end = buffer_line_start(b, line + 1);
+  if (line + 1 < buffer_num_lines(b))
+    end--; // The newline.
+  return end - start;
+}
+
+static inline size_t textview_cursor_offset(const TextView *t) {
+  size_t len = textviewLineLength(t->buffer, t->cursor_line);
+  return buffer_line_start(t->buffer, t->cursor_line) +
+         (t->cursor_col < len ? t->cursor_col : len);
+}
+
+static inline void textviewDrawDiff(TextView *t, TMT *screen, size_t line) {
+  DiffMarker m = t->diff ? diff_marker(t->diff, line) : DIFF_NONE;
+  switch (m) {
+  case DIFF_ADDED:
+    tmt_write(screen, "\x1b[32m▎\x1b[0m", sizeof("\x1b[32m▎\x1b[0m") - 1);
+    break;
+  case DIFF_CHANGED:
+    tmt_write(screen, "\x1b[33m▎\x1b[0m", sizeof("\x1b[33m▎\x1b[0m") - 1);
+    break;
+  case DIFF_REMOVED:
+    tmt_write(screen, "\x1b[31m▔\x1b[0m", sizeof("\x1b[31m▔\x1b[0m") - 1);
+    break;
+  default:
+    tmt_write(screen, " ", 1);
+  }
+}
+
+static inline void textviewDrawGutter(TextView *t, TMT *screen,
+                                      size_t line) {
+  textviewDrawDiff(t, screen, line);
+  switch (fold_marker(t->folds, line)) {
+  case FOLD_OPEN:
+    tmt_write(screen, "▾", sizeof("▾") - 1);
+    break;
+  case FOLD_CLOSED:
+    tmt_write(screen, "▸", sizeof("▸") - 1);
+    break;
+  default:
+    tmt_write(screen, " ", 1);
+  }
+}
+
+// Column (in characters) of a byte offset into a line.
+static inline uint16_t textviewColumn(const char *text, size_t offset) {
+  size_t col = 0;
+  for (size_t i = 0; i < offset; i++)
+    col += ((unsigned char)text[i] & 0xC0) != 0x80;
+  return col > UINT16_MAX ? UINT16_MAX : (uint16_t)col;
+}
+
+// Underlines the bracket paired with the one under the cursor, if it's on
+// screen.
+static inline void textviewDrawMatch(TextView *t, TMT *screen,
+                                     Position pos) {
+  size_t match;
+  if (!t->brackets ||
+      !bracket_match(t->brackets, textview_cursor_offset(t), &match))
+    return;
+  size_t line = buffer_line_of(t->buffer, match);
+  size_t row = fold_row_of(t->folds, line);
+  if (fold_line_of(t->folds, row) != line || row < t->top ||
+      row >= t->top + pos.height)
+    return;
+  char text[TEXTVIEW_MAX_LINE_BYTES];
+  size_t at = match - buffer_line_start(t->buffer, line);
+  if (at >= sizeof(text))
+    return;
+  buffer_read(t->buffer, match - at, at + 1, text);
+  uint16_t col = textviewColumn(text, at);
+  if (col >= pos.width - TEXTVIEW_GUTTER)
+    return;
+  moveCursor(screen, pos.x + TEXTVIEW_GUTTER + col, pos.y + (row - t->top));
+  tmt_write(screen, "\x1b[4m", 4);
+  tmt_write(screen, text + at, 1);
+  tmt_write(screen, "\x1b[0m", 4);
+}
+
+static void textview_render(Component *self, TMT *screen) {
+  TextView *t = self->text;
+  Position pos = self->pos;
+  if (t->diff)
+    diff_poll(t->diff);
+  t->rows = pos.height;
+  if (pos.width <= TEXTVIEW_GUTTER || !pos.height)
+    return;
+
+  // Keep the cursor on screen. The buffer may have shrunk under it, or a
+  // fold closed over it.
+  if (t->cursor_line >= buffer_num_lines(t->buffer))
+    t->cursor_line = buffer_num_lines(t->buffer) - 1;
+  size_t cursor_row = fold_row_of(t->folds, t->cursor_line);
+  t->cursor_line = fold_line_of(t->folds, cursor_row);
+  if (cursor_row < t->top)
+    t->top = cursor_row;
+  else if (cursor_row >= t->top + pos.height)
+    t->top = cursor_row - pos.height + 1;
+
+  uint16_t width = pos.width - TEXTVIEW_GUTTER;
+  size_t num_rows = fold_num_rows(t->folds);
+  char text[TEXTVIEW_MAX_LINE_BYTES];
+  for (uint16_t i = 0; i < pos.height; i++) {
+    moveCursor(screen, pos.x, pos.y + i);
+    if (t->top + i >= num_rows) {
+      drawText(screen, "", 0, pos.width);
+      continue;
+    }
+    size_t line = fold_line_of(t->folds, t->top + i);
+    textviewDrawGutter(t, screen, line);
+
+    size_t len = textviewLineLength(t->buffer, line);
+    if (len > sizeof(text))
+      len = sizeof(text);
+    buffer_read(t->buffer, buffer_line_start(t->buffer, line), len, text);
+    if (line != t->cursor_line) {
+      drawText(screen, text, len, width);
+      continue;
+    }
+
+    // The cursor is drawn as a reversed cell.
+    size_t at = t->cursor_col < len ? t->cursor_col : len;
+    size_t next = at;
+    if (next < len)
+      next++;
+    while (next < len && ((unsigned char)text[next] & 0xC0) == 0x80)
+      next++;
+    uint16_t col = textviewColumn(text, at);
+    if (col >= width) {
+      drawText(screen, text, len, width);
+      continue;
+    }
+    drawText(screen, text, at, col);
+    tmt_write(screen, "\x1b[7m", 4);
+    drawText(screen, next > at ? text + at : " ", next > at ? next - at : 1,
+             1);
+    tmt_write(screen, "\x1b[0m", 4);
+    if (width > col + 1)
+      drawText(screen, text + next, len - next, width - col - 1);
+  }
+  textviewDrawMatch(t, screen, pos);
+}
+
+static void textview_resize(Component *self, Position new_pos) {
+  self->pos = new_pos;
+}
+
+static inline void textviewInsert(TextView *t, const char *s, size_t n) {
+  size_t offset = textview_cursor_offset(t);
+  if (!buffer_insert(t->buffer, offset, s, n))
+    return;
+  size_t end = offset + n;
+  t->cursor_line = buffer_line_of(t->buffer, end);
+  t->cursor_col = end - buffer_line_start(t->buffer, t->cursor_line);
+}
+
+static inline void textviewBackspace(TextView *t) {
+  size_t offset = textview_cursor_offset(t);
+  if (!offset)
+    return;
+  // Back over one whole utf8 sequence.
+  size_t start = offset - 1;
+  char c;
+  while (start && (buffer_read(t->buffer, start, 1, &c),
+                   ((unsigned char)c & 0xC0) == 0x80))
+    start--;
+  if (!buffer_delete(t->buffer, start, offset - start))
+    return;
+  t->cursor_line = buffer_line_of(t->buffer, start);
+  t->cursor_col = start - buffer_line_start(t->buffer, t->cursor_line);
+}
+
+static int textviewKey(Component *self, KeyEvent event) {
+  TextView *t = self->text;
+  size_t num_rows = fold_num_rows(t->folds);
+  size_t row = fold_row_of(t->folds, t->cursor_line);
+  size_t page = self->pos.height > 1 ? self->pos.height / 2 : 1;
+  switch (event.key) {
+  case 0x0e: // ^N
+    if (row + 1 < num_rows)
+      t->cursor_line = fold_line_of(t->folds, row + 1);
+    return 1;
+  case 0x10: // ^P
+    if (row)
+      t->cursor_line = fold_line_of(t->folds, row - 1);
+    return 1;
+  case 0x04: // ^D
+    row = row + page < num_rows ? row + page : num_rows - 1;
+    t->cursor_line = fold_line_of(t->folds, row);
+    return 1;
+  case 0x15: // ^U
+    t->cursor_line = fold_line_of(t->folds, row > page ? row - page : 0);
+    return 1;
+  case 0x1d: { // ^]
+    size_t match;
+    if (t->brackets &&
+        bracket_match(t->brackets, textview_cursor_offset(t), &match)) {
+      t->cursor_line = buffer_line_of(t->buffer, match);
+      t->cursor_col = match - buffer_line_start(t->buffer, t->cursor_line);
+    }
+    return 1;
+  }
+  case 0x0f: // ^O
+    fold_toggle(t->folds, t->cursor_line);
+    return 1;
+  case 0x06: // ^F
+    if (t->cursor_col < textviewLineLength(t->buffer, t->cursor_line))
+      t->cursor_col++;
+    return 1;
+  case 0x02: // ^B
+    if (t->cursor_col)
+      t->cursor_col--;
+    return 1;
+  case 0x1f: // ^_
+  case 0x1e: // ^^
+    if (event.key == 0x1f ? buffer_undo(t->buffer) : buffer_redo(t->buffer))
+      t->cursor_col = 0;
+    return 1;
+  case 0x08:
+  case 0x7f:
+    textviewBackspace(t);
+    return 1;
+  case L'\r':
+  case L'\n':
+    textviewInsert(t, "\n", 1);
+    return 1;
+  default: {
+    if (event.key < 0x20 && event.key != L'\t')
+      return 0;
+    char bytes[4];
+    size_t len = utf8_put((uint32_t)event.key, bytes);
+    if (len)
+      textviewInsert(t, bytes, len);
+    return 1;
+  }
+  }
+}
+
+static int textview_onKeypress(Component *self, KeyEvent event) {
+  TextView *t = self->text;
+  switch (event.key) {
+  case 0x12: // ^R
+    if (t->macro.recording)
+      macro_stop(&t->macro);
+    else
+      macro_start(&t->macro);
+    return 1;
+  case 0x14: // ^T
+    macro_replay(&t->macro, self, t->buffer,
+                 buffer_num_lines(t->buffer) - t->cursor_line,
+                 macro_show_progress, NULL);
+    return 1;
+  default: {
+    int handled = textviewKey(self, event);
+    if (handled)
+      macro_record(&t->macro, event);
+    return handled;
+  }
+  }
+}
+
+// The view doesn't own the buffer. Pass track_saved to show the diff
+// against the file on disk in the gutter.
+static inline Component *textview_new(GlobalContext *context, Buffer *buffer,
+                                      bool track_saved) {
+  Component *c = tui_calloc(ALLOC_COMPONENT, 1, sizeof(Component));
+  TextView *t = tui_calloc(ALLOC_COMPONENT, 1, sizeof(TextView));
+  if (!c || !t) {
+    tui_free(ALLOC_COMPONENT, c);
+    tui_free(ALLOC_COMPONENT, t);
+    return NULL;
+  }
+  t->buffer = buffer;
+  if (!(t->folds = fold_attach(buffer))) {
+    tui_free(ALLOC_COMPONENT, c);
+    tui_free(ALLOC_COMPONENT, t);
+    return NULL;
+  }
+  if (track_saved)
+    t->diff = diff_attach(buffer);
+  t->brackets = bracket_attach(buffer);
+  c->text = t;
+  c->context = context;
+  c->kind = COMPONENT_TEXTVIEW;
+  c->render = textview_render;
+  c->resize = textview_resize;
+  c->onKeypress = textview_onKeypress;
+  return c;
+}
+
+static inline void textview_free(Component *c) {
+  if (!c)
+    return;
+  diff_detach(c->text->diff);
+  fold_detach(c->text->folds);
+  bracket_detach(c->text->brackets);
+  tui_free(ALLOC_COMPONENT, c->text);
+  tui_free(ALLOC_COMPONENT, c);
+}
+
+#endif
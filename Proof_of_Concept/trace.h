@@ -0,0 +1,155 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Timing spans for finding out where a slow frame went. Built with
+// TUI_TRACE defined, every span is kept in a ring of the recording
+// thread's own and can be written out as Chrome trace JSON (for
+// chrome://tracing or Perfetto) with trace_dump(), or at exit to the file
+// named by $TUI_TRACE_FILE. Without it, spans compile to nothing.
+//
+//   TRACE_BEGIN(span, "name");
+//   ...
+//   TRACE_END(span);
+//
+// Names must be string literals, or at least outlive the dump. Recording
+// takes no locks: a thread only ever writes its own ring, and each event
+// carries a sequence number that the dump checks before and after copying
+// it, so events overwritten meanwhile are left out rather than torn.
+
+#include <stdbool.h>
+
+#ifdef TUI_TRACE
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TRACE_RING_EVENTS ((size_t)1 << 15) // Per thread; the last are kept.
+
+typedef struct {
+  atomic_size_t seq; // 2i + 2 once it holds event i, odd while written.
+  const char *name;
+  uint64_t start, duration; // Nanoseconds.
+} TraceEvent;
+
+typedef struct TraceRing {
+  struct TraceRing *next;
+  unsigned tid;
+  size_t count; // Events ever recorded.
+  TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+typedef struct {
+  const char *name;
+  uint64_t start;
+} TraceSpan;
+
+static _Atomic(TraceRing *) traceRings;
+static atomic_uint traceThreads;
+static _Thread_local TraceRing *traceLocal;
+
+static inline bool trace_dump(const char *path);
+
+static inline uint64_t traceNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void traceAtExit(void) {
+  const char *path = getenv("TUI_TRACE_FILE");
+  if (path && *path)
+    trace_dump(path);
+}
+
+// The calling thread's ring, made on first use. Rings are never freed, so
+// a thread's spans can still be dumped after it has gone.
+static inline TraceRing *traceRing(void) {
+  if (traceLocal)
+    return traceLocal;
+  TraceRing *ring = calloc(1, sizeof(TraceRing));
+  if (!ring)
+    return NULL;
+  ring->tid = atomic_fetch_add(&traceThreads, 1) + 1;
+  if (ring->tid == 1)
+    atexit(traceAtExit);
+  ring->next = atomic_load(&traceRings);
+  while (!atomic_compare_exchange_weak(&traceRings, &ring->next, ring))
+    ;
+  return traceLocal = ring;
+}
+
+static inline TraceSpan traceBegin(const char *name) {
+  return (TraceSpan){name, traceNow()};
+}
+
+static inline void traceEnd(TraceSpan span) {
+  uint64_t end = traceNow();
+  TraceRing *ring = traceRing();
+  if (!ring)
+    return;
+  size_t i = ring->count++;
+  TraceEvent *e = &ring->events[i % TRACE_RING_EVENTS];
+  atomic_store_explicit(&e->seq, 2 * i + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  e->name = span.name;
+  e->start = span.start;
+  e->duration = end - span.start;
+  atomic_store_explicit(&e->seq, 2 * i + 2, memory_order_release);
+}
+
+// Writes every thread's spans to path. Safe to call while they're still
+// being recorded.
+static inline bool trace_dump(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  fputs("{\"traceEvents\":[", f);
+  bool first = true;
+  for (TraceRing *ring = atomic_load(&traceRings); ring; ring = ring->next) {
+    for (size_t slot = 0; slot < TRACE_RING_EVENTS; slot++) {
+      TraceEvent *e = &ring->events[slot];
+      size_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+      if (!seq || seq % 2)
+        continue;
+      const char *name = e->name;
+      uint64_t start = e->start, duration = e->duration;
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&e->seq, memory_order_relaxed) != seq)
+        continue;
+      fprintf(f,
+              "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              first ? "" : ",", name, ring->tid, (double)start / 1000,
+              (double)duration / 1000);
+      first = false;
+    }
+  }
+  fputs("\n],\"displayTimeUnit\":\"ms\"}\n", f);
+  return !fclose(f);
+}
+
+#define TRACE_BEGIN(span, name) TraceSpan span = traceBegin(name)
+#define TRACE_END(span) traceEnd(span)
+
+#else
+
+static inline bool trace_dump(const char *path) {
+  (void)path;
+  return false;
+}
+
+#define TRACE_BEGIN(span, name)
+#define TRACE_END(span)
+
+#endif
+
+// libtmt has hooks of its own, so it needn't know about this file.
+#ifndef TMT_TRACE_BEGIN
+#define TMT_TRACE_BEGIN TRACE_BEGIN
+#define TMT_TRACE_END TRACE_END
+#endif
+
+#endif
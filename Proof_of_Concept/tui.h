@@ -1,10 +1,21 @@
+#ifndef TUI_H
+#define TUI_H
+
+#include "alloc.h" // These two before tmt.h, to fill in its hooks.
+#include "trace.h"
+
+#include "caps.h"
+#include "encoding.h"
 #include "libtmt/tmt.h"
+#include "profile.h"
 
+#include <errno.h>
 #include <locale.h>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef TUI_PANIC
@@ -28,8 +39,29 @@ typedef struct {
   } mouse_action;
 } MouseEvent;
 
+// Keys that aren't characters have codes past the last one unicode has,
+// so they can't be taken for one. A control character like ^A comes as
+// itself, without TUI_MOD_CTRL.
+enum {
+  TUI_KEY_UP = 0x110000,
+  TUI_KEY_DOWN,
+  TUI_KEY_RIGHT,
+  TUI_KEY_LEFT,
+  TUI_KEY_HOME,
+  TUI_KEY_END,
+  TUI_KEY_INSERT,
+  TUI_KEY_DELETE,
+  TUI_KEY_PAGE_UP,
+  TUI_KEY_PAGE_DOWN,
+  TUI_KEY_F1, // Up to TUI_KEY_F12, in order.
+  TUI_KEY_F12 = TUI_KEY_F1 + 11,
+};
+
+enum { TUI_MOD_SHIFT = 1, TUI_MOD_ALT = 2, TUI_MOD_CTRL = 4 };
+
 typedef struct {
   wchar_t key;
+  uint8_t mods; // TUI_MOD_*
 } KeyEvent;
 
 typedef enum { END, RESIZE, MOUSE, KEY } EventKind;
@@ -52,17 +84,69 @@ typedef struct {
 
   uint16_t window_width;
   uint16_t window_height;
+  int output_fd; // Frames go here; -1 drops them.
+  TermCaps caps;  // What the terminal there can do (see caps.h).
+
+  // What each row was last written as. Components redraw whole rows, so
+  // rows that come out the same are left out by comparing them here.
+  TMTCHAR *shown;
+  size_t shown_lines, shown_cols;
 
   bool _needs_resize;
   bool _exiting;
+  // Set to have the next frame drawn from nothing, as when an overlay
+  // goes away; components that only draw what changed draw it all.
+  bool repaint;
 
   // Things towards the back of the list
   // are on top of the ones at the front.
   uint16_t num_components;
   Component *componentList[MAX_COMPONENTS];
   Component *rootComponent;
+  Component *overlay; // Drawn over the root, if set.
 } GlobalContext;
 
+// Counters the runtime keeps as it goes, for a HUD (see hud.h) or anyone
+// else to read. A frame is one render_window().
+#define TUI_FRAME_WINDOW 256 // Frames that frame time percentiles cover.
+#define TUI_FRAME_BUCKETS 64
+
+typedef struct {
+  size_t events, dirty_rows, cells, output_bytes, allocations;
+} TuiFrameCounts;
+
+// Key to flush latency is kept HDR-style: linear buckets within each
+// power of two nanoseconds, so every figure is good to about 3% however
+// large, in a fixed few kilobytes.
+#define TUI_LATENCY_SUB_BITS 5  // 32 buckets to each power of two.
+#define TUI_LATENCY_MAX_BITS 36 // About 69s; anything longer counts as that.
+#define TUI_LATENCY_BUCKETS                                                   \
+  ((TUI_LATENCY_MAX_BITS - TUI_LATENCY_SUB_BITS + 1) << TUI_LATENCY_SUB_BITS)
+#define TUI_MAX_PENDING_INPUT 64
+
+typedef struct {
+  uint64_t pending[TUI_MAX_PENDING_INPUT]; // Reads not yet shown.
+  size_t num_pending;
+  uint64_t count, total, max; // Over the whole run, in nanoseconds.
+  uint32_t buckets[TUI_LATENCY_BUCKETS];
+} TuiLatency;
+
+typedef struct {
+  TuiFrameCounts current; // So far this frame.
+  TuiFrameCounts last;    // Over the last whole frame.
+  size_t frames;
+  uint64_t frame_ns;   // How long the last frame took.
+  int tty_backlog;     // Bytes the terminal hadn't taken yet, if known.
+
+  // Frame times over the last TUI_FRAME_WINDOW frames, as counts in
+  // buckets four to each power of two microseconds.
+  uint8_t recent[TUI_FRAME_WINDOW];
+  uint16_t buckets[TUI_FRAME_BUCKETS];
+
+  // From each read of input to when the frame after it was written out.
+  TuiLatency latency;
+} TuiStats;
+
 typedef struct {
   uint16_t x, y;
   uint16_t width, height;
@@ -77,25 +161,40 @@ struct Component {
   uint16_t num_children;
   Component *children[MAX_CHILDREN];
 
-  int (*onClick)(MouseEvent event);  // Returns if the event was handled by one
-                                     // of its children or not.
-  int (*onKeypress)(KeyEvent event); // Returns if the event was handled by one
+  // Every callback gets the component it was installed on, so that
+  // one function can serve every instance of a kind.
+  int (*onClick)(Component *self,
+                 MouseEvent event); // Returns if the event was handled by one
+                                    // of its children or not.
+  int (*onKeypress)(Component *self,
+                    KeyEvent event); // Returns if the event was handled by one
                                      // of its children or not.
-  void (*render)(TMT *screen);       // Calls the render() of any subcomponents.
-  void (*resize)(Position new_pos);  // Calls the resize() of any subcomponents.
+  void (*render)(Component *self,
+                 TMT *screen); // Calls the render() of any subcomponents.
+  void (*resize)(Component *self,
+                 Position new_pos); // Calls the resize() of any subcomponents.
 
   enum {
-    Kind1,
-    Kind2,
+    COMPONENT_CONTAINER,
+    COMPONENT_TABLE,
+    COMPONENT_FINDER,
+    COMPONENT_SEARCH,
+    COMPONENT_TEXTVIEW,
+    COMPONENT_MINIMAP,
+    COMPONENT_TERMINAL,
+    COMPONENT_HUD,
     // For each kind of component
   } kind;
   union {
-    struct {
-      // ...
-    } ComponentKind1Data;
-    struct {
-      // ...
-    } ComponentKind2Data;
+    // Kinds that own large or threaded state keep it behind a pointer,
+    // declared in the kind's own header.
+    struct TableView *table;
+    struct FileFinder *finder;
+    struct ProjectSearch *search;
+    struct TextView *text;
+    struct Minimap *minimap;
+    struct Terminal *terminal;
+    struct Hud *hud;
     // For all the stuff each kind of component has to store
   };
 };
@@ -106,9 +205,15 @@ typedef void (*tuisighandler_t)(int);
 // GLOBAL VARIABLES //
 //////////////////////
 // "Public"
-static GlobalContext tui_globalcontext;
+// The terminal's.
+static GlobalContext tui_globalcontext = {.output_fd = STDOUT_FILENO};
+// The context being handled and drawn: the terminal's, unless a server
+// (see server.h) is busy with one of its clients.
+static GlobalContext *tui_context = &tui_globalcontext;
+static TuiStats tui_stats;
 // "Private"
 static int _tui_active = 0;
+static int _tui_headless = 0;
 static struct termios _old_tio;
 static tuisighandler_t _old_sigwinch;
 static tuisighandler_t _old_sigterm;
@@ -119,6 +224,174 @@ static char *_old_locale;
 
 static inline void tui_error(const char *message);
 
+static inline uint64_t tuiNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Writes straight to the current context's terminal, counting the bytes.
+// Headless, only counts them.
+static inline void tuiWrite(const void *bytes, size_t n) {
+  TRACE_BEGIN(span, "write");
+  int fd = tui_context->output_fd;
+  for (size_t at = 0; fd >= 0 && at < n;) {
+    ssize_t written = write(fd, (const char *)bytes + at, n - at);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      break;
+    at += (size_t)written;
+  }
+  tui_stats.current.output_bytes += n;
+  TRACE_END(span);
+}
+
+static inline size_t tuiFrameBucket(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  if (us < 4)
+    return (size_t)us;
+  size_t log = 63 - (size_t)__builtin_clzll(us);
+  size_t bucket = 4 * (log - 1) + (size_t)((us >> (log - 2)) & 3);
+  return bucket < TUI_FRAME_BUCKETS ? bucket : TUI_FRAME_BUCKETS - 1;
+}
+
+// The most a frame in bucket could have taken.
+static inline uint64_t tuiFrameBucketTop(size_t bucket) {
+  if (bucket < 4)
+    return (bucket + 1) * 1000u;
+  size_t log = bucket / 4 + 1;
+  return (((uint64_t)4 + bucket % 4 + 1) << (log - 2)) * 1000u;
+}
+
+// Closes the books on a frame that took ns.
+static inline void tuiEndFrame(uint64_t ns) {
+  TuiStats *s = &tui_stats;
+  size_t slot = s->frames % TUI_FRAME_WINDOW;
+  if (s->frames >= TUI_FRAME_WINDOW)
+    s->buckets[s->recent[slot]]--;
+  s->recent[slot] = (uint8_t)tuiFrameBucket(ns);
+  s->buckets[s->recent[slot]]++;
+  s->frames++;
+  s->frame_ns = ns;
+  s->current.allocations = alloc_end_frame();
+  s->last = s->current;
+  s->current = (TuiFrameCounts){0};
+  // Where this context's frames went, which for a server's client is
+  // its socket rather than a tty.
+  int fd = tui_context->output_fd, backlog;
+  s->tty_backlog = fd < 0 || ioctl(fd, TIOCOUTQ, &backlog) ? -1 : backlog;
+}
+
+// Call as each batch of input is read; the frame that next finishes
+// writing is the one that shows it. Reads beyond TUI_MAX_PENDING_INPUT in
+// one frame aren't timed, as the earlier ones waited longer anyway.
+static inline void tui_note_input(void) {
+  TuiLatency *l = &tui_stats.latency;
+  if (l->num_pending < TUI_MAX_PENDING_INPUT)
+    l->pending[l->num_pending++] = tuiNow();
+}
+
+static inline size_t tuiLatencyBucket(uint64_t ns) {
+  if (ns >> TUI_LATENCY_MAX_BITS)
+    ns = ((uint64_t)1 << TUI_LATENCY_MAX_BITS) - 1;
+  if (!(ns >> TUI_LATENCY_SUB_BITS))
+    return (size_t)ns;
+  size_t log = 63 - (size_t)__builtin_clzll(ns);
+  size_t shift = log - TUI_LATENCY_SUB_BITS;
+  return ((shift + 1) << TUI_LATENCY_SUB_BITS) +
+         (size_t)(ns >> shift) - ((size_t)1 << TUI_LATENCY_SUB_BITS);
+}
+
+// The most a latency in bucket could have been, or was.
+static inline uint64_t tuiLatencyBucketTop(size_t bucket) {
+  size_t octave = bucket >> TUI_LATENCY_SUB_BITS;
+  uint64_t top = bucket;
+  if (octave) {
+    uint64_t sub = bucket & (((size_t)1 << TUI_LATENCY_SUB_BITS) - 1);
+    top = ((((uint64_t)1 << TUI_LATENCY_SUB_BITS) + sub + 1) << (octave - 1)) -
+          1;
+  }
+  return top < tui_stats.latency.max ? top : tui_stats.latency.max;
+}
+
+// Times every read since the last frame against flushed, when this one
+// finished writing.
+static inline void tuiRecordLatency(uint64_t flushed) {
+  TuiLatency *l = &tui_stats.latency;
+  for (size_t i = 0; i < l->num_pending; i++) {
+    uint64_t ns = flushed - l->pending[i];
+    l->buckets[tuiLatencyBucket(ns)]++;
+    l->count++;
+    l->total += ns;
+    if (ns > l->max)
+      l->max = ns;
+  }
+  l->num_pending = 0;
+}
+
+// Key to flush latency at percentile p (0 to 100) over the whole run, to
+// within a bucket.
+static inline uint64_t tui_latency_percentile(double p) {
+  const TuiLatency *l = &tui_stats.latency;
+  if (!l->count)
+    return 0;
+  uint64_t want = (uint64_t)(p / 100 * (double)(l->count - 1)) + 1, seen = 0;
+  for (size_t i = 0; i < TUI_LATENCY_BUCKETS; i++)
+    if ((seen += l->buckets[i]) >= want)
+      return tuiLatencyBucketTop(i);
+  return l->max;
+}
+
+// Writes the latency histogram as HdrHistogram's percentile distribution
+// text, in milliseconds, which its plotters read.
+static inline bool tui_latency_dump(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  const TuiLatency *l = &tui_stats.latency;
+  fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+          "1/(1-Percentile)");
+  uint64_t seen = 0;
+  for (size_t i = 0; i < TUI_LATENCY_BUCKETS; i++) {
+    if (!l->buckets[i])
+      continue;
+    seen += l->buckets[i];
+    uint64_t top = tuiLatencyBucketTop(i);
+    double p = (double)seen / (double)l->count;
+    fprintf(f, "%12.3f %14.12f %10llu", (double)top / 1e6, p,
+            (unsigned long long)seen);
+    if (p < 1)
+      fprintf(f, " %14.2f", 1 / (1 - p));
+    fputc('\n', f);
+  }
+  fprintf(f, "#[Mean    = %12.3f, Max            = %12.3f]\n",
+          l->count ? (double)l->total / (double)l->count / 1e6 : 0.0,
+          (double)l->max / 1e6);
+  fprintf(f, "#[Total count    = %12llu]\n", (unsigned long long)l->count);
+  return !fclose(f);
+}
+
+static void tuiLatencyAtExit(void) {
+  const char *path = getenv("TUI_LATENCY_FILE");
+  if (path && *path)
+    tui_latency_dump(path);
+}
+
+// How long frames took at percentile p (0 to 100) over the recent ones,
+// to within a bucket.
+static inline uint64_t tui_frame_percentile(double p) {
+  size_t n = tui_stats.frames < TUI_FRAME_WINDOW ? tui_stats.frames
+                                                 : TUI_FRAME_WINDOW;
+  if (!n)
+    return 0;
+  size_t want = (size_t)(p / 100 * (double)(n - 1)) + 1, seen = 0;
+  for (size_t i = 0; i < TUI_FRAME_BUCKETS; i++)
+    if ((seen += tui_stats.buckets[i]) >= want)
+      return tuiFrameBucketTop(i);
+  return tuiFrameBucketTop(TUI_FRAME_BUCKETS - 1);
+}
+
 static inline bool inComponent(Component *c, uint16_t x, uint16_t y) {
   Position p = c->pos;
   return (x >= p.x) & (x <= p.x + p.width) & (y >= p.y) & (y <= p.y + p.height);
@@ -126,8 +399,8 @@ static inline bool inComponent(Component *c, uint16_t x, uint16_t y) {
 
 // Move component to the front of the list
 static void raiseComponent(Component *c) {
-  uint16_t nc = tui_globalcontext.num_components;
-  Component **components = tui_globalcontext.componentList;
+  uint16_t nc = tui_context->num_components;
+  Component **components = tui_context->componentList;
 
   if (nc <= 1)
     return;
@@ -148,6 +421,40 @@ static void raiseComponent(Component *c) {
   }
 }
 
+// Moves the cursor of a screen model to column x, row y.
+static inline void moveCursor(TMT *screen, uint16_t x, uint16_t y) {
+  char seq[32];
+  int n = snprintf(seq, sizeof(seq), "\x1b[%u;%uH", y + 1u, x + 1u);
+  tmt_write(screen, seq, (size_t)n);
+}
+
+// Writes n bytes of utf8 text at the cursor, clipped and space-padded to
+// exactly width columns. Control bytes are shown as spaces so that
+// untrusted text can't move the cursor.
+static inline void drawText(TMT *screen, const char *s, size_t n,
+                            uint16_t width) {
+  char buffer[256];
+  size_t len = 0;
+  uint16_t used = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char b = (unsigned char)s[i];
+    bool continuation = (b & 0xC0) == 0x80;
+    if (!continuation && used == width)
+      break;
+    if (len + 1 >= sizeof(buffer))
+      tmt_write(screen, buffer, len), len = 0;
+    buffer[len++] = (b < 0x20 || b == 0x7f) ? ' ' : (char)b;
+    used += !continuation;
+  }
+  for (; used < width; used++) {
+    if (len + 1 >= sizeof(buffer))
+      tmt_write(screen, buffer, len), len = 0;
+    buffer[len++] = ' ';
+  }
+  if (len)
+    tmt_write(screen, buffer, len);
+}
+
 // TODO: have TMT resize itself to match.
 static inline void updateSize(void) {
   struct winsize ws;
@@ -173,6 +480,51 @@ static void sigint_sigterm_handler(int sig) {
   tui_globalcontext._exiting = true;
 }
 
+// Forgets what was shown, so the next frame writes every row.
+static inline void tuiForgetShown(GlobalContext *ctx) {
+  tui_free(ALLOC_TMT, ctx->shown);
+  ctx->shown = NULL;
+  ctx->shown_lines = ctx->shown_cols = 0;
+}
+
+// A context with nothing in it yet, writing to fd.
+static inline void tuiClearContext(GlobalContext *ctx, int fd) {
+  ctx->output_fd = fd;
+  ctx->caps = (TermCaps){0}; // Only the basics, until someone asks.
+  ctx->_exiting = 0;
+  ctx->_needs_resize = 0;
+
+  // Init component list
+  ctx->rootComponent = NULL;
+  ctx->overlay = NULL;
+  ctx->num_components = 0;
+  for (size_t i = 0; i < MAX_COMPONENTS; i++)
+    ctx->componentList[i] = NULL;
+}
+
+// The locale and the global context, the same with a terminal or without.
+static inline void tuiInitContext(int fd) {
+  static bool registered;
+  if (!registered) {
+    registered = true;
+    atexit(tuiLatencyAtExit);
+  }
+  profile_from_env();
+
+  // Copy the current locale, set new one. Only the character type
+  // matters (for tmt's decoding and wcwidth()), and it's under half what
+  // loading every category costs, before the first frame.
+  const char *old_locale = setlocale(LC_CTYPE, NULL);
+  if (!old_locale || !(_old_locale = strdup(old_locale)))
+    tui_error("Could not query the locale.");
+
+  if (!setlocale(LC_CTYPE, "C.UTF-8"))
+    if (!setlocale(LC_CTYPE, "en_US.UTF-8"))
+      tui_error("Could not set locale to utf8.");
+
+  tuiClearContext(&tui_globalcontext, fd);
+}
+
 static inline void tui_init(void) {
   // Install signal handlers, save what they used to be.
   // Get term size
@@ -186,32 +538,25 @@ static inline void tui_init(void) {
   struct termios _tio_new = _old_tio;
   _tio_new.c_lflag &= (~ECHO & ~ICANON);
   tcsetattr(1, TCSANOW, &_tio_new);
+  tui_globalcontext.output_fd = STDOUT_FILENO;
 
   // Initialize the terminal
-  char init_term[] = "\x1b?1049h"   // Alt buffer
+  char init_term[] = "\x1b[?1049h"  // Alt buffer
                      "\x1b[2J"      // Clear screen
                      "\x1b[H"       // Cursor to home position
                      "\x1b[?25l"    // Hide cursor
                      "\x1b[?1000l"; // Enable mouse events
-  write(1, init_term, sizeof(init_term));
+  tuiWrite(init_term, sizeof(init_term));
 
-  // Copy the current locale, set new one
-  if (!(_old_locale = setlocale(LC_CTYPE, NULL)))
-    tui_error("Could not query the locale.");
+  tuiInitContext(STDOUT_FILENO);
 
-  if (!setlocale(LC_ALL, "C.UTF-8"))
-    if (!setlocale(LC_ALL, "en_US.UTF-8"))
-      tui_error("Could not set locale to utf8.");
-
-  // Initialize the global context
-  tui_globalcontext._exiting = 0;
-  tui_globalcontext._needs_resize = 0;
-
-  // Init component list
-  tui_globalcontext.rootComponent = NULL;
-  tui_globalcontext.num_components = 0;
-  for (size_t i = 0; i < MAX_COMPONENTS; i++)
-    tui_globalcontext.componentList[i] = NULL;
+  // What the terminal can do: from the cache if it's been asked before,
+  // if not asked now, with the answer read along with the keys.
+  if (!caps_load(&tui_globalcontext.caps) && isatty(STDIN_FILENO)) {
+    const char *queries =
+        caps_probe_start(&tui_globalcontext.caps, STDIN_FILENO, tuiNow());
+    tuiWrite(queries, strlen(queries));
+  }
 
   // Install signal handlers, back up old ones
   _old_sigint = signal(SIGINT, sigint_sigterm_handler);
@@ -227,10 +572,62 @@ static inline void tui_init(void) {
   _tui_active = 1;
 }
 
+// Like tui_init(), for a screen of the given size with no terminal behind
+// it: nothing is read, output is counted but never written, and signals
+// and terminal modes are left alone. For replaying sessions (see
+// session.h) and for benchmarks.
+static inline void tui_init_headless(uint16_t width, uint16_t height) {
+  tuiInitContext(-1);
+  tui_globalcontext.window_width = width;
+  tui_globalcontext.window_height = height;
+  tui_globalcontext.screen = tmt_open(height, width, NULL, NULL, NULL);
+  if (!tui_globalcontext.screen)
+    tui_error("Could not make the screen.");
+  _tui_headless = 1;
+  _tui_active = 1;
+}
+
+// Sets up another context, for another terminal of the given size whose
+// frames are written to fd. It's handled and drawn like the terminal's
+// own, with tui_context pointing at it; its components are its own, but
+// what they show can be shared with other contexts'. For serving more
+// than one terminal from a process (see server.h). Call after tui_init()
+// or tui_init_headless().
+static inline bool tui_context_open(GlobalContext *ctx, uint16_t width,
+                                    uint16_t height, int fd) {
+  tuiClearContext(ctx, fd);
+  ctx->window_width = width;
+  ctx->window_height = height;
+  return (ctx->screen = tmt_open(height, width, NULL, NULL, NULL));
+}
+
+// Frees what tui_context_open() made; the components are the caller's.
+static inline void tui_context_close(GlobalContext *ctx) {
+  if (tui_context == ctx)
+    tui_context = &tui_globalcontext;
+  tuiForgetShown(ctx);
+  tmt_close(ctx->screen);
+  ctx->screen = NULL;
+}
+
+static inline void tuiRestoreLocale(void) {
+  if (_old_locale)
+    setlocale(LC_CTYPE, _old_locale);
+  free(_old_locale);
+  _old_locale = NULL;
+}
+
 static inline void tui_deinit(void) {
   if (!_tui_active)
     return;
   _tui_active = 0;
+  caps_probe_stop();
+  tuiForgetShown(&tui_globalcontext);
+  if (_tui_headless) {
+    _tui_headless = 0;
+    tuiRestoreLocale();
+    return;
+  }
 
   // Swap in old signal hadnlers
   signal(SIGINT, _old_sigint);
@@ -241,7 +638,7 @@ static inline void tui_deinit(void) {
   tcsetattr(1, TCSANOW, &_old_tio);
 
   // Reset locale
-  setlocale(LC_ALL, _old_locale);
+  tuiRestoreLocale();
 
   // Return the terminal to normal
   char restore_term[] =
@@ -250,7 +647,7 @@ static inline void tui_deinit(void) {
     //"\x1b[2J"      // Clear screen
       "\x1b[?25h"    // Show cursor
       "\x1b[?1049l"; // Return to main buffer
-  write(1, restore_term, sizeof(restore_term));
+  tuiWrite(restore_term, sizeof(restore_term));
 }
 
 static inline void tui_error(const char *message) {
@@ -259,36 +656,67 @@ static inline void tui_error(const char *message) {
   TUI_PANIC();
 }
 
-static inline Event handle_event(void) {
+// Bubbles the window's size down from the root.
+static inline void resizeRoot(void) {
+  tui_context->rootComponent->resize(
+      tui_context->rootComponent,
+      (Position){0, 0, tui_context->window_width,
+                 tui_context->window_height});
+}
+
+// For KEY and MOUSE events, find the topmost component that it applies
+// to (overlaps the (x,y) coordinate where the event happened, and has
+// the applicable event handler).
+// That event handler will give the event to its parent if it doesn't
+// want to handle, it, then it to its parent, etc. At the end, we mark
+// it as handled or not.
+static inline void dispatchEvent(Event *e) {
+  Component **components = tui_context->componentList;
+  for (uint16_t i = 0; i < tui_context->num_components; i++) {
+    if (e->kind == KEY) {
+      if (components[i]->onKeypress) {
+        e->handled = components[i]->onKeypress(components[i], e->keyEvent);
+        if (e->handled)
+          break;
+      }
+    } else if (e->kind == MOUSE) {
+      if (components[i]->onClick) {
+        if (inComponent(components[i], e->mouseEvent.mouse_x,
+                        e->mouseEvent.mouse_y)) {
+          e->handled = components[i]->onClick(components[i], e->mouseEvent);
+          if (e->handled)
+            break;
+        }
+      }
+    }
+  }
+}
+
+static inline Event handleEvent(void) {
   if (!_tui_active)
     tui_error("Root component not initialized.");
-  if (tui_globalcontext.rootComponent)
+  if (tui_context->rootComponent)
     tui_error("Tui is not active.");
 
   Event e;
-  if (tui_globalcontext._exiting) {
+  if (tui_context->_exiting) {
     tui_deinit();
     return (e.kind = END, e.handled = 1), e;
   }
 
-  Component **components = tui_globalcontext.componentList;
-
   // Resize in response to SIGWINCH
-  if (tui_globalcontext._needs_resize) {
-    tui_globalcontext._needs_resize = 0;
+  if (tui_context->_needs_resize) {
+    tui_context->_needs_resize = 0;
 
     // Ask the OS for the new size
     updateSize();
-
-    // Bubble resizes down
-    tui_globalcontext.rootComponent->resize((Position){
-        0, 0, tui_globalcontext.window_width, tui_globalcontext.window_height});
+    resizeRoot();
 
     // return resize info
     e.kind = RESIZE;
     e.handled = 1;
-    e.resizeEvent.new_height = tui_globalcontext.window_height;
-    e.resizeEvent.new_width = tui_globalcontext.window_width;
+    e.resizeEvent.new_height = tui_context->window_height;
+    e.resizeEvent.new_width = tui_context->window_width;
     return e;
   }
 
@@ -296,32 +724,15 @@ static inline Event handle_event(void) {
 
   // Handle the event (This depends on the kind of event.)
 
-  // For KEY and MOUSE events, find the topmost component that it applies
-  // to (overlaps the (x,y) coordinate where the event happened, and has
-  // the applicable event handler).
-  // That event handler will give the event to its parent if it doesn't
-  // want to handle, it, then it to its parent, etc. At the end, we mark
-  // it as handled or not.
-
-  for (uint16_t i = 0; i < tui_globalcontext.num_components; i++) {
-    if (e.kind == KEY) {
-      if (components[i]->onKeypress) {
-        e.handled = components[i]->onKeypress(e.keyEvent);
-        if (e.handled)
-          break;
-      }
-    } else if (e.kind == MOUSE) {
-      if (components[i]->onClick) {
-        if (inComponent(components[i], e.mouseEvent.mouse_x,
-                        e.mouseEvent.mouse_y)) {
-          e.handled = components[i]->onClick(e.mouseEvent);
-          if (e.handled)
-            break;
-        }
-      }
-    }
-  }
+  dispatchEvent(&e);
+  return e;
+}
 
+static inline Event handle_event(void) {
+  TRACE_BEGIN(span, "handle_event");
+  tui_stats.current.events++;
+  Event e = handleEvent();
+  TRACE_END(span);
   return e;
 }
 
@@ -345,51 +756,314 @@ static inline TMTATTRS subtract_attr_bits(TMTATTRS b1, TMTATTRS b2) {
   return b1;
 }
 
-static inline void writescreen(TMT *tmt) {
-  // For every dirty line in the screen, render the line.
-  const TMTSCREEN *screen = tmt_screen(tui_globalcontext.screen);
-  size_t nline = screen->nline, ncol = screen->ncol;
-  for (size_t lnum = 0; lnum < nline; lnum++) {
-    TMTLINE *line = screen->lines[lnum];
-    if (!line->dirty)
+// Output for a frame is gathered here and written in as few writes as it
+// takes, rather than a write a cell.
+#define TUI_OUTPUT_CHUNK 16384
+
+typedef struct {
+  size_t len;
+  char bytes[TUI_OUTPUT_CHUNK];
+} TuiOutput;
+
+static inline void tuiFlush(TuiOutput *out) {
+  if (out->len)
+    tuiWrite(out->bytes, out->len);
+  out->len = 0;
+}
+
+static inline void tuiPut(TuiOutput *out, const char *bytes, size_t n) {
+  if (out->len + n > sizeof(out->bytes))
+    tuiFlush(out);
+  memcpy(out->bytes + out->len, bytes, n);
+  out->len += n;
+}
+
+static inline bool tuiSameLook(TMTATTRS a, TMTATTRS b) {
+  return a.fg.ansi == b.fg.ansi && a.bg.ansi == b.bg.ansi &&
+         a.bold == b.bold && a.dim == b.dim && a.underline == b.underline &&
+         a.blink == b.blink && a.reverse == b.reverse &&
+         a.invisible == b.invisible;
+}
+
+// Sets every attribute at once, from a reset, so that what came before
+// doesn't matter.
+static inline void tuiPutAttrs(TuiOutput *out, TMTATTRS a) {
+  char seq[64];
+  int n = snprintf(seq, sizeof(seq), "\x1b[0%s%s%s%s%s%s;%u;%um",
+                   a.bold ? ";1" : "", a.dim ? ";2" : "",
+                   a.underline ? ";4" : "", a.blink ? ";5" : "",
+                   a.reverse ? ";7" : "", a.invisible ? ";8" : "",
+                   a.fg.ansi ? a.fg.ansi : 39u,
+                   a.bg.ansi ? a.bg.ansi + 10u : 49u);
+  tuiPut(out, seq, (size_t)n);
+}
+
+// Whether row lnum was last written as line is now, noting it if not.
+static inline bool tuiShown(GlobalContext *ctx, size_t lnum,
+                            const TMTLINE *line, size_t ncol) {
+  if (!ctx->shown)
+    return false;
+  TMTCHAR *shown = ctx->shown + lnum * ncol;
+  bool same = true;
+  for (size_t i = 0; i < ncol; i++) {
+    if (same && shown[i].c == line->chars[i].c &&
+        tuiSameLook(shown[i].a, line->chars[i].a))
       continue;
+    same = false;
+    shown[i] = line->chars[i];
+  }
+  return same;
+}
 
-    TMTATTRS last;
-    last.fg = (tmt_color_t){0, 0, 0, TMT_ANSI_COLOR_DEFAULT};
-    last.bg = (tmt_color_t){0, 0, 0, TMT_ANSI_COLOR_DEFAULT};
-    last.attrs = 0;
-    for (size_t cnum = 0; cnum < ncol; cnum++) {
-      wchar_t c = line->chars[cnum].c;
-      TMTATTRS attrs = line->chars[cnum].a;
-      if (attrs.reverse) {
-        tmt_color_t tmp = attrs.bg;
-        attrs.bg = attrs.fg;
-        attrs.fg = tmp;
-        attrs.reverse = 0;
-      }
+static inline bool tuiSameCell(const TMTCHAR *a, const TMTCHAR *b) {
+  return a->c == b->c && tuiSameLook(a->a, b->a);
+}
 
-      size_t cbuflen = 0;
-      char cbuffer[64];
+static inline bool tuiSameRow(const TMTCHAR *a, const TMTCHAR *b,
+                              size_t ncol) {
+  for (size_t i = 0; i < ncol; i++)
+    if (!tuiSameCell(&a[i], &b[i]))
+      return false;
+  return true;
+}
 
-      // Apply colors and attributes
+static inline uint64_t tuiRowHash(const TMTCHAR *cells, size_t ncol) {
+  uint64_t h = 14695981039346656037u;
+  for (size_t i = 0; i < ncol; i++) {
+    TMTATTRS a = cells[i].a;
+    uint64_t look = (uint64_t)a.fg.ansi << 16 | (uint64_t)a.bg.ansi << 8 |
+                    a.bold | a.dim << 1 | a.underline << 2 | a.blink << 3 |
+                    a.reverse << 4 | a.invisible << 5;
+    h = (h ^ ((uint64_t)cells[i].c << 24 | look)) * 1099511628211u;
+  }
+  return h;
+}
+
+// Fewer changed rows than this aren't worth a scroll region's bytes.
+#define TUI_MIN_SCROLL 3
+
+// Moves rows the terminal already shows to where this frame has them, as
+// when a view scrolls, with a scroll region rather than writing them out
+// again. Takes the run of rows that all moved the same distance with the
+// most changed rows in it; the rows the scroll uncovers come up blank,
+// and are marked dirty for the frame to fill. Returns whether it wrote.
+static inline bool tuiScroll(TuiOutput *out, GlobalContext *ctx,
+                             const TMTSCREEN *screen) {
+  size_t nline = screen->nline, ncol = screen->ncol;
+  uint64_t *now = tui_malloc(ALLOC_TMT, 2 * nline * sizeof(uint64_t));
+  if (!now)
+    return false;
+  uint64_t *was = now + nline;
+  for (size_t i = 0; i < nline; i++) {
+    now[i] = tuiRowHash(screen->lines[i]->chars, ncol);
+    was[i] = tuiRowHash(ctx->shown + i * ncol, ncol);
+  }
 
-      // Finally append the character and write.
-      // If wctomb doesn't know about that character,
-      // use the unicode replacement character.
-      int wcret = wctomb(cbuffer, c);
-      if (wcret == -1) {
-        const char replacement_char[] = "\uFFFD";
-        wcret = sprintf(cbuffer, replacement_char);
+  // Runs of rows i that were shown at i + k (up) or i - k (down).
+  size_t best = 0, best_from = 0, best_len = 0, best_k = 0;
+  bool best_up = false;
+  for (size_t k = 1; k < nline; k++) {
+    for (int up = 0; up < 2; up++) {
+      size_t run = 0, gain = 0;
+      for (size_t j = 0; j + k <= nline; j++) {
+        size_t i = up ? j : j + k, from = up ? j + k : j;
+        bool moved = j + k < nline && now[i] == was[from];
+        if (moved) {
+          run++;
+          gain += now[i] != was[i];
+        }
+        if (!moved || j + k + 1 == nline) {
+          if (gain > best) {
+            best = gain, best_len = run, best_k = k, best_up = up;
+            best_from = (up ? j : j + k) + moved - run;
+          }
+          run = gain = 0;
+        }
       }
-      cbuflen += wcret;
-      tmt_write(tmt, cbuffer, cbuflen);
     }
   }
+  tui_free(ALLOC_TMT, now);
+  if (best < TUI_MIN_SCROLL)
+    return false;
+  size_t k = best_k, from = best_from;
+  for (size_t i = from; i < from + best_len; i++)
+    if (!tuiSameRow(screen->lines[i]->chars,
+                    ctx->shown + (best_up ? i + k : i - k) * ncol, ncol))
+      return false; // Hashes alike, rows not.
+
+  size_t top = best_up ? from : from - k;
+  size_t bottom = best_up ? from + best_len - 1 + k : from + best_len - 1;
+  // LF on the region's bottom row scrolls it up, and RI on its top row
+  // down; SU and SD would be shorter, but they aren't VT100, and the
+  // Linux console ignores them.
+  char seq[64];
+  int n = snprintf(seq, sizeof(seq), "\x1b[0m\x1b[%zu;%zur\x1b[%zu;1H",
+                   top + 1, bottom + 1, best_up ? bottom + 1 : top + 1);
+  tuiPut(out, seq, (size_t)n);
+  for (size_t i = 0; i < k; i++)
+    tuiPut(out, best_up ? "\n" : "\x1bM", best_up ? 1 : 2);
+  tuiPut(out, "\x1b[r", 3);
+
+  // The terminal's rows moved; so do the ones noted as shown.
+  size_t kept = bottom + 1 - top - k;
+  TMTCHAR *region = ctx->shown + top * ncol;
+  size_t blank = best_up ? top + kept : top;
+  if (best_up)
+    memmove(region, region + k * ncol, kept * ncol * sizeof(TMTCHAR));
+  else
+    memmove(region + k * ncol, region, kept * ncol * sizeof(TMTCHAR));
+  for (size_t i = blank; i < blank + k; i++) {
+    for (size_t c = 0; c < ncol; c++)
+      ctx->shown[i * ncol + c] = (TMTCHAR){.c = L' '};
+    screen->lines[i]->dirty = true;
+  }
+  return true;
+}
+
+// Spaces with nothing to show but the default background, which erasing
+// leaves the same.
+static inline bool tuiBlank(const TMTCHAR *cell) {
+  return cell->c == L' ' && !cell->a.bg.ansi && !cell->a.reverse &&
+         !cell->a.underline;
+}
+
+// Fewer cells than this are cheaper written than erased or repeated.
+#define TUI_MIN_RUN 6
+
+// Writes run cells the same as cell, the cheapest way the terminal has:
+// blanks to the end of the row with EL, others with ECH, and anything
+// else once and then REP.
+static inline void tuiPutRun(TuiOutput *out, const TermCaps *caps,
+                             const TMTCHAR *cell, size_t run, bool to_end) {
+  char seq[32];
+  int n = 0;
+  if (tuiBlank(cell) && to_end && run >= 3)
+    n = snprintf(seq, sizeof(seq), "\x1b[K");
+  else if (tuiBlank(cell) && caps->ech && run >= TUI_MIN_RUN)
+    n = snprintf(seq, sizeof(seq), "\x1b[%zuX\x1b[%zuC", run, run);
+  if (n) {
+    tuiPut(out, seq, (size_t)n);
+    return;
+  }
+
+  // If it isn't a character, use the unicode replacement character.
+  char cbuffer[4];
+  size_t len = utf8_put((uint32_t)cell->c, cbuffer);
+  if (!len)
+    len = utf8_put(ENCODING_REPLACEMENT, cbuffer);
+  if (caps->rep && len * (run - 1) >= TUI_MIN_RUN) {
+    tuiPut(out, cbuffer, len);
+    n = snprintf(seq, sizeof(seq), "\x1b[%zub", run - 1);
+    tuiPut(out, seq, (size_t)n);
+    return;
+  }
+  for (size_t i = 0; i < run; i++)
+    tuiPut(out, cbuffer, len);
+}
+
+// Writes out the rows of the current context's screen model that changed
+// since its last frame, then marks them clean. Each context keeps what
+// its own terminal was last sent, so each is only sent the difference,
+// in whatever its terminal has that's cheapest (see caps.h).
+static inline void writescreen(TMT *tmt) {
+  TRACE_BEGIN(span, "writescreen");
+  static TuiOutput out;
+  GlobalContext *ctx = tui_context;
+  const TermCaps *caps = &ctx->caps;
+  const TMTSCREEN *screen = tmt_screen(tmt);
+  size_t nline = screen->nline, ncol = screen->ncol;
+  if (nline != ctx->shown_lines || ncol != ctx->shown_cols) {
+    tuiForgetShown(ctx);
+    // Zeroed cells are what no row looks like, so every row differs.
+    if ((ctx->shown = tui_calloc(ALLOC_TMT, nline * ncol, sizeof(TMTCHAR)))) {
+      ctx->shown_lines = nline;
+      ctx->shown_cols = ncol;
+    }
+  }
+  // Dropped again if nothing changed.
+  if (caps->sync)
+    tuiPut(&out, "\x1b[?2026h", 8);
+  bool wrote = ctx->shown && caps->scroll_region && ncol &&
+               tuiScroll(&out, ctx, screen);
+  for (size_t lnum = 0; lnum < nline; lnum++) {
+    TMTLINE *line = screen->lines[lnum];
+    if (!line->dirty || tuiShown(ctx, lnum, line, ncol))
+      continue;
+    tui_stats.current.dirty_rows++;
+    tui_stats.current.cells += ncol;
+    wrote = true;
+
+    char seq[32];
+    int n = snprintf(seq, sizeof(seq), "\x1b[%zu;1H", lnum + 1);
+    tuiPut(&out, seq, (size_t)n);
+    TMTATTRS last = line->chars[0].a;
+    tuiPutAttrs(&out, last);
+    for (size_t cnum = 0, run; cnum < ncol; cnum += run) {
+      const TMTCHAR *cell = &line->chars[cnum];
+      if (!tuiSameLook(cell->a, last))
+        tuiPutAttrs(&out, last = cell->a);
+      for (run = 1; cnum + run < ncol && tuiSameCell(cell + run, cell); run++)
+        ;
+      tuiPutRun(&out, caps, cell, run, cnum + run == ncol);
+    }
+  }
+  if (wrote) {
+    tuiPut(&out, "\x1b[0m", 4);
+    if (caps->sync)
+      tuiPut(&out, "\x1b[?2026l", 8);
+    tuiFlush(&out);
+  }
+  out.len = 0;
+  tmt_clean(tmt);
+  TRACE_END(span);
+}
+
+// A name for traces; spans need one that outlives them.
+static inline const char *componentName(const Component *c) {
+  switch (c->kind) {
+  case COMPONENT_CONTAINER:
+    return "render container";
+  case COMPONENT_TABLE:
+    return "render table";
+  case COMPONENT_FINDER:
+    return "render finder";
+  case COMPONENT_SEARCH:
+    return "render search";
+  case COMPONENT_TEXTVIEW:
+    return "render textview";
+  case COMPONENT_MINIMAP:
+    return "render minimap";
+  case COMPONENT_TERMINAL:
+    return "render terminal";
+  case COMPONENT_HUD:
+    return "render hud";
+  }
+  return "render";
+}
+
+// Renders one component. Components rendering their children should go
+// through here too, so each shows up in traces on its own.
+static inline void render_component(Component *c, TMT *screen) {
+  TRACE_BEGIN(span, componentName(c));
+  c->render(c, screen);
+  TRACE_END(span);
 }
 
 static inline void render_window(void) {
-  tui_globalcontext.rootComponent->render(tui_globalcontext.screen);
-  writescreen(tui_globalcontext.screen);
+  uint64_t start = tuiNow();
+  caps_poll(start);
+  // Blanked first, for whatever no component covers.
+  if (tui_context->repaint)
+    tmt_write(tui_context->screen, "\x1b[2J", 0);
+  render_component(tui_context->rootComponent,
+                   tui_context->screen);
+  if (tui_context->overlay)
+    render_component(tui_context->overlay, tui_context->screen);
+  tui_context->repaint = false;
+  writescreen(tui_context->screen);
+  uint64_t flushed = tuiNow();
+  tuiRecordLatency(flushed);
+  tuiEndFrame(flushed - start);
 }
 
 static inline int example_main(void) {
@@ -414,3 +1088,5 @@ static inline int example_main(void) {
 
   return 0;
 }
+
+#endif